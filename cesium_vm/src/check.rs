@@ -1,4 +1,15 @@
-use std::hint::unlikely;
+/// Stable stand-in for `std::hint::unlikely`: a branch that calls a `#[cold]` function
+/// is laid out as the unlikely one.
+#[inline(always)]
+fn unlikely(condition: bool) -> bool {
+    if condition {
+        cold();
+    }
+    condition
+}
+
+#[cold]
+fn cold() {}
 
 #[derive(Debug, Copy, Clone, PartialEq, Eq)]
 pub enum ChecksumError {
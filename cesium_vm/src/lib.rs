@@ -1,4 +1,4 @@
-#![feature(likely_unlikely)]
-
 pub mod vm;
-pub mod check;
\ No newline at end of file
+pub mod check;
+
+pub use wasmtime::{Module, TypedFunc};
@@ -1,14 +1,28 @@
-use std::sync::Arc;
-use wasmtime::{Config, Engine, Instance, InstanceAllocationStrategy, Module, PoolingAllocationConfig, Store};
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use wasmtime::{
+    Config, Engine, Instance, InstanceAllocationStrategy, Memory, Module, PoolingAllocationConfig, Store, Trap, TypedFunc,
+    WasmParams, WasmResults,
+};
 
+/// Fuel a call gets unless [`VM::with_fuel`] sets another budget. One unit is roughly one
+/// wasm instruction.
+pub const DEFAULT_FUEL: u64 = 1_000_000_000;
+
+#[derive(Debug)]
 pub enum VMError {
     WASMEngineCreateError,
     WASMEntryPointNotFound,
     WASMFailedToCallFunction,
+    /// The call used up its fuel, see [`VM::with_fuel`].
+    WASMOutOfFuel,
     WASMFailedToParseFunctionResponse,
     WASMInvalidStatusReturned,
     WASMFailedToGetMemory,
     WASMFailedWhileWritingInMemory,
+    WASMFailedWhileReadingMemory,
     WASMFailedToGetInstance,
     WASMProvidedWebAssemblyBytecodeIsNotValid,
 }
@@ -27,13 +41,55 @@ pub enum WorkerResult {
 
 pub struct VM {
     engine: Arc<Engine>,
+    /// Compiled modules by caller-provided key, with the CRC32 of the bytes they were compiled from.
+    modules: Mutex<HashMap<String, (u32, Module)>>,
+    /// Directory where compiled modules are kept between runs, see [`VM::with_cache_dir`].
+    cache_dir: Option<PathBuf>,
+    /// Fuel of every call, see [`VM::with_fuel`].
+    fuel: u64,
+}
+
+/// An instantiated module that is kept alive between calls.
+///
+/// Instantiation is paid once: callers run many calls on the same instance and only
+/// create a new one after a trap, when the instance's memory can't be trusted anymore.
+pub struct WarmInstance {
+    store: Store<()>,
+    instance: Instance,
+    memory: Memory,
+    fuel: u64,
+}
+
+impl WarmInstance {
+    pub fn typed_func<P: WasmParams, R: WasmResults>(&mut self, name: &str) -> Result<TypedFunc<P, R>, VMError> {
+        self.instance.get_typed_func::<P, R>(&mut self.store, name)
+            .map_err(|_| VMError::WASMEntryPointNotFound)
+    }
+
+    pub fn has_export(&mut self, name: &str) -> bool {
+        self.instance.get_export(&mut self.store, name).is_some()
+    }
+
+    /// Runs `func` with a fresh fuel budget, so a guest that never returns traps instead of
+    /// holding the calling thread.
+    pub fn call<P: WasmParams, R: WasmResults>(&mut self, func: &TypedFunc<P, R>, params: P) -> Result<R, VMError> {
+        self.store.set_fuel(self.fuel).map_err(|_| VMError::WASMFailedToCallFunction)?;
+        func.call(&mut self.store, params).map_err(call_error)
+    }
+
+    pub fn read(&self, ptr: u32, len: u32) -> Result<Vec<u8>, VMError> {
+        let mut buffer = vec![0u8; len as usize];
+        self.memory.read(&self.store, ptr as usize, &mut buffer)
+            .map_err(|_| VMError::WASMFailedWhileReadingMemory)?;
+        Ok(buffer)
+    }
+
+    pub fn write(&mut self, ptr: u32, bytes: &[u8]) -> Result<(), VMError> {
+        self.memory.write(&mut self.store, ptr as usize, bytes)
+            .map_err(|_| VMError::WASMFailedWhileWritingInMemory)
+    }
 }
 
-// TODO: Обязательно добавить метод `run_worker_from_module()`, для поддержки создания воркеров не толкьо
-// по WASM байткоду, но и по уже созданному модулю (wasmtime::Module).
-// В ядре Netter нужно будет создать заранее после компиляции под каждый маршрут свой модуль (Module),
-// чтобы исключить лишнего оверхеда в рантайме при уже полученном запросе.
-// Сам метод `run_worker_from_module()` должен будет создавать Store и Isntance из полученного модуля.
 impl VM {
     pub fn new(
         max_workers: u32,
@@ -45,22 +101,108 @@ impl VM {
 
         let mut config = Config::new();
         config.allocation_strategy(InstanceAllocationStrategy::Pooling(pooling_config));
-
+        config.consume_fuel(true);
 
         let engine = Engine::new(&config).map_err(|_| VMError::WASMEngineCreateError)?;
 
         Ok(Self {
             engine: Arc::new(engine),
+            modules: Mutex::new(HashMap::new()),
+            cache_dir: None,
+            fuel: DEFAULT_FUEL,
         })
     }
 
+    /// Fuel every call gets. A call that uses it up traps with [`VMError::WASMOutOfFuel`].
+    pub fn with_fuel(mut self, fuel: u64) -> Self {
+        self.fuel = fuel;
+        self
+    }
+
+    /// Keeps compiled modules in `dir`, so the next process loads them without compiling.
+    ///
+    /// Compiled code is loaded from there without validation, the directory must only be
+    /// writable by the process that owns it.
+    pub fn with_cache_dir(mut self, dir: PathBuf) -> Self {
+        self.cache_dir = Some(dir);
+        self
+    }
+
+    /// Compiles `wasm_bytes`, or returns the module compiled earlier under the same `key`
+    /// if the bytes haven't changed since.
+    pub fn load_module(&self, key: &str, wasm_bytes: &[u8]) -> Result<Module, VMError> {
+        let checksum = crc32fast::hash(wasm_bytes);
+
+        if let Ok(modules) = self.modules.lock() {
+            if let Some((cached_checksum, module)) = modules.get(key) {
+                if *cached_checksum == checksum {
+                    return Ok(module.clone());
+                }
+            }
+        }
+
+        let cached = self.cache_dir.as_ref()
+            .map(|dir| dir.join(format!("{:08x}-{:08x}.cwasm", crc32fast::hash(key.as_bytes()), checksum)));
+
+        let module = match cached.as_deref().and_then(|path| self.load_compiled(path)) {
+            Some(module) => module,
+            None => {
+                let module = Module::new(&self.engine, wasm_bytes)
+                    .map_err(|_| VMError::WASMProvidedWebAssemblyBytecodeIsNotValid)?;
+                if let Some(path) = &cached {
+                    store_compiled(&module, path);
+                }
+                module
+            }
+        };
+
+        if let Ok(mut modules) = self.modules.lock() {
+            modules.insert(key.to_string(), (checksum, module.clone()));
+        }
+        Ok(module)
+    }
+
+    fn load_compiled(&self, path: &Path) -> Option<Module> {
+        if !path.exists() {
+            return None;
+        }
+        // SAFETY: the file was written by `store_compiled` into the VM's own cache directory.
+        // wasmtime rejects files from another version or engine configuration.
+        match unsafe { Module::deserialize_file(&self.engine, path) } {
+            Ok(module) => Some(module),
+            Err(_) => {
+                let _ = fs::remove_file(path);
+                None
+            }
+        }
+    }
+
+    /// Creates an instance of `module` that can be called many times.
+    pub fn instantiate(&self, module: &Module) -> Result<WarmInstance, VMError> {
+        let mut store = Store::new(&self.engine, ());
+        store.set_fuel(self.fuel).map_err(|_| VMError::WASMFailedToGetInstance)?;
+        let instance = Instance::new(&mut store, module, &[])
+            .map_err(|_| VMError::WASMFailedToGetInstance)?;
+
+        let memory = instance.get_memory(&mut store, "memory")
+            .ok_or_else(|| VMError::WASMFailedToGetMemory)?;
+
+        Ok(WarmInstance { store, instance, memory, fuel: self.fuel })
+    }
+
     /// Execute worker with given wasm bytes and context in bytes
     pub fn run_worker(&self, wasm_bytes: &[u8], context_bytes: &[u8]) -> Result<WorkerResult, VMError> {
         let module = Module::new(&self.engine, wasm_bytes)
             .map_err(|_| VMError::WASMProvidedWebAssemblyBytecodeIsNotValid)?;
 
+        self.run_worker_from_module(&module, context_bytes)
+    }
+
+    /// Execute worker with an already compiled module and context in bytes
+    pub fn run_worker_from_module(&self, module: &Module, context_bytes: &[u8]) -> Result<WorkerResult, VMError> {
         let mut store = Store::new(&self.engine, ());
-        let instance = Instance::new(&mut store, &module, &[])
+        store.set_fuel(self.fuel).map_err(|_| VMError::WASMFailedToGetInstance)?;
+        let instance = Instance::new(&mut store, module, &[])
             .map_err(|_| VMError::WASMFailedToGetInstance)?;
 
         let memory = instance.get_memory(&mut store, "memory")
@@ -76,7 +218,7 @@ impl VM {
         let packed_result: u64 = entry_point.call(
             &mut store,
             (0, context_bytes.len() as u32)
-        ).map_err(|_| VMError::WASMFailedToCallFunction)?;
+        ).map_err(call_error)?;
 
         let result = cesium_sdk::parse_response(packed_result, &store, &memory)
             .map_err(|_| VMError::WASMFailedToParseFunctionResponse)?;
@@ -104,3 +246,24 @@ impl VM {
         }
     }
 }
+
+fn call_error(e: wasmtime::Error) -> VMError {
+    match e.downcast_ref::<Trap>() {
+        Some(Trap::OutOfFuel) => VMError::WASMOutOfFuel,
+        _ => VMError::WASMFailedToCallFunction,
+    }
+}
+
+/// The cache is only an optimization, a module that can't be written is compiled again next time.
+fn store_compiled(module: &Module, path: &Path) {
+    let Ok(bytes) = module.serialize() else {
+        return;
+    };
+    if let Some(dir) = path.parent() {
+        let _ = fs::create_dir_all(dir);
+    }
+    let temp = path.with_extension("tmp");
+    if fs::write(&temp, bytes).is_ok() && fs::rename(&temp, path).is_err() {
+        let _ = fs::remove_file(&temp);
+    }
+}
@@ -1,7 +1,16 @@
 use netter_plugger::{netter_plugin, generate_dispatch_func};
 use rand::Rng;
 
-generate_dispatch_func!();
+generate_dispatch_func!(
+    is_email_valid,
+    is_ip_valid,
+    env_var,
+    random,
+    to_uppercase,
+    to_lowercase,
+    sleep,
+    now,
+);
 
 // ----------- network -----------
 
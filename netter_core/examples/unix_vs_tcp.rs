@@ -0,0 +1,131 @@
+//! Compares requests over a Unix domain socket with requests over loopback TCP.
+//!
+//! Both listeners serve the same router with the same connection limits, only the
+//! transport differs. Run with `cargo run --release -p netter_core --example unix_vs_tcp`.
+
+#[cfg(unix)]
+mod harness {
+    use std::{future::Future, path::PathBuf, sync::Arc, time::{Duration, Instant}};
+    use axum::{Router, routing::get};
+    use http_body_util::{BodyExt, Empty};
+    use hyper::body::Bytes;
+    use hyper_util::{rt::{TokioExecutor, TokioIo}, server::conn::auto, service::TowerToHyperService};
+    use netter_core::servers::{ServerLimits, limits::{ConnectionLimiter, configure_builder}, unix};
+    use tokio::{io::{AsyncRead, AsyncWrite}, net::{TcpListener, TcpStream, UnixStream}, sync::{Notify, Semaphore}};
+
+    /// Requests of one run, split over its connections.
+    const REQUESTS: usize = 20_000;
+    const CONNECTIONS: [usize; 2] = [1, 32];
+    const BODY: &str = "hello world";
+
+    async fn serve_tcp(listener: TcpListener, app: Router, limiter: ConnectionLimiter) {
+        let mut builder = auto::Builder::new(TokioExecutor::new());
+        configure_builder(&mut builder, limiter.limits());
+        let builder = Arc::new(builder);
+
+        loop {
+            let Ok((stream, _)) = listener.accept().await else {
+                continue;
+            };
+            stream.set_nodelay(true).expect("TCP_NODELAY");
+            let Some(permit) = limiter.admit() else {
+                continue;
+            };
+
+            let io = TokioIo::new(limiter.guard(stream, permit));
+            let service = TowerToHyperService::new(app.clone());
+            let builder = Arc::clone(&builder);
+            tokio::spawn(async move {
+                let _ = builder.serve_connection_with_upgrades(io, service).await;
+            });
+        }
+    }
+
+    async fn client<S>(stream: S, requests: usize)
+    where
+        S: AsyncRead + AsyncWrite + Unpin + Send + 'static,
+    {
+        let (mut sender, connection) = hyper::client::conn::http1::handshake(TokioIo::new(stream)).await.expect("handshake");
+        tokio::spawn(connection);
+
+        for _ in 0..requests {
+            let request = hyper::Request::get("/").header("host", "localhost").body(Empty::<Bytes>::new()).expect("request");
+            sender.ready().await.expect("connection closed");
+            let response = sender.send_request(request).await.expect("response");
+            let body = response.into_body().collect().await.expect("body").to_bytes();
+            assert_eq!(&body[..], BODY.as_bytes());
+        }
+    }
+
+    async fn bench<S, F>(transport: &str, connect: impl Fn() -> F)
+    where
+        S: AsyncRead + AsyncWrite + Unpin + Send + 'static,
+        F: Future<Output = S>,
+    {
+        // Warms up the allocator and the runtime before anything is measured.
+        client(connect().await, 1_000).await;
+
+        for connections in CONNECTIONS {
+            let per_connection = REQUESTS / connections;
+            let started = Instant::now();
+
+            let mut clients = Vec::with_capacity(connections);
+            for _ in 0..connections {
+                clients.push(tokio::spawn(client(connect().await, per_connection)));
+            }
+            for client in clients {
+                client.await.expect("client panicked");
+            }
+
+            let elapsed = started.elapsed();
+            let requests = per_connection * connections;
+            println!(
+                "{:>4}, {:>2} connection(s): {:>8.0} requests/s, {:>6.1} us per request and connection",
+                transport,
+                connections,
+                requests as f64 / elapsed.as_secs_f64(),
+                elapsed.as_secs_f64() * 1e6 / per_connection as f64,
+            );
+        }
+    }
+
+    pub async fn run() {
+        let app = Router::new().route("/", get(|| async { BODY }));
+        let limits = ServerLimits::default();
+        let limiter = ConnectionLimiter::new(Arc::new(Semaphore::new(limits.max_connections)), limits);
+
+        let path: PathBuf = std::env::temp_dir().join(format!("netter-bench-{}.sock", std::process::id()));
+        let listener = unix::bind(&path).expect("bind the Unix socket");
+        let shutdown = Arc::new(Notify::new());
+        let unix_server = tokio::spawn(unix::serve(listener, app.clone(), limiter.clone(), Arc::clone(&shutdown), Duration::from_secs(1)));
+
+        let tcp = TcpListener::bind("127.0.0.1:0").await.expect("bind loopback TCP");
+        let addr = tcp.local_addr().expect("TCP address");
+        tokio::spawn(serve_tcp(tcp, app, limiter));
+
+        bench("tcp", || async move {
+            let stream = TcpStream::connect(addr).await.expect("connect over TCP");
+            stream.set_nodelay(true).expect("TCP_NODELAY");
+            stream
+        }).await;
+        bench("unix", || {
+            let path = path.clone();
+            async move { UnixStream::connect(path).await.expect("connect over the Unix socket") }
+        }).await;
+
+        shutdown.notify_one();
+        let _ = unix_server.await;
+        unix::remove_socket(&path);
+    }
+}
+
+#[cfg(unix)]
+#[tokio::main]
+async fn main() {
+    harness::run().await;
+}
+
+#[cfg(not(unix))]
+fn main() {
+    eprintln!("Unix domain sockets are only served on Unix");
+}
@@ -0,0 +1,239 @@
+//! Five-field cron expressions: minute, hour, day of month, month, day of week.
+//!
+//! Each field is `*`, a number, a range `a-b`, any of them with a step (`*/5`, `0-30/10`)
+//! or a comma-separated list of those. Day of week counts from 0 = Sunday, 7 is Sunday too.
+//! As in cron, when both day fields are restricted a day matches if either of them does.
+//! A field that starts with `*`, such as `*/2`, doesn't count as restricted for this, a day
+//! then has to match both.
+//! Times are UTC.
+
+use std::fmt;
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Cron {
+    /// Bit `n` is set when the field allows the value `n`.
+    minutes: u64,
+    hours: u64,
+    days: u64,
+    months: u64,
+    weekdays: u64,
+    any_day: bool,
+    any_weekday: bool,
+    source: String,
+}
+
+/// A minute in calendar terms.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Time {
+    pub minute: u32,
+    pub hour: u32,
+    pub day: u32,
+    pub month: u32,
+    /// 0 = Sunday.
+    pub weekday: u32,
+}
+
+impl Cron {
+    pub fn parse(expression: &str) -> Result<Self, String> {
+        let fields: Vec<&str> = expression.split_whitespace().collect();
+        let [minute, hour, day, month, weekday] = fields[..] else {
+            return Err(format!("expected 5 fields (minute, hour, day, month, day of week), got {}", fields.len()));
+        };
+
+        let mut weekdays = field(weekday, 0, 7, "day of week")?;
+        // 7 is another name for Sunday.
+        if weekdays & (1 << 7) != 0 {
+            weekdays = (weekdays | 1) & !(1 << 7);
+        }
+
+        Ok(Self {
+            minutes: field(minute, 0, 59, "minute")?,
+            hours: field(hour, 0, 23, "hour")?,
+            days: field(day, 1, 31, "day")?,
+            months: field(month, 1, 12, "month")?,
+            weekdays,
+            any_day: day.starts_with('*'),
+            any_weekday: weekday.starts_with('*'),
+            source: expression.to_string(),
+        })
+    }
+
+    pub fn matches(&self, time: &Time) -> bool {
+        let day = if self.any_day || self.any_weekday {
+            has(self.days, time.day) && has(self.weekdays, time.weekday)
+        } else {
+            has(self.days, time.day) || has(self.weekdays, time.weekday)
+        };
+
+        day && has(self.minutes, time.minute) && has(self.hours, time.hour) && has(self.months, time.month)
+    }
+}
+
+impl fmt::Display for Cron {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str(&self.source)
+    }
+}
+
+impl Time {
+    /// The minute that contains `secs` seconds since the Unix epoch.
+    pub fn from_unix(secs: u64) -> Self {
+        let days = secs / 86_400;
+        let seconds_of_day = secs % 86_400;
+
+        // Days to a civil date, from Howard Hinnant's `civil_from_days`.
+        let z = days as i64 + 719_468;
+        let era = z.div_euclid(146_097);
+        let day_of_era = z - era * 146_097;
+        let year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36_524 - day_of_era / 146_096) / 365;
+        let day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+        let shifted_month = (5 * day_of_year + 2) / 153;
+        let day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+        let month = if shifted_month < 10 { shifted_month + 3 } else { shifted_month - 9 };
+
+        Self {
+            minute: (seconds_of_day / 60 % 60) as u32,
+            hour: (seconds_of_day / 3600) as u32,
+            day: day as u32,
+            month: month as u32,
+            // 1970-01-01 was a Thursday.
+            weekday: ((days + 4) % 7) as u32,
+        }
+    }
+}
+
+fn has(bits: u64, value: u32) -> bool {
+    bits & (1 << value) != 0
+}
+
+fn field(text: &str, min: u32, max: u32, name: &str) -> Result<u64, String> {
+    let mut bits = 0;
+
+    for part in text.split(',') {
+        let (range, step) = match part.split_once('/') {
+            Some((range, step)) => {
+                let step = number(step, name)?;
+                if step == 0 {
+                    return Err(format!("step of the {} field can't be 0", name));
+                }
+                (range, step)
+            }
+            None => (part, 1),
+        };
+
+        let (start, end) = match range {
+            "*" => (min, max),
+            _ => match range.split_once('-') {
+                Some((start, end)) => (number(start, name)?, number(end, name)?),
+                // `5/15` means from 5 to the end, every 15.
+                None if step > 1 => (number(range, name)?, max),
+                None => {
+                    let value = number(range, name)?;
+                    (value, value)
+                }
+            },
+        };
+
+        if start < min || end > max || start > end {
+            return Err(format!("'{}' is out of range {}-{} for the {} field", part, min, max, name));
+        }
+        for value in (start..=end).step_by(step as usize) {
+            bits |= 1 << value;
+        }
+    }
+
+    Ok(bits)
+}
+
+fn number(text: &str, name: &str) -> Result<u32, String> {
+    text.parse().map_err(|_| format!("'{}' is not a number in the {} field", text, name))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn at(minute: u32, hour: u32, day: u32, month: u32, weekday: u32) -> Time {
+        Time { minute, hour, day, month, weekday }
+    }
+
+    fn allowed(bits: u64, min: u32, max: u32) -> Vec<u32> {
+        (min..=max).filter(|&value| has(bits, value)).collect()
+    }
+
+    #[test]
+    fn ranges_steps_and_lists() {
+        let cron = Cron::parse("0-10/5,30,45-47 */6 1-3 * *").unwrap();
+        assert_eq!(allowed(cron.minutes, 0, 59), [0, 5, 10, 30, 45, 46, 47]);
+        assert_eq!(allowed(cron.hours, 0, 23), [0, 6, 12, 18]);
+        assert_eq!(allowed(cron.days, 1, 31), [1, 2, 3]);
+        assert_eq!(allowed(cron.months, 1, 12), (1..=12).collect::<Vec<_>>());
+
+        // A single value with a step runs to the end of the field.
+        let cron = Cron::parse("50/4 * * */5 *").unwrap();
+        assert_eq!(allowed(cron.minutes, 0, 59), [50, 54, 58]);
+        assert_eq!(allowed(cron.months, 1, 12), [1, 6, 11]);
+    }
+
+    #[test]
+    fn sunday_is_0_and_7() {
+        let cron = Cron::parse("0 0 * * 5-7").unwrap();
+        assert_eq!(allowed(cron.weekdays, 0, 7), [0, 5, 6]);
+    }
+
+    #[test]
+    fn invalid_expressions() {
+        for expression in ["* * * *", "60 * * * *", "* 24 * * *", "* * 0 * *", "* * * 13 *", "* * * * 8", "5-1 * * * *", "*/0 * * * *", "a * * * *", "1- * * * *"] {
+            assert!(Cron::parse(expression).is_err(), "{}", expression);
+        }
+    }
+
+    #[test]
+    fn day_of_month_or_day_of_week() {
+        // Both restricted: the 13th or any Friday.
+        let cron = Cron::parse("0 12 13 * 5").unwrap();
+        assert!(cron.matches(&at(0, 12, 13, 6, 2)));
+        assert!(cron.matches(&at(0, 12, 20, 6, 5)));
+        assert!(!cron.matches(&at(0, 12, 14, 6, 6)));
+        assert!(!cron.matches(&at(1, 12, 13, 6, 2)));
+
+        // Only one restricted: that one decides.
+        let cron = Cron::parse("0 12 13 * *").unwrap();
+        assert!(!cron.matches(&at(0, 12, 20, 6, 5)));
+        let cron = Cron::parse("0 12 * * 5").unwrap();
+        assert!(!cron.matches(&at(0, 12, 13, 6, 2)));
+        assert!(cron.matches(&at(0, 12, 20, 6, 5)));
+
+        // A step over `*` isn't a restriction for this rule, both fields have to match.
+        let cron = Cron::parse("0 12 */2 * 5").unwrap();
+        assert!(cron.matches(&at(0, 12, 3, 6, 5)));
+        assert!(!cron.matches(&at(0, 12, 4, 6, 5)));
+        assert!(!cron.matches(&at(0, 12, 3, 6, 1)));
+    }
+
+    #[test]
+    fn calendar_rollover() {
+        // One minute before each date, then the date itself.
+        let cases = [
+            (1_704_067_200, at(0, 0, 1, 1, 1)),  // 2024-01-01, after the last day of 2023
+            (1_706_745_600, at(0, 0, 1, 2, 4)),  // 2024-02-01, after January 31
+            (1_709_164_800, at(0, 0, 29, 2, 4)), // 2024-02-29, a leap day
+            (1_709_251_200, at(0, 0, 1, 3, 5)),  // 2024-03-01, after February 29
+            (951_782_400, at(0, 0, 29, 2, 2)),   // 2000-02-29, a leap day of a century
+            (4_107_542_400, at(0, 0, 1, 3, 1)),  // 2100-03-01, 2100 isn't a leap year
+        ];
+        for (secs, expected) in cases {
+            assert_eq!(Time::from_unix(secs), expected, "{}", secs);
+            let before = Time::from_unix(secs - 60);
+            assert_eq!((before.minute, before.hour), (59, 23));
+            assert_eq!(before.weekday, (expected.weekday + 6) % 7);
+        }
+        assert_eq!(Time::from_unix(1_703_980_800 + 59), at(0, 0, 31, 12, 0));
+
+        // Monthly at midnight of the 1st, so only the first minute of a month matches.
+        let cron = Cron::parse("0 0 1 * *").unwrap();
+        assert!(cron.matches(&Time::from_unix(1_709_251_200)));
+        assert!(!cron.matches(&Time::from_unix(1_709_251_200 - 60)));
+        assert!(!cron.matches(&Time::from_unix(1_709_164_800)));
+    }
+}
@@ -0,0 +1,521 @@
+//! Background work of routes: `job` blocks run by `Jobs.enqueue` and `schedule` blocks run
+//! on a cron schedule, both on `WORKERS` threads of their own, away from the requests.
+//!
+//! Enqueued jobs are kept in a KV store of their own until they succeed, so the ones a
+//! stopped daemon didn't finish run after the next start. A failed job is retried with
+//! exponential backoff, up to `MAX_ATTEMPTS` runs in total. Scheduled runs aren't kept or
+//! retried: like in cron, a time missed while the daemon was down is skipped, and a run
+//! that is still going when its next time comes skips that time.
+//!
+//! Job names are shared by all servers of the process. A job waits until a server that
+//! declares its name is running. Servers are recorded as soon as they start, while the queue
+//! may still be opening, so their jobs can be enqueued once it is open.
+
+pub mod cron;
+
+use std::{
+    cmp::Ordering,
+    collections::{BinaryHeap, HashMap, HashSet},
+    panic::AssertUnwindSafe,
+    path::PathBuf,
+    sync::{Arc, Condvar, Mutex, MutexGuard, OnceLock, RwLock, atomic::{AtomicU64, Ordering as AtomicOrdering}},
+    time::{Duration, Instant, SystemTime, UNIX_EPOCH},
+};
+use log::{debug, error, info, warn};
+use crate::{kv::KvStore, language::Interpreter, utils::background_open::BackgroundOpen};
+use cron::{Cron, Time};
+
+/// Threads that run jobs and scheduled runs.
+const WORKERS: usize = 4;
+/// Runs of an enqueued job before it is dropped.
+const MAX_ATTEMPTS: u32 = 5;
+/// Delay before the first retry, doubled for every next one.
+const FIRST_RETRY: Duration = Duration::from_secs(1);
+const MAX_RETRY: Duration = Duration::from_secs(5 * 60);
+
+enum Target {
+    Named(String),
+    Scheduled { server: String, index: usize },
+}
+
+struct Job {
+    /// Key in the store, `None` for scheduled runs.
+    id: Option<u64>,
+    target: Target,
+    /// Arguments given to `Jobs.enqueue`, encoded like `Kv` values.
+    args: Vec<u8>,
+    /// Runs that failed so far.
+    attempt: u32,
+}
+
+impl Job {
+    /// Attempt (u32), name length (u32), name, arguments. Integers are little-endian.
+    fn encode(&self, name: &str) -> Vec<u8> {
+        let mut encoded = Vec::with_capacity(8 + name.len() + self.args.len());
+        encoded.extend_from_slice(&self.attempt.to_le_bytes());
+        encoded.extend_from_slice(&(name.len() as u32).to_le_bytes());
+        encoded.extend_from_slice(name.as_bytes());
+        encoded.extend_from_slice(&self.args);
+        encoded
+    }
+
+    fn decode(key: &[u8], value: &[u8]) -> Option<Job> {
+        let id = u64::from_be_bytes(key.try_into().ok()?);
+        let attempt = u32::from_le_bytes(value.get(..4)?.try_into().ok()?);
+        let name_len = u32::from_le_bytes(value.get(4..8)?.try_into().ok()?) as usize;
+        let name = String::from_utf8(value.get(8..8 + name_len)?.to_vec()).ok()?;
+        let args = value.get(8 + name_len..)?.to_vec();
+        Some(Job { id: Some(id), target: Target::Named(name), args, attempt })
+    }
+
+    fn describe(&self) -> String {
+        match (&self.target, self.id) {
+            (Target::Named(name), Some(id)) => format!("Job '{}' #{}", name, id),
+            (Target::Named(name), None) => format!("Job '{}'", name),
+            (Target::Scheduled { server, index }, _) => format!("Schedule {} of server {}", index, server),
+        }
+    }
+}
+
+/// Keys are big-endian, so the store lists jobs in the order they were enqueued.
+fn job_key(id: u64) -> Vec<u8> {
+    id.to_be_bytes().to_vec()
+}
+
+struct Queued {
+    due: Instant,
+    seq: u64,
+    job: Job,
+}
+
+// `BinaryHeap` is a max-heap: the earliest due job is the greatest.
+impl Ord for Queued {
+    fn cmp(&self, other: &Self) -> Ordering {
+        (other.due, other.seq).cmp(&(self.due, self.seq))
+    }
+}
+
+impl PartialOrd for Queued {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for Queued {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for Queued {}
+
+struct Server {
+    interpreter: Arc<RwLock<Interpreter>>,
+    schedules: Vec<Cron>,
+}
+
+/// Running servers with jobs or schedules. When both are needed, the queue's state is
+/// locked first.
+#[derive(Default)]
+struct Registry {
+    servers: HashMap<String, Server>,
+    /// Server that runs each job name.
+    owners: HashMap<String, String>,
+}
+
+static REGISTRY: OnceLock<Mutex<Registry>> = OnceLock::new();
+
+fn registry() -> MutexGuard<'static, Registry> {
+    REGISTRY.get_or_init(|| Mutex::new(Registry::default()))
+        .lock()
+        .unwrap_or_else(|poisoned| poisoned.into_inner())
+}
+
+struct State {
+    ready: BinaryHeap<Queued>,
+    /// Jobs whose name no running server declares, by name.
+    parked: HashMap<String, Vec<Job>>,
+    /// Schedules with a run queued or going.
+    busy: HashSet<(String, usize)>,
+    seq: u64,
+}
+
+impl State {
+    fn push(&mut self, job: Job, due: Instant) {
+        self.seq += 1;
+        self.ready.push(Queued { due, seq: self.seq, job });
+    }
+}
+
+struct Shared {
+    store: KvStore,
+    state: Mutex<State>,
+    wake: Condvar,
+    next_id: AtomicU64,
+}
+
+pub struct JobQueue {
+    shared: Arc<Shared>,
+}
+
+impl JobQueue {
+    /// Opens the queue kept in `dir` and starts its threads. Jobs left in it run if a
+    /// registered server declares them, or wait for one that does.
+    pub fn open(dir: &std::path::Path) -> std::io::Result<Self> {
+        let store = KvStore::open(dir)?;
+
+        let mut parked: HashMap<String, Vec<Job>> = HashMap::new();
+        let mut next_id = 0;
+        let mut recovered = 0;
+        for (key, value) in store.scan(b"") {
+            let Some(job) = Job::decode(&key, &value) else {
+                warn!("[Jobs] Dropping a job that can't be read");
+                store.delete(key).map_err(std::io::Error::other)?;
+                continue;
+            };
+            next_id = next_id.max(job.id.unwrap_or_default() + 1);
+            if let Target::Named(name) = &job.target {
+                parked.entry(name.clone()).or_default().push(job);
+                recovered += 1;
+            }
+        }
+        if recovered > 0 {
+            info!("[Jobs] {} jobs left from the last run are waiting for their servers", recovered);
+        }
+
+        let shared = Arc::new(Shared {
+            store,
+            state: Mutex::new(State {
+                ready: BinaryHeap::new(),
+                parked,
+                busy: HashSet::new(),
+                seq: 0,
+            }),
+            wake: Condvar::new(),
+            next_id: AtomicU64::new(next_id),
+        });
+
+        for i in 0..WORKERS {
+            let worker_shared = Arc::clone(&shared);
+            std::thread::Builder::new()
+                .name(format!("netter-job-{}", i))
+                .spawn(move || worker_loop(worker_shared))?;
+        }
+
+        let schedule_shared = Arc::clone(&shared);
+        std::thread::Builder::new()
+            .name("netter-job-schedule".to_string())
+            .spawn(move || schedule_loop(schedule_shared))?;
+
+        let queue = Self { shared };
+        queue.unpark();
+        Ok(queue)
+    }
+
+    /// Queues a run of the job `name`. It is on disk when this returns.
+    pub fn enqueue(&self, name: &str, args: Vec<u8>) -> Result<u64, String> {
+        if !registry().owners.contains_key(name) {
+            return Err(format!("Job '{}' is not declared", name));
+        }
+
+        let id = self.shared.next_id.fetch_add(1, AtomicOrdering::Relaxed);
+        let job = Job { id: Some(id), target: Target::Named(name.to_string()), args, attempt: 0 };
+        self.shared.store.put(job_key(id), job.encode(name))?;
+
+        self.shared.lock().push(job, Instant::now());
+        self.shared.wake.notify_one();
+        debug!("[Jobs] Enqueued job '{}' #{}", name, id);
+        Ok(id)
+    }
+
+    /// Queues the parked jobs whose name a running server declares.
+    fn unpark(&self) {
+        let mut state = self.shared.lock();
+        let names: Vec<String> = {
+            let registry = registry();
+            state.parked.keys().filter(|name| registry.owners.contains_key(*name)).cloned().collect()
+        };
+        if names.is_empty() {
+            return;
+        }
+
+        let now = Instant::now();
+        for name in names {
+            for job in state.parked.remove(&name).unwrap_or_default() {
+                state.push(job, now);
+            }
+        }
+        drop(state);
+
+        self.shared.wake.notify_all();
+    }
+}
+
+impl Shared {
+    fn lock(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(|poisoned| poisoned.into_inner())
+    }
+
+    /// Waits for the next job that is due.
+    fn next(&self) -> Job {
+        let mut state = self.lock();
+        loop {
+            let now = Instant::now();
+            state = match state.ready.peek().map(|queued| queued.due) {
+                Some(due) if due <= now => match state.ready.pop() {
+                    Some(queued) => return queued.job,
+                    None => state,
+                },
+                Some(due) => self.wake.wait_timeout(state, due - now).unwrap_or_else(|poisoned| poisoned.into_inner()).0,
+                None => self.wake.wait(state).unwrap_or_else(|poisoned| poisoned.into_inner()),
+            };
+        }
+    }
+
+    fn run(&self, mut job: Job) {
+        let interpreter = {
+            let mut state = self.lock();
+            let interpreter = {
+                let registry = registry();
+                let server = match &job.target {
+                    Target::Named(name) => registry.owners.get(name),
+                    Target::Scheduled { server, .. } => Some(server),
+                };
+                server.and_then(|server| registry.servers.get(server)).map(|server| Arc::clone(&server.interpreter))
+            };
+            match interpreter {
+                Some(interpreter) => interpreter,
+                None => {
+                    match &job.target {
+                        Target::Named(name) => {
+                            debug!("[Jobs] No running server declares job '{}', it waits", name);
+                            state.parked.entry(name.clone()).or_default().push(job);
+                        }
+                        Target::Scheduled { server, index } => {
+                            let key = (server.clone(), *index);
+                            state.busy.remove(&key);
+                        }
+                    }
+                    return;
+                }
+            }
+        };
+
+        let started = Instant::now();
+        // A route panics on `!!`, the worker has to outlive it.
+        let result = std::panic::catch_unwind(AssertUnwindSafe(|| {
+            let interpreter = interpreter.read().unwrap_or_else(|poisoned| poisoned.into_inner());
+            match &job.target {
+                Target::Named(name) => interpreter.run_job(name, &job.args, job.attempt + 1),
+                Target::Scheduled { index, .. } => interpreter.run_schedule(*index),
+            }
+        }))
+        .unwrap_or_else(|_| Err("the job panicked".to_string()));
+
+        match (result, &job.target) {
+            (Ok(()), _) => {
+                debug!("[Jobs] {} done in {:?}", job.describe(), started.elapsed());
+                self.finish(&job);
+            }
+            (Err(e), Target::Scheduled { .. }) => {
+                error!("[Jobs] {} failed: {}", job.describe(), e);
+                self.finish(&job);
+            }
+            (Err(e), Target::Named(name)) => {
+                job.attempt += 1;
+                if job.attempt >= MAX_ATTEMPTS {
+                    error!("[Jobs] {} failed {} times, dropping it: {}", job.describe(), job.attempt, e);
+                    self.finish(&job);
+                    return;
+                }
+
+                let delay = FIRST_RETRY.saturating_mul(1 << (job.attempt - 1)).min(MAX_RETRY);
+                warn!("[Jobs] {} failed, retrying in {:?}: {}", job.describe(), delay, e);
+                if let Some(id) = job.id {
+                    // Without the new count a restart retries more often, nothing is lost.
+                    if let Err(e) = self.store.put(job_key(id), job.encode(name)) {
+                        error!("[Jobs] Failed to save the attempts of {}: {}", job.describe(), e);
+                    }
+                }
+                self.lock().push(job, Instant::now() + delay);
+                self.wake.notify_one();
+            }
+        }
+    }
+
+    fn finish(&self, job: &Job) {
+        match (&job.target, job.id) {
+            (Target::Scheduled { server, index }, _) => {
+                self.lock().busy.remove(&(server.clone(), *index));
+            }
+            (Target::Named(_), Some(id)) => {
+                if let Err(e) = self.store.delete(job_key(id)) {
+                    error!("[Jobs] Failed to remove finished {}: {}", job.describe(), e);
+                }
+            }
+            (Target::Named(_), None) => {}
+        }
+    }
+
+    /// Queues a run of every schedule that matches `time`.
+    fn fire(&self, time: &Time) {
+        let mut state = self.lock();
+        let now = Instant::now();
+
+        let due: Vec<(String, usize)> = registry().servers.iter()
+            .flat_map(|(server, entry)| {
+                entry.schedules.iter().enumerate()
+                    .filter(|(_, cron)| cron.matches(time))
+                    .map(move |(index, _)| (server.clone(), index))
+            })
+            .collect();
+
+        for (server, index) in due {
+            if !state.busy.insert((server.clone(), index)) {
+                warn!("[Jobs] Schedule {} of server {} is still running, skipping this time", index, server);
+                continue;
+            }
+            state.push(Job { id: None, target: Target::Scheduled { server, index }, args: Vec::new(), attempt: 0 }, now);
+        }
+        drop(state);
+
+        self.wake.notify_all();
+    }
+}
+
+fn worker_loop(shared: Arc<Shared>) {
+    loop {
+        let job = shared.next();
+        shared.run(job);
+    }
+}
+
+fn schedule_loop(shared: Arc<Shared>) {
+    loop {
+        let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap_or_default();
+        let next_minute = (now.as_secs() / 60 + 1) * 60;
+        std::thread::sleep(Duration::from_secs(next_minute).saturating_sub(now));
+        shared.fire(&Time::from_unix(next_minute));
+    }
+}
+
+static DIR: OnceLock<PathBuf> = OnceLock::new();
+static QUEUE: BackgroundOpen<JobQueue> = BackgroundOpen::new("job queue");
+
+/// Sets the directory of the queue. Only takes effect before the queue is first used.
+pub fn set_dir(dir: PathBuf) {
+    if DIR.set(dir).is_err() {
+        debug!("[Jobs] Directory is already set");
+    }
+}
+
+/// The queue, opened on first use. Like `kv::global`, a route waits for the open at most
+/// `kv::OPEN_WAIT`, and a failed open is tried again by the next call.
+pub fn global() -> Result<&'static JobQueue, String> {
+    open(Some(crate::kv::OPEN_WAIT))
+}
+
+fn open(wait: Option<Duration>) -> Result<&'static JobQueue, String> {
+    QUEUE.get_or_open(wait, || {
+        let dir = DIR.get_or_init(|| std::env::temp_dir().join("netter-jobs"));
+        JobQueue::open(dir).map_err(|e| {
+            error!("[Jobs] Failed to open '{}', enqueued jobs won't run until it opens: {}", dir.display(), e);
+            e.to_string()
+        })
+    })
+}
+
+/// Starts running the jobs and schedules of a server, if its config has any, until
+/// `unregister`. Its jobs are declared when this returns. Opening the queue may wait for a
+/// daemon that is handing over, so it happens on a thread of its own.
+pub fn register(server_id: &str, interpreter: &Arc<RwLock<Interpreter>>) {
+    let (names, schedules) = {
+        let Ok(interpreter) = interpreter.read() else {
+            return;
+        };
+        if !interpreter.has_background_work() {
+            return;
+        }
+        (interpreter.job_names(), interpreter.schedules())
+    };
+    info!("[Jobs] Server {}: {} jobs, {} schedules", server_id, names.len(), schedules.len());
+
+    {
+        let mut registry = registry();
+        for name in names {
+            if let Some(other) = registry.owners.insert(name.clone(), server_id.to_string()) {
+                if other != server_id {
+                    warn!("[Jobs] Job '{}' of server {} replaces the one of server {}", name, server_id, other);
+                }
+            }
+        }
+        registry.servers.insert(server_id.to_string(), Server { interpreter: Arc::clone(interpreter), schedules });
+    }
+
+    if let Some(queue) = QUEUE.get() {
+        queue.unpark();
+        return;
+    }
+
+    // A server unregistered before the open ends is gone from the registry by then, so
+    // none of its jobs is unparked.
+    let server_id = server_id.to_string();
+    let spawned = std::thread::Builder::new()
+        .name("netter-job-open".to_string())
+        .spawn(move || match open(None) {
+            Ok(queue) => queue.unpark(),
+            Err(e) => error!("[Jobs] Jobs and schedules of server {} won't run: {}", server_id, e),
+        });
+    if let Err(e) = spawned {
+        error!("[Jobs] Failed to start opening the queue: {}", e);
+    }
+}
+
+/// Stops running the jobs and schedules of a server. Its queued jobs wait for it to start again.
+pub fn unregister(server_id: &str) {
+    let mut registry = registry();
+    registry.servers.remove(server_id);
+    registry.owners.retain(|_, owner| owner != server_id);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::language::parse;
+
+    fn server(source: &str) -> Arc<RwLock<Interpreter>> {
+        let mut interpreter = Interpreter::new();
+        interpreter.interpret(&parse(source).unwrap()).unwrap();
+        Arc::new(RwLock::new(interpreter))
+    }
+
+    #[test]
+    fn jobs_are_declared_before_the_queue_opens() {
+        let dir = std::env::temp_dir().join(format!("netter-jobs-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        set_dir(dir.clone());
+
+        register("stopped", &server(r#"job "stale" { };"#));
+        unregister("stopped");
+        register("running", &server(r#"job "ping" { };"#));
+
+        // Nothing here waits for the open.
+        assert!(registry().owners.get("ping").is_some_and(|owner| owner == "running"));
+        assert!(!registry().owners.contains_key("stale"));
+
+        let queue = open(None).unwrap();
+        let id = queue.enqueue("ping", Vec::new()).unwrap();
+        assert_eq!(queue.enqueue("stale", Vec::new()), Err("Job 'stale' is not declared".to_string()));
+
+        // The job runs and leaves the store.
+        let started = Instant::now();
+        while queue.shared.store.get(&job_key(id)).is_some() {
+            assert!(started.elapsed() < Duration::from_secs(10), "job #{} didn't run", id);
+            std::thread::sleep(Duration::from_millis(10));
+        }
+
+        // The open the stopped server started didn't bring it back.
+        assert!(!registry().servers.contains_key("stopped"));
+        unregister("running");
+    }
+}
@@ -0,0 +1,853 @@
+//! Durable key-value store for routes, kept under the service state directory.
+//!
+//! Writes go through one commit thread. It takes every write waiting at that moment, appends
+//! them to the write-ahead log with a single sync and then applies them to the memtable, so
+//! concurrent routes share the cost of a sync. A memtable over `FLUSH_BYTES` is written out
+//! as a sorted table by the compaction thread, which also merges the tables into one once
+//! there are `COMPACT_AT` of them. While a flush is behind, writes are refused once the new
+//! memtable reaches `BACKLOG_BYTES`. Reads look at the memtables, then the tables from newest
+//! to oldest, without waiting for writes.
+//!
+//! `MANIFEST` lists the live tables and the first log that isn't in them yet. Files it
+//! doesn't list are left over from an interrupted flush or compaction and removed on open.
+
+mod table;
+mod wal;
+
+use std::{
+    collections::BTreeMap,
+    fs::{self, File},
+    io,
+    path::{Path, PathBuf},
+    sync::{Arc, OnceLock, RwLock, RwLockReadGuard, RwLockWriteGuard, mpsc},
+    time::Duration,
+};
+use log::{debug, error, info, warn};
+use crate::utils::background_open::BackgroundOpen;
+use table::{Entry, Table};
+use wal::{Op, Wal};
+
+/// Memtable size at which it is written out as a table.
+const FLUSH_BYTES: usize = 4 * 1024 * 1024;
+/// Memtable size at which writes are refused while the previous memtable is still being
+/// written out, so flushes that keep failing don't grow the memtable without bound.
+const BACKLOG_BYTES: usize = 4 * FLUSH_BYTES;
+/// Number of tables at which they are merged.
+const COMPACT_AT: usize = 4;
+/// Most commits synced together.
+const MAX_GROUP: usize = 512;
+/// How long `open` waits for another process, such as a daemon handing over to this one,
+/// to release the directory.
+const LOCK_TIMEOUT: Duration = Duration::from_secs(30);
+/// Longest a route waits for the store to open, the open goes on in the background after
+/// that. Routes run on the shared execution threads, which shouldn't wait out `LOCK_TIMEOUT`.
+pub(crate) const OPEN_WAIT: Duration = Duration::from_secs(2);
+
+type Memtable = BTreeMap<Vec<u8>, Option<Vec<u8>>>;
+
+pub type UpdateFn = Box<dyn FnOnce(Option<&[u8]>) -> Result<Vec<u8>, String> + Send>;
+
+pub enum Write {
+    Put(Vec<u8>, Vec<u8>),
+    Delete(Vec<u8>),
+    /// Replaces the value with what the function returns for the current one, `None` for a
+    /// missing key. It runs on the commit thread, so two updates never see the same value.
+    Update(Vec<u8>, UpdateFn),
+}
+
+struct Commit {
+    writes: Vec<Write>,
+    reply: mpsc::SyncSender<Result<Vec<Vec<u8>>, String>>,
+}
+
+struct State {
+    memtable: Memtable,
+    /// Rough size of the memtable, overwritten values are still counted.
+    memtable_bytes: usize,
+    /// Memtable being written out, with the first log that isn't in it.
+    frozen: Option<(Arc<Memtable>, u64)>,
+    /// Oldest first.
+    tables: Vec<Arc<Table>>,
+    /// First log that isn't in the tables.
+    wal_start: u64,
+    next_id: u64,
+}
+
+struct Shared {
+    dir: PathBuf,
+    state: RwLock<State>,
+    // Held open for the `flock` on it.
+    #[cfg(target_os = "linux")]
+    _lock: File,
+}
+
+pub struct KvStore {
+    shared: Arc<Shared>,
+    commits: mpsc::Sender<Commit>,
+}
+
+impl KvStore {
+    /// Opens the store in `dir`, replaying the logs of writes that didn't reach a table.
+    pub fn open(dir: &Path) -> io::Result<Self> {
+        fs::create_dir_all(dir)?;
+        #[cfg(target_os = "linux")]
+        let lock = lock_dir(dir)?;
+
+        let manifest = Manifest::read(dir)?;
+        let mut next_id = manifest.wal_start;
+        let mut tables = Vec::new();
+        for id in &manifest.tables {
+            tables.push(Arc::new(Table::open(*id, &table_path(dir, *id))?));
+            next_id = next_id.max(id + 1);
+        }
+
+        let mut logs = Vec::new();
+        for entry in fs::read_dir(dir)? {
+            let entry = entry?;
+            let name = entry.file_name();
+            let name = name.to_string_lossy();
+
+            let stale = if let Some(id) = parse_id(&name, "wal-", ".log") {
+                next_id = next_id.max(id + 1);
+                let live = id >= manifest.wal_start;
+                if live {
+                    logs.push(id);
+                }
+                !live
+            } else if let Some(id) = parse_id(&name, "table-", ".sst") {
+                next_id = next_id.max(id + 1);
+                !manifest.tables.contains(&id)
+            } else {
+                name.ends_with(".tmp")
+            };
+
+            if stale {
+                debug!("[KV Store] Removing leftover '{}'", name);
+                fs::remove_file(entry.path())?;
+            }
+        }
+
+        let mut state = State {
+            memtable: Memtable::new(),
+            memtable_bytes: 0,
+            frozen: None,
+            tables,
+            wal_start: manifest.wal_start,
+            next_id,
+        };
+
+        logs.sort_unstable();
+        let mut replayed = 0;
+        for id in logs {
+            for op in wal::replay(&wal::path(dir, id))? {
+                state.apply(op);
+                replayed += 1;
+            }
+        }
+
+        let wal = Wal::create(dir, state.take_id())?;
+        info!(
+            "[KV Store] Opened '{}': {} tables, {} writes replayed from the log",
+            dir.display(), state.tables.len(), replayed
+        );
+
+        let shared = Arc::new(Shared {
+            dir: dir.to_path_buf(),
+            state: RwLock::new(state),
+            #[cfg(target_os = "linux")]
+            _lock: lock,
+        });
+
+        let (commits, commits_rx) = mpsc::channel();
+        let (work, work_rx) = mpsc::channel();
+
+        let commit_shared = Arc::clone(&shared);
+        std::thread::Builder::new()
+            .name("netter-kv-commit".to_string())
+            .spawn(move || commit_loop(commit_shared, wal, commits_rx, work))?;
+
+        let compaction_shared = Arc::clone(&shared);
+        std::thread::Builder::new()
+            .name("netter-kv-compaction".to_string())
+            .spawn(move || compaction_loop(compaction_shared, work_rx))?;
+
+        Ok(Self { shared, commits })
+    }
+
+    pub fn get(&self, key: &[u8]) -> Option<Vec<u8>> {
+        self.shared.get(key)
+    }
+
+    /// Keys that start with `prefix` and their values, in key order.
+    pub fn scan(&self, prefix: &[u8]) -> Vec<(Vec<u8>, Vec<u8>)> {
+        self.shared.scan(prefix)
+    }
+
+    /// Commits the writes together: they are all durable when this returns, or none is
+    /// applied. Returns the values written by `Write::Update`, in order.
+    pub fn write(&self, writes: Vec<Write>) -> Result<Vec<Vec<u8>>, String> {
+        let (reply, result) = mpsc::sync_channel(1);
+        self.commits.send(Commit { writes, reply }).map_err(|_| "KV store is closed".to_string())?;
+        result.recv().map_err(|_| "KV store is closed".to_string())?
+    }
+
+    pub fn put(&self, key: Vec<u8>, value: Vec<u8>) -> Result<(), String> {
+        self.write(vec![Write::Put(key, value)]).map(|_| ())
+    }
+
+    pub fn delete(&self, key: Vec<u8>) -> Result<(), String> {
+        self.write(vec![Write::Delete(key)]).map(|_| ())
+    }
+
+    /// Returns the new value.
+    pub fn update(&self, key: Vec<u8>, update: UpdateFn) -> Result<Vec<u8>, String> {
+        self.write(vec![Write::Update(key, update)])?
+            .pop()
+            .ok_or_else(|| "KV store returned no value".to_string())
+    }
+}
+
+impl State {
+    fn apply(&mut self, op: Op) {
+        self.memtable_bytes += op.key().len() + op.value().map_or(0, <[u8]>::len) + 32;
+        match op {
+            Op::Put(key, value) => self.memtable.insert(key, Some(value)),
+            Op::Delete(key) => self.memtable.insert(key, None),
+        };
+    }
+
+    fn take_id(&mut self) -> u64 {
+        self.next_id += 1;
+        self.next_id - 1
+    }
+
+    fn manifest(&self) -> Manifest {
+        Manifest { wal_start: self.wal_start, tables: self.tables.iter().map(|table| table.id).collect() }
+    }
+}
+
+impl Shared {
+    fn read(&self) -> RwLockReadGuard<'_, State> {
+        self.state.read().unwrap_or_else(|poisoned| poisoned.into_inner())
+    }
+
+    fn write(&self) -> RwLockWriteGuard<'_, State> {
+        self.state.write().unwrap_or_else(|poisoned| poisoned.into_inner())
+    }
+
+    fn get(&self, key: &[u8]) -> Option<Vec<u8>> {
+        let state = self.read();
+
+        if let Some(value) = state.memtable.get(key) {
+            return value.clone();
+        }
+        if let Some(value) = state.frozen.as_ref().and_then(|(frozen, _)| frozen.get(key)) {
+            return value.clone();
+        }
+        state.tables.iter().rev()
+            .find_map(|table| table.get(key))
+            .flatten()
+            .map(<[u8]>::to_vec)
+    }
+
+    fn scan(&self, prefix: &[u8]) -> Vec<(Vec<u8>, Vec<u8>)> {
+        let state = self.read();
+        let mut found = Memtable::new();
+
+        // Oldest first, newer entries replace older ones.
+        for table in &state.tables {
+            for (key, value) in table.iter_from(prefix).take_while(|(key, _)| key.starts_with(prefix)) {
+                found.insert(key.to_vec(), value.map(<[u8]>::to_vec));
+            }
+        }
+        let memtables = state.frozen.iter().map(|(frozen, _)| &**frozen).chain([&state.memtable]);
+        for memtable in memtables {
+            for (key, value) in memtable.range(prefix.to_vec()..).take_while(|(key, _)| key.starts_with(prefix)) {
+                found.insert(key.clone(), value.clone());
+            }
+        }
+
+        found.into_iter().filter_map(|(key, value)| Some((key, value?))).collect()
+    }
+
+    /// Writes the frozen memtable out as a table and drops the logs it came from.
+    fn flush(&self) -> io::Result<()> {
+        let Some((memtable, wal_start)) = self.read().frozen.clone() else {
+            return Ok(());
+        };
+
+        let id = self.write().take_id();
+        let path = table_path(&self.dir, id);
+        Table::write(&path, memtable.iter().map(|(key, value)| (key.as_slice(), value.as_deref())))?;
+        let table = Arc::new(Table::open(id, &path)?);
+        debug!("[KV Store] Wrote {} keys to table {}", table.len(), id);
+
+        let old_start = {
+            let mut state = self.write();
+            state.tables.push(table);
+            state.frozen = None;
+            let old_start = std::mem::replace(&mut state.wal_start, wal_start);
+            state.manifest().write(&self.dir)?;
+            old_start
+        };
+
+        for id in old_start..wal_start {
+            remove_if_exists(&wal::path(&self.dir, id))?;
+        }
+        Ok(())
+    }
+
+    /// Merges the tables into one. Deleted keys are dropped: nothing older than the tables
+    /// is left to hide.
+    fn compact(&self) -> io::Result<()> {
+        let tables = self.read().tables.clone();
+        if tables.len() < COMPACT_AT {
+            return Ok(());
+        }
+
+        let id = self.write().take_id();
+        let path = table_path(&self.dir, id);
+        Table::write(&path, merge(&tables))?;
+        let merged = Arc::new(Table::open(id, &path)?);
+        info!("[KV Store] Merged {} tables into table {} with {} keys", tables.len(), id, merged.len());
+
+        {
+            let mut state = self.write();
+            // Tables flushed meanwhile are newer than the merged ones and stay after them.
+            state.tables.splice(..tables.len(), [merged]);
+            state.manifest().write(&self.dir)?;
+        }
+
+        for table in tables {
+            remove_if_exists(&table_path(&self.dir, table.id))?;
+        }
+        Ok(())
+    }
+}
+
+fn commit_loop(shared: Arc<Shared>, mut wal: Wal, commits: mpsc::Receiver<Commit>, work: mpsc::Sender<()>) {
+    let mut refusing = false;
+    while let Ok(first) = commits.recv() {
+        let mut group = vec![first];
+        while group.len() < MAX_GROUP {
+            match commits.try_recv() {
+                Ok(commit) => group.push(commit),
+                Err(_) => break,
+            }
+        }
+
+        let backlog = {
+            let state = shared.read();
+            state.frozen.is_some() && state.memtable_bytes >= BACKLOG_BYTES
+        };
+        if backlog {
+            if !refusing {
+                warn!("[KV Store] The memtable reached {} bytes while the previous one is still being written out, refusing writes until it is", BACKLOG_BYTES);
+                refusing = true;
+            }
+            for commit in group {
+                let _ = commit.reply.send(Err("KV store is refusing writes until its memtable is written out".to_string()));
+            }
+            continue;
+        }
+        if refusing {
+            info!("[KV Store] The memtable was written out, accepting writes again");
+            refusing = false;
+        }
+
+        let mut ops: Vec<Vec<Op>> = Vec::new();
+        let mut replies = Vec::new();
+        for commit in group {
+            match resolve(&shared, &ops, commit.writes) {
+                Ok((commit_ops, values)) => {
+                    ops.push(commit_ops);
+                    replies.push((commit.reply, values));
+                }
+                Err(e) => {
+                    let _ = commit.reply.send(Err(e));
+                }
+            }
+        }
+
+        if !ops.is_empty() {
+            if let Err(e) = wal.append(ops.iter().map(Vec::as_slice)) {
+                error!("[KV Store] Failed to write the log: {}", e);
+                for (reply, _) in replies {
+                    let _ = reply.send(Err(format!("Failed to write the log: {}", e)));
+                }
+                // A half-written group ends the replay of its log, later groups go to a new one.
+                let id = shared.write().take_id();
+                match Wal::create(&shared.dir, id) {
+                    Ok(new) => wal = new,
+                    Err(e) => error!("[KV Store] Failed to start a new log: {}", e),
+                }
+                continue;
+            }
+        }
+
+        let freeze = {
+            let mut state = shared.write();
+            for op in ops.into_iter().flatten() {
+                state.apply(op);
+            }
+            state.memtable_bytes >= FLUSH_BYTES && state.frozen.is_none()
+        };
+
+        for (reply, values) in replies {
+            let _ = reply.send(Ok(values));
+        }
+
+        if freeze {
+            let id = shared.write().take_id();
+            match Wal::create(&shared.dir, id) {
+                Ok(new) => {
+                    wal = new;
+                    let mut state = shared.write();
+                    let memtable = std::mem::take(&mut state.memtable);
+                    state.memtable_bytes = 0;
+                    state.frozen = Some((Arc::new(memtable), id));
+                    let _ = work.send(());
+                }
+                Err(e) => error!("[KV Store] Failed to start a new log: {}", e),
+            }
+        }
+    }
+}
+
+/// Turns a commit into the ops to log. Updates see the writes before them in the group.
+fn resolve(shared: &Shared, group: &[Vec<Op>], writes: Vec<Write>) -> Result<(Vec<Op>, Vec<Vec<u8>>), String> {
+    let mut ops: Vec<Op> = Vec::with_capacity(writes.len());
+    let mut values = Vec::new();
+
+    for write in writes {
+        match write {
+            Write::Put(key, value) => ops.push(Op::Put(key, value)),
+            Write::Delete(key) => ops.push(Op::Delete(key)),
+            Write::Update(key, update) => {
+                let pending = ops.iter().rev()
+                    .chain(group.iter().rev().flat_map(|commit| commit.iter().rev()))
+                    .find(|op| op.key() == key.as_slice());
+                let value = match pending {
+                    Some(op) => update(op.value())?,
+                    None => update(shared.get(&key).as_deref())?,
+                };
+                values.push(value.clone());
+                ops.push(Op::Put(key, value));
+            }
+        }
+    }
+
+    Ok((ops, values))
+}
+
+fn compaction_loop(shared: Arc<Shared>, work: mpsc::Receiver<()>) {
+    loop {
+        match work.recv_timeout(Duration::from_secs(10)) {
+            Ok(()) | Err(mpsc::RecvTimeoutError::Timeout) => {}
+            Err(mpsc::RecvTimeoutError::Disconnected) => break,
+        }
+
+        // A failed flush is retried on the next round, the memtable stays readable meanwhile.
+        if let Err(e) = shared.flush() {
+            error!("[KV Store] Failed to write the memtable to a table: {}", e);
+            continue;
+        }
+        if let Err(e) = shared.compact() {
+            error!("[KV Store] Failed to merge tables: {}", e);
+        }
+    }
+}
+
+/// Entries of all tables in key order, the newest table's entry for each key.
+fn merge(tables: &[Arc<Table>]) -> impl Iterator<Item = Entry<'_>> {
+    let mut cursors: Vec<_> = tables.iter().map(|table| table.iter().peekable()).collect();
+
+    std::iter::from_fn(move || loop {
+        let mut smallest: Option<(usize, &[u8])> = None;
+        for (i, cursor) in cursors.iter_mut().enumerate() {
+            if let Some(&(key, _)) = cursor.peek() {
+                // Later tables are newer and win ties.
+                if smallest.is_none_or(|(_, smallest)| key <= smallest) {
+                    smallest = Some((i, key));
+                }
+            }
+        }
+
+        let (newest, key) = smallest?;
+        let entry = cursors[newest].next()?;
+        for cursor in cursors.iter_mut() {
+            if cursor.peek().is_some_and(|&(other, _)| other == key) {
+                cursor.next();
+            }
+        }
+
+        if entry.1.is_some() {
+            return Some(entry);
+        }
+    })
+}
+
+struct Manifest {
+    wal_start: u64,
+    tables: Vec<u64>,
+}
+
+impl Manifest {
+    fn read(dir: &Path) -> io::Result<Self> {
+        let contents = match fs::read_to_string(dir.join("MANIFEST")) {
+            Ok(contents) => contents,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(Self { wal_start: 0, tables: Vec::new() }),
+            Err(e) => return Err(e),
+        };
+
+        let mut manifest = Self { wal_start: 0, tables: Vec::new() };
+        for line in contents.lines() {
+            let parsed = match line.split_once(' ') {
+                Some(("wal", id)) => u64::from_str_radix(id, 16).map(|id| manifest.wal_start = id),
+                Some(("table", id)) => u64::from_str_radix(id, 16).map(|id| manifest.tables.push(id)),
+                _ => continue,
+            };
+            parsed.map_err(|e| io::Error::new(io::ErrorKind::InvalidData, format!("Bad MANIFEST line '{}': {}", line, e)))?;
+        }
+        Ok(manifest)
+    }
+
+    fn write(&self, dir: &Path) -> io::Result<()> {
+        let mut contents = format!("wal {:016x}\n", self.wal_start);
+        for id in &self.tables {
+            contents.push_str(&format!("table {:016x}\n", id));
+        }
+
+        let tmp = dir.join("MANIFEST.tmp");
+        fs::write(&tmp, contents)?;
+        File::open(&tmp)?.sync_all()?;
+        fs::rename(&tmp, dir.join("MANIFEST"))?;
+        sync_dir(dir)
+    }
+}
+
+fn table_path(dir: &Path, id: u64) -> PathBuf {
+    dir.join(format!("table-{:016x}.sst", id))
+}
+
+fn parse_id(name: &str, prefix: &str, suffix: &str) -> Option<u64> {
+    u64::from_str_radix(name.strip_prefix(prefix)?.strip_suffix(suffix)?, 16).ok()
+}
+
+fn remove_if_exists(path: &Path) -> io::Result<()> {
+    match fs::remove_file(path) {
+        Err(e) if e.kind() != io::ErrorKind::NotFound => Err(e),
+        _ => Ok(()),
+    }
+}
+
+/// Makes renames in `dir` durable.
+fn sync_dir(dir: &Path) -> io::Result<()> {
+    #[cfg(unix)]
+    File::open(dir)?.sync_all()?;
+    #[cfg(not(unix))]
+    let _ = dir;
+    Ok(())
+}
+
+/// Keeps other processes out of the directory while the store is open.
+#[cfg(target_os = "linux")]
+fn lock_dir(dir: &Path) -> io::Result<File> {
+    use std::os::fd::AsRawFd;
+
+    let file = File::create(dir.join("LOCK"))?;
+    let started = std::time::Instant::now();
+    let mut waiting = false;
+    loop {
+        if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX | libc::LOCK_NB) } == 0 {
+            return Ok(file);
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::WouldBlock {
+            return Err(e);
+        }
+        if started.elapsed() > LOCK_TIMEOUT {
+            return Err(io::Error::new(io::ErrorKind::WouldBlock, "the store is used by another process"));
+        }
+        if !waiting {
+            info!("[KV Store] '{}' is used by another process, waiting for it", dir.display());
+            waiting = true;
+        }
+        std::thread::sleep(Duration::from_millis(100));
+    }
+}
+
+static DIR: OnceLock<PathBuf> = OnceLock::new();
+static STORE: BackgroundOpen<KvStore> = BackgroundOpen::new("KV store");
+
+/// Sets the directory of the store. Only takes effect before the store is first used.
+pub fn set_dir(dir: PathBuf) {
+    if DIR.set(dir).is_err() {
+        debug!("[KV Store] Directory is already set");
+    }
+}
+
+/// The store, opened on first use. A store that doesn't open within `OPEN_WAIT` is an error
+/// for this call only, a later call gets it once it is open or tries again if the open failed.
+pub fn global() -> Result<&'static KvStore, String> {
+    STORE.get_or_open(Some(OPEN_WAIT), || {
+        let dir = DIR.get_or_init(|| std::env::temp_dir().join("netter-kv"));
+        KvStore::open(dir).map_err(|e| {
+            error!("[KV Store] Failed to open '{}': {}", dir.display(), e);
+            e.to_string()
+        })
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn store_dir(test: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("netter-kv-{}-{}", std::process::id(), test));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn update(f: impl FnOnce(Option<&[u8]>) -> Vec<u8> + Send + 'static) -> Write {
+        Write::Update(b"counter".to_vec(), Box::new(move |value| Ok(f(value))))
+    }
+
+    fn increment(value: Option<&[u8]>) -> Vec<u8> {
+        let count: u32 = value.map_or(0, |value| std::str::from_utf8(value).unwrap().parse().unwrap());
+        (count + 1).to_string().into_bytes()
+    }
+
+    /// Waits for the compaction thread to reach `tables` tables with no flush pending.
+    fn wait_for_tables(store: &KvStore, tables: usize) {
+        let started = std::time::Instant::now();
+        loop {
+            {
+                let state = store.shared.read();
+                if state.tables.len() == tables && state.frozen.is_none() {
+                    return;
+                }
+            }
+            assert!(started.elapsed() < Duration::from_secs(30), "the store didn't reach {} tables", tables);
+            std::thread::sleep(Duration::from_millis(10));
+        }
+    }
+
+    /// Writes a memtable's worth of values under `prefix`.
+    fn fill(store: &KvStore, prefix: &str) {
+        for i in 0..4 {
+            store.put(format!("{}-{}", prefix, i).into_bytes(), vec![i as u8; 1024 * 1024]).unwrap();
+        }
+    }
+
+    fn newest_log(dir: &Path) -> PathBuf {
+        let mut logs: Vec<_> = fs::read_dir(dir).unwrap()
+            .map(|entry| entry.unwrap().path())
+            .filter(|path| path.extension().is_some_and(|extension| extension == "log"))
+            .collect();
+        logs.sort();
+        logs.pop().unwrap()
+    }
+
+    #[test]
+    fn put_delete_update() {
+        let dir = store_dir("round-trip");
+        let store = KvStore::open(&dir).unwrap();
+
+        store.put(b"a".to_vec(), b"1".to_vec()).unwrap();
+        store.put(b"b".to_vec(), b"2".to_vec()).unwrap();
+        store.put(b"c".to_vec(), b"3".to_vec()).unwrap();
+        store.put(b"a".to_vec(), b"4".to_vec()).unwrap();
+        store.delete(b"b".to_vec()).unwrap();
+
+        assert_eq!(store.get(b"a").as_deref(), Some(&b"4"[..]));
+        assert_eq!(store.get(b"b"), None);
+        assert_eq!(store.scan(b""), vec![(b"a".to_vec(), b"4".to_vec()), (b"c".to_vec(), b"3".to_vec())]);
+
+        assert_eq!(store.update(b"counter".to_vec(), Box::new(|value| Ok(increment(value)))).unwrap(), b"1");
+        assert_eq!(store.update(b"counter".to_vec(), Box::new(|value| Ok(increment(value)))).unwrap(), b"2");
+        assert_eq!(store.get(b"counter").as_deref(), Some(&b"2"[..]));
+
+        // A failed update fails its whole commit.
+        let failed = store.write(vec![
+            Write::Put(b"a".to_vec(), b"5".to_vec()),
+            Write::Update(b"counter".to_vec(), Box::new(|_| Err("no".to_string()))),
+        ]);
+        assert_eq!(failed, Err("no".to_string()));
+        assert_eq!(store.get(b"a").as_deref(), Some(&b"4"[..]));
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn update_sees_earlier_writes() {
+        let dir = store_dir("update-order");
+        let store = KvStore::open(&dir).unwrap();
+        store.put(b"counter".to_vec(), b"10".to_vec()).unwrap();
+
+        let values = store.write(vec![
+            Write::Put(b"counter".to_vec(), b"1".to_vec()),
+            update(increment),
+            update(increment),
+            Write::Delete(b"counter".to_vec()),
+            update(|value| {
+                assert_eq!(value, None);
+                b"new".to_vec()
+            }),
+        ]).unwrap();
+        assert_eq!(values, vec![b"2".to_vec(), b"3".to_vec(), b"new".to_vec()]);
+        assert_eq!(store.get(b"counter").as_deref(), Some(&b"new"[..]));
+
+        // Updates of commits synced together see each other, none of them is lost.
+        store.put(b"counter".to_vec(), b"0".to_vec()).unwrap();
+        let mut values: Vec<u32> = std::thread::scope(|scope| {
+            let threads: Vec<_> = (0..64).map(|_| scope.spawn(|| store.write(vec![update(increment)]).unwrap())).collect();
+            threads.into_iter()
+                .map(|thread| String::from_utf8(thread.join().unwrap().remove(0)).unwrap().parse().unwrap())
+                .collect()
+        });
+        values.sort_unstable();
+        assert_eq!(values, (1..=64).collect::<Vec<_>>());
+        assert_eq!(store.get(b"counter").as_deref(), Some(&b"64"[..]));
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn reopen_replays_the_log() {
+        let dir = store_dir("replay");
+        let store = KvStore::open(&dir).unwrap();
+        store.put(b"kept".to_vec(), b"value".to_vec()).unwrap();
+        store.put(b"deleted".to_vec(), b"value".to_vec()).unwrap();
+        store.delete(b"deleted".to_vec()).unwrap();
+        drop(store);
+
+        let store = KvStore::open(&dir).unwrap();
+        assert_eq!(store.get(b"kept").as_deref(), Some(&b"value"[..]));
+        assert_eq!(store.get(b"deleted"), None);
+        store.put(b"later".to_vec(), b"value".to_vec()).unwrap();
+        drop(store);
+
+        // The second open started its own log, both are replayed.
+        let store = KvStore::open(&dir).unwrap();
+        assert_eq!(store.scan(b""), vec![
+            (b"kept".to_vec(), b"value".to_vec()),
+            (b"later".to_vec(), b"value".to_vec()),
+        ]);
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn torn_record_ends_the_replay() {
+        let dir = store_dir("torn");
+        let store = KvStore::open(&dir).unwrap();
+        store.put(b"first".to_vec(), b"value".to_vec()).unwrap();
+        store.put(b"second".to_vec(), b"value".to_vec()).unwrap();
+        drop(store);
+
+        let log = newest_log(&dir);
+        let len = fs::metadata(&log).unwrap().len();
+        fs::OpenOptions::new().write(true).open(&log).unwrap().set_len(len - 3).unwrap();
+
+        let store = KvStore::open(&dir).unwrap();
+        assert_eq!(store.get(b"first").as_deref(), Some(&b"value"[..]));
+        assert_eq!(store.get(b"second"), None);
+
+        // Writes after the torn record go to a new log and survive the next open.
+        store.put(b"third".to_vec(), b"value".to_vec()).unwrap();
+        drop(store);
+        let store = KvStore::open(&dir).unwrap();
+        assert_eq!(store.get(b"first").as_deref(), Some(&b"value"[..]));
+        assert_eq!(store.get(b"third").as_deref(), Some(&b"value"[..]));
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn deleted_key_stays_deleted_after_compaction() {
+        let dir = store_dir("compaction");
+        let store = KvStore::open(&dir).unwrap();
+
+        store.put(b"gone".to_vec(), b"value".to_vec()).unwrap();
+        store.put(b"kept".to_vec(), b"value".to_vec()).unwrap();
+        fill(&store, "first");
+        wait_for_tables(&store, 1);
+
+        store.delete(b"gone".to_vec()).unwrap();
+        fill(&store, "second");
+        wait_for_tables(&store, 2);
+        assert_eq!(store.get(b"gone"), None);
+
+        fill(&store, "third");
+        wait_for_tables(&store, 3);
+        fill(&store, "fourth");
+        wait_for_tables(&store, 1);
+
+        assert_eq!(store.get(b"gone"), None);
+        assert_eq!(store.get(b"kept").as_deref(), Some(&b"value"[..]));
+        assert_eq!(store.scan(b"g"), Vec::new());
+        drop(store);
+
+        let store = KvStore::open(&dir).unwrap();
+        assert_eq!(store.get(b"gone"), None);
+        assert_eq!(store.get(b"kept").as_deref(), Some(&b"value"[..]));
+        assert_eq!(store.get(b"fourth-3"), Some(vec![3; 1024 * 1024]));
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn leftovers_are_removed_on_open() {
+        let dir = store_dir("leftovers");
+        let store = KvStore::open(&dir).unwrap();
+        store.put(b"key".to_vec(), b"value".to_vec()).unwrap();
+        drop(store);
+
+        let unlisted = table_path(&dir, 0xff);
+        Table::write(&unlisted, [(&b"key"[..], Some(&b"stale"[..]))].into_iter()).unwrap();
+        fs::write(dir.join("table-0000000000000100.tmp"), b"half a table").unwrap();
+        fs::write(dir.join("MANIFEST.tmp"), b"half a manifest").unwrap();
+
+        let store = KvStore::open(&dir).unwrap();
+        assert!(!unlisted.exists());
+        assert!(!dir.join("table-0000000000000100.tmp").exists());
+        assert!(!dir.join("MANIFEST.tmp").exists());
+        assert_eq!(store.get(b"key").as_deref(), Some(&b"value"[..]));
+        // Ids aren't reused, a new file never collides with a removed one.
+        assert!(store.shared.read().next_id > 0xff);
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn writes_are_refused_behind_a_stuck_flush() {
+        let dir = store_dir("backlog");
+        let store = KvStore::open(&dir).unwrap();
+        store.put(b"key".to_vec(), b"value".to_vec()).unwrap();
+
+        {
+            let mut state = store.shared.write();
+            state.frozen = Some((Arc::new(Memtable::new()), u64::MAX));
+            state.memtable_bytes = BACKLOG_BYTES;
+        }
+        assert!(store.put(b"key".to_vec(), b"other".to_vec()).is_err());
+        assert_eq!(store.get(b"key").as_deref(), Some(&b"value"[..]));
+
+        {
+            let mut state = store.shared.write();
+            state.frozen = None;
+        }
+        store.put(b"key".to_vec(), b"other".to_vec()).unwrap();
+        assert_eq!(store.get(b"key").as_deref(), Some(&b"other"[..]));
+
+        drop(store);
+        let _ = fs::remove_dir_all(&dir);
+    }
+}
@@ -0,0 +1,189 @@
+//! Sorted, immutable table files.
+//!
+//! Layout: the entries in key order, an offset per entry (u64), then the footer: entry
+//! count (u64), offset of the first entry offset (u64) and the magic. Entry: key length
+//! (u32), value length (u32, `TOMBSTONE` for a deleted key), key, value. Integers are
+//! little-endian.
+//!
+//! On Linux tables are mapped, so a lookup reads the pages it needs instead of the file.
+
+use std::{fs::File, io::{self, BufWriter, Write}, ops::Deref, path::Path};
+
+const MAGIC: u64 = u64::from_le_bytes(*b"NETTKVT1");
+const FOOTER_SIZE: usize = 24;
+const TOMBSTONE: u32 = u32::MAX;
+
+/// A key and its value, `None` when the key was deleted.
+pub type Entry<'a> = (&'a [u8], Option<&'a [u8]>);
+
+pub struct Table {
+    pub id: u64,
+    data: Data,
+    count: usize,
+    index_offset: usize,
+}
+
+impl Table {
+    /// Writes `entries`, which must be sorted by key, to `path` and syncs it.
+    pub fn write<'a>(path: &Path, entries: impl Iterator<Item = Entry<'a>>) -> io::Result<()> {
+        let tmp = path.with_extension("tmp");
+        let file = File::create(&tmp)?;
+        let mut writer = BufWriter::with_capacity(256 * 1024, file);
+        let mut offsets = Vec::new();
+        let mut offset = 0u64;
+
+        for (key, value) in entries {
+            offsets.push(offset);
+            let value_len = value.map_or(TOMBSTONE, |value| value.len() as u32);
+            writer.write_all(&(key.len() as u32).to_le_bytes())?;
+            writer.write_all(&value_len.to_le_bytes())?;
+            writer.write_all(key)?;
+            writer.write_all(value.unwrap_or_default())?;
+            offset += 8 + key.len() as u64 + value.map_or(0, |value| value.len() as u64);
+        }
+
+        for entry_offset in &offsets {
+            writer.write_all(&entry_offset.to_le_bytes())?;
+        }
+        writer.write_all(&(offsets.len() as u64).to_le_bytes())?;
+        writer.write_all(&offset.to_le_bytes())?;
+        writer.write_all(&MAGIC.to_le_bytes())?;
+
+        let file = writer.into_inner().map_err(|e| e.into_error())?;
+        file.sync_all()?;
+        std::fs::rename(&tmp, path)
+    }
+
+    pub fn open(id: u64, path: &Path) -> io::Result<Self> {
+        let data = Data::open(path)?;
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, format!("'{}' is not a table", path.display()));
+
+        let footer = data.len().checked_sub(FOOTER_SIZE).ok_or_else(invalid)?;
+        let count = read_u64(&data, footer).ok_or_else(invalid)? as usize;
+        let index_offset = read_u64(&data, footer + 8).ok_or_else(invalid)? as usize;
+        if read_u64(&data, footer + 16) != Some(MAGIC)
+            || count.checked_mul(8).and_then(|len| len.checked_add(index_offset)) != Some(footer)
+        {
+            return Err(invalid());
+        }
+
+        Ok(Self { id, data, count, index_offset })
+    }
+
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    /// `Some(None)` when the table records the key as deleted.
+    pub fn get(&self, key: &[u8]) -> Option<Option<&[u8]>> {
+        let (mut low, mut high) = (0, self.count);
+        while low < high {
+            let middle = (low + high) / 2;
+            let (entry_key, value) = self.entry(middle)?;
+            match entry_key.cmp(key) {
+                std::cmp::Ordering::Less => low = middle + 1,
+                std::cmp::Ordering::Greater => high = middle,
+                std::cmp::Ordering::Equal => return Some(value),
+            }
+        }
+        None
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = Entry<'_>> {
+        (0..self.count).map_while(|i| self.entry(i))
+    }
+
+    /// Entries from the first key that isn't less than `start`.
+    pub fn iter_from(&self, start: &[u8]) -> impl Iterator<Item = Entry<'_>> {
+        let (mut low, mut high) = (0, self.count);
+        while low < high {
+            let middle = (low + high) / 2;
+            match self.entry(middle) {
+                Some((key, _)) if key < start => low = middle + 1,
+                _ => high = middle,
+            }
+        }
+        (low..self.count).map_while(|i| self.entry(i))
+    }
+
+    fn entry(&self, i: usize) -> Option<Entry<'_>> {
+        let offset = read_u64(&self.data, self.index_offset + i * 8)? as usize;
+        let key_len = read_u32(&self.data, offset)? as usize;
+        let value_len = read_u32(&self.data, offset + 4)?;
+        let key = self.data.get(offset + 8..offset + 8 + key_len)?;
+
+        if value_len == TOMBSTONE {
+            return Some((key, None));
+        }
+        let value_start = offset + 8 + key_len;
+        let value = self.data.get(value_start..value_start + value_len as usize)?;
+        Some((key, Some(value)))
+    }
+}
+
+fn read_u64(data: &[u8], offset: usize) -> Option<u64> {
+    Some(u64::from_le_bytes(data.get(offset..offset + 8)?.try_into().ok()?))
+}
+
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    Some(u32::from_le_bytes(data.get(offset..offset + 4)?.try_into().ok()?))
+}
+
+/// Contents of a table file. A mapping stays valid after compaction deletes the file.
+enum Data {
+    #[cfg(target_os = "linux")]
+    Mapped { ptr: *const u8, len: usize },
+    #[allow(dead_code)]
+    Read(Vec<u8>),
+}
+
+// The mapping is read-only and owned by the table.
+unsafe impl Send for Data {}
+unsafe impl Sync for Data {}
+
+impl Data {
+    #[cfg(target_os = "linux")]
+    fn open(path: &Path) -> io::Result<Self> {
+        use std::os::fd::AsRawFd;
+
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Data::Read(Vec::new()));
+        }
+
+        let ptr = unsafe {
+            libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE, file.as_raw_fd(), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Data::Mapped { ptr: ptr as *const u8, len })
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    fn open(path: &Path) -> io::Result<Self> {
+        std::fs::read(path).map(Data::Read)
+    }
+}
+
+impl Deref for Data {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            #[cfg(target_os = "linux")]
+            Data::Mapped { ptr, len } => unsafe { std::slice::from_raw_parts(*ptr, *len) },
+            Data::Read(data) => data,
+        }
+    }
+}
+
+impl Drop for Data {
+    fn drop(&mut self) {
+        #[cfg(target_os = "linux")]
+        if let Data::Mapped { ptr, len } = self {
+            unsafe { libc::munmap(*ptr as *mut libc::c_void, *len) };
+        }
+    }
+}
@@ -0,0 +1,130 @@
+//! Write-ahead log: every committed group of writes is appended and synced before it is
+//! applied, so a restart replays what the memtable held.
+//!
+//! One record per commit, so a crash never leaves half of one: crc32 of the payload (u32),
+//! payload length (u32), payload. The payload is the commit's ops, each one as op (u8), key
+//! length (u32), key, value length (u32), value. Integers are little-endian. A record cut
+//! short by a crash ends the replay of its file.
+
+use std::{fs::{File, OpenOptions}, io::{self, Read, Write}, path::{Path, PathBuf}};
+use log::warn;
+
+const PUT: u8 = 1;
+const DELETE: u8 = 2;
+
+#[derive(Debug, Clone)]
+pub enum Op {
+    Put(Vec<u8>, Vec<u8>),
+    Delete(Vec<u8>),
+}
+
+impl Op {
+    pub fn key(&self) -> &[u8] {
+        match self {
+            Op::Put(key, _) | Op::Delete(key) => key,
+        }
+    }
+
+    pub fn value(&self) -> Option<&[u8]> {
+        match self {
+            Op::Put(_, value) => Some(value),
+            Op::Delete(_) => None,
+        }
+    }
+}
+
+pub struct Wal {
+    file: File,
+    buffer: Vec<u8>,
+}
+
+impl Wal {
+    pub fn create(dir: &Path, id: u64) -> io::Result<Self> {
+        let file = OpenOptions::new().create_new(true).append(true).open(path(dir, id))?;
+        Ok(Self { file, buffer: Vec::new() })
+    }
+
+    /// Appends a group of commits with one write and one sync.
+    pub fn append<'a>(&mut self, commits: impl Iterator<Item = &'a [Op]>) -> io::Result<()> {
+        self.buffer.clear();
+
+        for ops in commits {
+            let start = self.buffer.len();
+            self.buffer.extend_from_slice(&[0; 8]);
+            for op in ops {
+                let (code, value) = match op {
+                    Op::Put(_, value) => (PUT, value.as_slice()),
+                    Op::Delete(_) => (DELETE, &[][..]),
+                };
+                self.buffer.push(code);
+                self.buffer.extend_from_slice(&(op.key().len() as u32).to_le_bytes());
+                self.buffer.extend_from_slice(op.key());
+                self.buffer.extend_from_slice(&(value.len() as u32).to_le_bytes());
+                self.buffer.extend_from_slice(value);
+            }
+
+            let payload = &self.buffer[start + 8..];
+            let header = [crc32fast::hash(payload).to_le_bytes(), (payload.len() as u32).to_le_bytes()].concat();
+            self.buffer[start..start + 8].copy_from_slice(&header);
+        }
+
+        self.file.write_all(&self.buffer)?;
+        self.file.sync_data()
+    }
+}
+
+pub fn path(dir: &Path, id: u64) -> PathBuf {
+    dir.join(format!("wal-{:016x}.log", id))
+}
+
+/// Reads the ops of a log in order.
+pub fn replay(path: &Path) -> io::Result<Vec<Op>> {
+    let mut data = Vec::new();
+    File::open(path)?.read_to_end(&mut data)?;
+
+    let mut ops = Vec::new();
+    let mut pos = 0;
+    while pos < data.len() {
+        match decode(&data[pos..]) {
+            Some((commit, len)) => {
+                ops.extend(commit);
+                pos += len;
+            }
+            None => {
+                warn!("[KV Store] '{}' ends with {} bytes of an unfinished write, skipping them", path.display(), data.len() - pos);
+                break;
+            }
+        }
+    }
+
+    Ok(ops)
+}
+
+fn decode(data: &[u8]) -> Option<(Vec<Op>, usize)> {
+    let crc = u32::from_le_bytes(data.get(..4)?.try_into().ok()?);
+    let len = u32::from_le_bytes(data.get(4..8)?.try_into().ok()?) as usize;
+    let payload = data.get(8..8 + len)?;
+    if crc32fast::hash(payload) != crc {
+        return None;
+    }
+
+    let mut ops = Vec::new();
+    let mut pos = 0;
+    while pos < payload.len() {
+        let code = payload[pos];
+        let key_len = u32::from_le_bytes(payload.get(pos + 1..pos + 5)?.try_into().ok()?) as usize;
+        let key = payload.get(pos + 5..pos + 5 + key_len)?.to_vec();
+        pos += 5 + key_len;
+        let value_len = u32::from_le_bytes(payload.get(pos..pos + 4)?.try_into().ok()?) as usize;
+        let value = payload.get(pos + 4..pos + 4 + value_len)?;
+        pos += 4 + value_len;
+
+        ops.push(match code {
+            PUT => Op::Put(key, value.to_vec()),
+            DELETE => Op::Delete(key),
+            _ => return None,
+        });
+    }
+
+    Some((ops, 8 + len))
+}
@@ -1,11 +1,13 @@
 use std::fmt::{self, Pointer};
+use serde::{Deserialize, Serialize};
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Serialize, Deserialize)]
 pub enum AstNode {
     Program(Vec<Box<AstNode>>),
     Route {
         path: String,
         method: String,
+        options: Vec<RouteOption>,
         body: Box<AstNode>,
         on_error: Option<Box<AstNode>>,
     },
@@ -67,6 +69,7 @@ pub enum AstNode {
         config_type: String,
         host: String,
         port: String,
+        settings: Vec<ConfigSetting>,
     },
     Import {
         path: String,
@@ -80,7 +83,45 @@ pub enum AstNode {
     WhileLoop {
         condition: Box<AstNode>,
         body: Box<AstNode>,
-    }
+    },
+    /// `job "name" { ... };`, run in the background by `Jobs.enqueue("name", args)`.
+    Job {
+        name: String,
+        body: Box<AstNode>,
+    },
+    /// `schedule "*/5 * * * *" { ... };`, run in the background on a cron schedule.
+    Schedule {
+        cron: String,
+        body: Box<AstNode>,
+    },
+}
+
+/// Option written between the HTTP method and the body of a route:
+/// `route "/items" GET coalesce(params = ["page"]) { ... };`
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct RouteOption {
+    pub name: String,
+    pub args: Vec<(String, OptionValue)>,
+    pub line: usize,
+    pub column: usize,
+}
+
+/// `key = value;` in the `config` block, other than `type`, `host` and `port`.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ConfigSetting {
+    pub name: String,
+    pub value: OptionValue,
+    pub line: usize,
+    pub column: usize,
+}
+
+/// Value of a route option parameter or of a config setting.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum OptionValue {
+    String(String),
+    Number(i64),
+    Boolean(bool),
+    List(Vec<String>),
 }
 
 pub trait AstVisitor<T> {
@@ -108,13 +149,15 @@ pub trait AstVisitor<T> {
     fn visit_for_loop(&mut self, var_name: &str, iterable: &AstNode, body: &AstNode) -> Result<T, Self::Error>;
     fn visit_array_literal(&mut self, values: &[Box<AstNode>]) -> Result<T, Self::Error>;
     fn visit_array_access(&mut self, array: &AstNode, index: &AstNode) -> Result<T, Self::Error>;
+    fn visit_job(&mut self, name: &str, body: &AstNode) -> Result<T, Self::Error>;
+    fn visit_schedule(&mut self, cron: &str, body: &AstNode) -> Result<T, Self::Error>;
 }
 
 impl AstNode {
     pub fn accept<T, V: AstVisitor<T>>(&self, visitor: &mut V) -> Result<T, V::Error> {
         match self {
             AstNode::Program(statements) => visitor.visit_program(statements),
-            AstNode::Route { path, method, body, on_error } =>
+            AstNode::Route { path, method, body, on_error, .. } =>
                 visitor.visit_route(path, method, body, on_error.as_ref().map(|b| b.as_ref())),
             AstNode::Block(statements) => visitor.visit_block(statements),
             AstNode::FormattedString(statements) => visitor.visit_formatted_string(statements),
@@ -139,12 +182,50 @@ impl AstNode {
                 ),
             AstNode::GlobalErrorHandler { error_var, body } => visitor.visit_global_error_handler(error_var, body),
             AstNode::ErrorHandlerBlock { error_var, body } => visitor.visit_error_handler_block(error_var, body),
-            AstNode::ConfigBlock { config_type, host, port } => visitor.visit_config_block(config_type, host, port),
+            AstNode::ConfigBlock { config_type, host, port, .. } => visitor.visit_config_block(config_type, host, port),
             AstNode::Import { path, alias } => visitor.visit_import(path, alias),
             AstNode::WhileLoop { condition, body } => visitor.visit_while_loop(condition, body),
             AstNode::ForLoop { var_name, iterable, body } => visitor.visit_for_loop(var_name, iterable, body),
             AstNode::ArrayLiteral(elements) => visitor.visit_array_literal(elements),
             AstNode::ArrayAccess { array, index } => visitor.visit_array_access(array, index),
+            AstNode::Job { name, body } => visitor.visit_job(name, body),
+            AstNode::Schedule { cron, body } => visitor.visit_schedule(cron, body),
+        }
+    }
+
+    /// Whether `predicate` holds for this node or any node inside it.
+    pub fn any_node(&self, predicate: &impl Fn(&AstNode) -> bool) -> bool {
+        if predicate(self) {
+            return true;
+        }
+
+        let any = |nodes: &[Box<AstNode>]| nodes.iter().any(|node| node.any_node(predicate));
+        let any_opt = |node: &Option<Box<AstNode>>| node.as_ref().is_some_and(|node| node.any_node(predicate));
+
+        match self {
+            AstNode::Program(nodes) | AstNode::Block(nodes) | AstNode::FormattedString(nodes) | AstNode::ArrayLiteral(nodes) => any(nodes),
+            AstNode::Route { body, on_error, .. } => body.any_node(predicate) || any_opt(on_error),
+            AstNode::VarDeclaration { value, .. } => value.any_node(predicate),
+            AstNode::FunctionCall { object, args, .. } => any_opt(object) || any(args),
+            AstNode::PropertyAccess { object, .. } => object.any_node(predicate),
+            AstNode::IfStatement { condition, then_branch, else_branch } =>
+                condition.any_node(predicate) || then_branch.any_node(predicate) || any_opt(else_branch),
+            AstNode::ArrayAccess { array, index } => array.any_node(predicate) || index.any_node(predicate),
+            AstNode::BinaryOp { left, right, .. } => left.any_node(predicate) || right.any_node(predicate),
+            AstNode::ServerConfig { routes, tls_config, global_error_handler, config_block } =>
+                any(routes) || any_opt(tls_config) || any_opt(global_error_handler) || any_opt(config_block),
+            AstNode::GlobalErrorHandler { body, .. }
+            | AstNode::ErrorHandlerBlock { body, .. }
+            | AstNode::Job { body, .. }
+            | AstNode::Schedule { body, .. } => body.any_node(predicate),
+            AstNode::ForLoop { iterable, body, .. } => iterable.any_node(predicate) || body.any_node(predicate),
+            AstNode::WhileLoop { condition, body } => condition.any_node(predicate) || body.any_node(predicate),
+            AstNode::StringLiteral(_)
+            | AstNode::NumberLiteral(_)
+            | AstNode::Identifier(_)
+            | AstNode::TlsConfig { .. }
+            | AstNode::ConfigBlock { .. }
+            | AstNode::Import { .. } => false,
         }
     }
 }
@@ -159,7 +240,7 @@ impl fmt::Display for AstNode {
                 }
                 Ok(())
             },
-            AstNode::Route { path, method, body, on_error } => {
+            AstNode::Route { path, method, body, on_error, .. } => {
                 match on_error {
                     Some(e) => {
                         writeln!(f, "Route: {} {} {} {}", method, path, body, e)
@@ -255,11 +336,14 @@ impl fmt::Display for AstNode {
                 writeln!(f, "   {}", body)?;
                 writeln!(f, "}}")
             },
-            AstNode::ConfigBlock { config_type, host, port } => {
+            AstNode::ConfigBlock { config_type, host, port, settings } => {
                 writeln!(f, "Config: {{")?;
                 writeln!(f, "   type: \"{}\"", config_type)?;
                 writeln!(f, "   host: \"{}\"", host)?;
                 writeln!(f, "   port: {}", port)?;
+                for setting in settings {
+                    writeln!(f, "   {}: {:?}", setting.name, setting.value)?;
+                }
                 writeln!(f, "}}")
             },
             AstNode::Import { path, alias } => {
@@ -271,6 +355,12 @@ impl fmt::Display for AstNode {
             AstNode::ForLoop {var_name, iterable, body} => {
                 writeln!(f, "for {} in {}", var_name, iterable)
             },
+            AstNode::Job { name, body } => {
+                writeln!(f, "Job: \"{}\" {}", name, body)
+            },
+            AstNode::Schedule { cron, body } => {
+                writeln!(f, "Schedule: \"{}\" {}", cron, body)
+            },
         }
     }
 }
\ No newline at end of file
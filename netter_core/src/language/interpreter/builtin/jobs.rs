@@ -0,0 +1,53 @@
+use netter_sdk::{RDLTypes, Object};
+use crate::jobs;
+use super::store::encode_value;
+
+/// Queues runs of the `job` blocks of the config on the background threads.
+///
+/// A queued job is on disk, it runs even if the daemon restarts before it's done. A failed
+/// job is retried a few times with growing delays.
+pub struct Jobs {}
+
+impl Object for Jobs {
+    fn name(&self) -> &'static str {
+        "Jobs"
+    }
+
+    fn methods(&self) -> Vec<&str> {
+        vec!["enqueue"]
+    }
+
+    fn call_method(&mut self, name: &str, args: Vec<RDLTypes>) -> Result<RDLTypes, String> {
+        match name {
+            "enqueue" => {
+                if args.len() < 1 {
+                    return Err("Method Jobs.enqueue required 1 argument".to_string());
+                }
+
+                let encoded = match args.get(1) {
+                    Some(value) => encode_value(value)?,
+                    None => Vec::new(),
+                };
+                let id = jobs::global()?.enqueue(&args[0].to_string(), encoded)?;
+                Ok(RDLTypes::Number(id as i64))
+            }
+            _ => Err(format!("Function with name '{}' not found in Jobs object", name))
+        }
+    }
+
+    fn get_property(&self, _name: &str) -> RDLTypes {
+        RDLTypes::Boolean(false)
+    }
+
+    fn method_exist(&self, name: &str) -> bool {
+        self.methods().contains(&name)
+    }
+
+    fn properties(&self) -> Vec<&str> {
+        vec![]
+    }
+
+    fn property_exist(&self, _name: &str) -> bool {
+        false
+    }
+}
@@ -0,0 +1,104 @@
+use netter_sdk::{RDLTypes, Object};
+use crate::kv;
+use super::store::{decode_value, encode_value};
+
+/// Durable key-value entries, kept by the service next to its state.
+///
+/// Unlike `Store`, nothing is evicted and entries survive restarts. Every write is on disk
+/// when the method returns.
+pub struct Kv {}
+
+impl Object for Kv {
+    fn name(&self) -> &'static str {
+        "Kv"
+    }
+
+    fn methods(&self) -> Vec<&str> {
+        vec!["get", "set", "delete", "incr"]
+    }
+
+    fn call_method(&mut self, name: &str, args: Vec<RDLTypes>) -> Result<RDLTypes, String> {
+        match name {
+            "get" => {
+                if args.len() < 1 {
+                    return Err("Method Kv.get required 1 argument".to_string());
+                }
+
+                Kv::get(&args[0])
+            }
+            "set" => {
+                if args.len() < 2 {
+                    return Err("Method Kv.set required 2 argument".to_string());
+                }
+
+                kv::global()?.put(kv_key(&args[0]), encode_value(&args[1])?)?;
+                Ok(RDLTypes::Boolean(true))
+            }
+            "delete" => {
+                if args.len() < 1 {
+                    return Err("Method Kv.delete required 1 argument".to_string());
+                }
+
+                kv::global()?.delete(kv_key(&args[0]))?;
+                Ok(RDLTypes::Boolean(true))
+            }
+            "incr" => {
+                if args.len() < 1 {
+                    return Err("Method Kv.incr required 1 argument".to_string());
+                }
+
+                let by = match args.get(1) {
+                    Some(by) => by.as_i64()?,
+                    None => 1,
+                };
+                Kv::incr(&args[0], by)
+            }
+            _ => Err(format!("Function with name '{}' not found in Kv object", name))
+        }
+    }
+
+    fn get_property(&self, _name: &str) -> RDLTypes {
+        RDLTypes::Boolean(false)
+    }
+
+    fn method_exist(&self, name: &str) -> bool {
+        self.methods().contains(&name)
+    }
+
+    fn properties(&self) -> Vec<&str> {
+        vec![]
+    }
+
+    fn property_exist(&self, _name: &str) -> bool {
+        false
+    }
+}
+
+impl Kv {
+    pub fn get(key: &RDLTypes) -> Result<RDLTypes, String> {
+        kv::global()?
+            .get(&kv_key(key))
+            .and_then(decode_value)
+            .ok_or_else(|| format!("Key '{}' not found in Kv", key))
+    }
+
+    /// Adds `by` to the number under `key`, a missing key counts as 0. Concurrent
+    /// increments don't lose each other's updates.
+    pub fn incr(key: &RDLTypes, by: i64) -> Result<RDLTypes, String> {
+        let name = key.to_string();
+        let value = kv::global()?.update(kv_key(key), Box::new(move |current| {
+            let current = match current.map(|value| decode_value(value.to_vec())) {
+                None => 0,
+                Some(Some(RDLTypes::Number(n))) => n,
+                Some(_) => return Err(format!("Value of '{}' in Kv is not a number", name)),
+            };
+            encode_value(&RDLTypes::Number(current.wrapping_add(by)))
+        }))?;
+
+        decode_value(value).ok_or_else(|| "Kv returned a broken value".to_string())
+    }
+}
+
+fn kv_key(key: &RDLTypes) -> Vec<u8> {
+    key.to_string().into_bytes()
+}
@@ -1,6 +1,13 @@
 pub mod database;
 pub mod request;
 pub mod response;
+pub mod response_stream;
 pub mod plugin;
+pub mod plugin_batch;
+#[cfg(feature = "wasm-plugins")]
+pub mod plugin_wasm;
 pub mod filesystem;
+pub mod jobs;
+pub mod kv;
+pub mod store;
 pub mod localization;
\ No newline at end of file
@@ -1,104 +1,453 @@
 use std::collections::HashMap;
-use std::ffi::CString;
+use std::ffi::{c_void, CString};
+use std::fs;
 use std::os::raw::c_char;
-use libloading::{Library, Symbol};
-use log::{debug, error, trace};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, RwLock, RwLockReadGuard};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::SystemTime;
+use libloading::Library;
+use log::{debug, error, info, trace};
 use crate::language::error::{Result, Error, ErrorKind};
 use crate::runtime_error;
-use netter_sdk::{RDLTypes, FFIResult, FFIValue, FFIStatus};
+use crate::servers::slow_log;
+use crate::servers::timing::{self, Phase};
+use crate::servers::trace::{self, SpanKind};
+use netter_sdk::{RDLTypes, FFIArgs, FFIBatchResult, FFIFunctionInfo, FFIInitResult, FFIResult, FFIValue, FFIStatus};
+use super::plugin_batch::BatchQueue;
+#[cfg(feature = "wasm-plugins")]
+use super::plugin_wasm::WasmPlugin;
 
-#[derive(Debug)]
-pub struct PluginManager {
-    loaded_plugins: HashMap<String, Library>,
+type DispatchFuncSig = unsafe extern "C" fn(
+    plugin_state: *const c_void,
+    func_name_ptr: *const c_char,
+    args_ptr: *const FFIValue,
+    args_len: usize,
+) -> FFIResult;
+
+type DispatchBatchFuncSig = unsafe extern "C" fn(
+    plugin_state: *const c_void,
+    func_name_ptr: *const c_char,
+    calls_ptr: *const FFIValue,
+    calls_len: usize,
+) -> FFIBatchResult;
+
+type AbiVersionFuncSig = unsafe extern "C" fn() -> u32;
+
+type FunctionCountFuncSig = unsafe extern "C" fn() -> usize;
+
+type FunctionInfoFuncSig = unsafe extern "C" fn(index: usize) -> FFIFunctionInfo;
+
+type InitFuncSig = unsafe extern "C" fn() -> FFIInitResult;
+
+type ShutdownFuncSig = unsafe extern "C" fn(state: *mut c_void);
+
+/// One loaded version of a plugin library together with the state returned by its `__netter_init`.
+///
+/// The state is created once per loaded version and handed back to
+/// `__netter_shutdown` when the version is dropped, before the library is unloaded.
+pub struct LoadedPlugin {
+    dispatch: DispatchFuncSig,
+    dispatch_batch: Option<DispatchBatchFuncSig>,
+    batchers: HashMap<String, BatchQueue>,
+    shutdown: Option<ShutdownFuncSig>,
+    state: *mut c_void,
+    library: Library,
+    shadow: Option<ShadowFile>,
 }
 
-impl PluginManager {
-    pub fn new() -> Self {
-        PluginManager {
-            loaded_plugins: HashMap::new(),
-        }
+// SAFETY: `#[netter_plugin_init]` only accepts `Send + Sync` state types, and the
+// function pointers stay valid for as long as `library` is loaded.
+unsafe impl Send for LoadedPlugin {}
+unsafe impl Sync for LoadedPlugin {}
+
+impl std::fmt::Debug for LoadedPlugin {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("LoadedPlugin")
+            .field("library", &self.library)
+            .field("has_state", &!self.state.is_null())
+            .field("batchers", &self.batchers)
+            .finish()
     }
+}
 
-    pub fn load_plugin(&mut self, path: &str, alias: &str) -> Result<()> {
-        debug!("Plugin loading: '{}' from '{}'", alias, path);
+impl LoadedPlugin {
+    unsafe fn load(path: &str, alias: &str) -> Result<Self> {
+        let library = match unsafe { Library::new(path) } {
+            Ok(lib) => lib,
+            Err(e) => {
+                let err_msg = format!(
+                    "Critical error: Failed while loading plugin '{}' from {}: {}",
+                    alias, path, e
+                );
+                error!("{}", err_msg);
+                return runtime_error!(err_msg);
+            }
+        };
 
-        unsafe {
-            match Library::new(path) {
-                Ok(lib) => {
-                    if self.loaded_plugins.contains_key(alias) {
-                        debug!("Plugin redefinition with alias: {}", alias);
+        let abi_version = unsafe { library.get::<AbiVersionFuncSig>(b"__netter_abi_version\0") }.ok().map(|func| unsafe { func() });
+        if abi_version != Some(netter_sdk::ABI_VERSION) {
+            let built_for = abi_version.map_or("an older netter_sdk".to_string(), |version| format!("ABI version {}", version));
+            let err_msg = format!(
+                "Plugin '{}' was built for {}, this host needs ABI version {}. Rebuild it with the current netter_sdk",
+                alias, built_for, netter_sdk::ABI_VERSION
+            );
+            error!("{}", err_msg);
+            return runtime_error!(err_msg);
+        }
+
+        let dispatch = match unsafe { library.get::<DispatchFuncSig>(b"__netter_dispatch\0") } {
+            Ok(func) => *func,
+            Err(e) => return runtime_error!(format!("__netter_dispatch not found in plugin '{}': {e}", alias)),
+        };
+        let init = unsafe { library.get::<InitFuncSig>(b"__netter_init\0") }.ok().map(|func| *func);
+        let shutdown = unsafe { library.get::<ShutdownFuncSig>(b"__netter_shutdown\0") }.ok().map(|func| *func);
+        let dispatch_batch = unsafe { library.get::<DispatchBatchFuncSig>(b"__netter_dispatch_batch\0") }.ok().map(|func| *func);
+
+        let mut batchers = HashMap::new();
+        if dispatch_batch.is_some() {
+            let count = unsafe { library.get::<FunctionCountFuncSig>(b"__netter_function_count\0") }.ok().map(|func| *func);
+            let info = unsafe { library.get::<FunctionInfoFuncSig>(b"__netter_function_info\0") }.ok().map(|func| *func);
+
+            if let (Some(count), Some(info)) = (count, info) {
+                for index in 0..unsafe { count() } {
+                    let function = unsafe { info(index) };
+                    if !function.batched || function.name.ptr.is_null() {
+                        continue;
                     }
-                    self.loaded_plugins.insert(alias.to_string(), lib);
-                    debug!("Plugin '{}' loaded successfully.", alias);
-                    Ok(())
-                }
-                Err(e) => {
-                    let err_msg = format!(
-                        "Critical error: Failed while loading plugin '{}' from {}: {}",
-                        alias, path, e
+
+                    let name_bytes = unsafe { std::slice::from_raw_parts(function.name.ptr as *const u8, function.name.len) };
+                    let name = String::from_utf8_lossy(name_bytes).into_owned();
+                    debug!(
+                        "Plugin '{}': function '{}' is batched (max {} calls, {}us window)",
+                        alias, name, function.max_batch_items, function.batch_window_us
                     );
+                    batchers.insert(name, BatchQueue::new(function.max_batch_items, function.batch_window_us));
+                }
+            }
+        }
+
+        let mut state = std::ptr::null_mut();
+        if let Some(init) = init {
+            debug!("Initializing plugin '{}'", alias);
+            let result = unsafe { init() };
+
+            match result.status {
+                FFIStatus::Ok => state = result.state,
+                FFIStatus::Err => {
+                    let message = unsafe { take_plugin_string(result.error_ptr) };
+                    let err_msg = format!("Plugin '{}' failed to initialize: {}", alias, message);
                     error!("{}", err_msg);
-                    runtime_error!(err_msg)
+                    return runtime_error!(err_msg);
                 }
             }
         }
-    }
 
-    pub fn has_plugin(&self, name: &str) -> bool {
-        self.loaded_plugins.contains_key(name)
+        Ok(Self {
+            dispatch,
+            dispatch_batch,
+            batchers,
+            shutdown,
+            state,
+            library,
+            shadow: None,
+        })
     }
 
-    pub fn call_plugin_function(&self, plugin_name: &str, function_name: &str, args: &[RDLTypes]) -> Result<RDLTypes> {
-        if let Some(library) = self.loaded_plugins.get(plugin_name) {
-            trace!("Dispatching plugin call: {}::{}", plugin_name, function_name);
+    fn call(&self, function_name: &str, args: &[RDLTypes]) -> Result<RDLTypes> {
+        let c_name = CString::new(function_name.as_bytes()).map_err(|e| {
+            Error {
+                kind: ErrorKind::Runtime,
+                message: format!("Error creating CString for function name: {e}"),
+                line: None, column: None,
+            }
+        })?;
+
+        if let Some(batcher) = self.batchers.get(function_name) {
+            return batcher.call(args.to_vec(), |calls| self.run_batch(&c_name, calls))
+                .or_else(|e| runtime_error!(format!("Plugin Error: {e}")));
+        }
+
+        let ffi_args = FFIArgs::new(args);
 
-            let ffi_args: Vec<FFIValue> = args.iter().map(|arg| arg.to_ffi()).collect();
+        unsafe {
+            let result = (self.dispatch)(self.state, c_name.as_ptr(), ffi_args.as_ptr(), ffi_args.len());
 
-            let c_name = CString::new(function_name.as_bytes()).map_err(|e| {
+            if result.data_ptr.is_null() {
+                return runtime_error!("Plugin returned null data pointer!".to_string());
+            }
+
+            let raw_string = CString::from_raw(result.data_ptr).into_string().map_err(|e| {
                 Error {
                     kind: ErrorKind::Runtime,
-                    message: format!("Error creating CString for function name: {e}"),
+                    message: format!("Conversion error: {e}"),
                     line: None, column: None,
                 }
             })?;
 
-            type DispatchFuncSig = unsafe extern "C" fn(
-                func_name_ptr: *const c_char,
-                args_ptr: *const FFIValue,
-                args_len: usize,
-            ) -> FFIResult;
+            match result.status {
+                FFIStatus::Ok => {
+                    Ok(RDLTypes::String(raw_string))
+                },
+                FFIStatus::Err => {
+                    runtime_error!(format!("Plugin Error: {raw_string}"))
+                }
+            }
+        }
+    }
 
-            unsafe {
-                let dispatch_func: Symbol<DispatchFuncSig> = match library.get(b"__netter_dispatch\0") {
-                    Ok(func) => func,
-                    Err(e) => return runtime_error!(format!("__netter_dispatch not found: {e}")),
-                };
+    /// Runs every call of `calls` with a single `__netter_dispatch_batch` call.
+    fn run_batch(&self, function_name: &CString, calls: Vec<Vec<RDLTypes>>) -> Vec<std::result::Result<RDLTypes, String>> {
+        let call_count = calls.len();
+        let Some(dispatch_batch) = self.dispatch_batch else {
+            return vec![Err("Plugin doesn't export __netter_dispatch_batch".to_string()); call_count];
+        };
 
-                let result = dispatch_func(c_name.as_ptr(), ffi_args.as_ptr(), ffi_args.len());
+        let calls: Vec<RDLTypes> = calls.into_iter().map(RDLTypes::Vector).collect();
+        let ffi_calls = FFIArgs::new(&calls);
 
-                if result.data_ptr.is_null() {
-                    return runtime_error!("Plugin returned null data pointer!".to_string());
-                }
+        let batch = unsafe { dispatch_batch(self.state, function_name.as_ptr(), ffi_calls.as_ptr(), ffi_calls.len()) };
 
-                let raw_string = CString::from_raw(result.data_ptr).into_string().map_err(|e| {
-                    Error {
-                        kind: ErrorKind::Runtime,
-                        message: format!("Conversion error: {e}"),
-                        line: None, column: None,
-                    }
-                })?;
-
-                match result.status {
-                    FFIStatus::Ok => {
-                        Ok(RDLTypes::String(raw_string))
-                    },
-                    FFIStatus::Err => {
-                        runtime_error!(format!("Plugin Error: {raw_string}"))
-                    }
+        match batch.status {
+            FFIStatus::Ok if !batch.results.is_null() => {
+                let results = unsafe { Box::from_raw(std::ptr::slice_from_raw_parts_mut(batch.results, batch.len)) };
+                let mut results: Vec<_> = results.into_vec().into_iter()
+                    .map(|result| {
+                        let message = unsafe { take_plugin_string(result.data_ptr) };
+                        match result.status {
+                            FFIStatus::Ok => Ok(RDLTypes::String(message)),
+                            FFIStatus::Err => Err(message),
+                        }
+                    })
+                    .collect();
+                results.resize(call_count, Err("Plugin returned fewer results than calls in the batch".to_string()));
+                results
+            }
+            _ => {
+                let message = unsafe { take_plugin_string(batch.error_ptr) };
+                vec![Err(message); call_count]
+            }
+        }
+    }
+}
+
+impl Drop for LoadedPlugin {
+    fn drop(&mut self) {
+        if let Some(shutdown) = self.shutdown {
+            unsafe { shutdown(self.state) };
+        }
+    }
+}
+
+unsafe fn take_plugin_string(ptr: *mut c_char) -> String {
+    if ptr.is_null() {
+        return String::new();
+    }
+
+    unsafe { CString::from_raw(ptr) }.into_string().unwrap_or_else(|e| e.into_cstring().to_string_lossy().into_owned())
+}
+
+/// Removes a shadow copy of a plugin library once the library itself is unloaded.
+///
+/// Declared after `library` in `LoadedPlugin`, so it is dropped after `dlclose`.
+#[derive(Debug)]
+struct ShadowFile(PathBuf);
+
+impl Drop for ShadowFile {
+    fn drop(&mut self) {
+        if let Err(e) = fs::remove_file(&self.0) {
+            debug!("Failed to remove plugin shadow copy {}: {}", self.0.display(), e);
+        }
+    }
+}
+
+static NEXT_SHADOW_ID: AtomicU64 = AtomicU64::new(1);
+
+/// Copies `source` to a unique file in the temp directory.
+///
+/// The dynamic loader returns the already loaded handle when the same path is opened
+/// twice, so every version of a plugin is loaded from its own copy. It also lets the
+/// original file be replaced while the old version still serves calls.
+fn make_shadow_copy(source: &Path, alias: &str) -> Result<ShadowFile> {
+    let dir = std::env::temp_dir().join("netter_plugins");
+    let file_name = source.file_name().map(|n| n.to_string_lossy().into_owned()).unwrap_or_else(|| "plugin".to_string());
+    let target = dir.join(format!(
+        "{}-{}-{}-{}",
+        std::process::id(), NEXT_SHADOW_ID.fetch_add(1, Ordering::Relaxed), alias, file_name
+    ));
+
+    fs::create_dir_all(&dir)
+        .and_then(|_| fs::copy(source, &target))
+        .map(|_| ShadowFile(target))
+        .or_else(|e| runtime_error!(format!("Failed to copy plugin '{}' from {}: {}", alias, source.display(), e)))
+}
+
+fn modified_time(path: &Path) -> Option<SystemTime> {
+    fs::metadata(path).and_then(|m| m.modified()).ok()
+}
+
+/// One loaded version of a plugin: a native library or a sandboxed wasm module.
+#[derive(Debug)]
+enum PluginBackend {
+    Native(LoadedPlugin),
+    #[cfg(feature = "wasm-plugins")]
+    Wasm(WasmPlugin),
+}
+
+#[derive(Debug)]
+struct PluginSlot {
+    plugin: Arc<PluginBackend>,
+    source: PathBuf,
+    modified: Option<SystemTime>,
+    version: u64,
+}
+
+/// Plugins imported by an interpreter, shared between all of its clones.
+///
+/// Every call holds an `Arc` of the plugin version it started on. Reloading swaps in
+/// a new version for the calls that follow, and the old library is shut down and
+/// unloaded when its last in-flight call returns.
+#[derive(Debug, Clone, Default)]
+pub struct PluginManager {
+    loaded_plugins: Arc<RwLock<HashMap<String, PluginSlot>>>,
+}
+
+impl PluginManager {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn load_version(source: &Path, alias: &str) -> Result<PluginBackend> {
+        if source.extension().is_some_and(|ext| ext.eq_ignore_ascii_case("wasm")) {
+            #[cfg(feature = "wasm-plugins")]
+            return WasmPlugin::load(source, alias).map(PluginBackend::Wasm);
+
+            #[cfg(not(feature = "wasm-plugins"))]
+            return runtime_error!(format!(
+                "Plugin '{}' is a wasm module, but Netter was built without the 'wasm-plugins' feature", alias
+            ));
+        }
+
+        let shadow = make_shadow_copy(source, alias)?;
+        let path = shadow.0.to_string_lossy().into_owned();
+        let mut plugin = unsafe { LoadedPlugin::load(&path, alias)? };
+        plugin.shadow = Some(shadow);
+        Ok(PluginBackend::Native(plugin))
+    }
+
+    pub fn load_plugin(&self, path: &str, alias: &str) -> Result<()> {
+        debug!("Plugin loading: '{}' from '{}'", alias, path);
+
+        let source = fs::canonicalize(path).unwrap_or_else(|_| PathBuf::from(path));
+        let modified = modified_time(&source);
+        let plugin = Self::load_version(&source, alias)?;
+
+        let mut plugins = self.loaded_plugins.write().unwrap_or_else(|e| e.into_inner());
+        if plugins.contains_key(alias) {
+            debug!("Plugin redefinition with alias: {}", alias);
+        }
+        plugins.insert(alias.to_string(), PluginSlot {
+            plugin: Arc::new(plugin),
+            source,
+            modified,
+            version: 1,
+        });
+        debug!("Plugin '{}' loaded successfully.", alias);
+        Ok(())
+    }
+
+    /// Loads the current file of the plugin `alias` next to the running version and
+    /// switches new calls to it. Returns the new version number.
+    ///
+    /// If the new library fails to load or initialize, the old version keeps serving.
+    pub fn reload_plugin(&self, alias: &str) -> Result<u64> {
+        let source = match self.read_plugins().get(alias) {
+            Some(slot) => slot.source.clone(),
+            None => return runtime_error!(format!("Plugin '{}' not found", alias)),
+        };
+
+        let modified = modified_time(&source);
+        let plugin = Arc::new(Self::load_version(&source, alias)?);
+
+        let mut plugins = self.loaded_plugins.write().unwrap_or_else(|e| e.into_inner());
+        let Some(slot) = plugins.get_mut(alias) else {
+            return runtime_error!(format!("Plugin '{}' was removed during reload", alias));
+        };
+
+        let previous = std::mem::replace(&mut slot.plugin, plugin);
+        slot.modified = modified;
+        slot.version += 1;
+        let version = slot.version;
+        drop(plugins);
+
+        info!(
+            "Plugin '{}' reloaded as version {} ({} in-flight calls on the previous version)",
+            alias, version, Arc::strong_count(&previous) - 1
+        );
+        Ok(version)
+    }
+
+    /// Reloads every plugin whose library file changed since it was loaded
+    /// (or every plugin when `force` is set). Returns the aliases and their new versions.
+    ///
+    /// A plugin that fails to reload doesn't stop the others: every plugin is tried, and the
+    /// error names each one that failed along with those that were reloaded.
+    pub fn reload_changed(&self, force: bool) -> Result<Vec<(String, u64)>> {
+        let changed: Vec<String> = self.read_plugins().iter()
+            .filter(|(_, slot)| force || modified_time(&slot.source) != slot.modified)
+            .map(|(alias, _)| alias.clone())
+            .collect();
+
+        let mut reloaded = Vec::with_capacity(changed.len());
+        let mut failed = Vec::new();
+        for alias in changed {
+            match self.reload_plugin(&alias) {
+                Ok(version) => reloaded.push((alias, version)),
+                Err(e) => {
+                    error!("Plugin '{}' failed to reload, the previous version keeps serving: {}", alias, e.message);
+                    failed.push(format!("'{}': {}", alias, e.message));
                 }
             }
-        } else {
-            runtime_error!(format!("Plugin '{}' not found", plugin_name))
         }
+
+        if failed.is_empty() {
+            return Ok(reloaded);
+        }
+        let mut message = format!("{} plugin(s) failed to reload: {}", failed.len(), failed.join("; "));
+        if !reloaded.is_empty() {
+            let names: Vec<String> = reloaded.iter()
+                .map(|(alias, version)| format!("'{}' (v{})", alias, version))
+                .collect();
+            message.push_str(&format!(". Reloaded: {}", names.join(", ")));
+        }
+        runtime_error!(message)
+    }
+
+    pub fn has_plugin(&self, name: &str) -> bool {
+        self.read_plugins().contains_key(name)
     }
-}
\ No newline at end of file
+
+    fn read_plugins(&self) -> RwLockReadGuard<'_, HashMap<String, PluginSlot>> {
+        self.loaded_plugins.read().unwrap_or_else(|e| e.into_inner())
+    }
+
+    pub fn call_plugin_function(&self, plugin_name: &str, function_name: &str, args: &[RDLTypes]) -> Result<RDLTypes> {
+        let (plugin, version) = match self.read_plugins().get(plugin_name) {
+            Some(slot) => (slot.plugin.clone(), slot.version),
+            None => return runtime_error!(format!("Plugin '{}' not found", plugin_name)),
+        };
+        trace!("Dispatching plugin call: {}::{} (v{})", plugin_name, function_name, version);
+
+        let describe = || (
+            format!("{}.{}", plugin_name, function_name),
+            vec![("netter.plugin", plugin_name.into()), ("netter.plugin.function", function_name.into())],
+        );
+        slow_log::plugin_call(plugin_name, function_name, || {
+            trace::span(SpanKind::Client, describe, || timing::measure(Phase::Plugins, || match plugin.as_ref() {
+                PluginBackend::Native(plugin) => plugin.call(function_name, args),
+                #[cfg(feature = "wasm-plugins")]
+                PluginBackend::Wasm(plugin) => plugin.call(function_name, args),
+            }), Result::is_err)
+        })
+    }
+}
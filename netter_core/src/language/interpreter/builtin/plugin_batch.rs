@@ -0,0 +1,111 @@
+use std::sync::{Condvar, Mutex, mpsc};
+use std::time::{Duration, Instant};
+use log::trace;
+use netter_sdk::RDLTypes;
+
+type CallResult = std::result::Result<RDLTypes, String>;
+
+struct PendingCall {
+    args: Vec<RDLTypes>,
+    reply: mpsc::SyncSender<CallResult>,
+}
+
+#[derive(Default)]
+struct BatchState {
+    pending: Vec<PendingCall>,
+    leader_active: bool,
+}
+
+/// Collects calls of one batched plugin function coming from concurrent requests.
+///
+/// The first caller of a batch becomes its leader: it waits until `max_items` calls are
+/// queued or `window` has passed, takes everything queued and runs it in chunks of at
+/// most `max_items`. Other callers only block until the leader sends their result.
+/// Calls arriving while the leader executes start the next batch.
+pub struct BatchQueue {
+    state: Mutex<BatchState>,
+    filled: Condvar,
+    max_items: usize,
+    window: Duration,
+}
+
+impl std::fmt::Debug for BatchQueue {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("BatchQueue")
+            .field("max_items", &self.max_items)
+            .field("window", &self.window)
+            .finish()
+    }
+}
+
+impl BatchQueue {
+    pub fn new(max_items: u32, window_us: u32) -> Self {
+        Self {
+            state: Mutex::new(BatchState::default()),
+            filled: Condvar::new(),
+            max_items: max_items.max(1) as usize,
+            window: Duration::from_micros(window_us as u64),
+        }
+    }
+
+    /// Queues one call and blocks until its result is ready.
+    ///
+    /// `run` receives the arguments of every call in the batch and must return one
+    /// result per call, in the same order.
+    pub fn call<F>(&self, args: Vec<RDLTypes>, run: F) -> CallResult
+    where
+        F: Fn(Vec<Vec<RDLTypes>>) -> Vec<CallResult>,
+    {
+        let (reply, result) = mpsc::sync_channel(1);
+
+        let mut state = self.state.lock().map_err(|_| "Plugin batch queue is poisoned".to_string())?;
+        state.pending.push(PendingCall { args, reply });
+
+        if state.leader_active {
+            if state.pending.len() >= self.max_items {
+                self.filled.notify_one();
+            }
+            drop(state);
+            return result.recv().unwrap_or_else(|_| Err("Plugin batch was dropped before completion".to_string()));
+        }
+
+        state.leader_active = true;
+        let deadline = Instant::now() + self.window;
+
+        while state.pending.len() < self.max_items {
+            let now = Instant::now();
+            if now >= deadline {
+                break;
+            }
+
+            state = match self.filled.wait_timeout(state, deadline - now) {
+                Ok((guard, _)) => guard,
+                Err(_) => return Err("Plugin batch queue is poisoned".to_string()),
+            };
+        }
+
+        let mut calls = std::mem::take(&mut state.pending);
+        state.leader_active = false;
+        drop(state);
+
+        while !calls.is_empty() {
+            let rest = calls.split_off(calls.len().min(self.max_items));
+            let (args, replies): (Vec<_>, Vec<_>) = calls.into_iter()
+                .map(|call| (call.args, call.reply))
+                .unzip();
+
+            trace!("Running plugin batch of {} calls", args.len());
+            let mut results = run(args).into_iter();
+
+            for reply in replies {
+                let result = results.next()
+                    .unwrap_or_else(|| Err("Plugin returned fewer results than calls in the batch".to_string()));
+                let _ = reply.send(result);
+            }
+
+            calls = rest;
+        }
+
+        result.recv().unwrap_or_else(|_| Err("Plugin batch was dropped before completion".to_string()))
+    }
+}
@@ -0,0 +1,207 @@
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Mutex, OnceLock};
+use cesium_vm::vm::{DEFAULT_FUEL, VM, VMError, WarmInstance};
+use cesium_vm::{Module, TypedFunc};
+use log::{debug, warn};
+use netter_sdk::RDLTypes;
+use netter_sdk::wasm::{self as wire, STATUS_OK};
+use crate::language::error::{Result, Error, ErrorKind};
+use crate::runtime_error;
+
+/// Upper bound of live wasm instances across all plugins (one linear memory each).
+const MAX_INSTANCES: u32 = 256;
+const MAX_MEMORY_BYTES: usize = 64 * 1024 * 1024;
+
+static WASM_VM: OnceLock<std::result::Result<VM, String>> = OnceLock::new();
+static MODULE_CACHE_DIR: OnceLock<PathBuf> = OnceLock::new();
+
+/// Keeps compiled wasm plugins in `dir` between runs. Only has an effect before the
+/// first plugin is loaded.
+pub fn set_module_cache_dir(dir: PathBuf) {
+    let _ = MODULE_CACHE_DIR.set(dir);
+}
+
+fn vm() -> Result<&'static VM> {
+    let vm = WASM_VM.get_or_init(|| {
+        VM::new(MAX_INSTANCES, MAX_MEMORY_BYTES)
+            .map(|vm| match MODULE_CACHE_DIR.get() {
+                Some(dir) => vm.with_cache_dir(dir.clone()),
+                None => vm,
+            })
+            .map_err(|e| format!("{:?}", e))
+    });
+
+    match vm {
+        Ok(vm) => Ok(vm),
+        Err(e) => runtime_error!(format!("Failed to create the wasm plugin VM: {}", e)),
+    }
+}
+
+fn vm_error(alias: &str, action: &str, e: VMError) -> Error {
+    Error {
+        kind: ErrorKind::Runtime,
+        message: format!("Wasm plugin '{}' failed to {}: {:?}", alias, action, e),
+        line: None, column: None,
+    }
+}
+
+/// One instance of a wasm plugin with its exports resolved.
+struct PluginInstance {
+    instance: WarmInstance,
+    alloc: TypedFunc<u32, u32>,
+    free: TypedFunc<(u32, u32), ()>,
+    call: TypedFunc<(u32, u32, u32, u32), u64>,
+    shutdown: Option<TypedFunc<(), ()>>,
+}
+
+impl PluginInstance {
+    fn new(module: &Module, alias: &str) -> Result<Self> {
+        let mut instance = vm()?.instantiate(module).map_err(|e| vm_error(alias, "instantiate", e))?;
+
+        let alloc = instance.typed_func("__netter_alloc").map_err(|e| vm_error(alias, "resolve __netter_alloc", e))?;
+        let free = instance.typed_func("__netter_free").map_err(|e| vm_error(alias, "resolve __netter_free", e))?;
+        let call = instance.typed_func("__netter_wasm_call").map_err(|e| vm_error(alias, "resolve __netter_wasm_call", e))?;
+        let init = match instance.has_export("__netter_wasm_init") {
+            true => Some(instance.typed_func::<(), u64>("__netter_wasm_init").map_err(|e| vm_error(alias, "resolve __netter_wasm_init", e))?),
+            false => None,
+        };
+        let shutdown = match instance.has_export("__netter_wasm_shutdown") {
+            true => Some(instance.typed_func("__netter_wasm_shutdown").map_err(|e| vm_error(alias, "resolve __netter_wasm_shutdown", e))?),
+            false => None,
+        };
+
+        let mut plugin_instance = Self { instance, alloc, free, call, shutdown };
+
+        if let Some(init) = init {
+            debug!("Initializing wasm plugin instance '{}'", alias);
+            let packed = plugin_instance.instance.call(&init, ()).map_err(|e| vm_error(alias, "initialize", e))?;
+            if packed != 0 {
+                plugin_instance.shutdown = None;
+                let (_, message) = plugin_instance.take_response(packed).map_err(|e| vm_error(alias, "initialize", e))?;
+                return runtime_error!(format!("Plugin '{}' failed to initialize: {}", alias, String::from_utf8_lossy(&message)));
+            }
+        }
+
+        Ok(plugin_instance)
+    }
+
+    fn put(&mut self, bytes: &[u8]) -> std::result::Result<u32, VMError> {
+        let ptr = self.instance.call(&self.alloc, bytes.len() as u32)?;
+        self.instance.write(ptr, bytes)?;
+        Ok(ptr)
+    }
+
+    /// Copies a packed response out of the instance and frees it there.
+    fn take_response(&mut self, packed: u64) -> std::result::Result<(u8, Vec<u8>), VMError> {
+        let (ptr, len) = ((packed >> 32) as u32, packed as u32);
+        let mut response = self.instance.read(ptr, len)?;
+        self.instance.call(&self.free, (ptr, len))?;
+
+        if response.is_empty() {
+            return Err(VMError::WASMFailedToParseFunctionResponse);
+        }
+        let status = response.remove(0);
+        Ok((status, response))
+    }
+
+    fn call(&mut self, function_name: &str, args: &[u8]) -> std::result::Result<(u8, Vec<u8>), VMError> {
+        let name_ptr = self.put(function_name.as_bytes())?;
+        let args_ptr = self.put(args)?;
+        let packed = self.instance.call(&self.call, (name_ptr, function_name.len() as u32, args_ptr, args.len() as u32))?;
+        self.take_response(packed)
+    }
+}
+
+impl Drop for PluginInstance {
+    fn drop(&mut self) {
+        if let Some(shutdown) = self.shutdown.take() {
+            let _ = self.instance.call(&shutdown, ());
+        }
+    }
+}
+
+/// A plugin compiled to wasm and executed in a sandbox on `cesium_vm`.
+///
+/// The module is compiled once and instances are reused between calls. Every instance
+/// serves one call at a time and has its own plugin state. A trap (including a panic
+/// in the plugin) only fails the current call: the instance is thrown away and the
+/// next call gets a fresh one.
+pub struct WasmPlugin {
+    alias: String,
+    module: Module,
+    idle: Mutex<Vec<PluginInstance>>,
+    max_idle: usize,
+}
+
+impl std::fmt::Debug for WasmPlugin {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("WasmPlugin")
+            .field("alias", &self.alias)
+            .field("max_idle", &self.max_idle)
+            .finish()
+    }
+}
+
+impl WasmPlugin {
+    pub fn load(path: &Path, alias: &str) -> Result<Self> {
+        let bytes = match fs::read(path) {
+            Ok(bytes) => bytes,
+            Err(e) => return runtime_error!(format!("Failed to read wasm plugin '{}' from {}: {}", alias, path.display(), e)),
+        };
+
+        let module = vm()?.load_module(&path.to_string_lossy(), &bytes).map_err(|e| vm_error(alias, "compile", e))?;
+
+        // The first instance checks the exports and runs init, so a broken plugin fails the import.
+        let first = PluginInstance::new(&module, alias)?;
+        let max_idle = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(4);
+
+        debug!("Wasm plugin '{}' compiled, keeping up to {} warm instances", alias, max_idle);
+        Ok(Self {
+            alias: alias.to_string(),
+            module,
+            idle: Mutex::new(vec![first]),
+            max_idle,
+        })
+    }
+
+    pub fn call(&self, function_name: &str, args: &[RDLTypes]) -> Result<RDLTypes> {
+        let encoded = wire::encode_values(args).or_else(|e| runtime_error!(format!("Plugin Error: {e}")))?;
+
+        let idle = self.idle.lock().ok().and_then(|mut idle| idle.pop());
+        let mut instance = match idle {
+            Some(instance) => instance,
+            None => PluginInstance::new(&self.module, &self.alias)?,
+        };
+
+        match instance.call(function_name, &encoded) {
+            Ok((status, payload)) => {
+                self.release(instance);
+                if status == STATUS_OK {
+                    wire::decode_value(&payload).or_else(|e| runtime_error!(format!("Plugin Error: {e}")))
+                } else {
+                    runtime_error!(format!("Plugin Error: {}", String::from_utf8_lossy(&payload)))
+                }
+            }
+            Err(e) => {
+                // The instance's memory may be corrupted: don't run its shutdown or reuse it.
+                instance.shutdown = None;
+                warn!("Wasm plugin '{}' trapped in '{}': {:?}. Instance discarded.", self.alias, function_name, e);
+                match e {
+                    VMError::WASMOutOfFuel => runtime_error!(format!(
+                        "Plugin Error: '{}' ran out of fuel in '{}' after about {} instructions", self.alias, function_name, DEFAULT_FUEL
+                    )),
+                    _ => runtime_error!(format!("Plugin Error: '{}' trapped in '{}'", self.alias, function_name)),
+                }
+            }
+        }
+    }
+
+    fn release(&self, instance: PluginInstance) {
+        if let Ok(mut idle) = self.idle.lock() {
+            if idle.len() < self.max_idle {
+                idle.push(instance);
+            }
+        }
+    }
+}
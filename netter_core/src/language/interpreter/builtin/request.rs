@@ -24,7 +24,7 @@ impl Object for Request {
     fn methods(&self) -> Vec<&str> {
         vec![
             "get_param", "get_header", 
-            "body", "text_body", "body_base64", "is_binary"
+            "body", "text_body", "body_base64", "body_bytes", "is_binary"
         ]
     }
 
@@ -46,6 +46,7 @@ impl Object for Request {
             }
             "body" | "text_body" => Ok(self.get_body()),
             "body_base64" => Ok(self.get_body_as_base64()),
+            "body_bytes" => Ok(self.get_body_as_bytes()),
             "is_binary" => Ok(self.is_body_binary().into()),
             _ => Err(format!("Function with name '{}' not found in Request object", name))
         }
@@ -109,6 +110,14 @@ impl Request {
         }
     }
     
+    pub fn get_body_as_bytes(&self) -> RDLTypes {
+        match &self.body {
+            HttpBodyVariant::Text(s) => RDLTypes::Bytes(s.as_bytes().to_vec()),
+            HttpBodyVariant::Bytes(bytes_vec) => RDLTypes::Bytes(bytes_vec.clone()),
+            HttpBodyVariant::Empty => RDLTypes::Bytes(Vec::new()),
+        }
+    }
+
     pub fn is_body_binary(&self) -> bool {
         matches!(&self.body, HttpBodyVariant::Bytes(_))
     }
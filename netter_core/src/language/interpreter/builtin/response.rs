@@ -1,5 +1,7 @@
 use std::collections::HashMap;
+use log::debug;
 use netter_sdk::{RDLTypes, Object};
+use super::response_stream::{ResponseStream, StreamMode};
 
 #[derive(Debug, Clone)]
 pub struct Response {
@@ -7,6 +9,7 @@ pub struct Response {
     pub headers: HashMap<String, String>,
     pub body: Option<String>,
     pub is_sent: bool,
+    stream: Option<ResponseStream>,
 }
 
 impl Object for Response {
@@ -15,7 +18,7 @@ impl Object for Response {
     }
 
     fn methods(&self) -> Vec<&str> {
-        vec!["set_header", "body", "send", "status"]
+        vec!["set_header", "body", "send", "status", "write", "flush", "event"]
     }
 
     fn call_method(&mut self, name: &str, args: Vec<RDLTypes>) -> Result<RDLTypes, String> {
@@ -40,6 +43,29 @@ impl Object for Response {
                 self.send();
                 Ok(RDLTypes::Boolean(true))
             }
+            "write" => {
+                if args.len() < 1 {
+                    return Err("Method Response.write required 1 argument".to_string());
+                }
+
+                match &args[0] {
+                    RDLTypes::Bytes(bytes) => self.write(bytes)?,
+                    other => self.write(other.to_string().as_bytes())?,
+                }
+                Ok(RDLTypes::Boolean(true))
+            }
+            "flush" => {
+                self.flush()?;
+                Ok(RDLTypes::Boolean(true))
+            }
+            "event" => {
+                match args.len() {
+                    1 => self.event(None, &args[0].to_string())?,
+                    2 => self.event(Some(&args[0].to_string()), &args[1].to_string())?,
+                    _ => return Err("Method Response.event required 1 or 2 arguments".to_string()),
+                }
+                Ok(RDLTypes::Boolean(true))
+            }
             "status" => {
                 if args.len() < 1 {
                     return Err("Method Response.status required 1 argument".to_string());
@@ -82,15 +108,33 @@ impl Response {
             headers: HashMap::new(),
             body: None,
             is_sent: false,
+            stream: None,
         }
     }
 
+    /// Response of a `stream` or `sse` route: written data goes to the client as it is flushed.
+    pub fn streaming(stream: ResponseStream) -> Self {
+        let mut response = Response::new();
+        response.stream = Some(stream);
+        response
+    }
+
     pub fn body(&mut self, content: impl Into<String>) -> &mut Self {
         self.body = Some(content.into());
         self
     }
 
     pub fn send(&mut self) {
+        if self.stream.as_ref().is_some_and(|stream| stream.is_started()) {
+            // Status and headers are already sent: the body becomes the last chunk.
+            if let Some(body) = self.body.take() {
+                let _ = self.write(body.as_bytes());
+            }
+            self.finish_stream();
+            self.is_sent = true;
+            return;
+        }
+
         self.is_sent = true;
         if !self.headers.contains_key("Content-Type") && self.body.is_some() {
             self.headers.insert(
@@ -113,4 +157,85 @@ impl Response {
     pub fn is_sent(&self) -> bool {
         self.is_sent
     }
-}
\ No newline at end of file
+
+    /// Appends to the body. In a streaming route the data is sent on the next flush.
+    pub fn write(&mut self, chunk: &[u8]) -> Result<(), String> {
+        match &self.stream {
+            Some(stream) => stream.write(chunk, || self.head()),
+            None => {
+                self.body.get_or_insert_with(String::new).push_str(&String::from_utf8_lossy(chunk));
+                Ok(())
+            }
+        }
+    }
+
+    /// Sends written data to the client now. Does nothing outside of streaming routes.
+    pub fn flush(&mut self) -> Result<(), String> {
+        match &self.stream {
+            Some(stream) => stream.flush(|| self.head()),
+            None => Ok(()),
+        }
+    }
+
+    /// Sends one server-sent event.
+    pub fn event(&mut self, name: Option<&str>, data: &str) -> Result<(), String> {
+        if self.stream.as_ref().map(|stream| stream.mode()) != Some(StreamMode::Sse) {
+            return Err("Method Response.event is only available in routes with the 'sse' option".to_string());
+        }
+
+        let mut event = String::with_capacity(data.len() + 16);
+        if let Some(name) = name {
+            event.push_str("event: ");
+            event.push_str(name);
+            event.push('\n');
+        }
+        for line in data.split('\n') {
+            event.push_str("data: ");
+            event.push_str(line);
+            event.push('\n');
+        }
+        event.push('\n');
+
+        self.write(event.as_bytes())?;
+        self.flush()
+    }
+
+    /// Closes the stream of a streaming route once it is done. Data that was never flushed
+    /// becomes a regular body.
+    pub fn finish_stream(&mut self) {
+        let Some(stream) = self.stream.clone() else {
+            return;
+        };
+
+        match stream.finish(|| self.head()) {
+            Ok(Some(unsent)) if !unsent.is_empty() => {
+                let body = self.body.get_or_insert_with(String::new);
+                body.insert_str(0, &String::from_utf8_lossy(&unsent));
+                add_stream_headers(stream.mode(), &mut self.headers);
+            }
+            Ok(_) => {}
+            Err(e) => debug!("Streaming response closed: {}", e),
+        }
+        self.stream = None;
+    }
+
+    fn head(&self) -> (u16, Vec<(String, String)>) {
+        let mut headers = self.headers.clone();
+        if let Some(stream) = &self.stream {
+            add_stream_headers(stream.mode(), &mut headers);
+        }
+        (self.status, headers.into_iter().collect())
+    }
+}
+
+fn add_stream_headers(mode: StreamMode, headers: &mut HashMap<String, String>) {
+    let content_type = match mode {
+        StreamMode::Sse => "text/event-stream",
+        StreamMode::Chunked => "text/plain; charset=utf-8",
+    };
+
+    headers.entry("Content-Type".to_string()).or_insert_with(|| content_type.to_string());
+    if mode == StreamMode::Sse {
+        headers.entry("Cache-Control".to_string()).or_insert_with(|| "no-cache".to_string());
+    }
+}
@@ -0,0 +1,132 @@
+use std::sync::{Arc, Mutex};
+use hyper::body::Bytes;
+use tokio::sync::mpsc;
+
+/// Frames queued between a streaming route and the connection that sends them.
+#[derive(Debug)]
+pub enum StreamFrame {
+    /// Status and headers, always the first frame.
+    Head { status: u16, headers: Vec<(String, String)> },
+    Data(Bytes),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum StreamMode {
+    /// `stream` route option: chunks written with `Response.write`.
+    Chunked,
+    /// `sse` route option: `text/event-stream` written with `Response.event`.
+    Sse,
+}
+
+/// Frames a route may queue before `Response.write` blocks until the client catches up.
+pub const STREAM_CAPACITY: usize = 16;
+/// Written data is sent automatically once this much has been buffered.
+const FLUSH_THRESHOLD: usize = 16 * 1024;
+
+#[derive(Debug)]
+struct StreamState {
+    tx: Option<mpsc::Sender<StreamFrame>>,
+    started: bool,
+    pending: Vec<u8>,
+}
+
+/// Sending half of a streaming response.
+///
+/// Nothing is sent until the first flush, so a route can still set the status and headers
+/// after it started writing. A route that never flushes gets a regular response with the
+/// written data as its body. Writes block while the channel is full, so this must only be
+/// used from the blocking pool, never from async code.
+#[derive(Debug, Clone)]
+pub struct ResponseStream {
+    mode: StreamMode,
+    state: Arc<Mutex<StreamState>>,
+}
+
+impl ResponseStream {
+    pub fn channel(mode: StreamMode) -> (Self, mpsc::Receiver<StreamFrame>) {
+        let (tx, rx) = mpsc::channel(STREAM_CAPACITY);
+        let stream = Self {
+            mode,
+            state: Arc::new(Mutex::new(StreamState {
+                tx: Some(tx),
+                started: false,
+                pending: Vec::new(),
+            })),
+        };
+        (stream, rx)
+    }
+
+    pub fn mode(&self) -> StreamMode {
+        self.mode
+    }
+
+    pub fn is_started(&self) -> bool {
+        self.state.lock().map(|state| state.started).unwrap_or(true)
+    }
+
+    /// Buffers `chunk` and sends the buffer once it is large enough.
+    /// `head` gives the status and headers if this is the first flush.
+    pub fn write<F>(&self, chunk: &[u8], head: F) -> Result<(), String>
+    where
+        F: FnOnce() -> (u16, Vec<(String, String)>),
+    {
+        let mut state = self.lock()?;
+        state.pending.extend_from_slice(chunk);
+        if state.pending.len() >= FLUSH_THRESHOLD {
+            Self::flush_locked(&mut state, head)?;
+        }
+        Ok(())
+    }
+
+    pub fn flush<F>(&self, head: F) -> Result<(), String>
+    where
+        F: FnOnce() -> (u16, Vec<(String, String)>),
+    {
+        let mut state = self.lock()?;
+        Self::flush_locked(&mut state, head)
+    }
+
+    /// Sends what is left and closes the stream. If nothing was flushed yet, the buffered
+    /// data is returned instead so it can be sent as a regular body.
+    pub fn finish<F>(&self, head: F) -> Result<Option<Vec<u8>>, String>
+    where
+        F: FnOnce() -> (u16, Vec<(String, String)>),
+    {
+        let mut state = self.lock()?;
+        let result = if state.started {
+            Self::flush_locked(&mut state, head).map(|_| None)
+        } else {
+            Ok(Some(std::mem::take(&mut state.pending)))
+        };
+        state.tx = None;
+        result
+    }
+
+    fn lock(&self) -> Result<std::sync::MutexGuard<'_, StreamState>, String> {
+        self.state.lock().map_err(|_| "Response stream is poisoned".to_string())
+    }
+
+    fn flush_locked<F>(state: &mut StreamState, head: F) -> Result<(), String>
+    where
+        F: FnOnce() -> (u16, Vec<(String, String)>),
+    {
+        let Some(tx) = state.tx.as_ref() else {
+            return Err("Response stream is already closed".to_string());
+        };
+
+        if !state.started {
+            let (status, headers) = head();
+            tx.blocking_send(StreamFrame::Head { status, headers })
+                .map_err(|_| "Client closed the connection".to_string())?;
+            state.started = true;
+        }
+
+        if !state.pending.is_empty() {
+            let data = Bytes::from(std::mem::take(&mut state.pending));
+            tx.blocking_send(StreamFrame::Data(data))
+                .map_err(|_| "Client closed the connection".to_string())?;
+        }
+
+        Ok(())
+    }
+}
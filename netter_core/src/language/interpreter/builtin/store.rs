@@ -0,0 +1,121 @@
+use std::time::Duration;
+use netter_sdk::{RDLTypes, Object};
+use crate::servers::shared_cache;
+
+/// Key-value entries in the host's shared cache, visible to every Netter process.
+///
+/// Entries may be evicted when the cache is full, so `Store` holds data that can be
+/// recomputed: sessions, counters, rendered fragments.
+pub struct Store {}
+
+impl Object for Store {
+    fn name(&self) -> &'static str {
+        "Store"
+    }
+
+    fn methods(&self) -> Vec<&str> {
+        vec!["get", "set", "delete"]
+    }
+
+    fn call_method(&mut self, name: &str, args: Vec<RDLTypes>) -> Result<RDLTypes, String> {
+        match name {
+            "get" => {
+                if args.len() < 1 {
+                    return Err("Method Store.get required 1 argument".to_string());
+                }
+
+                Store::get(&args[0])
+            }
+            "set" => {
+                if args.len() < 2 {
+                    return Err("Method Store.set required 2 argument".to_string());
+                }
+
+                let ttl = match args.get(2) {
+                    Some(RDLTypes::Number(seconds)) if *seconds > 0 => Some(Duration::from_secs(*seconds as u64)),
+                    Some(_) => return Err("TTL of Store.set must be a positive number of seconds".to_string()),
+                    None => None,
+                };
+                Store::set(&args[0], &args[1], ttl).map(RDLTypes::Boolean)
+            }
+            "delete" => {
+                if args.len() < 1 {
+                    return Err("Method Store.delete required 1 argument".to_string());
+                }
+
+                Ok(RDLTypes::Boolean(shared_cache::global().remove(store_key(&args[0]).as_bytes())))
+            }
+            _ => Err(format!("Function with name '{}' not found in Store object", name))
+        }
+    }
+
+    fn get_property(&self, _name: &str) -> RDLTypes {
+        RDLTypes::Boolean(false)
+    }
+
+    fn method_exist(&self, name: &str) -> bool {
+        self.methods().contains(&name)
+    }
+
+    fn properties(&self) -> Vec<&str> {
+        vec![]
+    }
+
+    fn property_exist(&self, _name: &str) -> bool {
+        false
+    }
+}
+
+impl Store {
+    pub fn get(key: &RDLTypes) -> Result<RDLTypes, String> {
+        shared_cache::global()
+            .get(store_key(key).as_bytes())
+            .and_then(decode_value)
+            .ok_or_else(|| format!("Key '{}' not found in Store", key))
+    }
+
+    /// Returns false when the value wasn't stored: it's larger than the cache's biggest
+    /// chunk, or another process was writing the same place at that moment.
+    pub fn set(key: &RDLTypes, value: &RDLTypes, ttl: Option<Duration>) -> Result<bool, String> {
+        // Without a TTL the entry lives until the cache needs its space.
+        let ttl = ttl.unwrap_or(Duration::from_secs(u32::MAX as u64));
+        Ok(shared_cache::global().insert(store_key(key).as_bytes(), &encode_value(value)?, ttl))
+    }
+}
+
+fn store_key(key: &RDLTypes) -> String {
+    format!("store:{}", key)
+}
+
+// One tag byte for the type, then the value. `Kv` stores values the same way.
+pub(crate) fn encode_value(value: &RDLTypes) -> Result<Vec<u8>, String> {
+    let mut encoded = Vec::new();
+    match value {
+        RDLTypes::String(s) => {
+            encoded.push(b's');
+            encoded.extend_from_slice(s.as_bytes());
+        }
+        RDLTypes::Number(n) => {
+            encoded.push(b'n');
+            encoded.extend_from_slice(&n.to_le_bytes());
+        }
+        RDLTypes::Boolean(b) => encoded.extend_from_slice(&[b'b', *b as u8]),
+        RDLTypes::Bytes(bytes) => {
+            encoded.push(b'x');
+            encoded.extend_from_slice(bytes);
+        }
+        _ => return Err("Only strings, numbers, booleans and bytes can be stored".to_string()),
+    }
+    Ok(encoded)
+}
+
+pub(crate) fn decode_value(encoded: Vec<u8>) -> Option<RDLTypes> {
+    let (tag, value) = encoded.split_first()?;
+    match tag {
+        b's' => String::from_utf8(value.to_vec()).ok().map(RDLTypes::String),
+        b'n' => Some(RDLTypes::Number(i64::from_le_bytes(value.try_into().ok()?))),
+        b'b' => Some(RDLTypes::Boolean(*value.first()? != 0)),
+        b'x' => Some(RDLTypes::Bytes(value.to_vec())),
+        _ => None,
+    }
+}
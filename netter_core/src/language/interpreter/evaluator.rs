@@ -1,5 +1,5 @@
 use log::{trace, error, info};
-use netter_sdk::RDLTypes;
+use netter_sdk::{Object, RDLTypes};
 use crate::language::ast::AstNode;
 use crate::language::error::{Result, Error, ErrorKind};
 use crate::language::interpreter::OBJECT_REGISTRY;
@@ -7,7 +7,11 @@ use crate::runtime_error;
 use super::context::ExecutionContext;
 use super::builtin::request::Request;
 use super::builtin::response::Response;
+use super::builtin::store::Store;
+use super::builtin::kv::Kv;
+use super::builtin::jobs::Jobs;
 use super::builtin::plugin::PluginManager;
+use crate::servers::trace::{self, SpanKind};
 
 pub struct Evaluator<'a> {
     context: &'a mut ExecutionContext,
@@ -127,7 +131,7 @@ impl<'a> Evaluator<'a> {
         }
 
         match name.to_string().as_str() {
-            "Request" | "Response" | "Database" | "FileSystem" => Ok(name.to_string().into()),
+            "Request" | "Response" | "Database" | "FileSystem" | "Store" | "Kv" | "Jobs" => Ok(name.to_string().into()),
             _ if self.plugin_manager.has_plugin(name.to_string().as_str()) => Ok(name.to_string().into()),
             _ => runtime_error!(format!("Variable or object '{}' not found", name)),
         }
@@ -309,17 +313,35 @@ impl<'a> Evaluator<'a> {
         let obj_names = self.get_objects_names()?;
 
         let result = match object_name.as_deref() {
+            // Request and Response belong to the current request, not to the object registry.
+            Some("Request") => self.request.call_method(name, evaluated_args)
+                .or_else(|e| runtime_error!(e)),
+            Some("Response") => self.response.call_method(name, evaluated_args)
+                .or_else(|e| runtime_error!(e)),
+            // Store, Kv and Jobs keep their entries outside the interpreter, there is no per-request state.
+            Some("Store") => data_span("Store", name, || Store {}.call_method(name, evaluated_args)
+                .or_else(|e| runtime_error!(e))),
+            Some("Kv") => data_span("Kv", name, || Kv {}.call_method(name, evaluated_args)
+                .or_else(|e| runtime_error!(e))),
+            Some("Jobs") => Jobs {}.call_method(name, evaluated_args)
+                .or_else(|e| runtime_error!(e)),
             Some(n) if obj_names.contains(&n) => {
-                let mut lock = if let Ok(l) = OBJECT_REGISTRY.lock() {
-                    l
-                } else {
-                    return runtime_error!("OBJECT_REGISTRY mutex is poisoned!");
-                };
+                let call = || {
+                    let mut lock = if let Ok(l) = OBJECT_REGISTRY.lock() {
+                        l
+                    } else {
+                        return runtime_error!("OBJECT_REGISTRY mutex is poisoned!");
+                    };
 
-                if let Some(object) = lock.get_object_mut(name) {
-                    object.call_method(name, evaluated_args)
-                } else {
-                    runtime_error!(format!("Object '{}' not found", n))
+                    if let Some(object) = lock.get_object_mut(name) {
+                        object.call_method(name, evaluated_args)
+                    } else {
+                        runtime_error!(format!("Object '{}' not found", n))
+                    }
+                };
+                match n {
+                    "Database" => data_span(n, name, call),
+                    _ => call(),
                 }
             }
             Some(plugin_name) if self.plugin_manager.has_plugin(plugin_name) => {
@@ -527,4 +549,14 @@ impl<'a> Evaluator<'a> {
 
         Ok(string_items.join(separator.to_string().as_str()).into())
     }
-}
\ No newline at end of file
+}
+
+/// Calls of the data stores get a span in traced requests.
+fn data_span(object: &str, method: &str, call: impl FnOnce() -> Result<RDLTypes>) -> Result<RDLTypes> {
+    trace::span(
+        SpanKind::Client,
+        || (format!("{}.{}", object, method), vec![("db.system.name", object.into()), ("db.operation.name", method.into())]),
+        call,
+        Result::is_err,
+    )
+}
@@ -2,7 +2,9 @@ use log::{debug, trace};
 use crate::language::ast::AstNode;
 use crate::language::error::Result;
 use crate::interpreter_error;
+use crate::jobs::cron::Cron;
 use super::{Interpreter, ErrorHandler};
+use super::route_options::BodyRead;
 
 pub struct Executor {}
 
@@ -51,8 +53,9 @@ impl Executor {
                 }
 
                 if let Some(config_node) = config_block {
-                    if let AstNode::ConfigBlock { config_type, host, port } = &**config_node {
+                    if let AstNode::ConfigBlock { config_type, host, port, settings } = &**config_node {
                         interpreter.set_configuration(config_type.clone(), host.clone(), port.clone());
+                        interpreter.apply_config_settings(settings)?;
                     } else {
                         return interpreter_error!("Expected ConfigBlock node in ServerConfig");
                     }
@@ -78,7 +81,7 @@ impl Executor {
 
     fn execute_node(&self, node: &Box<AstNode>, interpreter: &mut Interpreter) -> Result<()> {
         match &**node {
-            AstNode::Route { path, method, body, on_error } => {
+            AstNode::Route { path, method, options, body, on_error } => {
                 trace!("Interpreting route: {} {}", method, path);
 
                 let actions = self.convert_ast_to_actions(body)?;
@@ -98,10 +101,37 @@ impl Executor {
                     None
                 };
 
-                let route_handler = super::route_handler::RouteHandler::new(actions, error_handler);
+                let mut route_options = super::route_options::RouteOptions::from_ast(method, path, options)?;
+                // Without a `body` option, a route that can't look at the body doesn't wait for it.
+                let global_handler_reads_body = interpreter.global_error_handler.as_ref()
+                    .is_some_and(|handler| handler.actions.iter().any(|action| action.any_node(&may_read_body)));
+                if !options.iter().any(|option| option.name == "body") && !node.any_node(&may_read_body) && !global_handler_reads_body {
+                    route_options.body.read = BodyRead::Skip;
+                }
+
+                let route_handler = super::route_handler::RouteHandler::new(actions, error_handler)
+                    .with_options(route_options);
                 interpreter.add_route(path.clone(), method.clone(), route_handler);
                 Ok(())
             },
+            AstNode::Job { name, body } => {
+                trace!("Interpreting job: {}", name);
+
+                let actions = self.convert_ast_to_actions(body)?;
+                interpreter.add_job(name.clone(), super::route_handler::RouteHandler::new(actions, None));
+                Ok(())
+            },
+            AstNode::Schedule { cron, body } => {
+                trace!("Interpreting schedule: {}", cron);
+
+                let parsed = match Cron::parse(cron) {
+                    Ok(parsed) => parsed,
+                    Err(e) => return interpreter_error!(format!("Invalid schedule \"{}\": {}", cron, e)),
+                };
+                let actions = self.convert_ast_to_actions(body)?;
+                interpreter.add_schedule(parsed, super::route_handler::RouteHandler::new(actions, None));
+                Ok(())
+            },
             AstNode::Import { .. } => Ok(()),
             _ => interpreter_error!(format!("Unexpected type of node in main loop of execution: {:?}", node)),
         }
@@ -117,4 +147,38 @@ impl Executor {
             }
         }
     }
-}
\ No newline at end of file
+}
+
+/// Calls of `Request` that may need the request body. The body is only reachable through
+/// them, and every method other than the ones known to leave it alone counts, so a method
+/// added to `Request` later keeps its routes buffering.
+fn may_read_body(node: &AstNode) -> bool {
+    match node {
+        AstNode::FunctionCall { object: Some(object), name, .. } => {
+            matches!(&**object, AstNode::Identifier(id) if id == "Request")
+                && !matches!(name.as_str(), "get_param" | "get_header")
+        }
+        _ => false,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::language::parse;
+
+    fn route_may_read_body(code: &str) -> bool {
+        parse(&format!("route \"/\" POST {{ {} }};", code)).unwrap().any_node(&may_read_body)
+    }
+
+    #[test]
+    fn body_is_skipped_only_when_unreachable() {
+        assert!(!route_may_read_body(r#"Response.body("ok"); Response.send();"#));
+        assert!(!route_may_read_body(r#"Response.body(Request.get_param("id") + Request.get_header("host")); Response.send();"#));
+
+        assert!(route_may_read_body(r#"Response.body(Request.body()); Response.send();"#));
+        assert!(route_may_read_body(r#"if (Request.is_binary()) { Response.send(); };"#));
+        // Methods it doesn't know count as reading the body.
+        assert!(route_may_read_body(r#"Response.body(Request.form("name")); Response.send();"#));
+    }
+}
@@ -2,23 +2,31 @@ mod context;
 mod evaluator;
 mod executor;
 mod route_handler;
+pub mod route_options;
 pub mod builtin;
 
 use std::collections::HashMap;
 use std::path::Path;
-use netter_sdk::Object;
+use netter_sdk::{Object, RDLTypes};
 use std::sync::OnceLock;
+use std::time::Duration;
 use log::{debug, info, warn};
-use crate::language::ast::AstNode;
-use crate::language::error::Result;
+use crate::language::ast::{AstNode, ConfigSetting, OptionValue};
+use crate::language::error::{Result, Error, ErrorKind};
 use crate::interpreter_error;
-use crate::servers::TlsConfig;
+use crate::jobs::cron::Cron;
+use crate::servers::{HandshakePoolConfig, SchedulingPolicy, ServerLimits, SlowRequestConfig, TlsConfig, TraceConfig, TraceExport};
+use crate::servers::slow_log;
+use crate::servers::timing::{self, Phase};
+use crate::servers::trace::{self, SpanKind};
 use executor::Executor;
 use route_handler::RouteHandler;
+use route_options::RouteOptions;
 use builtin::plugin::PluginManager;
 use builtin::response::Response;
 use builtin::request::Request;
 use builtin::request::HttpBodyVariant;
+use builtin::response_stream::ResponseStream;
 
 pub(crate) static OBJECT_REGISTRY: OnceLock<ObjectRegister> = OnceLock::new();
 
@@ -59,6 +67,23 @@ pub struct Configuration {
     pub config_type: String,
     pub host: String,
     pub port: String,
+    pub limits: ServerLimits,
+    /// `unix = "/run/app.sock";`: serve on a Unix domain socket instead of host and port.
+    pub unix: Option<String>,
+    /// `ktls = true;`: hand TLS encryption to the kernel after the handshake, Linux only.
+    pub ktls: bool,
+    /// `handshake_threads = 2;`: run TLS handshakes on their own threads.
+    pub handshake_pool: Option<HandshakePoolConfig>,
+    /// `weight = 2; cpu_share = 50;`: share of the route execution threads.
+    pub scheduling: SchedulingPolicy,
+    /// `warmup = true;`: also warm up every GET route without path parameters.
+    pub warmup: bool,
+    /// `server_timing = true;`: send the time of each request phase in a `Server-Timing` header.
+    pub server_timing: bool,
+    /// `trace_export = "http://127.0.0.1:4318/v1/traces"; trace_sample = 10;`: sampled request tracing.
+    pub tracing: Option<TraceConfig>,
+    /// `slow_request = 250; slow_request_sample = 10;`: keep execution traces of slow requests.
+    pub slow_requests: Option<SlowRequestConfig>,
 }
 
 #[derive(Debug, Clone)]
@@ -74,6 +99,10 @@ pub struct Interpreter {
     pub global_error_handler: Option<ErrorHandler>,
     pub configuration: Option<Configuration>,
     pub plugin_manager: PluginManager,
+    /// `job "name" { ... };` blocks, by name.
+    pub jobs: HashMap<String, RouteHandler>,
+    /// `schedule "cron" { ... };` blocks, in the order of the config.
+    pub schedules: Vec<(Cron, RouteHandler)>,
 }
 
 impl Interpreter {
@@ -85,6 +114,8 @@ impl Interpreter {
             global_error_handler: None,
             configuration: None,
             plugin_manager: PluginManager::new(),
+            jobs: HashMap::new(),
+            schedules: Vec::new(),
         }
     }
 
@@ -105,14 +136,135 @@ impl Interpreter {
         params: HashMap<String, String>,
         headers: HashMap<String, String>,
         body: HttpBodyVariant,
+    ) -> Response {
+        self.run_route(method, path, params, headers, body, Response::new())
+    }
+
+    /// Same as `handle_request`, but for `stream`/`sse` routes: flushed data goes to `stream`
+    /// while the route runs. Must be called from a blocking thread.
+    pub fn handle_streaming_request(
+        &self,
+        method: &str,
+        path: &str,
+        params: HashMap<String, String>,
+        headers: HashMap<String, String>,
+        body: HttpBodyVariant,
+        stream: ResponseStream,
+    ) -> Response {
+        self.run_route(method, path, params, headers, body, Response::streaming(stream))
+    }
+
+    fn run_route(
+        &self,
+        method: &str,
+        path: &str,
+        params: HashMap<String, String>,
+        headers: HashMap<String, String>,
+        body: HttpBodyVariant,
+        mut response: Response,
     ) -> Response {
         let mut request = Request::new(params, headers, body);
-        let mut response = Response::new();
+
+        if let Some((_, route_path, handler, path_params)) = timing::measure(Phase::Route, || self.find_route(method, path)) {
+            for (k, v) in path_params {
+                request.params.insert(k, v);
+            }
+            slow_log::route(route_path);
+            trace::span(
+                SpanKind::Internal,
+                || (format!("route {}", route_path), vec![("http.route", route_path.into())]),
+                || {
+                    // The route passes the trace on to plugins and upstreams with this header.
+                    if let Some(traceparent) = trace::traceparent() {
+                        request.headers.insert(trace::TRACEPARENT.to_string(), traceparent);
+                    }
+                    handler.execute(&mut request, &mut response, &self.plugin_manager, self.global_error_handler.as_ref());
+                    response.status
+                },
+                |status| *status >= 500,
+            );
+            response.finish_stream();
+            return response;
+        }
+
+        response.finish_stream();
+
+        response.status(404);
+        response.body("Not Found");
+        response.send();
+        response
+    }
+
+    /// Runs the job `name` with the arguments given to `Jobs.enqueue`, encoded like `Kv`
+    /// values. The job reads them with `Request.body()`, and its name and the number of the
+    /// run with `Request.get_param("job")` and `Request.get_param("attempt")`.
+    pub fn run_job(&self, name: &str, args: &[u8], attempt: u32) -> std::result::Result<(), String> {
+        let handler = self.jobs.get(name).ok_or_else(|| format!("Job '{}' is not declared", name))?;
+
+        let body = match builtin::store::decode_value(args.to_vec()) {
+            Some(RDLTypes::Bytes(bytes)) => HttpBodyVariant::Bytes(bytes),
+            Some(value) => HttpBodyVariant::Text(value.to_string()),
+            None => HttpBodyVariant::Empty,
+        };
+        let params = HashMap::from([
+            ("job".to_string(), name.to_string()),
+            ("attempt".to_string(), attempt.to_string()),
+        ]);
+
+        handler.run_in_background(&mut Request::new(params, HashMap::new(), body), &self.plugin_manager)
+    }
+
+    /// Runs the `index`th schedule of the config.
+    pub fn run_schedule(&self, index: usize) -> std::result::Result<(), String> {
+        let (_, handler) = self.schedules.get(index).ok_or_else(|| format!("Schedule {} is not declared", index))?;
+        handler.run_in_background(&mut Request::empty(), &self.plugin_manager)
+    }
+
+    pub fn job_names(&self) -> Vec<String> {
+        self.jobs.keys().cloned().collect()
+    }
+
+    pub fn schedules(&self) -> Vec<Cron> {
+        self.schedules.iter().map(|(cron, _)| cron.clone()).collect()
+    }
+
+    pub fn has_background_work(&self) -> bool {
+        !self.jobs.is_empty() || !self.schedules.is_empty()
+    }
+
+    /// Key (`METHOD:/path`) and options of the route that would handle the request, without
+    /// running it.
+    pub fn route_options(&self, method: &str, path: &str) -> Option<(&str, &RouteOptions)> {
+        self.find_route(method, path).map(|(route_key, _, handler, _)| (route_key, handler.options()))
+    }
+
+    /// Requests to run before the server accepts traffic, as `(method, path)`: the paths of
+    /// routes with `warmup` and, with `synthetic`, every GET route without path parameters.
+    pub fn warmup_requests(&self, synthetic: bool) -> Vec<(String, String)> {
+        let mut requests = Vec::new();
 
         for (route_key, (route_path, handler)) in &self.routes {
-            let mut local_params = HashMap::new();
-            let mut match_found = false;
+            let method = route_key.split_once(':').map_or(route_key.as_str(), |(method, _)| method);
+            let options = handler.options();
 
+            match &options.warmup {
+                Some(warmup) => {
+                    requests.extend(warmup.paths.iter().map(|path| (method.to_string(), path.clone())));
+                }
+                None if synthetic && method == "GET" && !route_path.contains('{') && options.stream.is_none() => {
+                    requests.push((method.to_string(), route_path.clone()));
+                }
+                None => {}
+            }
+        }
+
+        requests.sort();
+        requests
+    }
+
+    /// The route's path as declared, its handler and the values of its path parameters.
+    fn find_route(&self, method: &str, path: &str) -> Option<(&str, &str, &RouteHandler, HashMap<String, String>)> {
+        for (route_key, (route_path, handler)) in &self.routes {
             if !route_key.starts_with(&format!("{}:", method)) {
                 continue;
             }
@@ -133,27 +285,15 @@ impl Interpreter {
                         }
                     }
                     if current_match {
-                        match_found = true;
-                        local_params = extracted_params;
+                        return Some((route_key, route_path, handler, extracted_params));
                     }
                 }
             } else if route_path == path {
-                match_found = true;
-            }
-
-            if match_found {
-                for (k, v) in local_params {
-                    request.params.insert(k, v);
-                }
-                handler.execute(&mut request, &mut response, &self.plugin_manager, self.global_error_handler.as_ref());
-                return response;
+                return Some((route_key, route_path, handler, HashMap::new()));
             }
         }
 
-        response.status(404);
-        response.body("Not Found");
-        response.send();
-        response
+        None
     }
 
     pub fn add_route(&mut self, path: String, method: String, handler: RouteHandler) {
@@ -165,6 +305,19 @@ impl Interpreter {
         self.routes.insert(route_key, (path, handler));
     }
 
+    pub fn add_job(&mut self, name: String, handler: RouteHandler) {
+        if self.jobs.contains_key(&name) {
+            warn!("Redefining job: {}", name);
+        }
+        debug!("Adding job: {}", name);
+        self.jobs.insert(name, handler);
+    }
+
+    pub fn add_schedule(&mut self, cron: Cron, handler: RouteHandler) {
+        debug!("Adding schedule: {}", cron);
+        self.schedules.push((cron, handler));
+    }
+
     pub fn set_tls_config(&mut self, enabled: bool, cert_path: String, key_path: String) {
         self.tls_config = Some(TlsConfig {
             enabled,
@@ -187,10 +340,135 @@ impl Interpreter {
             config_type: config_type.clone(),
             host: host.clone(),
             port: port.clone(),
+            limits: ServerLimits::default(),
+            unix: None,
+            ktls: false,
+            handshake_pool: None,
+            scheduling: SchedulingPolicy::default(),
+            warmup: false,
+            server_timing: false,
+            tracing: None,
+            slow_requests: None,
         });
         debug!("Server configuration setup: type={}, host={}, port={}", config_type, host, port);
     }
 
+    /// Applies the `key = value;` settings of the `config` block. Must run after `set_configuration`.
+    pub fn apply_config_settings(&mut self, settings: &[ConfigSetting]) -> Result<()> {
+        let Some(configuration) = self.configuration.as_mut() else {
+            return interpreter_error!("Config settings applied before the config block");
+        };
+        let Configuration { limits, unix, ktls, handshake_pool, scheduling, warmup, server_timing, tracing, slow_requests, .. } = configuration;
+        let mut handshake_concurrency = None;
+        let mut trace_sample = None;
+        let mut slow_request_sample = None;
+
+        for setting in settings {
+            match setting.name.as_str() {
+                "max_connections" => limits.max_connections = positive_setting(setting)? as usize,
+                "header_timeout" => limits.header_timeout = Duration::from_secs(positive_setting(setting)?),
+                "body_timeout" => limits.body_timeout = Some(Duration::from_secs(positive_setting(setting)?)),
+                "idle_timeout" => limits.idle_timeout = Duration::from_secs(positive_setting(setting)?),
+                "max_streams" => limits.max_streams = positive_setting(setting)? as usize,
+                "min_body_rate" => {
+                    limits.min_body_rate = match setting.value {
+                        OptionValue::Number(n) if n >= 0 => n as u64,
+                        _ => return setting_error(setting, format!("'{}' must be a number of bytes per second, 0 disables it", setting.name)),
+                    }
+                }
+                "unix" => {
+                    *unix = match &setting.value {
+                        OptionValue::String(path) if !path.is_empty() => Some(path.clone()),
+                        _ => return setting_error(setting, "'unix' must be a socket path".to_string()),
+                    }
+                }
+                "ktls" => {
+                    *ktls = match setting.value {
+                        OptionValue::Boolean(enabled) => enabled,
+                        _ => return setting_error(setting, "'ktls' must be true or false".to_string()),
+                    }
+                }
+                "handshake_threads" => {
+                    *handshake_pool = Some(HandshakePoolConfig::with_threads(positive_setting(setting)? as usize));
+                }
+                "handshake_concurrency" => handshake_concurrency = Some((positive_setting(setting)? as usize, setting)),
+                "weight" => {
+                    scheduling.weight = match positive_setting(setting)? {
+                        weight @ 1..=1000 => weight as u32,
+                        _ => return setting_error(setting, "'weight' must be between 1 and 1000".to_string()),
+                    }
+                }
+                "cpu_share" => {
+                    scheduling.cpu_share = match positive_setting(setting)? {
+                        share @ 1..=100 => share as u8,
+                        _ => return setting_error(setting, "'cpu_share' must be a percentage from 1 to 100".to_string()),
+                    }
+                }
+                "warmup" => {
+                    *warmup = match setting.value {
+                        OptionValue::Boolean(enabled) => enabled,
+                        _ => return setting_error(setting, "'warmup' must be true or false".to_string()),
+                    }
+                }
+                "server_timing" => {
+                    *server_timing = match setting.value {
+                        OptionValue::Boolean(enabled) => enabled,
+                        _ => return setting_error(setting, "'server_timing' must be true or false".to_string()),
+                    }
+                }
+                "trace_export" => {
+                    let export = match &setting.value {
+                        OptionValue::String(target) => TraceExport::parse(target),
+                        _ => None,
+                    };
+                    let Some(export) = export else {
+                        return setting_error(setting, "'trace_export' must be an OTLP endpoint 'http://...' or 'file:<path>'".to_string());
+                    };
+                    *tracing = Some(TraceConfig { export, sample: DEFAULT_TRACE_SAMPLE });
+                }
+                "trace_sample" => {
+                    trace_sample = match setting.value {
+                        OptionValue::Number(percent @ 0..=100) => Some((percent as u8, setting)),
+                        _ => return setting_error(setting, "'trace_sample' must be a percentage from 0 to 100".to_string()),
+                    }
+                }
+                "slow_request" => {
+                    let threshold = Duration::from_millis(positive_setting(setting)?);
+                    *slow_requests = Some(SlowRequestConfig { threshold, sample: DEFAULT_SLOW_REQUEST_SAMPLE });
+                }
+                "slow_request_sample" => {
+                    slow_request_sample = match setting.value {
+                        OptionValue::Number(percent @ 0..=100) => Some((percent as u8, setting)),
+                        _ => return setting_error(setting, "'slow_request_sample' must be a percentage from 0 to 100".to_string()),
+                    }
+                }
+                other => return setting_error(setting, format!("Unknown key in the config block: '{}'", other)),
+            }
+        }
+
+        if let Some((max_in_flight, setting)) = handshake_concurrency {
+            match handshake_pool {
+                Some(pool) => pool.max_in_flight = max_in_flight,
+                None => return setting_error(setting, "'handshake_concurrency' needs 'handshake_threads'".to_string()),
+            }
+        }
+        if let Some((sample, setting)) = trace_sample {
+            match tracing {
+                Some(tracing) => tracing.sample = sample,
+                None => return setting_error(setting, "'trace_sample' needs 'trace_export'".to_string()),
+            }
+        }
+        if let Some((sample, setting)) = slow_request_sample {
+            match slow_requests {
+                Some(slow_requests) => slow_requests.sample = sample,
+                None => return setting_error(setting, "'slow_request_sample' needs 'slow_request'".to_string()),
+            }
+        }
+
+        debug!("Server limits: {:?}, unix socket: {:?}, ktls: {}, handshake pool: {:?}, scheduling: {:?}, warmup: {}, server timing: {}, tracing: {:?}, slow requests: {:?}", limits, unix, ktls, handshake_pool, scheduling, warmup, server_timing, tracing, slow_requests);
+        Ok(())
+    }
+
     pub fn load_plugin(&mut self, path: &str, alias: &str) -> Result<()> {
         debug!("Downloading plugin: '{}' from '{}'", alias, path);
 
@@ -202,6 +480,27 @@ impl Interpreter {
     }
 }
 
+/// Percent of requests traced when `trace_sample` isn't set.
+const DEFAULT_TRACE_SAMPLE: u8 = 10;
+/// Percent of requests recorded when `slow_request_sample` isn't set.
+const DEFAULT_SLOW_REQUEST_SAMPLE: u8 = 10;
+
+fn positive_setting(setting: &ConfigSetting) -> Result<u64> {
+    match setting.value {
+        OptionValue::Number(n) if n > 0 => Ok(n as u64),
+        _ => setting_error(setting, format!("'{}' must be a positive number", setting.name)),
+    }
+}
+
+fn setting_error<T>(setting: &ConfigSetting, message: String) -> Result<T> {
+    Err(Error {
+        kind: ErrorKind::Interpreter,
+        message,
+        line: Some(setting.line),
+        column: Some(setting.column),
+    })
+}
+
 impl Clone for Interpreter {
     fn clone(&self) -> Self {
         let mut new_routes = HashMap::new();
@@ -213,7 +512,9 @@ impl Clone for Interpreter {
             tls_config: self.tls_config.clone(),
             global_error_handler: self.global_error_handler.clone(),
             configuration: self.configuration.clone(),
-            plugin_manager: PluginManager::new(),
+            plugin_manager: self.plugin_manager.clone(),
+            jobs: self.jobs.clone(),
+            schedules: self.schedules.clone(),
         }
     }
 }
\ No newline at end of file
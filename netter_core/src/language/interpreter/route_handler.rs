@@ -4,16 +4,19 @@ use crate::language::ast::AstNode;
 use crate::language::error::{Result, Error, ErrorKind};
 use crate::language::interpreter::evaluator::Evaluator;
 use crate::runtime_error;
+use crate::servers::slow_log;
 use super::context::ExecutionContext;
 use super::builtin::request::Request;
 use super::builtin::response::Response;
 use super::builtin::plugin::PluginManager;
 use super::ErrorHandler;
+use super::route_options::RouteOptions;
 
 #[derive(Debug, Clone)]
 pub struct RouteHandler {
     pub(crate) actions: Vec<Box<AstNode>>,
     pub(crate) error_handler: Option<ErrorHandler>,
+    pub(crate) options: RouteOptions,
 }
 
 impl RouteHandler {
@@ -21,9 +24,19 @@ impl RouteHandler {
         RouteHandler {
             actions,
             error_handler,
+            options: RouteOptions::default(),
         }
     }
 
+    pub fn with_options(mut self, options: RouteOptions) -> Self {
+        self.options = options;
+        self
+    }
+
+    pub fn options(&self) -> &RouteOptions {
+        &self.options
+    }
+
     pub fn execute(
         &self,
         request: &mut Request,
@@ -34,13 +47,20 @@ impl RouteHandler {
     ) {
         let mut context = ExecutionContext::new();
         let mut error: Option<String> = None;
+        // Only sampled requests time their statements.
+        let recording = slow_log::recording();
 
         debug!("Начало выполнения маршрута. Действий: {}", self.actions.len());
 
         for (index, action) in self.actions.iter().enumerate() {
             trace!("Выполнение действия {}: {:?}", index, action);
 
-            if let Err(err) = self.execute_action(action, request, response, &mut context, plugin_manager) {
+            let result = if recording {
+                slow_log::statement(index, || describe(action), || self.execute_action(action, request, response, &mut context, plugin_manager))
+            } else {
+                self.execute_action(action, request, response, &mut context, plugin_manager)
+            };
+            if let Err(err) = result {
                 error = Some(err.message);
                 debug!("Ошибка при выполнении действия {}: {}", index, error.as_ref().unwrap());
                 break;
@@ -52,6 +72,10 @@ impl RouteHandler {
             }
         }
 
+        if recording {
+            slow_log::variables(context.get_local_variables());
+        }
+
         if let Some(err_msg) = error {
             warn!("Произошла ошибка при выполнении маршрута: {}", err_msg);
             let mut error_handled = false;
@@ -120,6 +144,26 @@ impl RouteHandler {
         // response.clone()
     }
 
+    /// Runs the actions of a `job` or `schedule` block. Nobody waits for a response, so the
+    /// first error ends the run and is returned for the job queue to retry.
+    pub fn run_in_background(&self, request: &mut Request, plugin_manager: &PluginManager) -> std::result::Result<(), String> {
+        let mut context = ExecutionContext::new();
+        let mut response = Response::new();
+
+        for (index, action) in self.actions.iter().enumerate() {
+            trace!("Выполнение действия задачи {}: {:?}", index, action);
+
+            self.execute_action(action, request, &mut response, &mut context, plugin_manager)
+                .map_err(|err| err.message)?;
+
+            if response.is_sent() {
+                break;
+            }
+        }
+
+        Ok(())
+    }
+
     fn execute_action(
         &self,
         action: &AstNode,
@@ -499,4 +543,24 @@ impl RouteHandler {
 
         result
     }
-}
\ No newline at end of file
+}
+
+/// Short name of a route statement in slow request traces.
+fn describe(action: &AstNode) -> String {
+    match action {
+        AstNode::VarDeclaration { name, .. } => format!("val {}", name),
+        AstNode::FunctionCall { object, name, .. } => match object.as_deref() {
+            Some(AstNode::Identifier(object)) => format!("{}.{}()", object, name),
+            Some(_) => format!("<expression>.{}()", name),
+            None => format!("{}()", name),
+        },
+        AstNode::IfStatement { .. } => "if".to_string(),
+        AstNode::WhileLoop { .. } => "while".to_string(),
+        AstNode::ForLoop { var_name, .. } => format!("for {}", var_name),
+        AstNode::BinaryOp { left, operator, .. } => match &**left {
+            AstNode::Identifier(name) => format!("{} {}", name, operator),
+            _ => operator.clone(),
+        },
+        _ => "expression".to_string(),
+    }
+}
@@ -0,0 +1,385 @@
+use std::{collections::HashMap, fmt::Write, time::Duration};
+use crate::language::ast::{RouteOption, OptionValue};
+use crate::language::error::{Result, Error, ErrorKind};
+use super::builtin::response_stream::StreamMode;
+
+/// Per-route settings written between the HTTP method and the route body.
+#[derive(Debug, Clone, Default)]
+pub struct RouteOptions {
+    pub coalesce: Option<CoalesceOptions>,
+    /// `stream` or `sse`: the response is sent to the client while the route runs.
+    pub stream: Option<StreamMode>,
+    pub warmup: Option<WarmupOptions>,
+    pub cache: Option<CacheOptions>,
+    pub body: BodyOptions,
+}
+
+/// `coalesce(params = [...], headers = [...])`: identical concurrent requests share one execution.
+///
+/// Requests are identical when the method, the path, the selected query parameters and the
+/// selected headers are equal. Without `params` the whole query string is part of the key.
+#[derive(Debug, Clone, Default)]
+pub struct CoalesceOptions {
+    pub params: Option<Vec<String>>,
+    pub headers: Vec<String>,
+}
+
+/// `warmup` or `warmup(paths = [...])`: requests run through the route before the server
+/// accepts traffic. Without `paths` the route's own path is used.
+#[derive(Debug, Clone, Default)]
+pub struct WarmupOptions {
+    pub paths: Vec<String>,
+}
+
+/// `cache` or `cache(ttl = 30)`: successful responses are kept in the host's shared cache
+/// for `ttl` seconds and served to every Netter process without running the route.
+#[derive(Debug, Clone)]
+pub struct CacheOptions {
+    pub ttl: Duration,
+}
+
+impl Default for CacheOptions {
+    fn default() -> Self {
+        Self { ttl: Duration::from_secs(60) }
+    }
+}
+
+/// `body(read = "skip" | "buffer", limit = 1048576)`: whether the request body is read before
+/// the route runs. Without the option a route whose only `Request` calls are `get_param` and
+/// `get_header` skips the body, the others buffer it without a limit.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct BodyOptions {
+    pub read: BodyRead,
+    /// Largest body in bytes, a bigger one is answered with `413`.
+    pub limit: Option<u64>,
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub enum BodyRead {
+    /// The body is never read, the route sees an empty one.
+    Skip,
+    /// The body is read before the route runs.
+    #[default]
+    Buffer,
+}
+
+impl RouteOptions {
+    pub fn from_ast(method: &str, path: &str, options: &[RouteOption]) -> Result<Self> {
+        let mut route_options = RouteOptions::default();
+
+        for option in options {
+            match option.name.as_str() {
+                "coalesce" => {
+                    if method != "GET" {
+                        return option_error(option, "'coalesce' is only allowed on GET routes".to_string());
+                    }
+                    route_options.coalesce = Some(CoalesceOptions::from_ast(option)?);
+                }
+                "stream" | "sse" => {
+                    if !option.args.is_empty() {
+                        return option_error(option, format!("Option '{}' takes no parameters", option.name));
+                    }
+                    if route_options.stream.is_some() {
+                        return option_error(option, "Only one of 'stream' and 'sse' can be set".to_string());
+                    }
+                    route_options.stream = Some(match option.name.as_str() {
+                        "sse" => StreamMode::Sse,
+                        _ => StreamMode::Chunked,
+                    });
+                }
+                "warmup" => route_options.warmup = Some(WarmupOptions::from_ast(path, option)?),
+                "cache" => {
+                    if method != "GET" {
+                        return option_error(option, "'cache' is only allowed on GET routes".to_string());
+                    }
+                    route_options.cache = Some(CacheOptions::from_ast(option)?);
+                }
+                "body" => route_options.body = BodyOptions::from_ast(option)?,
+                other => return option_error(option, format!("Unknown route option '{}'", other)),
+            }
+        }
+
+        if route_options.coalesce.is_some() && route_options.stream.is_some() {
+            if let Some(option) = options.iter().find(|option| option.name == "coalesce") {
+                return option_error(option, "'coalesce' can't be combined with 'stream' or 'sse'".to_string());
+            }
+        }
+
+        if route_options.warmup.is_some() && route_options.stream.is_some() {
+            if let Some(option) = options.iter().find(|option| option.name == "warmup") {
+                return option_error(option, "'warmup' can't be combined with 'stream' or 'sse'".to_string());
+            }
+        }
+
+        if route_options.cache.is_some() && route_options.stream.is_some() {
+            if let Some(option) = options.iter().find(|option| option.name == "cache") {
+                return option_error(option, "'cache' can't be combined with 'stream' or 'sse'".to_string());
+            }
+        }
+
+        Ok(route_options)
+    }
+}
+
+impl BodyOptions {
+    fn from_ast(option: &RouteOption) -> Result<Self> {
+        let mut body = BodyOptions::default();
+
+        for (key, value) in &option.args {
+            match (key.as_str(), value) {
+                ("read", OptionValue::String(read)) => {
+                    body.read = match read.as_str() {
+                        "skip" => BodyRead::Skip,
+                        "buffer" => BodyRead::Buffer,
+                        _ => return option_error(option, format!("'read' of 'body' must be \"skip\" or \"buffer\", got \"{}\"", read)),
+                    };
+                }
+                ("read", _) => return option_error(option, "'read' of 'body' must be \"skip\" or \"buffer\"".to_string()),
+                ("limit", OptionValue::Number(bytes)) if *bytes > 0 => body.limit = Some(*bytes as u64),
+                ("limit", _) => return option_error(option, "'limit' of 'body' must be a positive number of bytes".to_string()),
+                _ => return option_error(option, format!("Unknown parameter '{}' of 'body'", key)),
+            }
+        }
+
+        if body.read == BodyRead::Skip && body.limit.is_some() {
+            return option_error(option, "'limit' of 'body' has no effect with read = \"skip\"".to_string());
+        }
+
+        Ok(body)
+    }
+}
+
+impl CacheOptions {
+    fn from_ast(option: &RouteOption) -> Result<Self> {
+        let mut cache = CacheOptions::default();
+
+        for (key, value) in &option.args {
+            match (key.as_str(), value) {
+                ("ttl", OptionValue::Number(seconds)) if *seconds > 0 => cache.ttl = Duration::from_secs(*seconds as u64),
+                ("ttl", _) => return option_error(option, "'ttl' of 'cache' must be a positive number of seconds".to_string()),
+                _ => return option_error(option, format!("Unknown parameter '{}' of 'cache'", key)),
+            }
+        }
+
+        Ok(cache)
+    }
+}
+
+impl WarmupOptions {
+    fn from_ast(route_path: &str, option: &RouteOption) -> Result<Self> {
+        let mut warmup = WarmupOptions::default();
+
+        for (key, value) in &option.args {
+            match (key.as_str(), value) {
+                ("paths", OptionValue::List(paths)) => {
+                    if let Some(path) = paths.iter().find(|path| !path.starts_with('/')) {
+                        return option_error(option, format!("Warmup path '{}' must start with '/'", path));
+                    }
+                    warmup.paths = paths.clone();
+                }
+                ("paths", _) => return option_error(option, "'paths' of 'warmup' must be a list of strings".to_string()),
+                _ => return option_error(option, format!("Unknown parameter '{}' of 'warmup'", key)),
+            }
+        }
+
+        if warmup.paths.is_empty() {
+            if route_path.contains('{') {
+                return option_error(option, "'warmup' on a route with path parameters needs 'paths'".to_string());
+            }
+            warmup.paths.push(route_path.to_string());
+        }
+
+        Ok(warmup)
+    }
+}
+
+impl CoalesceOptions {
+    fn from_ast(option: &RouteOption) -> Result<Self> {
+        let mut coalesce = CoalesceOptions::default();
+
+        for (key, value) in &option.args {
+            match (key.as_str(), value) {
+                ("params", OptionValue::List(params)) => coalesce.params = Some(params.clone()),
+                // Header names arrive lowercased from the HTTP layer.
+                ("headers", OptionValue::List(headers)) => {
+                    coalesce.headers = headers.iter().map(|h| h.to_ascii_lowercase()).collect();
+                }
+                ("params" | "headers", _) => return option_error(option, format!("'{}' of 'coalesce' must be a list of strings", key)),
+                _ => return option_error(option, format!("Unknown parameter '{}' of 'coalesce'", key)),
+            }
+        }
+
+        Ok(coalesce)
+    }
+
+    /// Key under which concurrent requests are merged.
+    pub fn key(
+        &self,
+        method: &str,
+        path: &str,
+        params: &HashMap<String, String>,
+        headers: &HashMap<String, String>,
+    ) -> String {
+        let mut key = String::new();
+        push_field(&mut key, method);
+        push_field(&mut key, path);
+
+        match &self.params {
+            Some(names) => {
+                for name in names {
+                    push_part(&mut key, '?', name, params.get(name));
+                }
+            }
+            None => {
+                let mut all: Vec<_> = params.iter().collect();
+                all.sort();
+                for (name, value) in all {
+                    push_part(&mut key, '?', name, Some(value));
+                }
+            }
+        }
+
+        for name in &self.headers {
+            push_part(&mut key, '#', name, headers.get(name));
+        }
+
+        key
+    }
+}
+
+// Every name and value is prefixed with its length, so no decoded value, whatever bytes it
+// holds, can be read as the start of another part.
+fn push_part(key: &mut String, kind: char, name: &str, value: Option<&String>) {
+    key.push(kind);
+    push_field(key, name);
+    match value {
+        Some(value) => {
+            key.push('=');
+            push_field(key, value);
+        }
+        None => key.push('-'),
+    }
+}
+
+fn push_field(key: &mut String, field: &str) {
+    let _ = write!(key, "{}:{}", field.len(), field);
+}
+
+fn option_error<T>(option: &RouteOption, message: String) -> Result<T> {
+    Err(Error {
+        kind: ErrorKind::Interpreter,
+        message,
+        line: Some(option.line),
+        column: Some(option.column),
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn map(pairs: &[(&str, &str)]) -> HashMap<String, String> {
+        pairs.iter().map(|(name, value)| (name.to_string(), value.to_string())).collect()
+    }
+
+    fn body_option(args: Vec<(&str, OptionValue)>) -> RouteOption {
+        RouteOption {
+            name: "body".to_string(),
+            args: args.into_iter().map(|(key, value)| (key.to_string(), value)).collect(),
+            line: 1,
+            column: 1,
+        }
+    }
+
+    fn coalesce(params: Option<&[&str]>, headers: &[&str]) -> CoalesceOptions {
+        CoalesceOptions {
+            params: params.map(|names| names.iter().map(|name| name.to_string()).collect()),
+            headers: headers.iter().map(|name| name.to_string()).collect(),
+        }
+    }
+
+    #[test]
+    fn same_request_same_key() {
+        let options = coalesce(None, &["accept"]);
+        let params = map(&[("b", "2"), ("a", "1")]);
+        let headers = map(&[("accept", "text/html"), ("cookie", "x")]);
+        assert_eq!(
+            options.key("GET", "/items", &params, &headers),
+            options.key("GET", "/items", &map(&[("a", "1"), ("b", "2")]), &map(&[("accept", "text/html")])),
+        );
+    }
+
+    #[test]
+    fn listed_params_only() {
+        let options = coalesce(Some(&["page"]), &[]);
+        assert_eq!(
+            options.key("GET", "/items", &map(&[("page", "2"), ("utm", "a")]), &HashMap::new()),
+            options.key("GET", "/items", &map(&[("page", "2"), ("utm", "b")]), &HashMap::new()),
+        );
+        assert_ne!(
+            options.key("GET", "/items", &map(&[("page", "2")]), &HashMap::new()),
+            options.key("GET", "/items", &map(&[("page", "3")]), &HashMap::new()),
+        );
+    }
+
+    #[test]
+    fn missing_differs_from_empty() {
+        let options = coalesce(Some(&["q"]), &["accept"]);
+        let empty = HashMap::new();
+        assert_ne!(
+            options.key("GET", "/", &empty, &empty),
+            options.key("GET", "/", &map(&[("q", "")]), &empty),
+        );
+        assert_ne!(
+            options.key("GET", "/", &empty, &empty),
+            options.key("GET", "/", &empty, &map(&[("accept", "")])),
+        );
+    }
+
+    #[test]
+    fn values_cant_forge_other_parts() {
+        let options = coalesce(None, &[]);
+        let empty = HashMap::new();
+        // One parameter whose decoded value looks like a second parameter.
+        assert_ne!(
+            options.key("GET", "/", &map(&[("a", "1\0?b=2")]), &empty),
+            options.key("GET", "/", &map(&[("a", "1"), ("b", "2")]), &empty),
+        );
+        assert_ne!(
+            options.key("GET", "/", &map(&[("a", "1=b")]), &empty),
+            options.key("GET", "/", &map(&[("a=1", "b")]), &empty),
+        );
+        // A path that ends like the encoding of a parameter.
+        assert_ne!(
+            options.key("GET", "/x?1:a=1:1", &empty, &empty),
+            options.key("GET", "/x", &map(&[("a", "1")]), &empty),
+        );
+
+        let options = coalesce(Some(&["a"]), &["h"]);
+        assert_ne!(
+            options.key("GET", "/", &map(&[("a", "1#1:h=1:2")]), &empty),
+            options.key("GET", "/", &map(&[("a", "1")]), &map(&[("h", "2")])),
+        );
+    }
+
+    #[test]
+    fn body_read_modes() {
+        let body = BodyOptions::from_ast(&body_option(vec![("read", OptionValue::String("skip".to_string()))])).unwrap();
+        assert_eq!(body.read, BodyRead::Skip);
+
+        let body = BodyOptions::from_ast(&body_option(vec![
+            ("read", OptionValue::String("buffer".to_string())),
+            ("limit", OptionValue::Number(1024)),
+        ])).unwrap();
+        assert_eq!((body.read, body.limit), (BodyRead::Buffer, Some(1024)));
+
+        let stream = BodyOptions::from_ast(&body_option(vec![("read", OptionValue::String("stream".to_string()))]));
+        assert_eq!(stream.unwrap_err().message, "'read' of 'body' must be \"skip\" or \"buffer\", got \"stream\"");
+
+        let skip_with_limit = BodyOptions::from_ast(&body_option(vec![
+            ("read", OptionValue::String("skip".to_string())),
+            ("limit", OptionValue::Number(1024)),
+        ]));
+        assert!(skip_with_limit.is_err());
+    }
+}
@@ -363,6 +363,8 @@ impl Lexer {
                     match ident.as_str() {
                         "route" => Ok(Token { token_type: TokenType::Route, line, column }),
                         "middleware" => Ok(Token { token_type: TokenType::Middleware, line, column }),
+                        "job" => Ok(Token { token_type: TokenType::Job, line, column }),
+                        "schedule" => Ok(Token { token_type: TokenType::Schedule, line, column }),
                         "val" => Ok(Token { token_type: TokenType::Val, line, column }),
                         "if" => Ok(Token { token_type: TokenType::If, line, column }),
                         "else" => Ok(Token { token_type: TokenType::Else, line, column }),
@@ -1,9 +1,10 @@
 use log::{debug, error, info};
 use crate::language::token::{Token, TokenType};
-use crate::language::ast::AstNode;
+use crate::language::ast::{AstNode, ConfigSetting, RouteOption, OptionValue};
 use crate::language::lexer::Lexer;
 use crate::language::error::{Result, Error, ErrorKind};
 use crate::parser_error;
+use crate::jobs::cron::Cron;
 
 pub struct Parser {
     tokens: Vec<Token>,
@@ -50,6 +51,10 @@ impl Parser {
                 statements.push(Box::new(self.route()?));
             } else if self.check(&TokenType::Middleware) {
                 statements.push(Box::new(self.middleware()?));
+            } else if self.check(&TokenType::Job) {
+                statements.push(Box::new(self.job()?));
+            } else if self.check(&TokenType::Schedule) {
+                statements.push(Box::new(self.schedule()?));
             } else if self.check(&TokenType::Config) {
                 if config.is_some() {
                     return Err(Error {
@@ -65,7 +70,7 @@ impl Parser {
             } else {
                 return Err(Error {
                     kind: ErrorKind::Parser,
-                    message: format!("Expected 'route', 'middleware', 'tls' or 'config', got: {:?}", self.peek().token_type),
+                    message: format!("Expected 'route', 'middleware', 'job', 'schedule', 'tls' or 'config', got: {:?}", self.peek().token_type),
                     line: Some(self.peek().line),
                     column: Some(self.peek().column),
                 });
@@ -204,6 +209,7 @@ impl Parser {
         let mut type_name = String::new();
         let mut host = String::new();
         let mut port = String::new();
+        let mut settings = Vec::new();
 
         while !self.check(&TokenType::RBrace) && !self.is_at_end() {
             if self.match_token(&TokenType::TypeName) {
@@ -248,6 +254,18 @@ impl Parser {
                     ),
                 };
                 self.consume(&TokenType::Semicolon, "Ожидается ';' после значения port")?;
+            } else if self.check(&TokenType::Identifier(String::new())) {
+                let name_token = self.advance().clone();
+                let name = name_token.to_string();
+                self.consume(&TokenType::Equals, &format!("Ожидается '=' после '{}'", name))?;
+                let value = self.option_value()?;
+                self.consume(&TokenType::Semicolon, &format!("Ожидается ';' после значения {}", name))?;
+                settings.push(ConfigSetting {
+                    name,
+                    value,
+                    line: name_token.line,
+                    column: name_token.column,
+                });
             } else {
                 return parser_error!(
                     format!("Неизвестный ключ в блоке 'config': {:?}", self.peek().token_type),
@@ -260,10 +278,11 @@ impl Parser {
         self.consume(&TokenType::RBrace, "Ожидается '}' после блока 'config'")?;
         self.consume(&TokenType::Semicolon, "Ожидается ';' после блока 'config'")?;
 
-        if type_name == "http" && (host.is_empty() || port.is_empty()) {
+        let has_unix = settings.iter().any(|setting| setting.name == "unix");
+        if type_name == "http" && !has_unix && (host.is_empty() || port.is_empty()) {
             return Err(Error {
                 kind: ErrorKind::Parser,
-                message: "Для type=\"http\" необходимо указать host и port в блоке 'config'".to_string(),
+                message: "Для type=\"http\" необходимо указать host и port или unix в блоке 'config'".to_string(),
                 line: Some(self.previous().line),
                 column: Some(self.previous().column),
             });
@@ -281,6 +300,7 @@ impl Parser {
             config_type: type_name,
             host,
             port,
+            settings,
         })
     }
 
@@ -354,6 +374,7 @@ impl Parser {
             _ => return parser_error!("Impossible case when parsing HTTP method", method_token.line, method_token.column),
         };
 
+        let options = self.route_options()?;
         let body = self.block()?;
 
         let on_error = if self.match_token(&TokenType::OnError) {
@@ -367,6 +388,7 @@ impl Parser {
         Ok(AstNode::Route {
             path,
             method,
+            options,
             body: Box::new(body),
             on_error,
         })
@@ -387,6 +409,7 @@ impl Parser {
             _ => return parser_error!("Невозможный случай при парсинге HTTP метода", method_token.line, method_token.column),
         };
 
+        let options = self.route_options()?;
         let body = self.block()?;
 
         let on_error = if self.match_token(&TokenType::OnError) {
@@ -400,11 +423,140 @@ impl Parser {
         Ok(AstNode::Route {
             path,
             method,
+            options,
             body: Box::new(body),
             on_error,
         })
     }
 
+    /// `job "name" { ... };`
+    fn job(&mut self) -> Result<AstNode> {
+        self.consume(&TokenType::Job, "Ожидается ключевое слово 'job'")?;
+
+        let name_token = self.consume(&TokenType::String(String::new()), "Ожидается строка имени задачи")?;
+        let name = match &name_token.token_type {
+            TokenType::String(s) => s.clone(),
+            _ => return parser_error!("Невозможный случай при парсинге имени задачи", name_token.line, name_token.column),
+        };
+
+        let body = self.block()?;
+        self.consume(&TokenType::Semicolon, "Ожидается ';' после блока задачи")?;
+
+        Ok(AstNode::Job {
+            name,
+            body: Box::new(body),
+        })
+    }
+
+    /// `schedule "*/5 * * * *" { ... };`
+    fn schedule(&mut self) -> Result<AstNode> {
+        self.consume(&TokenType::Schedule, "Ожидается ключевое слово 'schedule'")?;
+
+        let cron_token = self.consume(&TokenType::String(String::new()), "Ожидается строка расписания в формате cron")?;
+        let cron = match &cron_token.token_type {
+            TokenType::String(s) => s.clone(),
+            _ => return parser_error!("Невозможный случай при парсинге расписания", cron_token.line, cron_token.column),
+        };
+        if let Err(e) = Cron::parse(&cron) {
+            return parser_error!(format!("Неверное расписание \"{}\": {}", cron, e), cron_token.line, cron_token.column);
+        }
+
+        let body = self.block()?;
+        self.consume(&TokenType::Semicolon, "Ожидается ';' после блока расписания")?;
+
+        Ok(AstNode::Schedule {
+            cron,
+            body: Box::new(body),
+        })
+    }
+
+    /// Options between the HTTP method and the route body: `name` or `name(key = value, ...)`.
+    fn route_options(&mut self) -> Result<Vec<RouteOption>> {
+        let mut options = Vec::new();
+
+        while self.check(&TokenType::Identifier(String::new())) {
+            let name_token = self.advance().clone();
+            let name = match name_token.token_type {
+                TokenType::Identifier(name) => name,
+                _ => return parser_error!("Невозможный случай при парсинге опции маршрута", name_token.line, name_token.column),
+            };
+
+            let mut args = Vec::new();
+            if self.match_token(&TokenType::LParen) {
+                while !self.check(&TokenType::RParen) && !self.is_at_end() {
+                    let key = self.route_option_key()?;
+                    self.consume(&TokenType::Equals, &format!("Ожидается '=' после '{}'", key))?;
+                    let value = self.option_value()?;
+                    args.push((key, value));
+
+                    if !self.match_token(&TokenType::Comma) {
+                        break;
+                    }
+                }
+                self.consume(&TokenType::RParen, &format!("Ожидается ')' после параметров опции '{}'", name))?;
+            }
+
+            options.push(RouteOption {
+                name,
+                args,
+                line: name_token.line,
+                column: name_token.column,
+            });
+        }
+
+        Ok(options)
+    }
+
+    fn route_option_key(&mut self) -> Result<String> {
+        let token = self.advance().clone();
+        match &token.token_type {
+            TokenType::Identifier(key) => Ok(key.clone()),
+            // Keywords such as `host` or `port` are valid option keys too.
+            other => {
+                let key = token.to_string();
+                if !key.is_empty() && key.chars().all(|c| c.is_alphanumeric() || c == '_') {
+                    Ok(key)
+                } else {
+                    parser_error!(format!("Ожидается имя параметра опции маршрута, получено {:?}", other), token.line, token.column)
+                }
+            }
+        }
+    }
+
+    fn option_value(&mut self) -> Result<OptionValue> {
+        let token = self.advance().clone();
+        match token.token_type {
+            TokenType::String(s) => Ok(OptionValue::String(s)),
+            TokenType::Number(n) => Ok(OptionValue::Number(n)),
+            TokenType::Identifier(ident) if ident == "true" => Ok(OptionValue::Boolean(true)),
+            TokenType::Identifier(ident) if ident == "false" => Ok(OptionValue::Boolean(false)),
+            TokenType::LBracket => {
+                let mut items = Vec::new();
+                while !self.check(&TokenType::RBracket) && !self.is_at_end() {
+                    let item = self.advance().clone();
+                    match item.token_type {
+                        TokenType::String(s) => items.push(s),
+                        other => return parser_error!(
+                            format!("Ожидается строка в списке, получено {:?}", other),
+                            item.line,
+                            item.column
+                        ),
+                    }
+                    if !self.match_token(&TokenType::Comma) {
+                        break;
+                    }
+                }
+                self.consume(&TokenType::RBracket, "Ожидается ']' после списка")?;
+                Ok(OptionValue::List(items))
+            }
+            other => parser_error!(
+                format!("Ожидается строка, число, true/false или список строк, получено {:?}", other),
+                token.line,
+                token.column
+            ),
+        }
+    }
+
     fn error_handler(&mut self) -> Result<AstNode> {
         self.consume(&TokenType::LParen, "Ожидается '(' после 'on_error'")?;
 
@@ -4,6 +4,8 @@ use std::fmt;
 pub enum TokenType {
     Route,              // route
     Middleware,         // middleware
+    Job,                // job
+    Schedule,           // schedule
     Val,                // val
     Var,                // var
     If,                 // if
@@ -79,6 +81,8 @@ impl fmt::Display for Token {
         match &self.token_type {
             TokenType::Route => write!(f, "route"),
             TokenType::Middleware => write!(f, "middleware"),
+            TokenType::Job => write!(f, "job"),
+            TokenType::Schedule => write!(f, "schedule"),
             TokenType::Val => write!(f, "val"),
             TokenType::Var => write!(f, "var"),
             TokenType::If => write!(f, "if"),
@@ -1,5 +1,9 @@
 use serde::{Deserialize, Serialize};
 use servers::TlsConfig;
+use servers::scheduler::TenantStats;
+use servers::slow_log::SlowRequestLog;
+use servers::timing::TimingStats;
+use servers::traffic::TrafficReport;
 use std::collections::HashMap;
 use std::error::Error as StdError;
 use std::fmt;
@@ -8,9 +12,12 @@ use crate::language::interpreter::OBJECT_REGISTRY;
 use crate::language::interpreter::builtin;
 use crate::language::interpreter::builtin::localization::I18N;
 use crate::language::interpreter::builtin::localization::I18n;
+use crate::language::ast::AstNode;
 use crate::language::parse;
 use crate::language::Interpreter;
 
+pub mod jobs;
+pub mod kv;
 pub mod language;
 pub mod servers;
 mod utils;
@@ -22,7 +29,13 @@ pub enum Command {
     StopServer { server_id: String },
     GetServerStatus { server_id: String },
     GetAllServersStatus,
+    ReloadPlugins { server_id: String, force: bool },
     CheckForUpdate,
+    GetSchedulerStats,
+    GetRequestTimings,
+    GetSlowRequests,
+    /// Keeps the connection open and answers with `Response::Traffic` every `interval`.
+    WatchTraffic { interval: std::time::Duration },
 }
 
 #[derive(Debug, Serialize, Deserialize, Clone)]
@@ -35,6 +48,11 @@ pub enum Response {
     UpdateAvailable(UpdateInfo),
     UpToDate(String),
     AllServersStatusReport(Vec<ServerInfo>),
+    PluginsReloaded(Vec<(String, u64)>),
+    SchedulerStats(Vec<TenantStats>),
+    RequestTimings(Vec<TimingStats>),
+    SlowRequests(Vec<SlowRequestLog>),
+    Traffic(TrafficReport),
     Error(CoreError),
 }
 
@@ -108,9 +126,128 @@ pub enum CoreExecutionResult {
     StartHttpServer {
         interpreter: Interpreter,
         tls_config: Option<TlsConfig>,
+        compiled: CompiledConfig,
     },
 }
 
+/// Layout of the encoded AST in [`CompiledConfig`]. Bump it whenever `AstNode` or a type
+/// inside it changes, bincode can't tell an old layout from a new one by itself.
+const AST_VERSION: u32 = 1;
+
+/// Config of a server in the form the service keeps between runs: the source and the
+/// AST parsed from it. A restarted daemon interprets the AST without parsing again.
+///
+/// The AST is kept as opaque bytes, so the config still loads when the AST changes between
+/// versions. Only a config whose AST can't be used is parsed again from `source`.
+#[derive(Debug, Serialize, Deserialize, Clone)]
+pub struct CompiledConfig {
+    /// Version of netter_core that parsed `ast`.
+    pub core_version: String,
+    pub source: String,
+    /// [`AST_VERSION`] of `ast`.
+    pub ast_version: u32,
+    /// `AstNode` encoded with bincode.
+    pub ast: Vec<u8>,
+}
+
+impl CompiledConfig {
+    /// Parses `source`, returning the config to keep and the AST to interpret now.
+    pub fn compile(source: String) -> Result<(Self, AstNode), CoreError> {
+        let ast = parse(&source)
+            .map_err(|e| CoreError::ConfigParseError(format!("Parsing error: {}", e)))?;
+        let encoded = bincode::serialize(&ast)
+            .map_err(|e| CoreError::SerializationError(format!("Failed to encode the AST: {}", e)))?;
+        let compiled = Self {
+            core_version: env!("CARGO_PKG_VERSION").to_string(),
+            source,
+            ast_version: AST_VERSION,
+            ast: encoded,
+        };
+        Ok((compiled, ast))
+    }
+
+    /// A config saved by an older layout of the state file, parsed again on restore.
+    pub fn from_source(core_version: String, source: String) -> Self {
+        Self { core_version, source, ast_version: 0, ast: Vec::new() }
+    }
+
+    /// The saved AST, or why it can't be used.
+    fn decode_ast(&self) -> Result<AstNode, String> {
+        if self.core_version != env!("CARGO_PKG_VERSION") {
+            return Err(format!("it was parsed by netter_core {}", self.core_version));
+        }
+        if self.ast_version != AST_VERSION {
+            return Err(format!("its AST has version {}, not {}", self.ast_version, AST_VERSION));
+        }
+        bincode::deserialize(&self.ast).map_err(|e| format!("its AST doesn't decode: {}", e))
+    }
+}
+
+/// Keeps compiled artifacts, such as wasm plugins, in `dir` so a restarted daemon loads
+/// them without compiling. Has to be called before the first server starts.
+pub fn set_compiled_cache_dir(dir: std::path::PathBuf) {
+    #[cfg(feature = "wasm-plugins")]
+    builtin::plugin_wasm::set_module_cache_dir(dir.join("wasm"));
+    #[cfg(not(feature = "wasm-plugins"))]
+    let _ = dir;
+}
+
+/// Maps the host's shared response and `Store` cache from `path`, so every process that
+/// passes the same file sees the same entries. Has to be called before the first server starts.
+pub fn set_shared_cache_path(path: std::path::PathBuf) {
+    servers::shared_cache::set_path(path);
+}
+
+/// Keeps the durable `Kv` entries of routes in `dir`. Has to be called before the first
+/// server starts.
+pub fn set_kv_dir(dir: std::path::PathBuf) {
+    kv::set_dir(dir);
+}
+
+/// Keeps the queued background jobs of routes in `dir`. Has to be called before the first
+/// server starts.
+pub fn set_jobs_dir(dir: std::path::PathBuf) {
+    jobs::set_dir(dir);
+}
+
+/// Prepares a server saved by the service for starting again. The saved AST is used as
+/// is, unless it was produced by another version of netter_core.
+///
+/// Blocks while plugins are loaded, call it off the async workers.
+pub fn restore_server(compiled: CompiledConfig) -> CoreExecutionResult {
+    match compiled.decode_ast() {
+        Ok(ast) => return interpret_config(compiled, &ast),
+        Err(reason) => info!("Saved config can't be used as is because {}, parsing it again", reason),
+    }
+
+    match CompiledConfig::compile(compiled.source) {
+        Ok((compiled, ast)) => interpret_config(compiled, &ast),
+        Err(e) => {
+            error!("Failed to parse saved config: {}", e);
+            CoreExecutionResult::CliResponse(Response::Error(e))
+        }
+    }
+}
+
+fn interpret_config(compiled: CompiledConfig, ast: &AstNode) -> CoreExecutionResult {
+    let mut interpreter = Interpreter::new();
+    match interpreter.interpret(ast) {
+        Ok(_) => {
+            info!("Interpretation successful. Preparing HTTP server response.");
+            let tls_config = interpreter.tls_config.clone();
+            CoreExecutionResult::StartHttpServer { interpreter, tls_config, compiled }
+        }
+        Err(e) => {
+            error!("Failed to interpret AST: {}", e);
+            CoreExecutionResult::CliResponse(
+                Response::Error(
+                    CoreError::ConfigParseError(format!("Interpretation error: {}", e))
+                )
+            )
+        }
+    }
+}
+
 pub fn init_backend() {
     rustls::crypto::ring::default_provider().install_default()
         .expect("Failed to install rustls crypto provider!");
@@ -132,33 +269,14 @@ pub async fn execute_core_command(command: Command) -> CoreExecutionResult {
             match config {
                 ConfigSource::CustomLangFileContent(content) => {
                     info!("Parsing Custom Language config...");
-                    match parse(&content) {
-                        Ok(ast) => {
+                    match CompiledConfig::compile(content) {
+                        Ok((compiled, ast)) => {
                             info!("Parsing successful. Interpreting AST...");
-                            let mut interpreter = Interpreter::new();
-                            match interpreter.interpret(&ast) {
-                                Ok(_) => {
-                                    info!("Interpretation successful. Preparing HTTP server response.");
-                                    let tls_config = interpreter.tls_config.clone();
-                                    CoreExecutionResult::StartHttpServer { interpreter, tls_config }
-                                }
-                                Err(e) => {
-                                    error!("Failed to interpret AST: {}", e);
-                                    CoreExecutionResult::CliResponse(
-                                        Response::Error(
-                                            CoreError::ConfigParseError(format!("Interpretation error: {}", e))
-                                        )
-                                    )
-                                }
-                            }
+                            interpret_config(compiled, &ast)
                         }
                         Err(e) => {
                             error!("Failed to parse custom language config: {}", e);
-                            CoreExecutionResult::CliResponse(
-                                Response::Error(
-                                    CoreError::ConfigParseError(format!("Parsing error: {}", e))
-                                )
-                            )
+                            CoreExecutionResult::CliResponse(Response::Error(e))
                         }
                     }
                 }
@@ -178,6 +296,10 @@ pub async fn execute_core_command(command: Command) -> CoreExecutionResult {
                 Response::Ok
             )
         }
+        Command::ReloadPlugins { .. } => {
+            info!("Core acknowledged ReloadPlugins command. Service will handle it.");
+            CoreExecutionResult::CliResponse(Response::Ok)
+        }
         Command::CheckForUpdate => {
             info!("Core processing CheckForUpdate command...");
             warn!("Update check functionality is not implemented.");
@@ -185,5 +307,21 @@ pub async fn execute_core_command(command: Command) -> CoreExecutionResult {
                 Response::UpToDate(env!("CARGO_PKG_VERSION").to_string())
             )
         }
+        Command::GetSchedulerStats => {
+            info!("Core collecting scheduler statistics...");
+            CoreExecutionResult::CliResponse(Response::SchedulerStats(servers::scheduler::stats()))
+        }
+        Command::GetRequestTimings => {
+            info!("Core collecting request timings...");
+            CoreExecutionResult::CliResponse(Response::RequestTimings(servers::timing::stats()))
+        }
+        Command::GetSlowRequests => {
+            info!("Core collecting slow requests...");
+            CoreExecutionResult::CliResponse(Response::SlowRequests(servers::slow_log::stats()))
+        }
+        Command::WatchTraffic { .. } => {
+            info!("Core acknowledged WatchTraffic command. Service will handle it.");
+            CoreExecutionResult::CliResponse(Response::Ok)
+        }
     }
 }
\ No newline at end of file
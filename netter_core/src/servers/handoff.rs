@@ -0,0 +1,485 @@
+use std::{collections::HashMap, io, mem, os::{fd::{AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd}, unix::{ffi::OsStrExt, fs::PermissionsExt}}, path::Path, ptr, sync::{Mutex, MutexGuard, OnceLock, atomic::{AtomicBool, Ordering}}, time::Duration};
+use log::{info, warn};
+use tokio::{io::unix::AsyncFd, sync::watch};
+
+/// Longest listen address a handoff message may carry.
+const MAX_KEY_LEN: usize = 4096;
+const DONE: &[u8] = b"done";
+const READY: &[u8] = b"ready";
+
+static LISTENERS: OnceLock<Mutex<HashMap<String, OwnedFd>>> = OnceLock::new();
+static INHERITED: OnceLock<Mutex<HashMap<String, OwnedFd>>> = OnceLock::new();
+static DRAIN: OnceLock<watch::Sender<bool>> = OnceLock::new();
+static TOOK_OVER: AtomicBool = AtomicBool::new(false);
+
+fn listeners() -> MutexGuard<'static, HashMap<String, OwnedFd>> {
+    lock(&LISTENERS)
+}
+
+fn inherited() -> MutexGuard<'static, HashMap<String, OwnedFd>> {
+    lock(&INHERITED)
+}
+
+fn lock(map: &'static OnceLock<Mutex<HashMap<String, OwnedFd>>>) -> MutexGuard<'static, HashMap<String, OwnedFd>> {
+    map.get_or_init(|| Mutex::new(HashMap::new()))
+        .lock()
+        .unwrap_or_else(|poisoned| poisoned.into_inner())
+}
+
+fn drain_channel() -> &'static watch::Sender<bool> {
+    DRAIN.get_or_init(|| watch::channel(false).0)
+}
+
+/// Keeps a copy of a server's listening socket, so it can be handed to the next daemon.
+/// `key` is the address the server listens on.
+pub fn register(key: String, socket: BorrowedFd<'_>) -> io::Result<()> {
+    let socket = socket.try_clone_to_owned()?;
+    listeners().insert(key, socket);
+    Ok(())
+}
+
+/// Forgets the socket of a server that stopped, so its address is released.
+pub fn unregister(key: &str) {
+    listeners().remove(key);
+}
+
+/// Listening socket for `key` received from the previous daemon, taken at most once.
+pub fn take_inherited(key: &str) -> Option<OwnedFd> {
+    inherited().remove(key)
+}
+
+/// Closes the received sockets that no server took, keeping those `keep` accepts.
+/// Clients would otherwise wait on them forever.
+pub fn release_inherited(keep: impl Fn(&str) -> bool) {
+    inherited().retain(|key, _| {
+        let kept = keep(key);
+        if !kept {
+            warn!("[HTTP Server :: Handoff] No server took the socket of {}, closing it", key);
+        }
+        kept
+    });
+}
+
+/// Whether this process took its listening sockets over from a previous daemon.
+pub fn took_over() -> bool {
+    TOOK_OVER.load(Ordering::Relaxed)
+}
+
+/// Stops all servers of the process once their sockets are served by the new daemon.
+/// Open connections finish their requests, new ones go to the new daemon.
+pub fn drain() {
+    drain_channel().send_replace(true);
+}
+
+pub fn draining() -> bool {
+    *drain_channel().borrow()
+}
+
+/// Resolves once [`drain`] was called.
+pub async fn drained() {
+    let mut rx = drain_channel().subscribe();
+    let _ = rx.wait_for(|draining| *draining).await;
+}
+
+/// Socket on which a running daemon waits for its successor.
+///
+/// The successor connects, receives copies of all listening sockets over `SCM_RIGHTS`
+/// and starts serving on them. The kernel queues new connections on the shared sockets
+/// while nobody accepts, so none are refused during the switch.
+pub struct HandoffListener {
+    socket: AsyncFd<OwnedFd>,
+}
+
+impl HandoffListener {
+    /// Replaces the socket of a previous daemon at `path`, that daemon keeps its own
+    /// listener but can't be reached through the path anymore.
+    pub fn bind(path: &Path) -> io::Result<Self> {
+        match std::fs::remove_file(path) {
+            Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+            _ => {}
+        }
+
+        let socket = seqpacket_socket(libc::SOCK_NONBLOCK)?;
+        let (addr, len) = socket_addr(path)?;
+        // SAFETY: `addr` is a valid `sockaddr_un` of `len` bytes.
+        cvt(unsafe { libc::bind(socket.as_raw_fd(), ptr::from_ref(&addr).cast(), len) })?;
+        // Whoever connects gets the listening sockets of all servers. Until this chmod the
+        // mode comes from the umask, `accept` checks the peer's user as well.
+        std::fs::set_permissions(path, std::fs::Permissions::from_mode(0o600))?;
+        cvt(unsafe { libc::listen(socket.as_raw_fd(), 1) })?;
+
+        Ok(Self { socket: AsyncFd::new(socket)? })
+    }
+
+    /// Waits for a successor run by the same user as this daemon (or by root). Other
+    /// processes are disconnected.
+    pub async fn accept(&self) -> io::Result<Handoff> {
+        loop {
+            let mut guard = self.socket.readable().await?;
+            let accepted = guard.try_io(|socket| {
+                // SAFETY: the peer address isn't needed, null pointers are allowed.
+                let fd = cvt(unsafe {
+                    libc::accept4(socket.as_raw_fd(), ptr::null_mut(), ptr::null_mut(), libc::SOCK_CLOEXEC)
+                })?;
+                // SAFETY: `accept4` returned a new descriptor that nothing else owns.
+                Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+            });
+            let Ok(result) = accepted else {
+                continue;
+            };
+
+            let socket = result?;
+            // SAFETY: `geteuid` can't fail.
+            let own = unsafe { libc::geteuid() };
+            match peer_uid(&socket) {
+                Ok(peer) if peer == own || peer == 0 => return Ok(Handoff { socket }),
+                Ok(peer) => warn!("[HTTP Server :: Handoff] Refusing a handoff to user {}, the daemon runs as user {}", peer, own),
+                Err(e) => warn!("[HTTP Server :: Handoff] Failed to check the user of a successor, refusing it: {}", e),
+            }
+        }
+    }
+}
+
+/// Connection between the daemon that hands its sockets over and its successor.
+/// All calls block, run them off the async workers.
+pub struct Handoff {
+    socket: OwnedFd,
+}
+
+impl Handoff {
+    /// Connects to the running daemon. `timeout` bounds every later wait for it.
+    pub fn connect(path: &Path, timeout: Duration) -> io::Result<Self> {
+        let socket = seqpacket_socket(0)?;
+        let (addr, len) = socket_addr(path)?;
+        // SAFETY: `addr` is a valid `sockaddr_un` of `len` bytes.
+        cvt(unsafe { libc::connect(socket.as_raw_fd(), ptr::from_ref(&addr).cast(), len) })?;
+        let handoff = Self { socket };
+        handoff.set_timeout(timeout)?;
+        Ok(handoff)
+    }
+
+    pub fn set_timeout(&self, timeout: Duration) -> io::Result<()> {
+        let tv = libc::timeval {
+            tv_sec: timeout.as_secs() as libc::time_t,
+            tv_usec: timeout.subsec_micros() as libc::suseconds_t,
+        };
+        for option in [libc::SO_RCVTIMEO, libc::SO_SNDTIMEO] {
+            // SAFETY: `tv` is a valid `timeval` for both options.
+            cvt(unsafe {
+                libc::setsockopt(
+                    self.socket.as_raw_fd(),
+                    libc::SOL_SOCKET,
+                    option,
+                    ptr::from_ref(&tv).cast(),
+                    mem::size_of::<libc::timeval>() as libc::socklen_t,
+                )
+            })?;
+        }
+        Ok(())
+    }
+
+    /// Sends the listening sockets of all running servers. Returns how many were sent.
+    pub fn send_listeners(&self) -> io::Result<usize> {
+        let sockets: Vec<(String, OwnedFd)> = listeners().iter()
+            .map(|(key, socket)| Ok((key.clone(), socket.try_clone()?)))
+            .collect::<io::Result<_>>()?;
+
+        for (key, socket) in &sockets {
+            send(&self.socket, key.as_bytes(), &[socket.as_raw_fd()])?;
+        }
+        send(&self.socket, DONE, &[])?;
+        Ok(sockets.len())
+    }
+
+    /// Receives the listening sockets of the previous daemon, servers started afterwards
+    /// take them with [`take_inherited`] instead of binding.
+    pub fn receive_listeners(&self) -> io::Result<usize> {
+        let mut received = HashMap::new();
+        let mut buf = vec![0; MAX_KEY_LEN];
+        loop {
+            let (len, socket) = recv(&self.socket, &mut buf)?;
+            let message = &buf[..len];
+            if message == DONE && socket.is_none() {
+                break;
+            }
+            let (Ok(key), Some(socket)) = (std::str::from_utf8(message), socket) else {
+                return Err(io::Error::new(io::ErrorKind::InvalidData, "unexpected handoff message"));
+            };
+            received.insert(key.to_string(), socket);
+        }
+
+        let count = received.len();
+        inherited().extend(received);
+        TOOK_OVER.store(true, Ordering::Relaxed);
+        info!("[HTTP Server :: Handoff] Received {} listening socket(s)", count);
+        Ok(count)
+    }
+
+    /// Tells the previous daemon that this one serves, so it can drain and exit.
+    pub fn confirm(&self) -> io::Result<()> {
+        send(&self.socket, READY, &[])
+    }
+
+    /// Waits for [`Handoff::confirm`] from the successor. On an error the successor didn't
+    /// start and this daemon keeps serving.
+    pub fn wait_confirmed(&self) -> io::Result<()> {
+        let mut buf = [0; 16];
+        let (len, socket) = recv(&self.socket, &mut buf)?;
+        if &buf[..len] != READY || socket.is_some() {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "unexpected handoff message"));
+        }
+        Ok(())
+    }
+}
+
+fn seqpacket_socket(flags: libc::c_int) -> io::Result<OwnedFd> {
+    // SAFETY: plain socket creation, the result is checked.
+    let fd = cvt(unsafe { libc::socket(libc::AF_UNIX, libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC | flags, 0) })?;
+    // SAFETY: `socket` returned a new descriptor that nothing else owns.
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+/// User of the process on the other end of a connected Unix socket.
+fn peer_uid(socket: &OwnedFd) -> io::Result<libc::uid_t> {
+    // SAFETY: all-zero bytes are a valid `ucred`.
+    let mut cred: libc::ucred = unsafe { mem::zeroed() };
+    let mut len = mem::size_of::<libc::ucred>() as libc::socklen_t;
+    // SAFETY: `cred` and `len` describe a valid buffer for `SO_PEERCRED`.
+    cvt(unsafe {
+        libc::getsockopt(socket.as_raw_fd(), libc::SOL_SOCKET, libc::SO_PEERCRED, ptr::from_mut(&mut cred).cast(), &mut len)
+    })?;
+    Ok(cred.uid)
+}
+
+fn socket_addr(path: &Path) -> io::Result<(libc::sockaddr_un, libc::socklen_t)> {
+    // SAFETY: all-zero bytes are a valid `sockaddr_un`.
+    let mut addr: libc::sockaddr_un = unsafe { mem::zeroed() };
+    addr.sun_family = libc::AF_UNIX as libc::sa_family_t;
+
+    let bytes = path.as_os_str().as_bytes();
+    // One byte stays zero to terminate the path.
+    if bytes.len() >= addr.sun_path.len() {
+        return Err(io::Error::new(io::ErrorKind::InvalidInput, format!("socket path '{}' is too long", path.display())));
+    }
+    for (dst, src) in addr.sun_path.iter_mut().zip(bytes) {
+        *dst = *src as libc::c_char;
+    }
+
+    let len = mem::size_of::<libc::sa_family_t>() + bytes.len() + 1;
+    Ok((addr, len as libc::socklen_t))
+}
+
+fn cmsg_space(fds: usize) -> usize {
+    // SAFETY: only computes a size.
+    unsafe { libc::CMSG_SPACE((fds * mem::size_of::<RawFd>()) as u32) as usize }
+}
+
+/// Sends one message, with `fds` attached as `SCM_RIGHTS`. Handoff messages carry at
+/// most one, [`recv`] rejects more.
+fn send(socket: &OwnedFd, data: &[u8], fds: &[RawFd]) -> io::Result<()> {
+    let mut iov = libc::iovec { iov_base: data.as_ptr() as *mut libc::c_void, iov_len: data.len() };
+    // u64 keeps the control buffer aligned for `cmsghdr`.
+    let mut control = vec![0u64; cmsg_space(fds.len()).div_ceil(8)];
+
+    // SAFETY: all-zero bytes are a valid `msghdr`, the pointers set below outlive the call.
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+
+    if !fds.is_empty() {
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = cmsg_space(fds.len()) as _;
+        // SAFETY: the control buffer has room for one header carrying all descriptors.
+        unsafe {
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN((fds.len() * mem::size_of::<RawFd>()) as u32) as _;
+            let data = libc::CMSG_DATA(cmsg).cast::<RawFd>();
+            for (i, fd) in fds.iter().enumerate() {
+                ptr::write_unaligned(data.add(i), *fd);
+            }
+        }
+    }
+
+    // SAFETY: `msg` points to valid buffers.
+    let sent = cvt_size(unsafe { libc::sendmsg(socket.as_raw_fd(), &msg, libc::MSG_NOSIGNAL) })?;
+    if sent != data.len() {
+        return Err(io::Error::new(io::ErrorKind::WriteZero, "handoff message was cut short"));
+    }
+    Ok(())
+}
+
+/// Receives one message into `buf`, with the descriptor attached to it.
+fn recv(socket: &OwnedFd, buf: &mut [u8]) -> io::Result<(usize, Option<OwnedFd>)> {
+    let mut iov = libc::iovec { iov_base: buf.as_mut_ptr().cast(), iov_len: buf.len() };
+    // Room for one descriptor, more are cut off and reported with `MSG_CTRUNC`.
+    let mut control = vec![0u64; cmsg_space(1).div_ceil(8)];
+
+    // SAFETY: all-zero bytes are a valid `msghdr`, the pointers set below outlive the call.
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr().cast();
+    msg.msg_controllen = cmsg_space(1) as _;
+
+    // SAFETY: `msg` points to valid buffers.
+    let len = cvt_size(unsafe { libc::recvmsg(socket.as_raw_fd(), &mut msg, libc::MSG_CMSG_CLOEXEC) })
+        .map_err(|e| match e.kind() {
+            io::ErrorKind::WouldBlock => io::Error::new(io::ErrorKind::TimedOut, "the other daemon didn't answer in time"),
+            _ => e,
+        })?;
+
+    // Take ownership of received descriptors first, so they are closed on any error below.
+    let mut fds = Vec::new();
+    // SAFETY: the kernel filled the control buffer, the headers are walked within it.
+    unsafe {
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let data = libc::CMSG_DATA(cmsg).cast::<RawFd>();
+                let count = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize) / mem::size_of::<RawFd>();
+                for i in 0..count {
+                    fds.push(OwnedFd::from_raw_fd(ptr::read_unaligned(data.add(i))));
+                }
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+    }
+
+    if len == 0 && fds.is_empty() {
+        return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "the other daemon closed the handoff"));
+    }
+    if msg.msg_flags & (libc::MSG_TRUNC | libc::MSG_CTRUNC) != 0 || fds.len() > 1 {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "handoff message is too large"));
+    }
+    Ok((len, fds.pop()))
+}
+
+fn cvt(result: libc::c_int) -> io::Result<libc::c_int> {
+    if result < 0 { Err(io::Error::last_os_error()) } else { Ok(result) }
+}
+
+fn cvt_size(result: libc::ssize_t) -> io::Result<usize> {
+    if result < 0 { Err(io::Error::last_os_error()) } else { Ok(result as usize) }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{net::TcpListener, os::fd::AsFd};
+
+    fn pair() -> (OwnedFd, OwnedFd) {
+        let mut fds = [0; 2];
+        // SAFETY: `fds` has room for the two descriptors.
+        cvt(unsafe { libc::socketpair(libc::AF_UNIX, libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC, 0, fds.as_mut_ptr()) }).unwrap();
+        // SAFETY: `socketpair` returned two new descriptors that nothing else owns.
+        unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) }
+    }
+
+    fn invalid_data(result: io::Result<impl std::fmt::Debug>) {
+        assert_eq!(result.unwrap_err().kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[test]
+    fn key_and_socket_arrive_together() {
+        let (a, b) = pair();
+        let tcp = TcpListener::bind("127.0.0.1:0").unwrap();
+
+        send(&a, b"127.0.0.1:8080", &[tcp.as_raw_fd()]).unwrap();
+        let mut buf = [0; MAX_KEY_LEN];
+        let (len, socket) = recv(&b, &mut buf).unwrap();
+
+        assert_eq!(&buf[..len], b"127.0.0.1:8080");
+        let received = TcpListener::from(socket.expect("socket attached"));
+        assert_eq!(received.local_addr().unwrap(), tcp.local_addr().unwrap());
+    }
+
+    #[test]
+    fn listeners_are_handed_over_and_confirmed() {
+        let (a, b) = pair();
+        let tcp = TcpListener::bind("127.0.0.1:0").unwrap();
+        let key = format!("handoff-test:{}", tcp.local_addr().unwrap());
+        register(key.clone(), tcp.as_fd()).unwrap();
+
+        let old = Handoff { socket: a };
+        let new = Handoff { socket: b };
+        let sender = std::thread::spawn(move || {
+            let sent = old.send_listeners().unwrap();
+            old.wait_confirmed().unwrap();
+            sent
+        });
+
+        assert_eq!(new.receive_listeners().unwrap(), 1);
+        new.confirm().unwrap();
+        assert_eq!(sender.join().unwrap(), 1);
+        unregister(&key);
+
+        assert!(took_over());
+        let inherited = TcpListener::from(take_inherited(&key).expect("inherited socket"));
+        assert_eq!(inherited.local_addr().unwrap(), tcp.local_addr().unwrap());
+        assert!(take_inherited(&key).is_none());
+    }
+
+    #[test]
+    fn truncated_message_is_rejected() {
+        let (a, b) = pair();
+        send(&a, &[b'k'; 64], &[]).unwrap();
+        invalid_data(recv(&b, &mut [0; 16]));
+    }
+
+    #[test]
+    fn several_sockets_in_one_message_are_rejected() {
+        let (a, b) = pair();
+        let (first, second) = (TcpListener::bind("127.0.0.1:0").unwrap(), TcpListener::bind("127.0.0.1:0").unwrap());
+        send(&a, b"127.0.0.1:8080", &[first.as_raw_fd(), second.as_raw_fd()]).unwrap();
+        invalid_data(recv(&b, &mut [0; MAX_KEY_LEN]));
+    }
+
+    #[test]
+    fn unexpected_messages_fail_the_handoff() {
+        let (a, b) = pair();
+        let (old, new) = (Handoff { socket: a }, Handoff { socket: b });
+
+        // A key always comes with its socket.
+        send(&old.socket, b"127.0.0.1:8080", &[]).unwrap();
+        invalid_data(new.receive_listeners());
+
+        send(&new.socket, b"later", &[]).unwrap();
+        invalid_data(old.wait_confirmed());
+    }
+
+    #[test]
+    fn closed_peer_ends_the_handoff() {
+        let (a, b) = pair();
+        drop(a);
+        let error = recv(&b, &mut [0; 16]).unwrap_err();
+        assert_eq!(error.kind(), io::ErrorKind::UnexpectedEof);
+    }
+
+    #[test]
+    fn silent_peer_times_out() {
+        let (a, b) = pair();
+        let new = Handoff { socket: b };
+        new.set_timeout(Duration::from_millis(20)).unwrap();
+        assert_eq!(new.receive_listeners().unwrap_err().kind(), io::ErrorKind::TimedOut);
+        drop(a);
+    }
+
+    #[tokio::test]
+    async fn listener_is_private_and_accepts_its_own_user() {
+        let path = std::env::temp_dir().join(format!("netter-handoff-{}.sock", std::process::id()));
+        let listener = HandoffListener::bind(&path).unwrap();
+        assert_eq!(std::fs::metadata(&path).unwrap().permissions().mode() & 0o777, 0o600);
+
+        let connect_path = path.clone();
+        let successor = tokio::task::spawn_blocking(move || {
+            let handoff = Handoff::connect(&connect_path, Duration::from_secs(5)).unwrap();
+            handoff.confirm().unwrap();
+        });
+        let handoff = listener.accept().await.unwrap();
+        tokio::task::spawn_blocking(move || handoff.wait_confirmed()).await.unwrap().unwrap();
+        successor.await.unwrap();
+        std::fs::remove_file(&path).unwrap();
+    }
+}
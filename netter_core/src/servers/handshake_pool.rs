@@ -0,0 +1,226 @@
+use std::{future::Future, io, pin::Pin, sync::{Arc, atomic::{AtomicU64, AtomicUsize, Ordering}}, task::{Context, Poll}, time::Duration};
+use axum_server::accept::Accept;
+use futures_util::{FutureExt, future::BoxFuture};
+use log::{info, warn};
+use serde::{Deserialize, Serialize};
+use tokio::{runtime::{Handle, Runtime}, sync::Semaphore, task::JoinHandle, time::Instant};
+use super::HandshakePoolConfig;
+
+/// Threads that run TLS handshakes, apart from the workers that serve requests.
+///
+/// A full handshake costs far more CPU than a typical request. When many clients reconnect
+/// at once, running them here keeps the request workers free for established connections.
+/// At most `max_in_flight` handshakes run at a time, the others wait in a queue.
+#[derive(Debug, Clone)]
+pub struct HandshakePool {
+    inner: Arc<PoolInner>,
+}
+
+#[derive(Debug)]
+struct PoolInner {
+    runtime: Option<Runtime>,
+    handle: Handle,
+    permits: Arc<Semaphore>,
+    max_in_flight: usize,
+    queued: AtomicUsize,
+    in_flight: AtomicUsize,
+    completed: AtomicU64,
+    failed: AtomicU64,
+    saturated: AtomicU64,
+    queue_wait_us: AtomicU64,
+}
+
+/// Snapshot of the handshake pool counters.
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize)]
+pub struct HandshakeStats {
+    /// Handshakes waiting for a free slot.
+    pub queued: usize,
+    /// Handshakes running right now.
+    pub in_flight: usize,
+    pub completed: u64,
+    /// Failed, timed out or abandoned by the client.
+    pub failed: u64,
+    /// Handshakes that had to wait because all slots were taken.
+    pub saturated: u64,
+    /// Time all handshakes spent in the queue.
+    pub queue_wait: Duration,
+}
+
+impl HandshakePool {
+    pub fn new(config: HandshakePoolConfig) -> io::Result<Self> {
+        let runtime = tokio::runtime::Builder::new_multi_thread()
+            .worker_threads(config.threads)
+            .thread_name("netter-tls-handshake")
+            .enable_all()
+            .build()?;
+        info!("[HTTP Server :: Handshakes] Running TLS handshakes on {} thread(s), at most {} at a time",
+            config.threads, config.max_in_flight);
+
+        Ok(Self {
+            inner: Arc::new(PoolInner {
+                handle: runtime.handle().clone(),
+                runtime: Some(runtime),
+                permits: Arc::new(Semaphore::new(config.max_in_flight)),
+                max_in_flight: config.max_in_flight,
+                queued: AtomicUsize::new(0),
+                in_flight: AtomicUsize::new(0),
+                completed: AtomicU64::new(0),
+                failed: AtomicU64::new(0),
+                saturated: AtomicU64::new(0),
+                queue_wait_us: AtomicU64::new(0),
+            }),
+        })
+    }
+
+    pub fn stats(&self) -> HandshakeStats {
+        let inner = &self.inner;
+        HandshakeStats {
+            queued: inner.queued.load(Ordering::Relaxed),
+            in_flight: inner.in_flight.load(Ordering::Relaxed),
+            completed: inner.completed.load(Ordering::Relaxed),
+            failed: inner.failed.load(Ordering::Relaxed),
+            saturated: inner.saturated.load(Ordering::Relaxed),
+            queue_wait: Duration::from_micros(inner.queue_wait_us.load(Ordering::Relaxed)),
+        }
+    }
+
+    /// Runs `handshake` on the pool once a slot is free.
+    ///
+    /// Dropping the returned future (for example on `header_timeout`) cancels the handshake.
+    pub async fn run<F, T>(&self, handshake: F) -> io::Result<T>
+    where
+        F: Future<Output = io::Result<T>> + Send + 'static,
+        T: Send + 'static,
+    {
+        let inner = &self.inner;
+        // Counted as failed until it completes, so abandoned handshakes show up too.
+        let outcome = Outcome { inner, done: false };
+
+        let permit = match inner.permits.clone().try_acquire_owned() {
+            Ok(permit) => permit,
+            Err(_) => {
+                let saturated = inner.saturated.fetch_add(1, Ordering::Relaxed) + 1;
+                if saturated == 1 || saturated % 1000 == 0 {
+                    warn!("[HTTP Server :: Handshakes] All {} handshake slots are busy, {} handshakes queued so far",
+                        inner.max_in_flight, saturated);
+                }
+
+                let queued_at = Instant::now();
+                let _queued = Gauge::enter(&inner.queued);
+                let permit = inner.permits.clone().acquire_owned().await
+                    .map_err(|_| io::Error::new(io::ErrorKind::Other, "handshake pool is closed"))?;
+                inner.queue_wait_us.fetch_add(queued_at.elapsed().as_micros() as u64, Ordering::Relaxed);
+                permit
+            }
+        };
+
+        let _in_flight = Gauge::enter(&inner.in_flight);
+        let task = AbortOnDrop(inner.handle.spawn(async move {
+            let _permit = permit;
+            handshake.await
+        }));
+
+        let result = match task.await {
+            Ok(result) => result,
+            Err(e) => Err(io::Error::new(io::ErrorKind::Other, format!("handshake task failed: {}", e))),
+        };
+        if result.is_ok() {
+            outcome.succeed();
+        }
+        result
+    }
+}
+
+impl Drop for PoolInner {
+    fn drop(&mut self) {
+        // Dropping a runtime blocks, which isn't allowed inside the server's own runtime.
+        if let Some(runtime) = self.runtime.take() {
+            runtime.shutdown_background();
+        }
+    }
+}
+
+/// Wraps the TLS acceptor of a server so handshakes run on a [`HandshakePool`].
+/// Without a pool handshakes run where the connection was accepted.
+#[derive(Debug, Clone)]
+pub struct PooledAcceptor<A> {
+    inner: A,
+    pool: Option<HandshakePool>,
+}
+
+impl<A> PooledAcceptor<A> {
+    pub fn new(inner: A, pool: Option<HandshakePool>) -> Self {
+        Self { inner, pool }
+    }
+}
+
+impl<A, I, S> Accept<I, S> for PooledAcceptor<A>
+where
+    A: Accept<I, S>,
+    A::Future: Send + 'static,
+    A::Stream: Send + 'static,
+    A::Service: Send + 'static,
+{
+    type Stream = A::Stream;
+    type Service = A::Service;
+    type Future = BoxFuture<'static, io::Result<(Self::Stream, Self::Service)>>;
+
+    fn accept(&self, stream: I, service: S) -> Self::Future {
+        let handshake = self.inner.accept(stream, service);
+        match self.pool.clone() {
+            Some(pool) => async move { pool.run(handshake).await }.boxed(),
+            None => handshake.boxed(),
+        }
+    }
+}
+
+struct Gauge<'a>(&'a AtomicUsize);
+
+impl<'a> Gauge<'a> {
+    fn enter(gauge: &'a AtomicUsize) -> Self {
+        gauge.fetch_add(1, Ordering::Relaxed);
+        Self(gauge)
+    }
+}
+
+impl Drop for Gauge<'_> {
+    fn drop(&mut self) {
+        self.0.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+struct Outcome<'a> {
+    inner: &'a PoolInner,
+    done: bool,
+}
+
+impl Outcome<'_> {
+    fn succeed(mut self) {
+        self.done = true;
+        self.inner.completed.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+impl Drop for Outcome<'_> {
+    fn drop(&mut self) {
+        if !self.done {
+            self.inner.failed.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+struct AbortOnDrop<T>(JoinHandle<T>);
+
+impl<T> Future for AbortOnDrop<T> {
+    type Output = Result<T, tokio::task::JoinError>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        Pin::new(&mut self.0).poll(cx)
+    }
+}
+
+impl<T> Drop for AbortOnDrop<T> {
+    fn drop(&mut self) {
+        self.0.abort();
+    }
+}
@@ -1,14 +1,81 @@
-use std::{collections::HashMap, net::SocketAddr, sync::{Arc, Mutex}, time::Duration};
+use std::{collections::HashMap, fmt, io, net::{SocketAddr, TcpListener}, path::PathBuf, sync::{Arc, RwLock}, time::Duration};
 use axum::{Router, body::Body, extract::{Request, State}, response::IntoResponse, routing::any};
 use axum_server::Handle;
 use http_body_util::BodyExt;
-use hyper::{HeaderMap, StatusCode, header::CONTENT_LENGTH};
+use hyper::{HeaderMap, Method, StatusCode, Version, body::Bytes, header::{CONNECTION, CONTENT_LENGTH, HeaderValue, TRANSFER_ENCODING}};
 use log::{error, warn, info};
 use rustls::ServerConfig;
-use tokio::sync::mpsc;
+use tokio::{sync::{Notify, Semaphore, mpsc}, time::Instant};
 use derive_more::Debug;
-use super::TlsConfig;
-use crate::{CoreError, language::{Interpreter, interpreter::builtin::request::HttpBodyVariant}, servers::{Server, load_rustls_config}};
+use super::{HandshakePoolConfig, SchedulingPolicy, ServerLimits, SlowRequestConfig, TlsConfig, TraceConfig};
+use super::http_response::{BufferedResponse, streamed_response};
+use super::handshake_pool::{HandshakePool, PooledAcceptor};
+use super::limits::{ConnectionLimiter, LimitedAcceptor, configure_builder};
+#[cfg(target_os = "linux")]
+use super::ktls::KtlsAcceptor;
+use super::scheduler::{self, Tenant};
+use super::shared_cache;
+use super::single_flight::SingleFlight;
+use super::slow_log::{self, SlowLog};
+use super::timing::{self, Phase, Phases, RequestTimer, ServerTimings};
+use super::trace::{self, RequestSpan, RouteTrace, Tracer};
+use super::traffic::{self, RequestTraffic, ServerTraffic};
+use crate::{CoreError, language::{Interpreter, interpreter::{builtin::{request::HttpBodyVariant, response_stream::{ResponseStream, StreamFrame, StreamMode}}, route_options::BodyRead}}, servers::{Server, load_rustls_config}};
+
+/// Address a server listens on: `host:port`, or `unix:<path>` for a Unix domain socket.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum ListenAddr {
+    Tcp(SocketAddr),
+    Unix(PathBuf),
+}
+
+impl ListenAddr {
+    pub const UNIX_PREFIX: &'static str = "unix:";
+
+    pub fn parse(addr: &str) -> Option<Self> {
+        match addr.strip_prefix(Self::UNIX_PREFIX) {
+            Some(path) if !path.is_empty() => Some(ListenAddr::Unix(PathBuf::from(path))),
+            Some(_) => None,
+            None => addr.parse().ok().map(ListenAddr::Tcp),
+        }
+    }
+}
+
+impl fmt::Display for ListenAddr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            ListenAddr::Tcp(addr) => write!(f, "{}", addr),
+            ListenAddr::Unix(path) => write!(f, "{}{}", Self::UNIX_PREFIX, path.display()),
+        }
+    }
+}
+
+/// Listening socket of a server. It stays open across restarts of the server instance,
+/// so connections wait in the backlog instead of being refused.
+enum Listener {
+    Tcp(TcpListener),
+    #[cfg(unix)]
+    Unix(std::os::unix::net::UnixListener),
+}
+
+impl Listener {
+    fn try_clone(&self) -> io::Result<Self> {
+        match self {
+            Listener::Tcp(listener) => listener.try_clone().map(Listener::Tcp),
+            #[cfg(unix)]
+            Listener::Unix(listener) => listener.try_clone().map(Listener::Unix),
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    fn as_fd(&self) -> std::os::fd::BorrowedFd<'_> {
+        use std::os::fd::AsFd;
+        match self {
+            Listener::Tcp(listener) => listener.as_fd(),
+            Listener::Unix(listener) => listener.as_fd(),
+        }
+    }
+}
 
 #[derive(Debug, Clone, Copy)]
 pub enum ServerCommand {
@@ -16,14 +83,46 @@ pub enum ServerCommand {
     Stop,
 }
 
+/// State shared by all requests of one server.
+#[derive(Debug, Clone)]
+struct AppState {
+    #[debug(skip)]
+    interpreter: Option<Arc<RwLock<Interpreter>>>,
+    flights: Arc<SingleFlight>,
+    limits: ServerLimits,
+    /// Queue of this server on the shared route execution threads.
+    #[debug(skip)]
+    tenant: Arc<Tenant>,
+    /// Listen address, separates this server's entries in the shared cache from other servers'.
+    cache_scope: Arc<str>,
+    timings: Arc<ServerTimings>,
+    /// Send the phases of each request in a `Server-Timing` header.
+    server_timing: bool,
+    #[debug(skip)]
+    tracer: Option<Arc<Tracer>>,
+    traffic: Arc<ServerTraffic>,
+    slow_log: Option<Arc<SlowLog>>,
+    /// Permits of the `stream`/`sse` responses, `limits.max_streams` of them.
+    streams: Arc<Semaphore>,
+}
+
 #[derive(Debug, Clone)] 
 pub struct HttpServer {
     #[debug(skip)] 
-    pub interpreter: Option<Arc<Mutex<Interpreter>>>,
+    pub interpreter: Option<Arc<RwLock<Interpreter>>>,
     pub tls_config: Option<TlsConfig>, 
     pub rustls_config: Option<Arc<ServerConfig>>, 
     pub server_id: String,
-    addr: Option<SocketAddr>,
+    pub limits: ServerLimits,
+    /// Hand TLS encryption to the kernel after the handshake, Linux only.
+    pub ktls: bool,
+    pub handshake_pool: Option<HandshakePoolConfig>,
+    pub scheduling: SchedulingPolicy,
+    pub server_timing: bool,
+    pub tracing: Option<TraceConfig>,
+    pub slow_requests: Option<SlowRequestConfig>,
+    handshakes: Option<HandshakePool>,
+    addr: Option<ListenAddr>,
     server_handle: Option<Handle<SocketAddr>>,
     control_tx: Option<mpsc::Sender<ServerCommand>>,
     boot_time: Option<std::time::Instant>,
@@ -57,11 +156,36 @@ impl HttpServer {
             None 
         };
 
+        let limits = interpreter.configuration.as_ref()
+            .map(|config| config.limits)
+            .unwrap_or_default();
+        let ktls = interpreter.configuration.as_ref()
+            .is_some_and(|config| config.ktls);
+        let handshake_pool = interpreter.configuration.as_ref()
+            .and_then(|config| config.handshake_pool);
+        let scheduling = interpreter.configuration.as_ref()
+            .map(|config| config.scheduling)
+            .unwrap_or_default();
+        let server_timing = interpreter.configuration.as_ref()
+            .is_some_and(|config| config.server_timing);
+        let tracing = interpreter.configuration.as_ref()
+            .and_then(|config| config.tracing.clone());
+        let slow_requests = interpreter.configuration.as_ref()
+            .and_then(|config| config.slow_requests);
+
         Self {
-            interpreter: Some(Arc::new(Mutex::new(interpreter))),
+            interpreter: Some(Arc::new(RwLock::new(interpreter))),
             tls_config,
             rustls_config: rustls_config_result,
             server_id,
+            limits,
+            ktls,
+            handshake_pool,
+            scheduling,
+            server_timing,
+            tracing,
+            slow_requests,
+            handshakes: None,
             addr: None,
             control_tx: None,
             server_handle: None,
@@ -91,9 +215,112 @@ impl HttpServer {
         self.rustls_config = None;
     }
 
+    /// Runs the warmup requests of the routes through the same execution path as real
+    /// requests. `false` if one of them fails, times out or answers with a 5xx status.
+    async fn warm_up(&self, tenant: &Arc<Tenant>, requests: &[(String, String)]) -> bool {
+        let Some(interpreter) = &self.interpreter else {
+            return true;
+        };
+        if requests.is_empty() {
+            return true;
+        }
+
+        let started = Instant::now();
+        let mut ok = true;
+
+        for (method, target) in requests {
+            let (path, query) = target.split_once('?').unwrap_or((target, ""));
+            let params = serde_urlencoded::from_str(query).unwrap_or_default();
+            // Lets a route skip side effects it shouldn't have during warmup.
+            let headers = HashMap::from([(WARMUP_HEADER.to_string(), "1".to_string())]);
+
+            let work = run_route(Arc::clone(tenant), Arc::clone(interpreter), method.clone(), path.to_string(), params, headers, HttpBodyVariant::Empty, None, None);
+            match tokio::time::timeout(WARMUP_TIMEOUT, work).await {
+                Ok((Some(response), _)) if response.status < 500 => {}
+                Ok((Some(response), _)) => {
+                    warn!("[HTTP Server ID: {}] Warmup request {} {} answered {}", self.server_id, method, target, response.status);
+                    ok = false;
+                }
+                Ok((None, _)) => {
+                    warn!("[HTTP Server ID: {}] Warmup request {} {} failed", self.server_id, method, target);
+                    ok = false;
+                }
+                Err(_) => {
+                    warn!("[HTTP Server ID: {}] Warmup request {} {} took longer than {:?}", self.server_id, method, target, WARMUP_TIMEOUT);
+                    ok = false;
+                }
+            }
+        }
+
+        info!("[HTTP Server ID: {}] Warmed up {} route request(s) in {:?}", self.server_id, requests.len(), started.elapsed());
+        ok
+    }
+
     pub fn is_tls_enabled(&self) -> bool {
         self.tls_config.as_ref().map_or(false, |c| c.enabled) && self.rustls_config.is_some()
     }
+
+    fn start_handshake_pool(&self, addr: &ListenAddr) -> Option<HandshakePool> {
+        let config = self.handshake_pool?;
+        if !self.is_tls_enabled() || matches!(addr, ListenAddr::Unix(_)) {
+            warn!("[HTTP Server ID: {}] Handshake threads need TLS over TCP, setting ignored", self.server_id);
+            return None;
+        }
+
+        match HandshakePool::new(config) {
+            Ok(pool) => Some(pool),
+            Err(e) => {
+                error!("[HTTP Server ID: {}] Failed to start handshake threads, handshakes run on request workers: {}", self.server_id, e);
+                None
+            }
+        }
+    }
+
+    /// Binds `addr`, or takes the socket handed over by the previous daemon for it.
+    fn listen(&self, addr: &ListenAddr) -> io::Result<Listener> {
+        let listener = match self.inherited(addr) {
+            Some(listener) => listener,
+            None => match addr {
+                ListenAddr::Tcp(addr) => Listener::Tcp(TcpListener::bind(addr)?),
+                #[cfg(unix)]
+                ListenAddr::Unix(path) => Listener::Unix(super::unix::bind(path)?),
+                #[cfg(not(unix))]
+                ListenAddr::Unix(_) => return Err(io::Error::new(io::ErrorKind::Unsupported, "Unix domain sockets are not supported")),
+            },
+        };
+        #[cfg(target_os = "linux")]
+        if let Err(e) = super::handoff::register(addr.to_string(), listener.as_fd()) {
+            warn!("[HTTP Server ID: {}] Socket can't be handed to a new daemon: {}", self.server_id, e);
+        }
+        Ok(listener)
+    }
+
+    #[cfg(target_os = "linux")]
+    fn inherited(&self, addr: &ListenAddr) -> Option<Listener> {
+        let socket = super::handoff::take_inherited(&addr.to_string())?;
+        info!("[HTTP Server ID: {}] Serving on the socket handed over for {}", self.server_id, addr);
+        Some(match addr {
+            ListenAddr::Tcp(_) => Listener::Tcp(TcpListener::from(socket)),
+            ListenAddr::Unix(_) => Listener::Unix(std::os::unix::net::UnixListener::from(socket)),
+        })
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    fn inherited(&self, _addr: &ListenAddr) -> Option<Listener> {
+        None
+    }
+
+    /// Checks the kernel once per `start`, the answer doesn't change between restarts.
+    #[cfg(target_os = "linux")]
+    fn kernel_tls(&self, addr: &ListenAddr) -> Option<super::ktls::KernelTls> {
+        if !self.ktls || !self.is_tls_enabled() || matches!(addr, ListenAddr::Unix(_)) {
+            if self.ktls {
+                warn!("[HTTP Server ID: {}] kTLS needs TLS over TCP, setting ignored", self.server_id);
+            }
+            return None;
+        }
+        super::ktls::probe()
+    }
 }
 
 impl Server for HttpServer {
@@ -104,40 +331,134 @@ impl Server for HttpServer {
     /// ```rust
     /// let mut server = HttpServer::from_interpreter(interpreter, None, "1234".to_string());
     /// server.start("127.0.0.1:9090").await;
+    /// // or, behind a reverse proxy on the same host:
+    /// server.start("unix:/run/app.sock").await;
     /// ```
     async fn start(&mut self, socket_addr_str: String) {
-        let addr = match socket_addr_str.parse::<SocketAddr>() {
-            Ok(a) => a,
-            Err(_) => {
-                error!("[HTTP Server ID: {}] Can't parse socket_addr_str to std::net::SocketAddr!", self.server_id);
+        let addr = match ListenAddr::parse(&socket_addr_str) {
+            Some(a) => a,
+            None => {
+                error!("[HTTP Server ID: {}] Can't parse '{}' as a socket address or 'unix:<path>'!", self.server_id, socket_addr_str);
+                return;
+            }
+        };
+        if cfg!(not(unix)) && matches!(addr, ListenAddr::Unix(_)) {
+            error!("[HTTP Server ID: {}] Unix domain sockets are not supported on this platform!", self.server_id);
+            return;
+        }
+        self.addr = Some(addr.clone());
+
+        let tenant = Arc::new(scheduler::global().register(&self.server_id, self.scheduling));
+        let warmup_requests = self.interpreter.as_ref()
+            .and_then(|interpreter| {
+                let interpreter = interpreter.read().ok()?;
+                let synthetic = interpreter.configuration.as_ref().is_some_and(|config| config.warmup);
+                Some(interpreter.warmup_requests(synthetic))
+            })
+            .unwrap_or_default();
+
+        // The first instance warms up before the socket is bound, so no client is queued
+        // behind cold routes. Restarts warm up while the old instance still serves.
+        if !self.warm_up(&tenant, &warmup_requests).await {
+            warn!("[HTTP Server ID: {}] Warmup failed, accepting traffic anyway", self.server_id);
+        }
+        let mut warmed_up = true;
+
+        let listener = match self.listen(&addr) {
+            Ok(listener) => listener,
+            Err(e) => {
+                error!("[HTTP Server ID: {}] Failed to listen on {}: {}", self.server_id, addr, e);
                 return;
             }
         };
-        self.addr = Some(addr);
 
         let (tx, mut rx) = mpsc::channel::<ServerCommand>(1);
         self.control_tx = Some(tx);
 
+        // Shared by all instances, connections of a stopping instance still count during a restart.
+        let limits = self.limits;
+        let limiter = ConnectionLimiter::new(Arc::new(Semaphore::new(limits.max_connections)), limits);
+        let streams = Arc::new(Semaphore::new(limits.max_streams));
+        self.handshakes = self.start_handshake_pool(&addr);
+        let timings = timing::register(&self.server_id);
+        let traffic = match self.interpreter.as_ref().and_then(|interpreter| interpreter.read().ok()) {
+            Some(interpreter) => traffic::register(&self.server_id, interpreter.routes.keys().map(String::as_str), self.handshakes.clone()),
+            None => traffic::register(&self.server_id, [], self.handshakes.clone()),
+        };
+        let slow_log = self.slow_requests.as_ref().map(|config| slow_log::register(&self.server_id, config));
+        let tracer = self.tracing.as_ref().and_then(|config| match Tracer::start(&self.server_id, config) {
+            Ok(tracer) => Some(Arc::new(tracer)),
+            Err(e) => {
+                error!("[HTTP Server ID: {}] Failed to start tracing: {}", self.server_id, e);
+                None
+            }
+        });
+        #[cfg(target_os = "linux")]
+        let kernel_tls = self.kernel_tls(&addr);
+        #[cfg(not(target_os = "linux"))]
+        if self.ktls {
+            warn!("[HTTP Server ID: {}] kTLS is only available on Linux, TLS stays in userspace", self.server_id);
+        }
+
+        if let Some(interpreter) = &self.interpreter {
+            crate::jobs::register(&self.server_id, interpreter);
+        }
+
         loop {
+            if !warmed_up && !self.warm_up(&tenant, &warmup_requests).await {
+                warn!("[HTTP Server ID: {}] Warmup failed, accepting traffic anyway", self.server_id);
+            }
+            warmed_up = false;
+
             info!("[HTTP Server ID: {}] Starting server instance...", self.server_id);
 
             self.boot_time = Some(std::time::Instant::now());
 
             let handle = Handle::new();
             self.server_handle = Some(handle.clone());
+            // Stops the Unix socket server, which isn't run by axum_server.
+            let shutdown = Arc::new(Notify::new());
 
             let app = Router::new()
                 .fallback(any(handle_request))
-                .with_state(self.interpreter.clone());
-
-            let make_service = app.into_make_service();
+                .with_state(AppState {
+                    interpreter: self.interpreter.clone(),
+                    flights: Arc::new(SingleFlight::new()),
+                    limits,
+                    tenant: Arc::clone(&tenant),
+                    cache_scope: Arc::from(addr.to_string()),
+                    timings: Arc::clone(&timings),
+                    server_timing: self.server_timing,
+                    tracer: tracer.clone(),
+                    traffic: Arc::clone(&traffic),
+                    slow_log: slow_log.clone(),
+                    streams: Arc::clone(&streams),
+                });
 
             let server_handle_clone = handle.clone();
             let is_tls = self.is_tls_enabled();
             let rustls_config = self.rustls_config.clone();
             let server_id = self.server_id.clone();
+            let limiter = limiter.clone();
+            let handshakes = self.handshakes.clone();
+            let listener = listener.try_clone();
+            let shutdown_clone = Arc::clone(&shutdown);
 
             let server_task = tokio::spawn(async move {
+                let listener = match listener? {
+                    Listener::Tcp(listener) => listener,
+                    #[cfg(unix)]
+                    Listener::Unix(listener) => {
+                        if is_tls {
+                            warn!("[HTTP Server ID: {}] TLS is not used on a Unix domain socket", server_id);
+                        }
+                        return super::unix::serve(listener, app, limiter, shutdown_clone, Duration::from_secs(5)).await;
+                    }
+                };
+                listener.set_nonblocking(true)?;
+
+                let make_service = app.into_make_service();
+
                 if is_tls {
                     let raw_cfg = match rustls_config {
                         Some(cfg) => cfg,
@@ -149,52 +470,87 @@ impl Server for HttpServer {
                             ))
                         }
                     };
-                    let config = axum_server::tls_rustls::RustlsConfig::from_config(raw_cfg);
-                    axum_server::bind_rustls(addr, config)
-                        .handle(server_handle_clone)
-                        .serve(make_service)
-                        .await
+                    'serve: {
+                        #[cfg(target_os = "linux")]
+                        if let Some(kernel) = kernel_tls {
+                            let mut server = axum_server::from_tcp(listener)?
+                                .map(|acceptor| LimitedAcceptor::new(PooledAcceptor::new(KtlsAcceptor::new(acceptor, &raw_cfg, kernel), handshakes), limiter))
+                                .handle(server_handle_clone);
+                            configure_builder(server.http_builder(), limits);
+                            break 'serve server.serve(make_service).await;
+                        }
+
+                        let config = axum_server::tls_rustls::RustlsConfig::from_config(raw_cfg);
+                        let mut server = axum_server::from_tcp_rustls(listener, config)?
+                            .map(|acceptor| LimitedAcceptor::new(PooledAcceptor::new(acceptor, handshakes), limiter))
+                            .handle(server_handle_clone);
+                        configure_builder(server.http_builder(), limits);
+                        server.serve(make_service).await
+                    }
                 } else {
-                    axum_server::bind(addr)
-                        .handle(server_handle_clone)
-                        .serve(make_service)
-                        .await
+                    let mut server = axum_server::from_tcp(listener)?
+                        .map(|acceptor| LimitedAcceptor::new(acceptor, limiter))
+                        .handle(server_handle_clone);
+                    configure_builder(server.http_builder(), limits);
+                    server.serve(make_service).await
                 }
             });
 
-            let mut next_action = ServerCommand::Restart;
-
             let mut task_opt = Some(server_task);
 
-            tokio::select! {
-                maybe_command = rx.recv() => {
-                    if let Some(command) = maybe_command {
-                        next_action = command;
+            let next_action = loop {
+                tokio::select! {
+                    maybe_command = rx.recv() => {
+                        let Some(command) = maybe_command else {
+                            break ServerCommand::Restart;
+                        };
                         info!("[HTTP Server ID: {}] Control command received: {:?}", self.server_id, command);
+
+                        if matches!(command, ServerCommand::Restart) {
+                            if !self.warm_up(&tenant, &warmup_requests).await {
+                                error!("[HTTP Server ID: {}] Warmup failed, the running instance keeps serving", self.server_id);
+                                continue;
+                            }
+                            warmed_up = true;
+                        }
+
                         handle.graceful_shutdown(Some(Duration::from_secs(5)));
-                        
+                        shutdown.notify_one();
+
                         if let Some(task) = task_opt.take() {
                             let _ = task.await;
                         }
+                        break command;
                     }
-                }
-                server_result = async {
-                    if let Some(ref mut task) = task_opt {
-                        task.await
-                    } else {
-                        std::future::pending().await
+                    server_result = async {
+                        if let Some(ref mut task) = task_opt {
+                            task.await
+                        } else {
+                            std::future::pending().await
+                        }
+                    } => {
+                        task_opt.take();
+
+                        match server_result {
+                            Ok(Err(e)) => error!("[HTTP Server ID: {}] Server stopped with error: {}", self.server_id, e),
+                            Err(panic_err) => error!("[HTTP Server ID: {}] Server task panicked: {:?}", self.server_id, panic_err),
+                            _ => info!("[HTTP Server ID: {}] Server instance stopped gracefully.", self.server_id),
+                        }
+                        break ServerCommand::Restart;
                     }
-                } => {
-                    task_opt.take();
-                    
-                    match server_result {
-                        Ok(Err(e)) => error!("[HTTP Server ID: {}] Server stopped with error: {}", self.server_id, e),
-                        Err(panic_err) => error!("[HTTP Server ID: {}] Server task panicked: {:?}", self.server_id, panic_err),
-                        _ => info!("[HTTP Server ID: {}] Server instance stopped gracefully.", self.server_id),
+                    _ = handed_off() => {
+                        info!("[HTTP Server ID: {}] A new daemon serves on {} now, draining connections", self.server_id, addr);
+
+                        handle.graceful_shutdown(Some(Duration::from_secs(5)));
+                        shutdown.notify_one();
+
+                        if let Some(task) = task_opt.take() {
+                            let _ = task.await;
+                        }
+                        break ServerCommand::Stop;
                     }
-                    next_action = ServerCommand::Restart;
                 }
-            }
+            };
 
             match next_action {
                 ServerCommand::Restart => {
@@ -207,6 +563,18 @@ impl Server for HttpServer {
                     self.server_handle = None;
                     self.control_tx = None;
                     self.boot_time = None;
+                    self.handshakes = None;
+                    crate::jobs::unregister(&self.server_id);
+
+                    #[cfg(target_os = "linux")]
+                    super::handoff::unregister(&addr.to_string());
+                    // After a handoff the socket file belongs to the new daemon.
+                    #[cfg(unix)]
+                    if let ListenAddr::Unix(path) = &addr {
+                        if !is_handed_off() {
+                            super::unix::remove_socket(path);
+                        }
+                    }
                     break;
                 }
             }
@@ -286,70 +654,395 @@ impl Server for HttpServer {
                     Some(time) => time.elapsed().as_secs(),
                     None => 0,
                 }
-            }
+            },
+            handshakes: self.handshakes.as_ref().map(|pool| pool.stats()),
         }
     }
 }
 
+/// Resolves once the listening sockets of this process were handed to a new daemon.
+async fn handed_off() {
+    #[cfg(target_os = "linux")]
+    super::handoff::drained().await;
+    #[cfg(not(target_os = "linux"))]
+    std::future::pending::<()>().await;
+}
+
+fn is_handed_off() -> bool {
+    #[cfg(target_os = "linux")]
+    return super::handoff::draining();
+    #[cfg(not(target_os = "linux"))]
+    false
+}
+
+/// Set on warmup requests, so routes can tell them from real traffic.
+pub const WARMUP_HEADER: &str = "x-netter-warmup";
+
+/// Time a single warmup request may take.
+const WARMUP_TIMEOUT: Duration = Duration::from_secs(10);
+
 #[axum::debug_handler]
 async fn handle_request(
-    State(interpreter): State<Option<Arc<Mutex<Interpreter>>>>,
+    State(state): State<AppState>,
+    req: Request<Body>,
+) -> axum::response::Response {
+    let timings = Arc::clone(&state.timings);
+    let server_timing = state.server_timing;
+
+    let span = state.tracer.as_ref().and_then(|tracer| tracer.request(req.headers(), req.method().as_str(), req.uri().path()));
+    let route_trace = span.as_ref().map(RequestSpan::route_trace);
+
+    let mut traffic = RequestTraffic::new(Arc::clone(&state.traffic));
+    let mut timer = RequestTimer::start();
+    let response = route_request(state, req, &mut timer, &mut traffic, route_trace).await;
+    let (phases, total) = timings.record(timer);
+    let mut response = traffic.finish(response, total);
+
+    if let Some(span) = span {
+        span.finish(response.status().as_u16());
+    }
+
+    if server_timing {
+        if let Ok(value) = HeaderValue::from_str(&phases.server_timing(total)) {
+            response.headers_mut().insert(SERVER_TIMING, value);
+        }
+    }
+
+    response
+}
+
+/// Not among hyper's header names.
+const SERVER_TIMING: &str = "server-timing";
+
+/// Handles a request, adding the time of its phases to `timer` and its route to `traffic`.
+/// A `stream`/`sse` route returns with its first flush, the phases of the rest of it aren't counted.
+async fn route_request(
+    state: AppState,
     req: Request<Body>,
-) -> impl IntoResponse {
+    timer: &mut RequestTimer,
+    traffic: &mut RequestTraffic,
+    trace: Option<RouteTrace>,
+) -> axum::response::Response {
     let (parts, body) = req.into_parts();
 
-    let Some(interpreter) = interpreter else {
+    let Some(interpreter) = state.interpreter else {
         return axum::http::StatusCode::SERVICE_UNAVAILABLE.into_response();
     };
 
-    {
-        if interpreter.lock().is_err() {
-            error!("[HTTP Server :: Handle Request] Failed to lock interpreter");
-            return (
+    if interpreter.is_poisoned() {
+        error!("[HTTP Server :: Handle Request] Failed to lock interpreter");
+        return (
+            axum::http::StatusCode::INTERNAL_SERVER_ERROR, 
+            "Internal Server Error!"
+        ).into_response();
+    }
+
+    let method = parts.method.to_string();
+    let path = parts.uri.path().to_string();
+
+    // The route is found first: it decides how the body is read, and a request no route
+    // handles is answered without parsing the query, copying headers or reading the body.
+    let options = timer.measure(Phase::Route, || {
+        interpreter.read().ok().and_then(|lock| {
+            let (route_key, options) = lock.route_options(&method, &path)?;
+            traffic.enter(route_key);
+            Some(options.clone())
+        })
+    });
+    let Some(options) = options else {
+        return unread_body_response(&parts, (StatusCode::NOT_FOUND, "Not Found").into_response());
+    };
+    let body = match options.body.read {
+        BodyRead::Skip => body,
+        BodyRead::Buffer => traffic.count_body(body),
+    };
+
+    // Served without reading the body: cached routes are GET only.
+    let cache_key = match &options.cache {
+        Some(_) if parts.method == Method::GET => {
+            let key = response_cache_key(&state.cache_scope, &parts.uri);
+            if let Some(cached) = shared_cache::global().get(vary_cache_key(&key, &parts.headers).as_bytes()).and_then(BufferedResponse::decode) {
+                return unread_body_response(&parts, cached.to_response());
+            }
+            Some(key)
+        }
+        _ => None,
+    };
+
+    let (params, converted_headers) = timer.measure(Phase::Headers, || {
+        let mut params = HashMap::new();
+        if let Some(query_str) = parts.uri.query() {
+            if let Ok(p) = serde_urlencoded::from_str::<HashMap<String, String>>(query_str) {
+                params = p;
+            }
+        }
+
+        (params, header_map_into_hashmap(&parts.headers))
+    });
+
+    // The route gets an execution thread only once the body is in, so a slow upload never
+    // holds one, and a body that is too large or too slow is answered without running it.
+    let rdl_body = match options.body.read {
+        BodyRead::Skip => HttpBodyVariant::Empty,
+        BodyRead::Buffer => match timed(timer, Phase::Body, make_rdl_body(body, &parts.headers, &state.limits, options.body.limit)).await {
+            Ok(body) => body,
+            Err(BodyError::Read(e)) => {
+                error!("[HTTP Server :: Handle Request] Failed while parsing body: {}", e);
+                HttpBodyVariant::Empty
+            }
+            Err(e) => return body_error_response(&parts, e),
+        },
+    };
+
+    if let Some(mode) = options.stream {
+        let response = run_streaming_route(&state.streams, state.limits.idle_timeout, interpreter, mode, method, path, params, converted_headers, rdl_body, trace).await;
+        return finish_body(&parts, options.body.read, response);
+    }
+
+    let coalesce_key = match &options.coalesce {
+        Some(coalesce) if parts.method == Method::GET => Some(coalesce.key(&method, &path, &params, &converted_headers)),
+        _ => None,
+    };
+
+    // Traced requests are always recorded, the others when sampled.
+    let slow_log = state.slow_log.filter(|log| trace.is_some() || log.sample());
+    let work = run_route(state.tenant, interpreter, method, path, params, converted_headers, rdl_body, trace, slow_log);
+    let response = match coalesce_key {
+        Some(key) => {
+            // Only the request whose work ran gets the phases of the route.
+            let (phases_tx, phases_rx) = tokio::sync::oneshot::channel();
+            let work = async move {
+                let (response, phases) = work.await;
+                let _ = phases_tx.send(phases);
+                response
+            };
+            let response = state.flights.run(key, work).await;
+            if let Ok(phases) = phases_rx.await {
+                timer.merge(&phases);
+            }
+            response
+        }
+        None => {
+            let (response, phases) = work.await;
+            timer.merge(&phases);
+            response.map(Arc::new)
+        }
+    };
+
+    let response = timer.measure(Phase::Response, || {
+        if let (Some(key), Some(response), Some(cache)) = (cache_key, &response, &options.cache) {
+            if response.is_cacheable() {
+                cache_response(&key, &parts.headers, response, cache.ttl);
+            }
+        }
+
+        match response {
+            Some(response) => response.to_response(),
+            None => (
                 axum::http::StatusCode::INTERNAL_SERVER_ERROR, 
                 "Internal Server Error!"
-            ).into_response();
+            ).into_response(),
+        }
+    });
+    finish_body(&parts, options.body.read, response)
+}
+
+/// Awaits `future`, adding the time to `phase`.
+async fn timed<T>(timer: &mut RequestTimer, phase: Phase, future: impl Future<Output = T>) -> T {
+    let start = Instant::now();
+    let result = future.await;
+    timer.add(phase, start.elapsed());
+    result
+}
+
+fn finish_body(parts: &axum::http::request::Parts, read: BodyRead, response: axum::response::Response) -> axum::response::Response {
+    match read {
+        BodyRead::Skip => unread_body_response(parts, response),
+        BodyRead::Buffer => response,
+    }
+}
+
+/// A response sent without reading the request body. Hyper would otherwise read the rest
+/// of the body off the connection to reuse it, so an HTTP/1 connection with a body is closed.
+fn unread_body_response(parts: &axum::http::request::Parts, mut response: axum::response::Response) -> axum::response::Response {
+    let has_body = content_length(&parts.headers).map_or(parts.headers.contains_key(TRANSFER_ENCODING), |len| len > 0);
+    if has_body && parts.version < Version::HTTP_2 {
+        response.headers_mut().insert(CONNECTION, HeaderValue::from_static("close"));
+    }
+    response
+}
+
+fn body_error_response(parts: &axum::http::request::Parts, error: BodyError) -> axum::response::Response {
+    // The rest of the body is never read, so the connection can't be reused.
+    match error {
+        BodyError::TooLarge(limit) => {
+            warn!("[HTTP Server :: Handle Request] Body of the request to '{}' is larger than {} bytes", parts.uri.path(), limit);
+            (StatusCode::PAYLOAD_TOO_LARGE, [(CONNECTION, "close")], "Payload Too Large").into_response()
+        }
+        e => {
+            warn!("[HTTP Server :: Handle Request] Dropping slow request to '{}': {}", parts.uri.path(), e);
+            (StatusCode::REQUEST_TIMEOUT, [(CONNECTION, "close")], "Request Timeout").into_response()
         }
     }
+}
+
+fn content_length(headers: &HeaderMap) -> Option<u64> {
+    headers.get(CONTENT_LENGTH)?.to_str().ok()?.parse().ok()
+}
+
+fn response_cache_key(scope: &str, uri: &axum::http::Uri) -> String {
+    let path = uri.path_and_query().map(|p| p.as_str()).unwrap_or_else(|| uri.path());
+    format!("response:{} GET {}", scope, path)
+}
+
+/// A route that answers with `Vary` has its header names cached under `vary:` and the
+/// URI key, and each response under a key that adds the request's values of those headers.
+fn vary_cache_key(key: &str, headers: &HeaderMap) -> String {
+    match shared_cache::global().get(format!("vary:{}", key).as_bytes()) {
+        Some(names) => {
+            let names = String::from_utf8_lossy(&names);
+            let names: Vec<&str> = names.split(',').filter(|name| !name.is_empty()).collect();
+            variant_cache_key(key, &names, headers)
+        }
+        None => key.to_string(),
+    }
+}
 
-    let mut params = HashMap::new();
-    if let Some(query_str) = parts.uri.query() {
-        if let Ok(p) = serde_urlencoded::from_str::<HashMap<String, String>>(query_str) {
-            params = p;
+fn variant_cache_key<S: AsRef<str>>(key: &str, names: &[S], headers: &HeaderMap) -> String {
+    let mut variant = key.to_string();
+    for name in names {
+        let name = name.as_ref();
+        // Header values can't hold a newline, so one ends each part.
+        variant.push('\n');
+        variant.push_str(name);
+        for value in headers.get_all(name) {
+            variant.push(':');
+            variant.push_str(&String::from_utf8_lossy(value.as_bytes()));
         }
     }
+    variant
+}
+
+fn cache_response(key: &str, headers: &HeaderMap, response: &BufferedResponse, ttl: Duration) {
+    let cache = shared_cache::global();
+    let vary_key = format!("vary:{}", key);
+    let names = response.vary();
 
-    let converted_headers = header_map_into_hashmap(&parts.headers);
+    if names.is_empty() {
+        cache.remove(vary_key.as_bytes());
+        cache.insert(key.as_bytes(), &response.encode(), ttl);
+    } else if cache.insert(vary_key.as_bytes(), names.join(",").as_bytes(), ttl) {
+        cache.insert(variant_cache_key(key, &names, headers).as_bytes(), &response.encode(), ttl);
+    }
+}
+
+async fn run_route(
+    tenant: Arc<Tenant>,
+    interpreter: Arc<RwLock<Interpreter>>,
+    method: String,
+    path: String,
+    params: HashMap<String, String>,
+    headers: HashMap<String, String>,
+    body: HttpBodyVariant,
+    trace: Option<RouteTrace>,
+    slow_log: Option<Arc<SlowLog>>,
+) -> (Option<BufferedResponse>, Phases) {
+    let queued = Instant::now();
+
+    // Routes only need shared access, so requests run concurrently on the execution
+    // threads instead of holding a runtime worker while RDL code and plugins execute.
+    // The scheduler decides whose turn it is when several servers are busy.
+    let response = tenant.run(move || {
+        let waited = queued.elapsed();
+        let run = || trace::enter(trace, || timing::track(|| {
+            let lock = match interpreter.read() {
+                Ok(l) => l,
+                Err(_) => {
+                    error!("[HTTP Server :: Handle Request] Failed to lock interpreter");
+                    return None;
+                }
+            };
 
-    let rdl_body = make_rdl_body(body, &parts.headers).await
-        .unwrap_or_else(|e| {
-            error!("[HTTP Server :: Handle Request] Failed while parsing body: {}", e);
-            HttpBodyVariant::Empty
+            Some(lock.handle_request(
+                &method, 
+                &path, 
+                params, 
+                headers, 
+                body
+            ))
+        }));
+        let (response, mut phases) = slow_log::capture(slow_log.as_deref(), &method, &path, run, |(response, _)| {
+            response.as_ref().map_or(500, |response| response.status)
         });
+        phases.add(Phase::Queue, waited);
 
-    let lock = match interpreter.lock() {
-        Ok(l) => l,
-        Err(_) => {
-            error!("[HTTP Server :: Handle Request] Failed to lock interpreter");
-            return (
-                axum::http::StatusCode::INTERNAL_SERVER_ERROR, 
-                "Internal Server Error!"
-            ).into_response();
-        }
+        let converted = Instant::now();
+        let response = response.map(BufferedResponse::from);
+        phases.add(Phase::Response, converted.elapsed());
+        (response, phases)
+    }).await;
+
+    match response {
+        Some((response, phases)) => (response, phases),
+        None => (None, Phases::default()),
+    }
+}
+
+async fn run_streaming_route(
+    streams: &Arc<Semaphore>,
+    idle_timeout: Duration,
+    interpreter: Arc<RwLock<Interpreter>>,
+    mode: StreamMode,
+    method: String,
+    path: String,
+    params: HashMap<String, String>,
+    headers: HashMap<String, String>,
+    body: HttpBodyVariant,
+    trace: Option<RouteTrace>,
+) -> axum::response::Response {
+    // A streaming route holds its thread while the client reads, it would starve the
+    // scheduler's fixed threads. These stay on the blocking pool, `max_streams` at a time
+    // so they can't use it up either.
+    let Ok(permit) = Arc::clone(streams).try_acquire_owned() else {
+        warn!("[HTTP Server :: Handle Request] 'max_streams' streaming responses are running, rejecting {} {}", method, path);
+        return (
+            axum::http::StatusCode::SERVICE_UNAVAILABLE,
+            [(axum::http::header::RETRY_AFTER, "1")],
+            "Service Unavailable",
+        ).into_response();
     };
 
-    let response = lock.handle_request(
-        &parts.method.to_string(), 
-        parts.uri.path(), 
-        params, 
-        converted_headers, 
-        rdl_body
-    );
-
-    (
-        StatusCode::from_u16(response.status).unwrap_or(StatusCode::OK),
-        response.body.unwrap_or("".to_string())
-    ).into_response()
+    let (stream, mut frames) = ResponseStream::channel(mode);
+    let task = tokio::task::spawn_blocking(move || trace::enter(trace, || {
+        let _permit = permit;
+        let lock = match interpreter.read() {
+            Ok(l) => l,
+            Err(_) => {
+                error!("[HTTP Server :: Handle Request] Failed to lock interpreter");
+                return None;
+            }
+        };
+
+        Some(lock.handle_streaming_request(&method, &path, params, headers, body, stream))
+    }));
+
+    // The head arrives with the first flush. If the route ends without flushing, the
+    // stream is closed and the route's return value is an ordinary response.
+    match frames.recv().await {
+        Some(StreamFrame::Head { status, headers }) => {
+            // Well within the idle timeout, which would otherwise close an SSE stream
+            // that waits for its next event.
+            let keep_alive = (mode == StreamMode::Sse).then(|| idle_timeout / 2);
+            streamed_response(status, &headers, frames, keep_alive)
+        }
+        _ => match task.await {
+            Ok(Some(response)) => BufferedResponse::from(response).to_response(),
+            _ => (
+                axum::http::StatusCode::INTERNAL_SERVER_ERROR,
+                "Internal Server Error!"
+            ).into_response(),
+        },
+    }
 }
 
 
@@ -371,24 +1064,87 @@ fn header_map_into_hashmap(map: &HeaderMap) -> HashMap<String, String> {
     headers
 }
 
-async fn make_rdl_body(body: axum::body::Body, headers: &axum::http::HeaderMap) -> Result<HttpBodyVariant, String> {
-    if let Some(content_length) = headers.get(CONTENT_LENGTH) {
-        if content_length == "0" {
-            return Ok(HttpBodyVariant::Empty);
+/// Time a body may take before `min_body_rate` is checked, so small slow starts are not dropped.
+const BODY_RATE_GRACE: Duration = Duration::from_secs(5);
+
+#[derive(Debug)]
+enum BodyError {
+    Timeout(Duration),
+    TooSlow(u64),
+    TooLarge(u64),
+    Read(String),
+}
+
+impl std::fmt::Display for BodyError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            BodyError::Timeout(timeout) => write!(f, "body was not received within {:?}", timeout),
+            BodyError::TooSlow(rate) => write!(f, "body arrives slower than {} bytes/s", rate),
+            BodyError::TooLarge(limit) => write!(f, "body is larger than {} bytes", limit),
+            BodyError::Read(e) => write!(f, "{}", e),
         }
     }
+}
+
+/// Reads the whole body. With `limit`, a body larger than `limit` bytes is an error, found
+/// from `Content-Length` before reading when the client sends it.
+async fn make_rdl_body(body: axum::body::Body, headers: &axum::http::HeaderMap, limits: &ServerLimits, limit: Option<u64>) -> Result<HttpBodyVariant, BodyError> {
+    match (content_length(headers), limit) {
+        (Some(0), _) => return Ok(HttpBodyVariant::Empty),
+        (Some(len), Some(limit)) if len > limit => return Err(BodyError::TooLarge(limit)),
+        _ => {}
+    }
 
-    let collected = body.collect().await
-        .map_err(|_| format!("[HTTP Server :: Packet Read] Failed while reading request"))?;
+    let start = Instant::now();
+    let deadline = limits.body_timeout.map(|timeout| start + timeout);
+    let mut body = body;
+    let mut data = Vec::new();
 
-    let bytes = collected.to_bytes();
+    loop {
+        // A client that sends received/min_body_rate seconds worth of data may keep going.
+        let rate_deadline = match limits.min_body_rate {
+            0 => None,
+            rate => Some(start + BODY_RATE_GRACE.max(Duration::from_secs_f64(data.len() as f64 / rate as f64))),
+        };
+        let next_deadline = deadline.into_iter().chain(rate_deadline).min();
 
-    if bytes.is_empty() {
+        let frame = match next_deadline {
+            Some(next_deadline) => tokio::time::timeout_at(next_deadline, body.frame()).await,
+            None => Ok(body.frame().await),
+        };
+        let frame = match frame {
+            Ok(Some(frame)) => frame
+                .map_err(|_| BodyError::Read("[HTTP Server :: Packet Read] Failed while reading request".to_string()))?,
+            Ok(None) => break,
+            Err(_) => return Err(match limits.body_timeout {
+                Some(timeout) if deadline == next_deadline => BodyError::Timeout(timeout),
+                _ => BodyError::TooSlow(limits.min_body_rate),
+            }),
+        };
+
+        if let Ok(chunk) = frame.into_data() {
+            append_chunk(&mut data, chunk);
+            if let Some(limit) = limit.filter(|limit| data.len() as u64 > *limit) {
+                return Err(BodyError::TooLarge(limit));
+            }
+        }
+    }
+
+    if data.is_empty() {
         return Ok(HttpBodyVariant::Empty);
     }
 
-    match String::from_utf8(bytes.to_vec()) {
+    match String::from_utf8(data) {
         Ok(text) => Ok(HttpBodyVariant::Text(text)),
-        Err(_) => Ok(HttpBodyVariant::Bytes(bytes.to_vec()))
+        Err(e) => Ok(HttpBodyVariant::Bytes(e.into_bytes()))
+    }
+}
+
+fn append_chunk(data: &mut Vec<u8>, chunk: Bytes) {
+    if data.is_empty() {
+        // Single-chunk bodies (the common case) are taken over without a copy when possible.
+        *data = Vec::from(chunk);
+    } else {
+        data.extend_from_slice(&chunk);
     }
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+use std::{convert::Infallible, time::Duration};
+use axum::{body::Body, response::{IntoResponse, Response}};
+use hyper::{StatusCode, body::Bytes, header::{HeaderName, HeaderValue}};
+use log::warn;
+use tokio::sync::mpsc;
+use crate::language::interpreter::builtin::{response::Response as RdlResponse, response_stream::StreamFrame};
+
+/// Fully built route response that can be handed to any number of requests.
+///
+/// The body is `Bytes`, so every waiter gets a reference to the same buffer instead of a copy.
+#[derive(Debug, Clone)]
+pub struct BufferedResponse {
+    pub status: u16,
+    pub headers: Vec<(String, String)>,
+    pub body: Bytes,
+}
+
+impl From<RdlResponse> for BufferedResponse {
+    fn from(response: RdlResponse) -> Self {
+        Self {
+            status: response.status,
+            headers: response.headers.into_iter().collect(),
+            body: Bytes::from(response.body.unwrap_or_default()),
+        }
+    }
+}
+
+impl BufferedResponse {
+    pub fn to_response(&self) -> Response {
+        build_response(self.status, &self.headers, Body::from(self.body.clone()))
+    }
+
+    /// Whether the response may be served to other clients from the shared cache.
+    /// Only `200` responses qualify, and only if the route didn't mark them as private
+    /// or as depending on the whole request with `Vary: *`.
+    pub fn is_cacheable(&self) -> bool {
+        self.status == 200 && !self.headers.iter().any(|(name, value)| {
+            name.eq_ignore_ascii_case("set-cookie")
+                || name.eq_ignore_ascii_case("cache-control") && {
+                    let value = value.to_ascii_lowercase();
+                    value.contains("no-store") || value.contains("private")
+                }
+                || name.eq_ignore_ascii_case("vary") && value.split(',').any(|name| name.trim() == "*")
+        })
+    }
+
+    /// Request headers named in the response's `Vary`, lowercase, sorted and deduplicated.
+    pub fn vary(&self) -> Vec<String> {
+        let mut names: Vec<String> = self.headers.iter()
+            .filter(|(name, _)| name.eq_ignore_ascii_case("vary"))
+            .flat_map(|(_, value)| value.split(','))
+            .map(|name| name.trim().to_ascii_lowercase())
+            .filter(|name| !name.is_empty())
+            .collect();
+        names.sort();
+        names.dedup();
+        names
+    }
+
+    /// Layout in the shared cache: status, header count, each header as a length-prefixed
+    /// name and value, then the body. Integers are little-endian.
+    pub fn encode(&self) -> Vec<u8> {
+        let headers_len: usize = self.headers.iter().map(|(name, value)| 6 + name.len() + value.len()).sum();
+        let mut encoded = Vec::with_capacity(4 + headers_len + self.body.len());
+
+        encoded.extend_from_slice(&self.status.to_le_bytes());
+        encoded.extend_from_slice(&(self.headers.len() as u16).to_le_bytes());
+        for (name, value) in &self.headers {
+            encoded.extend_from_slice(&(name.len() as u16).to_le_bytes());
+            encoded.extend_from_slice(name.as_bytes());
+            encoded.extend_from_slice(&(value.len() as u32).to_le_bytes());
+            encoded.extend_from_slice(value.as_bytes());
+        }
+        encoded.extend_from_slice(&self.body);
+
+        encoded
+    }
+
+    pub fn decode(encoded: Vec<u8>) -> Option<Self> {
+        let mut pos = 0;
+        let mut take = |len: usize| {
+            let part = encoded.get(pos..pos + len)?;
+            pos += len;
+            Some(part)
+        };
+
+        let status = u16::from_le_bytes(take(2)?.try_into().ok()?);
+        let count = u16::from_le_bytes(take(2)?.try_into().ok()?);
+        let mut headers = Vec::with_capacity(count as usize);
+        for _ in 0..count {
+            let name_len = u16::from_le_bytes(take(2)?.try_into().ok()?) as usize;
+            let name = String::from_utf8(take(name_len)?.to_vec()).ok()?;
+            let value_len = u32::from_le_bytes(take(4)?.try_into().ok()?) as usize;
+            let value = String::from_utf8(take(value_len)?.to_vec()).ok()?;
+            headers.push((name, value));
+        }
+
+        let mut body = Bytes::from(encoded);
+        Some(Self { status, headers, body: body.split_off(pos) })
+    }
+}
+
+/// Comment line of an event stream, ignored by clients.
+const SSE_KEEP_ALIVE: &[u8] = b": keep-alive\n\n";
+
+/// Response whose body is read from the frames a streaming route sends after its head.
+///
+/// With `keep_alive`, an SSE comment is sent whenever the route stays quiet that long, so
+/// the idle timeout and proxies don't close a stream that is only waiting for events.
+pub fn streamed_response(
+    status: u16,
+    headers: &[(String, String)],
+    frames: mpsc::Receiver<StreamFrame>,
+    keep_alive: Option<Duration>,
+) -> Response {
+    let chunks = futures_util::stream::unfold(frames, move |mut frames| async move {
+        let frame = match keep_alive {
+            Some(interval) => match tokio::time::timeout(interval, frames.recv()).await {
+                Ok(frame) => frame,
+                Err(_) => return Some((Ok::<_, Infallible>(Bytes::from_static(SSE_KEEP_ALIVE)), frames)),
+            },
+            None => frames.recv().await,
+        };
+        match frame {
+            Some(StreamFrame::Data(data)) => Some((Ok::<_, Infallible>(data), frames)),
+            Some(StreamFrame::Head { .. }) | None => None,
+        }
+    });
+
+    build_response(status, headers, Body::from_stream(chunks))
+}
+
+fn build_response(status: u16, headers: &[(String, String)], body: Body) -> Response {
+    let mut builder = axum::http::Response::builder()
+        .status(StatusCode::from_u16(status).unwrap_or(StatusCode::OK));
+
+    for (name, value) in headers {
+        match (HeaderName::from_bytes(name.as_bytes()), HeaderValue::from_str(value)) {
+            (Ok(name), Ok(value)) => builder = builder.header(name, value),
+            _ => warn!("[HTTP Server :: Response] Skipping invalid header '{}'", name),
+        }
+    }
+
+    builder.body(body)
+        .unwrap_or_else(|_| StatusCode::INTERNAL_SERVER_ERROR.into_response())
+}
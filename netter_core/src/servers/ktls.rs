@@ -0,0 +1,601 @@
+use std::{io::{self, Read}, mem, os::fd::{AsRawFd, RawFd}, pin::Pin, sync::Arc, task::{Context, Poll, ready}};
+use axum_server::accept::Accept;
+use futures_util::{FutureExt, future::BoxFuture};
+use hyper::body::Bytes;
+use log::{debug, info};
+use rustls::{CipherSuite, ConnectionTrafficSecrets, ProtocolVersion, ServerConfig, ServerConnection};
+use tokio::{io::{AsyncRead, AsyncWrite, AsyncWriteExt, ReadBuf}, net::TcpStream};
+use tokio_rustls::{TlsAcceptor, server::TlsStream};
+
+/// Ciphers the running kernel can take over, found by [`probe`].
+#[derive(Debug, Clone, Copy)]
+pub struct KernelTls {
+    chacha20: bool,
+}
+
+/// Checks once whether the kernel has the `tls` module, on a throwaway loopback connection.
+///
+/// Both directions are installed, as [`into_kernel`] does: the rustls session is gone once its
+/// secrets are extracted, so a kernel that only does TX (before Linux 4.17) can't be used.
+/// `None` means kTLS can't be used and connections stay in rustls.
+pub fn probe() -> Option<KernelTls> {
+    let try_cipher = |cipher: Cipher| -> io::Result<()> {
+        let listener = std::net::TcpListener::bind("127.0.0.1:0")?;
+        let stream = std::net::TcpStream::connect(listener.local_addr()?)?;
+        let _peer = listener.accept()?;
+        set_tls_ulp(stream.as_raw_fd())?;
+        install(stream.as_raw_fd(), libc::TLS_TX, libc::TLS_1_3_VERSION, 0, cipher, &[0; 32], &[0; 12])?;
+        install(stream.as_raw_fd(), libc::TLS_RX, libc::TLS_1_3_VERSION, 0, cipher, &[0; 32], &[0; 12])
+    };
+
+    if let Err(e) = try_cipher(Cipher::Aes128Gcm) {
+        info!("[HTTP Server :: kTLS] Kernel TLS is not available ({}), TLS stays in userspace", e);
+        return None;
+    }
+
+    let support = KernelTls { chacha20: try_cipher(Cipher::Chacha20Poly1305).is_ok() };
+    info!("[HTTP Server :: kTLS] Kernel TLS is available: {:?}", support);
+    Some(support)
+}
+
+/// TLS acceptor that hands the session to the kernel after the rustls handshake.
+///
+/// The kernel then encrypts writes and decrypts reads on the socket itself, so response
+/// bytes are no longer encrypted and copied in userspace. Connections whose cipher the
+/// kernel can't handle, or whose socket refuses the `tls` ULP, keep using rustls.
+#[derive(Clone)]
+pub struct KtlsAcceptor<A> {
+    inner: A,
+    tls: TlsAcceptor,
+    kernel: KernelTls,
+}
+
+impl<A> KtlsAcceptor<A> {
+    pub fn new(inner: A, config: &ServerConfig, kernel: KernelTls) -> Self {
+        let mut config = config.clone();
+        config.enable_secret_extraction = true;
+
+        Self {
+            inner,
+            tls: TlsAcceptor::from(Arc::new(config)),
+            kernel,
+        }
+    }
+}
+
+impl<A, S> Accept<TcpStream, S> for KtlsAcceptor<A>
+where
+    A: Accept<TcpStream, S, Stream = TcpStream>,
+    A::Future: Send + 'static,
+    A::Service: Send + 'static,
+{
+    type Stream = KtlsStream;
+    type Service = A::Service;
+    type Future = BoxFuture<'static, io::Result<(Self::Stream, Self::Service)>>;
+
+    fn accept(&self, stream: TcpStream, service: S) -> Self::Future {
+        let accepted = self.inner.accept(stream, service);
+        let tls = self.tls.clone();
+        let kernel = self.kernel;
+
+        async move {
+            let (stream, service) = accepted.await?;
+            let mut stream = tls.accept(RecordReader::new(stream)).await?;
+            // Session tickets are still queued in rustls, the kernel must not get them.
+            stream.flush().await?;
+            Ok((into_kernel(stream, kernel)?, service))
+        }.boxed()
+    }
+}
+
+fn into_kernel(stream: TlsStream<RecordReader<TcpStream>>, kernel: KernelTls) -> io::Result<KtlsStream> {
+    let supported = match stream.get_ref().1.negotiated_cipher_suite().map(|suite| suite.suite()) {
+        Some(CipherSuite::TLS13_AES_128_GCM_SHA256
+            | CipherSuite::TLS13_AES_256_GCM_SHA384
+            | CipherSuite::TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256
+            | CipherSuite::TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384
+            | CipherSuite::TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256
+            | CipherSuite::TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384) => true,
+        Some(CipherSuite::TLS13_CHACHA20_POLY1305_SHA256
+            | CipherSuite::TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256
+            | CipherSuite::TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256) => kernel.chacha20,
+        _ => false,
+    };
+
+    // Up to here nothing is lost if the kernel says no, rustls simply keeps the connection.
+    let fd = stream.get_ref().0.inner.as_raw_fd();
+    if !supported {
+        return Ok(KtlsStream::user(stream));
+    }
+    if let Err(e) = set_tls_ulp(fd) {
+        debug!("[HTTP Server :: kTLS] Socket refused the tls ULP, staying in userspace: {}", e);
+        return Ok(KtlsStream::user(stream));
+    }
+
+    let (io, mut connection) = stream.into_inner();
+    let early = take_plaintext(&mut connection)?;
+    let version = connection.protocol_version().unwrap_or(ProtocolVersion::TLSv1_3);
+    let secrets = connection.dangerous_extract_secrets()
+        .map_err(|e| io::Error::new(io::ErrorKind::Other, format!("Failed to extract TLS secrets: {}", e)))?;
+
+    let (tx_seq, tx) = secrets.tx;
+    let (rx_seq, rx) = secrets.rx;
+    install_key(fd, libc::TLS_TX, version, tx_seq, tx)?;
+    install_key(fd, libc::TLS_RX, version, rx_seq, rx)?;
+
+    Ok(KtlsStream::Kernel { tcp: io.inner, early })
+}
+
+/// Application data rustls already decrypted, the kernel only sees what comes after it.
+fn take_plaintext(connection: &mut ServerConnection) -> io::Result<Bytes> {
+    let mut early = Vec::new();
+    match connection.reader().read_to_end(&mut early) {
+        Ok(_) => Ok(Bytes::from(early)),
+        Err(e) if e.kind() == io::ErrorKind::WouldBlock => Ok(Bytes::from(early)),
+        Err(e) => Err(e),
+    }
+}
+
+fn set_tls_ulp(fd: RawFd) -> io::Result<()> {
+    setsockopt(fd, libc::SOL_TCP, libc::TCP_ULP, b"tls".as_slice())
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Cipher {
+    Aes128Gcm,
+    Aes256Gcm,
+    Chacha20Poly1305,
+}
+
+fn install_key(fd: RawFd, direction: libc::c_int, version: ProtocolVersion, seq: u64, secrets: ConnectionTrafficSecrets) -> io::Result<()> {
+    let version = match version {
+        ProtocolVersion::TLSv1_2 => libc::TLS_1_2_VERSION,
+        _ => libc::TLS_1_3_VERSION,
+    };
+
+    match &secrets {
+        ConnectionTrafficSecrets::Aes128Gcm { key, iv } => install(fd, direction, version, seq, Cipher::Aes128Gcm, key.as_ref(), iv.as_ref()),
+        ConnectionTrafficSecrets::Aes256Gcm { key, iv } => install(fd, direction, version, seq, Cipher::Aes256Gcm, key.as_ref(), iv.as_ref()),
+        ConnectionTrafficSecrets::Chacha20Poly1305 { key, iv } => install(fd, direction, version, seq, Cipher::Chacha20Poly1305, key.as_ref(), iv.as_ref()),
+        _ => Err(io::Error::new(io::ErrorKind::Unsupported, "cipher is not supported by kernel TLS")),
+    }
+}
+
+fn install(fd: RawFd, direction: libc::c_int, version: u16, seq: u64, cipher: Cipher, key: &[u8], iv: &[u8]) -> io::Result<()> {
+    let info = CryptoInfo::new(version, seq, cipher, key, iv);
+    setsockopt(fd, libc::SOL_TLS, direction, info.as_bytes())
+}
+
+/// Keys of one direction of a connection, as `setsockopt(SOL_TLS)` takes them.
+enum CryptoInfo {
+    Aes128Gcm(libc::tls12_crypto_info_aes_gcm_128),
+    Aes256Gcm(libc::tls12_crypto_info_aes_gcm_256),
+    Chacha20Poly1305(libc::tls12_crypto_info_chacha20_poly1305),
+}
+
+impl CryptoInfo {
+    fn new(version: u16, seq: u64, cipher: Cipher, key: &[u8], iv: &[u8]) -> Self {
+        // For AES-GCM the kernel takes the 4 byte implicit part of the nonce as "salt" and the rest as "iv".
+        match cipher {
+            Cipher::Aes128Gcm => {
+                let mut info: libc::tls12_crypto_info_aes_gcm_128 = unsafe { mem::zeroed() };
+                info.info = libc::tls_crypto_info { version, cipher_type: libc::TLS_CIPHER_AES_GCM_128 };
+                info.key.copy_from_slice(&key[..libc::TLS_CIPHER_AES_GCM_128_KEY_SIZE]);
+                info.salt.copy_from_slice(&iv[..4]);
+                info.iv.copy_from_slice(&iv[4..12]);
+                info.rec_seq = seq.to_be_bytes();
+                CryptoInfo::Aes128Gcm(info)
+            }
+            Cipher::Aes256Gcm => {
+                let mut info: libc::tls12_crypto_info_aes_gcm_256 = unsafe { mem::zeroed() };
+                info.info = libc::tls_crypto_info { version, cipher_type: libc::TLS_CIPHER_AES_GCM_256 };
+                info.key.copy_from_slice(&key[..libc::TLS_CIPHER_AES_GCM_256_KEY_SIZE]);
+                info.salt.copy_from_slice(&iv[..4]);
+                info.iv.copy_from_slice(&iv[4..12]);
+                info.rec_seq = seq.to_be_bytes();
+                CryptoInfo::Aes256Gcm(info)
+            }
+            Cipher::Chacha20Poly1305 => {
+                let mut info: libc::tls12_crypto_info_chacha20_poly1305 = unsafe { mem::zeroed() };
+                info.info = libc::tls_crypto_info { version, cipher_type: libc::TLS_CIPHER_CHACHA20_POLY1305 };
+                info.key.copy_from_slice(&key[..libc::TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE]);
+                info.iv.copy_from_slice(&iv[..12]);
+                info.rec_seq = seq.to_be_bytes();
+                CryptoInfo::Chacha20Poly1305(info)
+            }
+        }
+    }
+
+    fn as_bytes(&self) -> &[u8] {
+        match self {
+            CryptoInfo::Aes128Gcm(info) => as_bytes(info),
+            CryptoInfo::Aes256Gcm(info) => as_bytes(info),
+            CryptoInfo::Chacha20Poly1305(info) => as_bytes(info),
+        }
+    }
+}
+
+fn as_bytes<T>(value: &T) -> &[u8] {
+    // The crypto_info structs are plain byte arrays without padding.
+    unsafe { std::slice::from_raw_parts(value as *const T as *const u8, mem::size_of::<T>()) }
+}
+
+fn setsockopt(fd: RawFd, level: libc::c_int, name: libc::c_int, value: &[u8]) -> io::Result<()> {
+    let result = unsafe {
+        libc::setsockopt(fd, level, name, value.as_ptr() as *const libc::c_void, value.len() as libc::socklen_t)
+    };
+    if result == 0 { Ok(()) } else { Err(io::Error::last_os_error()) }
+}
+
+/// Connection accepted by [`KtlsAcceptor`].
+pub enum KtlsStream {
+    /// The kernel does the record layer: reads and writes are plaintext on the socket.
+    Kernel { tcp: TcpStream, early: Bytes },
+    User(Box<TlsStream<RecordReader<TcpStream>>>),
+}
+
+impl KtlsStream {
+    fn user(mut stream: TlsStream<RecordReader<TcpStream>>) -> Self {
+        stream.get_mut().0.limit = false;
+        KtlsStream::User(Box::new(stream))
+    }
+}
+
+impl AsyncRead for KtlsStream {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut ReadBuf<'_>) -> Poll<io::Result<()>> {
+        match self.get_mut() {
+            KtlsStream::Kernel { tcp, early } => {
+                if !early.is_empty() {
+                    let n = early.len().min(buf.remaining());
+                    buf.put_slice(&early.split_to(n));
+                    return Poll::Ready(Ok(()));
+                }
+
+                match ready!(Pin::new(tcp).poll_read(cx, buf)) {
+                    // A record that isn't application data (close_notify or a key update) can't
+                    // be read as plain data and fails with EIO, the connection is over either way.
+                    Err(e) if e.raw_os_error() == Some(libc::EIO) => Poll::Ready(Ok(())),
+                    other => Poll::Ready(other),
+                }
+            }
+            KtlsStream::User(tls) => Pin::new(tls.as_mut()).poll_read(cx, buf),
+        }
+    }
+}
+
+impl AsyncWrite for KtlsStream {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        match self.get_mut() {
+            KtlsStream::Kernel { tcp, .. } => Pin::new(tcp).poll_write(cx, buf),
+            KtlsStream::User(tls) => Pin::new(tls.as_mut()).poll_write(cx, buf),
+        }
+    }
+
+    fn poll_write_vectored(self: Pin<&mut Self>, cx: &mut Context<'_>, bufs: &[io::IoSlice<'_>]) -> Poll<io::Result<usize>> {
+        match self.get_mut() {
+            KtlsStream::Kernel { tcp, .. } => Pin::new(tcp).poll_write_vectored(cx, bufs),
+            KtlsStream::User(tls) => Pin::new(tls.as_mut()).poll_write_vectored(cx, bufs),
+        }
+    }
+
+    fn is_write_vectored(&self) -> bool {
+        match self {
+            KtlsStream::Kernel { tcp, .. } => tcp.is_write_vectored(),
+            KtlsStream::User(tls) => tls.is_write_vectored(),
+        }
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        match self.get_mut() {
+            KtlsStream::Kernel { tcp, .. } => Pin::new(tcp).poll_flush(cx),
+            KtlsStream::User(tls) => Pin::new(tls.as_mut()).poll_flush(cx),
+        }
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        match self.get_mut() {
+            KtlsStream::Kernel { tcp, .. } => Pin::new(tcp).poll_shutdown(cx),
+            KtlsStream::User(tls) => Pin::new(tls.as_mut()).poll_shutdown(cx),
+        }
+    }
+}
+
+const RECORD_HEADER_LEN: usize = 5;
+
+/// Never reads past the end of a TLS record during the handshake.
+///
+/// rustls keeps incomplete records it has read in its own buffer, and those bytes would be
+/// lost when the session moves to the kernel. Reading record by record leaves everything
+/// after the handshake in the socket.
+pub struct RecordReader<S> {
+    inner: S,
+    header: [u8; RECORD_HEADER_LEN],
+    header_len: usize,
+    body_left: usize,
+    limit: bool,
+}
+
+impl<S> RecordReader<S> {
+    fn new(inner: S) -> Self {
+        Self {
+            inner,
+            header: [0; RECORD_HEADER_LEN],
+            header_len: 0,
+            body_left: 0,
+            limit: true,
+        }
+    }
+}
+
+impl<S: AsyncRead + Unpin> AsyncRead for RecordReader<S> {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut ReadBuf<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        if !this.limit {
+            return Pin::new(&mut this.inner).poll_read(cx, buf);
+        }
+
+        let wanted = match this.body_left {
+            0 => RECORD_HEADER_LEN - this.header_len,
+            left => left,
+        };
+
+        let mut limited = buf.take(wanted);
+        ready!(Pin::new(&mut this.inner).poll_read(cx, &mut limited))?;
+        let read = limited.filled().len();
+
+        if this.body_left == 0 {
+            this.header[this.header_len..this.header_len + read].copy_from_slice(limited.filled());
+            this.header_len += read;
+            if this.header_len == RECORD_HEADER_LEN {
+                this.body_left = u16::from_be_bytes([this.header[3], this.header[4]]) as usize;
+                this.header_len = 0;
+            }
+        } else {
+            this.body_left -= read;
+        }
+
+        // `limited` wrote into the unfilled part of `buf`.
+        unsafe { buf.assume_init(read) };
+        buf.advance(read);
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl<S: AsyncWrite + Unpin> AsyncWrite for RecordReader<S> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        Pin::new(&mut self.get_mut().inner).poll_write(cx, buf)
+    }
+
+    fn poll_write_vectored(self: Pin<&mut Self>, cx: &mut Context<'_>, bufs: &[io::IoSlice<'_>]) -> Poll<io::Result<usize>> {
+        Pin::new(&mut self.get_mut().inner).poll_write_vectored(cx, bufs)
+    }
+
+    fn is_write_vectored(&self) -> bool {
+        self.inner.is_write_vectored()
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_shutdown(cx)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{collections::VecDeque, io::Write};
+    use axum_server::accept::DefaultAcceptor;
+    use rustls::{ClientConfig, ClientConnection, RootCertStore, crypto::{CryptoProvider, ring}, pki_types::{CertificateDer, PrivateKeyDer, ServerName, pem::PemObject}};
+    use tokio::{io::AsyncReadExt, net::TcpListener};
+    use tokio_rustls::TlsConnector;
+
+    /// Hands out its bytes in the given pieces, at most one piece per read.
+    struct Pieces(VecDeque<Vec<u8>>);
+
+    impl AsyncRead for Pieces {
+        fn poll_read(self: Pin<&mut Self>, _: &mut Context<'_>, buf: &mut ReadBuf<'_>) -> Poll<io::Result<()>> {
+            let pieces = &mut self.get_mut().0;
+            if let Some(piece) = pieces.front_mut() {
+                let n = piece.len().min(buf.remaining());
+                buf.put_slice(&piece[..n]);
+                piece.drain(..n);
+                if piece.is_empty() {
+                    pieces.pop_front();
+                }
+            }
+            Poll::Ready(Ok(()))
+        }
+    }
+
+    fn record(content_type: u8, body: &[u8]) -> Vec<u8> {
+        let mut record = vec![content_type, 3, 3];
+        record.extend((body.len() as u16).to_be_bytes());
+        record.extend(body);
+        record
+    }
+
+    async fn reads(reader: &mut RecordReader<Pieces>, count: usize) -> Vec<Vec<u8>> {
+        let mut reads = Vec::new();
+        for _ in 0..count {
+            let mut buf = [0; 64];
+            let n = reader.read(&mut buf).await.unwrap();
+            reads.push(buf[..n].to_vec());
+        }
+        reads
+    }
+
+    #[tokio::test]
+    async fn record_reader_stops_at_record_boundaries() {
+        let first = record(22, b"hello");
+        let second = record(23, b"abc");
+        let bytes = [first.as_slice(), &second, b"after"].concat();
+        let mut reader = RecordReader::new(Pieces(VecDeque::from([bytes])));
+
+        let expected = [&first[..5], b"hello", &second[..5], b"abc"].map(<[u8]>::to_vec);
+        assert_eq!(reads(&mut reader, 4).await, expected);
+        // What follows the records stays in the socket for the kernel.
+        assert_eq!(reader.inner.0, [b"after".to_vec()]);
+    }
+
+    #[tokio::test]
+    async fn record_reader_reassembles_split_headers() {
+        let first = record(22, b"hello");
+        let second = record(23, b"x");
+        let pieces = [
+            first[..2].to_vec(),
+            first[2..7].to_vec(),
+            [&first[7..], &second[..1]].concat(),
+            [&second[1..], b"after"].concat(),
+        ];
+        let mut reader = RecordReader::new(Pieces(VecDeque::from(pieces)));
+
+        let expected = [&first[..2], &first[2..5], b"he", b"llo", &second[..1], &second[1..5], b"x"].map(<[u8]>::to_vec);
+        assert_eq!(reads(&mut reader, 7).await, expected);
+        assert_eq!(reader.inner.0, [b"after".to_vec()]);
+    }
+
+    #[test]
+    fn crypto_info_splits_the_nonce_for_each_cipher() {
+        let key: Vec<u8> = (0..32).collect();
+        let iv: Vec<u8> = (100..112).collect();
+        let seq = 0x0102_0304_0506_0708;
+        let info = |cipher| CryptoInfo::new(libc::TLS_1_3_VERSION, seq, cipher, &key, &iv);
+
+        let CryptoInfo::Aes128Gcm(aes128) = info(Cipher::Aes128Gcm) else { panic!("wrong cipher") };
+        assert_eq!((aes128.info.version, aes128.info.cipher_type), (libc::TLS_1_3_VERSION, libc::TLS_CIPHER_AES_GCM_128));
+        assert_eq!(aes128.key[..], key[..16]);
+        assert_eq!(aes128.salt[..], iv[..4]);
+        assert_eq!(aes128.iv[..], iv[4..]);
+        assert_eq!(aes128.rec_seq, [1, 2, 3, 4, 5, 6, 7, 8]);
+
+        let CryptoInfo::Aes256Gcm(aes256) = info(Cipher::Aes256Gcm) else { panic!("wrong cipher") };
+        assert_eq!(aes256.info.cipher_type, libc::TLS_CIPHER_AES_GCM_256);
+        assert_eq!(aes256.key[..], key[..]);
+        assert_eq!(aes256.salt[..], iv[..4]);
+        assert_eq!(aes256.iv[..], iv[4..]);
+        assert_eq!(aes256.rec_seq, [1, 2, 3, 4, 5, 6, 7, 8]);
+
+        // ChaCha20-Poly1305 has no salt, the whole nonce is the iv.
+        let CryptoInfo::Chacha20Poly1305(chacha) = info(Cipher::Chacha20Poly1305) else { panic!("wrong cipher") };
+        assert_eq!(chacha.info.cipher_type, libc::TLS_CIPHER_CHACHA20_POLY1305);
+        assert_eq!(chacha.key[..], key[..]);
+        assert_eq!(chacha.iv[..], iv[..]);
+        assert_eq!(chacha.rec_seq, [1, 2, 3, 4, 5, 6, 7, 8]);
+
+        // The sizes the kernel checks the option length against.
+        assert_eq!(info(Cipher::Aes128Gcm).as_bytes().len(), 40);
+        assert_eq!(info(Cipher::Aes256Gcm).as_bytes().len(), 56);
+        assert_eq!(info(Cipher::Chacha20Poly1305).as_bytes().len(), 56);
+    }
+
+    fn server_config() -> ServerConfig {
+        let cert = CertificateDer::from_pem_slice(include_bytes!("testdata/localhost.pem")).unwrap();
+        let key = PrivateKeyDer::from_pem_slice(include_bytes!("testdata/localhost.key")).unwrap();
+        ServerConfig::builder_with_provider(Arc::new(ring::default_provider()))
+            .with_safe_default_protocol_versions()
+            .unwrap()
+            .with_no_client_auth()
+            .with_single_cert(vec![cert], key)
+            .unwrap()
+    }
+
+    fn client_config(provider: CryptoProvider) -> ClientConfig {
+        let mut roots = RootCertStore::empty();
+        roots.add(CertificateDer::from_pem_slice(include_bytes!("testdata/ca.pem")).unwrap()).unwrap();
+        ClientConfig::builder_with_provider(Arc::new(provider))
+            .with_safe_default_protocol_versions()
+            .unwrap()
+            .with_root_certificates(roots)
+            .with_no_client_auth()
+    }
+
+    /// Moves the TLS bytes each side has queued to the other one.
+    fn exchange(client: &mut ClientConnection, server: &mut ServerConnection) {
+        let mut bytes = Vec::new();
+        while client.wants_write() {
+            client.write_tls(&mut bytes).unwrap();
+        }
+        let mut bytes = bytes.as_slice();
+        while !bytes.is_empty() {
+            server.read_tls(&mut bytes).unwrap();
+            server.process_new_packets().unwrap();
+        }
+
+        let mut bytes = Vec::new();
+        while server.wants_write() {
+            server.write_tls(&mut bytes).unwrap();
+        }
+        let mut bytes = bytes.as_slice();
+        while !bytes.is_empty() {
+            client.read_tls(&mut bytes).unwrap();
+            client.process_new_packets().unwrap();
+        }
+    }
+
+    #[test]
+    fn take_plaintext_returns_data_rustls_decrypted() {
+        let mut server = ServerConnection::new(Arc::new(server_config())).unwrap();
+        let name = ServerName::try_from("localhost").unwrap();
+        let mut client = ClientConnection::new(Arc::new(client_config(ring::default_provider())), name).unwrap();
+
+        // Sent right behind the client's Finished, so rustls decrypts it with the handshake.
+        client.writer().write_all(b"GET / HTTP/1.1\r\n\r\n").unwrap();
+        while client.is_handshaking() || server.is_handshaking() {
+            exchange(&mut client, &mut server);
+        }
+        exchange(&mut client, &mut server);
+
+        assert_eq!(&take_plaintext(&mut server).unwrap()[..], b"GET / HTTP/1.1\r\n\r\n");
+        assert!(take_plaintext(&mut server).unwrap().is_empty());
+    }
+
+    /// Accepts one connection with a [`KtlsAcceptor`] and answers `hello` with `HELLO`.
+    /// Returns whether the server side ended up in the kernel.
+    async fn echo_once(kernel: KernelTls, client: ClientConfig) -> bool {
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let addr = listener.local_addr().unwrap();
+        let acceptor = KtlsAcceptor::new(DefaultAcceptor, &server_config(), kernel);
+
+        let server = tokio::spawn(async move {
+            let (tcp, _) = listener.accept().await.unwrap();
+            let (mut stream, ()) = acceptor.accept(tcp, ()).await.unwrap();
+            let mut request = [0; 5];
+            stream.read_exact(&mut request).await.unwrap();
+            stream.write_all(&request.to_ascii_uppercase()).await.unwrap();
+            stream.flush().await.unwrap();
+            matches!(stream, KtlsStream::Kernel { .. })
+        });
+
+        let tcp = TcpStream::connect(addr).await.unwrap();
+        let name = ServerName::try_from("localhost").unwrap();
+        let mut tls = TlsConnector::from(Arc::new(client)).connect(name, tcp).await.unwrap();
+        tls.write_all(b"hello").await.unwrap();
+        tls.flush().await.unwrap();
+        let mut response = [0; 5];
+        tls.read_exact(&mut response).await.unwrap();
+        assert_eq!(&response, b"HELLO");
+
+        server.await.unwrap()
+    }
+
+    #[tokio::test]
+    async fn handshake_hands_the_session_to_the_kernel() {
+        let Some(kernel) = probe() else {
+            eprintln!("Kernel TLS is not available here, skipping");
+            return;
+        };
+        assert!(echo_once(kernel, client_config(ring::default_provider())).await);
+    }
+
+    #[tokio::test]
+    async fn unsupported_cipher_stays_in_userspace() {
+        let provider = CryptoProvider {
+            cipher_suites: vec![ring::cipher_suite::TLS13_CHACHA20_POLY1305_SHA256],
+            ..ring::default_provider()
+        };
+        assert!(!echo_once(KernelTls { chacha20: false }, client_config(provider)).await);
+    }
+}
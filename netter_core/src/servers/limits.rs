@@ -0,0 +1,224 @@
+use std::{io, pin::Pin, sync::{Arc, atomic::{AtomicU64, Ordering}}, task::{Context, Poll}, time::Duration};
+use std::future::Future;
+use axum_server::accept::Accept;
+use futures_util::{FutureExt, future::BoxFuture};
+use hyper_util::{rt::TokioTimer, server::conn::auto};
+use log::{debug, warn};
+use tokio::{io::{AsyncRead, AsyncWrite, ReadBuf}, sync::{OwnedSemaphorePermit, Semaphore}, time::{Instant, Sleep}};
+use super::ServerLimits;
+
+/// Bounds the number of open connections and the time a connection may hold resources
+/// without making progress.
+///
+/// Connections above `max_connections` are closed right away instead of waiting in a queue.
+#[derive(Debug, Clone)]
+pub struct ConnectionLimiter {
+    permits: Arc<Semaphore>,
+    rejected: Arc<AtomicU64>,
+    limits: ServerLimits,
+}
+
+impl ConnectionLimiter {
+    pub fn new(permits: Arc<Semaphore>, limits: ServerLimits) -> Self {
+        Self {
+            permits,
+            rejected: Arc::new(AtomicU64::new(0)),
+            limits,
+        }
+    }
+
+    pub fn limits(&self) -> ServerLimits {
+        self.limits
+    }
+
+    /// Takes a connection slot, `None` if all of them are in use.
+    pub fn admit(&self) -> Option<OwnedSemaphorePermit> {
+        match self.permits.clone().try_acquire_owned() {
+            Ok(permit) => Some(permit),
+            Err(_) => {
+                let rejected = self.rejected.fetch_add(1, Ordering::Relaxed) + 1;
+                if rejected == 1 || rejected % 1000 == 0 {
+                    warn!("[HTTP Server :: Limits] Connection limit of {} reached, {} connections rejected so far",
+                        self.limits.max_connections, rejected);
+                }
+                None
+            }
+        }
+    }
+
+    pub fn guard<S>(&self, stream: S, permit: OwnedSemaphorePermit) -> GuardedStream<S> {
+        GuardedStream::new(stream, permit, self.limits.idle_timeout)
+    }
+}
+
+/// Applies the limits enforced by hyper itself to a connection builder.
+///
+/// hyper has no header timeout for HTTP/2, those connections rely on the idle guard.
+pub fn configure_builder<E>(builder: &mut auto::Builder<E>, limits: ServerLimits) {
+    builder.http1()
+        .timer(TokioTimer::new())
+        .header_read_timeout(limits.header_timeout);
+}
+
+/// Wraps the acceptor of a server (plain or TLS) with a [`ConnectionLimiter`].
+/// A TLS handshake must finish within `header_timeout`.
+#[derive(Debug, Clone)]
+pub struct LimitedAcceptor<A> {
+    inner: A,
+    limiter: ConnectionLimiter,
+}
+
+impl<A> LimitedAcceptor<A> {
+    pub fn new(inner: A, limiter: ConnectionLimiter) -> Self {
+        Self { inner, limiter }
+    }
+}
+
+impl<A, I, S> Accept<I, S> for LimitedAcceptor<A>
+where
+    A: Accept<I, S>,
+    A::Future: Send + 'static,
+    A::Stream: AsyncRead + AsyncWrite + Unpin + Send + 'static,
+    A::Service: Send + 'static,
+{
+    type Stream = GuardedStream<A::Stream>;
+    type Service = A::Service;
+    type Future = BoxFuture<'static, io::Result<(Self::Stream, Self::Service)>>;
+
+    fn accept(&self, stream: I, service: S) -> Self::Future {
+        let Some(permit) = self.limiter.admit() else {
+            drop(stream);
+            return futures_util::future::ready(Err(io::Error::new(io::ErrorKind::Other, "connection limit reached"))).boxed();
+        };
+
+        let handshake = self.inner.accept(stream, service);
+        let handshake_timeout = self.limiter.limits.header_timeout;
+        let limiter = self.limiter.clone();
+
+        async move {
+            let (stream, service) = match tokio::time::timeout(handshake_timeout, handshake).await {
+                Ok(accepted) => accepted?,
+                Err(_) => {
+                    debug!("[HTTP Server :: Limits] Handshake timed out");
+                    return Err(io::Error::new(io::ErrorKind::TimedOut, "handshake timed out"));
+                }
+            };
+
+            Ok((limiter.guard(stream, permit), service))
+        }.boxed()
+    }
+}
+
+/// Connection stream that holds a connection slot and fails once it stalls.
+///
+/// The idle timer only runs while the server waits for the client: a write the client
+/// doesn't read, or a read after the server has sent something. Time spent in a route
+/// after reading a request doesn't count.
+pub struct GuardedStream<S> {
+    inner: S,
+    _permit: OwnedSemaphorePermit,
+    idle_timeout: Duration,
+    idle: Pin<Box<Sleep>>,
+    last_progress: Instant,
+    wrote_last: bool,
+}
+
+impl<S> GuardedStream<S> {
+    fn new(inner: S, permit: OwnedSemaphorePermit, idle_timeout: Duration) -> Self {
+        let now = Instant::now();
+        Self {
+            inner,
+            _permit: permit,
+            idle_timeout,
+            idle: Box::pin(tokio::time::sleep_until(now + idle_timeout)),
+            last_progress: now,
+            wrote_last: false,
+        }
+    }
+
+    fn progress(&mut self, wrote: bool) {
+        // The timer is moved lazily in `idle_expired`, not on every read and write.
+        self.last_progress = Instant::now();
+        self.wrote_last = wrote;
+    }
+
+    fn idle_expired(&mut self, cx: &mut Context<'_>) -> bool {
+        loop {
+            if self.idle.as_mut().poll(cx).is_pending() {
+                return false;
+            }
+
+            let deadline = self.last_progress + self.idle_timeout;
+            if Instant::now() >= deadline {
+                return true;
+            }
+            self.idle.as_mut().reset(deadline);
+        }
+    }
+
+    fn timed_out() -> io::Error {
+        io::Error::new(io::ErrorKind::TimedOut, "connection idle timeout")
+    }
+}
+
+impl<S: AsyncRead + Unpin> AsyncRead for GuardedStream<S> {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut ReadBuf<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        let before = buf.filled().len();
+
+        match Pin::new(&mut this.inner).poll_read(cx, buf) {
+            Poll::Ready(Ok(())) => {
+                if buf.filled().len() > before {
+                    this.progress(false);
+                }
+                Poll::Ready(Ok(()))
+            }
+            Poll::Pending if this.wrote_last && this.idle_expired(cx) => Poll::Ready(Err(Self::timed_out())),
+            other => other,
+        }
+    }
+}
+
+impl<S: AsyncWrite + Unpin> AsyncWrite for GuardedStream<S> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+
+        match Pin::new(&mut this.inner).poll_write(cx, buf) {
+            Poll::Ready(Ok(written)) => {
+                if written > 0 {
+                    this.progress(true);
+                }
+                Poll::Ready(Ok(written))
+            }
+            Poll::Pending if this.idle_expired(cx) => Poll::Ready(Err(Self::timed_out())),
+            other => other,
+        }
+    }
+
+    fn poll_write_vectored(self: Pin<&mut Self>, cx: &mut Context<'_>, bufs: &[io::IoSlice<'_>]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+
+        match Pin::new(&mut this.inner).poll_write_vectored(cx, bufs) {
+            Poll::Ready(Ok(written)) => {
+                if written > 0 {
+                    this.progress(true);
+                }
+                Poll::Ready(Ok(written))
+            }
+            Poll::Pending if this.idle_expired(cx) => Poll::Ready(Err(Self::timed_out())),
+            other => other,
+        }
+    }
+
+    fn is_write_vectored(&self) -> bool {
+        self.inner.is_write_vectored()
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_shutdown(cx)
+    }
+}
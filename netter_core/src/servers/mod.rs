@@ -1,6 +1,6 @@
 #![allow(async_fn_in_trait)]
 
-use std::{fs::File, io::BufReader};
+use std::{fmt, fs::File, io::BufReader, path::PathBuf, time::Duration};
 use log::{debug, error};
 use rustls::ServerConfig;
 use rustls_pemfile::{certs, pkcs8_private_keys};
@@ -9,6 +9,22 @@ use crate::CoreError;
 
 pub mod webcosket_core;
 pub mod http_core;
+pub mod http_response;
+pub mod handshake_pool;
+#[cfg(target_os = "linux")]
+pub mod handoff;
+#[cfg(target_os = "linux")]
+pub mod ktls;
+pub mod limits;
+pub mod scheduler;
+pub mod shared_cache;
+pub mod single_flight;
+pub mod slow_log;
+pub mod timing;
+pub mod trace;
+pub mod traffic;
+#[cfg(unix)]
+pub mod unix;
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct TlsConfig {
@@ -17,10 +33,126 @@ pub struct TlsConfig {
     pub key_path: String,
 }
 
-#[allow(dead_code)]
+/// Connection limits and timeouts of an HTTP server, set in the `config` block.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+pub struct ServerLimits {
+    /// Connections above this are closed right after accept.
+    pub max_connections: usize,
+    /// Time to receive request headers. hyper counts it from the moment the connection is
+    /// ready for a request, so it also closes keep-alive connections that stay unused.
+    /// hyper only has this timer for HTTP/1: over HTTP/2 it limits the TLS handshake, and a
+    /// stalled connection is closed by `idle_timeout`.
+    pub header_timeout: Duration,
+    /// Time to receive the whole request body, `None` leaves slow bodies to `min_body_rate`.
+    pub body_timeout: Option<Duration>,
+    /// Time a connection may make no progress while the server waits for the client:
+    /// a client that stops reading the response, or a quiet connection after a response.
+    /// A `stream` response that writes nothing for this long counts as quiet too, `sse`
+    /// responses send a keep-alive comment every half of it.
+    pub idle_timeout: Duration,
+    /// Bytes per second a request body must arrive at after the first seconds, 0 disables it.
+    pub min_body_rate: u64,
+    /// `stream` and `sse` responses running at once. Each holds a thread of tokio's blocking
+    /// pool until it ends, requests above this get `503 Service Unavailable`.
+    pub max_streams: usize,
+}
+
+impl Default for ServerLimits {
+    fn default() -> Self {
+        Self {
+            max_connections: 10_000,
+            header_timeout: Duration::from_secs(10),
+            body_timeout: None,
+            idle_timeout: Duration::from_secs(60),
+            min_body_rate: 240,
+            max_streams: 256,
+        }
+    }
+}
+
+/// TLS handshake threads, set with `handshake_threads` in the `config` block.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+pub struct HandshakePoolConfig {
+    pub threads: usize,
+    /// Handshakes running at the same time, the rest wait in a queue.
+    pub max_in_flight: usize,
+}
+
+impl HandshakePoolConfig {
+    pub fn with_threads(threads: usize) -> Self {
+        Self { threads, max_in_flight: 256 }
+    }
+}
+
+/// Request tracing, set with `trace_export` and `trace_sample` in the `config` block.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TraceConfig {
+    pub export: TraceExport,
+    /// Percent of the requests without a `traceparent` that are traced.
+    pub sample: u8,
+}
+
+/// Where the spans of sampled requests go.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum TraceExport {
+    /// OTLP/HTTP endpoint that takes JSON, like `http://127.0.0.1:4318/v1/traces`.
+    Otlp(String),
+    /// File the spans are appended to.
+    File(PathBuf),
+}
+
+impl TraceExport {
+    pub const FILE_PREFIX: &'static str = "file:";
+
+    pub fn parse(target: &str) -> Option<Self> {
+        match target.strip_prefix(Self::FILE_PREFIX) {
+            Some(path) if !path.is_empty() => Some(TraceExport::File(PathBuf::from(path))),
+            Some(_) => None,
+            None if target.starts_with("http://") => Some(TraceExport::Otlp(target.to_string())),
+            None => None,
+        }
+    }
+}
+
+impl fmt::Display for TraceExport {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            TraceExport::Otlp(endpoint) => write!(f, "{}", endpoint),
+            TraceExport::File(path) => write!(f, "{}{}", Self::FILE_PREFIX, path.display()),
+        }
+    }
+}
+
+/// Slow request capture, set with `slow_request` and `slow_request_sample` in the `config` block.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+pub struct SlowRequestConfig {
+    /// Recorded requests that take longer are kept.
+    pub threshold: Duration,
+    /// Percent of the requests that are recorded, besides the traced ones.
+    pub sample: u8,
+}
+
+/// Share of the route execution threads a server gets, set in the `config` block.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+pub struct SchedulingPolicy {
+    /// Relative share when servers compete for threads.
+    pub weight: u32,
+    /// Percent of the threads the server may use at most, even when the others are idle.
+    pub cpu_share: u8,
+}
+
+impl Default for SchedulingPolicy {
+    fn default() -> Self {
+        Self { weight: 1, cpu_share: 100 }
+    }
+}
+
 pub struct ServerStats {
-    id: String,
-    uptime: u64,
+    pub id: String,
+    /// Seconds since the running instance started.
+    pub uptime: u64,
+    /// Also reported by `netter top`, see [`traffic::ServerLoad`].
+    pub handshakes: Option<handshake_pool::HandshakeStats>,
 }
 
 pub trait Server {
@@ -0,0 +1,290 @@
+use std::{collections::{HashMap, VecDeque}, panic::AssertUnwindSafe, sync::{Arc, Condvar, Mutex, MutexGuard, OnceLock}, time::{Duration, Instant}};
+use log::{error, info};
+use serde::{Deserialize, Serialize};
+use tokio::sync::oneshot;
+use super::SchedulingPolicy;
+
+/// Execution threads per CPU. Routes may wait on plugins or I/O, so there are more
+/// threads than CPUs, but far fewer than tokio's blocking pool.
+const THREADS_PER_CPU: usize = 4;
+
+/// Share of a job's measured cost that goes into the running estimate of the next ones.
+const COST_SMOOTHING: f64 = 0.2;
+
+static SCHEDULER: OnceLock<ExecutionScheduler> = OnceLock::new();
+
+/// The scheduler shared by all servers of the process, started on first use.
+pub fn global() -> &'static ExecutionScheduler {
+    SCHEDULER.get_or_init(|| {
+        let cpus = std::thread::available_parallelism().map_or(1, |n| n.get());
+        ExecutionScheduler::new(cpus * THREADS_PER_CPU)
+    })
+}
+
+/// Counters of all servers, empty while no server has started.
+pub fn stats() -> Vec<TenantStats> {
+    SCHEDULER.get().map(|scheduler| scheduler.stats()).unwrap_or_default()
+}
+
+/// Runs RDL route code of all servers on one set of threads.
+///
+/// Every server has its own queue. Free threads take the next job from the server that
+/// has received the least execution time relative to its `weight` (start-time fair
+/// queuing), so a busy server can't push the others out. `cpu_share` caps the threads a
+/// server may hold at once, even when the others are idle.
+pub struct ExecutionScheduler {
+    shared: Arc<Shared>,
+    threads: usize,
+}
+
+struct Shared {
+    state: Mutex<State>,
+    ready: Condvar,
+}
+
+#[derive(Default)]
+struct State {
+    tenants: HashMap<u64, TenantQueue>,
+    next_id: u64,
+    /// Start tag of the job that was dispatched last. Servers that were idle start from
+    /// here, so time spent idle isn't saved up as credit.
+    virtual_time: f64,
+}
+
+struct TenantQueue {
+    server_id: String,
+    policy: SchedulingPolicy,
+    max_running: usize,
+    jobs: VecDeque<Job>,
+    running: usize,
+    /// Execution time received so far divided by the weight, in nanoseconds.
+    virtual_time: f64,
+    /// Running estimate of a job's cost, charged up front and corrected on completion.
+    expected_cost: f64,
+    closed: bool,
+    completed: u64,
+    busy: Duration,
+    queue_wait: Duration,
+    max_queue_wait: Duration,
+}
+
+struct Job {
+    task: Box<dyn FnOnce() + Send>,
+    queued_at: Instant,
+}
+
+/// Isolation counters of one server.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TenantStats {
+    pub server_id: String,
+    pub weight: u32,
+    pub cpu_share: u8,
+    /// Route executions waiting for a thread.
+    pub queued: usize,
+    pub running: usize,
+    pub completed: u64,
+    /// Time the server's routes have held execution threads.
+    pub busy: Duration,
+    /// Time its route executions spent waiting, in total and at most.
+    pub queue_wait: Duration,
+    pub max_queue_wait: Duration,
+}
+
+impl ExecutionScheduler {
+    fn new(threads: usize) -> Self {
+        let shared = Arc::new(Shared {
+            state: Mutex::new(State::default()),
+            ready: Condvar::new(),
+        });
+        // Plugins may expect a runtime, threads enter the one the scheduler was started from.
+        let runtime = tokio::runtime::Handle::try_current().ok();
+
+        for n in 0..threads {
+            let shared = Arc::clone(&shared);
+            let runtime = runtime.clone();
+            let spawned = std::thread::Builder::new()
+                .name(format!("netter-exec-{}", n))
+                .spawn(move || {
+                    let _runtime = runtime.as_ref().map(|handle| handle.enter());
+                    shared.work();
+                });
+            if let Err(e) = spawned {
+                error!("[Scheduler] Failed to start execution thread: {}", e);
+            }
+        }
+        info!("[Scheduler] Running routes on {} execution threads", threads);
+
+        Self { shared, threads }
+    }
+
+    pub fn threads(&self) -> usize {
+        self.threads
+    }
+
+    /// Adds a queue for a server. It is removed once the returned [`Tenant`] is dropped
+    /// and the queued jobs have run.
+    pub fn register(&self, server_id: &str, policy: SchedulingPolicy) -> Tenant {
+        // A share always allows at least one thread, or the server would never run.
+        let max_running = (self.threads * policy.cpu_share as usize).div_ceil(100).max(1);
+
+        let mut state = self.shared.lock();
+        let id = state.next_id;
+        state.next_id += 1;
+        let virtual_time = state.virtual_time;
+        state.tenants.insert(id, TenantQueue {
+            server_id: server_id.to_string(),
+            policy,
+            max_running,
+            jobs: VecDeque::new(),
+            running: 0,
+            virtual_time,
+            expected_cost: 0.0,
+            closed: false,
+            completed: 0,
+            busy: Duration::ZERO,
+            queue_wait: Duration::ZERO,
+            max_queue_wait: Duration::ZERO,
+        });
+        info!("[Scheduler] Server {} registered with weight {} and {} of {} threads",
+            server_id, policy.weight, max_running, self.threads);
+
+        Tenant { id, shared: Arc::clone(&self.shared) }
+    }
+
+    pub fn stats(&self) -> Vec<TenantStats> {
+        let state = self.shared.lock();
+        let mut stats: Vec<_> = state.tenants.values()
+            .map(|tenant| TenantStats {
+                server_id: tenant.server_id.clone(),
+                weight: tenant.policy.weight,
+                cpu_share: tenant.policy.cpu_share,
+                queued: tenant.jobs.len(),
+                running: tenant.running,
+                completed: tenant.completed,
+                busy: tenant.busy,
+                queue_wait: tenant.queue_wait,
+                max_queue_wait: tenant.max_queue_wait,
+            })
+            .collect();
+        stats.sort_by(|a, b| a.server_id.cmp(&b.server_id));
+        stats
+    }
+}
+
+impl Shared {
+    fn lock(&self) -> MutexGuard<'_, State> {
+        // Jobs run outside the lock, a poisoned state is still consistent.
+        self.state.lock().unwrap_or_else(|poisoned| poisoned.into_inner())
+    }
+
+    fn work(&self) {
+        let mut state = self.lock();
+        loop {
+            let Some((id, job, charged)) = state.next_job() else {
+                state = self.ready.wait(state).unwrap_or_else(|poisoned| poisoned.into_inner());
+                continue;
+            };
+            drop(state);
+
+            let started = Instant::now();
+            let waited = started.duration_since(job.queued_at);
+            if std::panic::catch_unwind(AssertUnwindSafe(job.task)).is_err() {
+                error!("[Scheduler] Route execution panicked");
+            }
+            let elapsed = started.elapsed();
+
+            state = self.lock();
+            state.complete(id, charged, elapsed, waited);
+        }
+    }
+}
+
+impl State {
+    fn next_job(&mut self) -> Option<(u64, Job, f64)> {
+        let (&id, tenant) = self.tenants.iter_mut()
+            .filter(|(_, tenant)| !tenant.jobs.is_empty() && tenant.running < tenant.max_running)
+            .min_by(|(a_id, a), (b_id, b)| a.virtual_time.total_cmp(&b.virtual_time).then(a_id.cmp(b_id)))?;
+
+        let job = tenant.jobs.pop_front()?;
+        let charged = tenant.expected_cost / tenant.policy.weight as f64;
+        self.virtual_time = tenant.virtual_time;
+        tenant.virtual_time += charged;
+        tenant.running += 1;
+
+        Some((id, job, charged))
+    }
+
+    fn complete(&mut self, id: u64, charged: f64, elapsed: Duration, waited: Duration) {
+        let Some(tenant) = self.tenants.get_mut(&id) else {
+            return;
+        };
+
+        let cost = elapsed.as_nanos() as f64;
+        tenant.virtual_time += cost / tenant.policy.weight as f64 - charged;
+        tenant.expected_cost += (cost - tenant.expected_cost) * COST_SMOOTHING;
+        tenant.running -= 1;
+        tenant.completed += 1;
+        tenant.busy += elapsed;
+        tenant.queue_wait += waited;
+        tenant.max_queue_wait = tenant.max_queue_wait.max(waited);
+
+        if tenant.closed && tenant.jobs.is_empty() && tenant.running == 0 {
+            self.tenants.remove(&id);
+        }
+    }
+}
+
+/// Queue of one server in the [`ExecutionScheduler`].
+pub struct Tenant {
+    id: u64,
+    shared: Arc<Shared>,
+}
+
+impl Tenant {
+    /// Runs `task` on an execution thread once it is the server's turn, like
+    /// `spawn_blocking`. `None` if the task panicked.
+    ///
+    /// A task whose caller went away (the client disconnected) while it was queued is skipped.
+    pub async fn run<F, T>(&self, task: F) -> Option<T>
+    where
+        F: FnOnce() -> T + Send + 'static,
+        T: Send + 'static,
+    {
+        let (tx, rx) = oneshot::channel();
+        let job = Job {
+            task: Box::new(move || {
+                if !tx.is_closed() {
+                    let _ = tx.send(task());
+                }
+            }),
+            queued_at: Instant::now(),
+        };
+
+        {
+            let mut state = self.shared.lock();
+            let virtual_time = state.virtual_time;
+            let Some(tenant) = state.tenants.get_mut(&self.id) else {
+                return None;
+            };
+            if tenant.jobs.is_empty() && tenant.running == 0 {
+                tenant.virtual_time = tenant.virtual_time.max(virtual_time);
+            }
+            tenant.jobs.push_back(job);
+        }
+        self.shared.ready.notify_one();
+
+        rx.await.ok()
+    }
+}
+
+impl Drop for Tenant {
+    fn drop(&mut self) {
+        let mut state = self.shared.lock();
+        if let Some(tenant) = state.tenants.get_mut(&self.id) {
+            tenant.closed = true;
+            if tenant.jobs.is_empty() && tenant.running == 0 {
+                state.tenants.remove(&self.id);
+            }
+        }
+    }
+}
@@ -0,0 +1,773 @@
+//! Response and `Store` cache shared by every Netter process on the host.
+//!
+//! The cache is one file under the service's state directory, mapped into each process. It
+//! is only mapped from a regular file owned by the process's user. It holds:
+//!
+//! - a header with the layout and hit/miss counters;
+//! - an index of `AtomicU64` slots, each pointing at the chunk that holds a key;
+//! - four slab classes of fixed-size chunks: a value goes to the smallest class it fits in.
+//!
+//! Nothing is locked across processes after the file is set up. Every chunk has a version
+//! that is odd while a writer fills it: writers take a chunk by swapping their process id into
+//! it and skip the insert if another writer holds it, readers copy the chunk and drop the copy
+//! if the version moved meanwhile. A chunk whose writer process has exited is taken over.
+//! A reader always compares the whole key, so an index slot that points at a chunk reused
+//! for another key is a miss, not a wrong answer.
+//!
+//! Whether a writer has exited is told by its process id alone, so every process mapping
+//! the file must share one pid namespace: a Netter instance in another container would see
+//! live writers as gone and take their chunks over mid-copy.
+//!
+//! A full cache evicts the entry closest to expiry among two candidate chunks, so there is
+//! no shared LRU list to keep consistent.
+
+use std::{
+    path::{Path, PathBuf},
+    ptr,
+    sync::{OnceLock, atomic::{AtomicU32, AtomicU64, Ordering, fence}},
+    time::{Duration, SystemTime, UNIX_EPOCH},
+};
+use log::{debug, info, warn};
+
+const MAGIC: u64 = u64::from_le_bytes(*b"NETTERC1");
+const LAYOUT_VERSION: u32 = 2;
+/// Size of the segment the server maps by default.
+pub const DEFAULT_SIZE: usize = 64 * 1024 * 1024;
+/// Chunk sizes, header included. Values that don't fit the largest class aren't cached.
+const CLASS_SIZES: [usize; 4] = [256, 2048, 16 * 1024, 128 * 1024];
+/// Index slots looked at for one key.
+const PROBES: usize = 4;
+
+#[repr(C)]
+struct Header {
+    magic: AtomicU64,
+    layout_version: u32,
+    index_slots: u32,
+    chunks: [u32; 4],
+    size: u64,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    inserts: AtomicU64,
+    evictions: AtomicU64,
+}
+
+#[repr(C)]
+struct ChunkHeader {
+    /// Odd while a writer fills the chunk.
+    version: AtomicU64,
+    hash: AtomicU64,
+    /// 0 for a free chunk.
+    expires_at: AtomicU64,
+    /// Process id of the writer that holds the chunk, 0 when none does.
+    writer: AtomicU32,
+    key_len: AtomicU32,
+    value_len: AtomicU32,
+}
+
+const HEADER_SIZE: usize = align_up(size_of::<Header>(), 64);
+const CHUNK_HEADER_SIZE: usize = size_of::<ChunkHeader>();
+
+const fn align_up(value: usize, align: usize) -> usize {
+    (value + align - 1) & !(align - 1)
+}
+
+/// Where each part of the segment starts.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct Geometry {
+    index_slots: usize,
+    chunks: [usize; 4],
+    class_offsets: [usize; 4],
+}
+
+impl Geometry {
+    fn for_size(size: usize) -> Option<Self> {
+        // At least two index slots per chunk, so most probe sequences have a free slot even
+        // when every chunk is taken. Counted without the index, which only makes it larger.
+        let chunks_without_index: usize = CLASS_SIZES.iter()
+            .map(|chunk_size| size.saturating_sub(HEADER_SIZE) / CLASS_SIZES.len() / chunk_size)
+            .sum();
+        let index_slots = (chunks_without_index * 2).next_power_of_two().max(PROBES);
+        let data_start = HEADER_SIZE + index_slots * size_of::<u64>();
+        let per_class = size.checked_sub(data_start)? / CLASS_SIZES.len();
+
+        let mut chunks = [0; 4];
+        let mut class_offsets = [0; 4];
+        for (class, chunk_size) in CLASS_SIZES.iter().enumerate() {
+            chunks[class] = per_class / chunk_size;
+            class_offsets[class] = data_start + class * per_class;
+        }
+
+        if chunks.iter().any(|&count| count == 0 || count >= 1 << 28) {
+            return None;
+        }
+
+        Some(Self { index_slots, chunks, class_offsets })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SharedCacheStats {
+    pub size: usize,
+    pub hits: u64,
+    pub misses: u64,
+    pub inserts: u64,
+    pub evictions: u64,
+    /// False when the segment couldn't be mapped and the cache is private to this process.
+    pub shared: bool,
+}
+
+pub struct SharedCache {
+    region: Region,
+    geometry: Geometry,
+}
+
+// All access to the region goes through atomics or the chunk versions.
+unsafe impl Send for SharedCache {}
+unsafe impl Sync for SharedCache {}
+
+impl SharedCache {
+    /// Maps the segment at `path`, creating it if needed. A segment of another size or layout
+    /// is replaced, processes that still map the old one keep using it until they restart.
+    ///
+    /// If the file can't be mapped the cache still works, but only inside this process.
+    pub fn open(path: &Path, size: usize) -> Self {
+        let size = align_up(size, 4096);
+        let geometry = match Geometry::for_size(size) {
+            Some(geometry) => geometry,
+            None => {
+                warn!("[Shared Cache] {} bytes is too small for a cache, using {}", size, DEFAULT_SIZE);
+                return Self::open(path, DEFAULT_SIZE);
+            }
+        };
+
+        match Region::map(path, size, &geometry) {
+            Ok(region) => {
+                info!("[Shared Cache] Mapped {} MB at {}", size / (1024 * 1024), path.display());
+                Self { region, geometry }
+            }
+            Err(e) => {
+                warn!("[Shared Cache] Can't map '{}', the cache is private to this process: {}", path.display(), e);
+                Self::private(size)
+            }
+        }
+    }
+
+    /// A cache in this process's own memory.
+    pub fn private(size: usize) -> Self {
+        let size = Some(align_up(size, 4096))
+            .filter(|&size| Geometry::for_size(size).is_some())
+            .unwrap_or(DEFAULT_SIZE);
+        let geometry = Geometry::for_size(size).expect("the default size fits the layout");
+        let region = Region::heap(size);
+        init_header(&region, size, &geometry);
+        Self { region, geometry }
+    }
+
+    pub fn get(&self, key: &[u8]) -> Option<Vec<u8>> {
+        let hash = hash(key);
+        let now = now_ms();
+
+        for slot in self.probe(hash) {
+            let entry = slot.load(Ordering::Acquire);
+            if entry == 0 || tag(entry) != tag(hash) {
+                continue;
+            }
+            let Some((class, chunk)) = self.unpack(entry) else {
+                continue;
+            };
+            if let Some(value) = self.read_chunk(class, chunk, hash, key, now) {
+                self.header().hits.fetch_add(1, Ordering::Relaxed);
+                return Some(value);
+            }
+        }
+
+        self.header().misses.fetch_add(1, Ordering::Relaxed);
+        None
+    }
+
+    /// Stores `value` for `ttl`. Returns false when it's too large or another process is
+    /// writing the chunks it could go to; the caller just doesn't get a cached copy then.
+    pub fn insert(&self, key: &[u8], value: &[u8], ttl: Duration) -> bool {
+        let needed = CHUNK_HEADER_SIZE + key.len() + value.len();
+        let Some(class) = CLASS_SIZES.iter().position(|&size| size >= needed) else {
+            return false;
+        };
+
+        let hash = hash(key);
+        let now = now_ms();
+        let expires_at = now.saturating_add(ttl.as_millis() as u64).max(1);
+
+        let chunk = self.pick_chunk(class, hash, now);
+        let Some(version) = self.lock_chunk(class, chunk) else {
+            return false;
+        };
+
+        let header = self.chunk(class, chunk);
+        let evicted = header.expires_at.load(Ordering::Relaxed) > now
+            && header.hash.load(Ordering::Relaxed) != hash;
+
+        header.hash.store(hash, Ordering::Relaxed);
+        header.expires_at.store(expires_at, Ordering::Relaxed);
+        header.key_len.store(key.len() as u32, Ordering::Relaxed);
+        header.value_len.store(value.len() as u32, Ordering::Relaxed);
+        unsafe {
+            let payload = self.payload(class, chunk);
+            ptr::copy_nonoverlapping(key.as_ptr(), payload, key.len());
+            ptr::copy_nonoverlapping(value.as_ptr(), payload.add(key.len()), value.len());
+        }
+        if !unlock_chunk(header, version) {
+            return false;
+        }
+
+        // Older copies of the key in other classes would be found first by some probes.
+        for other in 0..CLASS_SIZES.len() {
+            if other != class {
+                self.invalidate(other, hash, key, now);
+            }
+        }
+        self.link(hash, class, chunk, now);
+
+        let stats = self.header();
+        stats.inserts.fetch_add(1, Ordering::Relaxed);
+        if evicted {
+            stats.evictions.fetch_add(1, Ordering::Relaxed);
+        }
+        true
+    }
+
+    pub fn remove(&self, key: &[u8]) -> bool {
+        let hash = hash(key);
+        let now = now_ms();
+        let mut removed = false;
+
+        for class in 0..CLASS_SIZES.len() {
+            removed |= self.invalidate(class, hash, key, now);
+        }
+
+        for slot in self.probe(hash) {
+            let entry = slot.load(Ordering::Acquire);
+            if entry != 0 && tag(entry) == tag(hash) {
+                let Some((class, chunk)) = self.unpack(entry) else {
+                    continue;
+                };
+                if self.chunk(class, chunk).expires_at.load(Ordering::Acquire) == 0 {
+                    let _ = slot.compare_exchange(entry, 0, Ordering::AcqRel, Ordering::Relaxed);
+                }
+            }
+        }
+
+        removed
+    }
+
+    pub fn stats(&self) -> SharedCacheStats {
+        let header = self.header();
+        SharedCacheStats {
+            size: self.region.len,
+            hits: header.hits.load(Ordering::Relaxed),
+            misses: header.misses.load(Ordering::Relaxed),
+            inserts: header.inserts.load(Ordering::Relaxed),
+            evictions: header.evictions.load(Ordering::Relaxed),
+            shared: self.region.is_shared(),
+        }
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.region.ptr as *const Header) }
+    }
+
+    fn probe(&self, hash: u64) -> impl Iterator<Item = &AtomicU64> {
+        let mask = self.geometry.index_slots - 1;
+        let start = hash as usize & mask;
+        (0..PROBES).map(move |i| unsafe {
+            &*(self.region.ptr.add(HEADER_SIZE + ((start + i) & mask) * size_of::<u64>()) as *const AtomicU64)
+        })
+    }
+
+    /// The class and chunk an index slot points at, None for a slot that points outside the
+    /// segment, which only a corrupted segment has.
+    fn unpack(&self, entry: u64) -> Option<(usize, usize)> {
+        let class = ((entry >> 28) & 0xF) as usize;
+        let chunk = ((entry & 0x0FFF_FFFF) as usize).checked_sub(1)?;
+        (class < CLASS_SIZES.len() && chunk < self.geometry.chunks[class]).then_some((class, chunk))
+    }
+
+    fn chunk(&self, class: usize, chunk: usize) -> &ChunkHeader {
+        let offset = self.geometry.class_offsets[class] + chunk * CLASS_SIZES[class];
+        unsafe { &*(self.region.ptr.add(offset) as *const ChunkHeader) }
+    }
+
+    fn payload(&self, class: usize, chunk: usize) -> *mut u8 {
+        let offset = self.geometry.class_offsets[class] + chunk * CLASS_SIZES[class] + CHUNK_HEADER_SIZE;
+        unsafe { self.region.ptr.add(offset) }
+    }
+
+    /// The two chunks a key may live in within a class.
+    fn candidates(&self, class: usize, hash: u64) -> [usize; 2] {
+        let count = self.geometry.chunks[class] as u64;
+        [(hash % count) as usize, (hash.rotate_left(29).wrapping_mul(0x9E37_79B9_7F4A_7C15) % count) as usize]
+    }
+
+    fn pick_chunk(&self, class: usize, hash: u64, now: u64) -> usize {
+        let [first, second] = self.candidates(class, hash);
+        let (a, b) = (self.chunk(class, first), self.chunk(class, second));
+
+        if a.hash.load(Ordering::Relaxed) == hash {
+            return first;
+        }
+        if b.hash.load(Ordering::Relaxed) == hash {
+            return second;
+        }
+
+        let expiry = |chunk: &ChunkHeader| {
+            let expires_at = chunk.expires_at.load(Ordering::Relaxed);
+            if expires_at <= now { 0 } else { expires_at }
+        };
+        if expiry(b) < expiry(a) { second } else { first }
+    }
+
+    /// Takes a chunk for writing and returns its odd version, or None if a live writer has it.
+    fn lock_chunk(&self, class: usize, chunk: usize) -> Option<u64> {
+        let header = self.chunk(class, chunk);
+        let writer = header.writer.load(Ordering::Acquire);
+        if writer != 0 && process_alive(writer) {
+            return None;
+        }
+        header.writer.compare_exchange(writer, std::process::id(), Ordering::AcqRel, Ordering::Relaxed).ok()?;
+
+        // A writer that died mid-write left the version odd. It stays odd, readers keep
+        // skipping the chunk until this write is done.
+        let version = header.version.load(Ordering::Relaxed);
+        let locked = if version % 2 == 0 { version + 1 } else { version + 2 };
+        header.version.store(locked, Ordering::Relaxed);
+        // The payload writes must not become visible before the version turns odd.
+        fence(Ordering::Release);
+        Some(locked)
+    }
+
+    fn read_chunk(&self, class: usize, chunk: usize, hash: u64, key: &[u8], now: u64) -> Option<Vec<u8>> {
+        let header = self.chunk(class, chunk);
+        let version = header.version.load(Ordering::Acquire);
+        if version % 2 == 1 {
+            return None;
+        }
+
+        if header.hash.load(Ordering::Relaxed) != hash || header.expires_at.load(Ordering::Relaxed) <= now {
+            return None;
+        }
+        let key_len = header.key_len.load(Ordering::Relaxed) as usize;
+        let value_len = header.value_len.load(Ordering::Relaxed) as usize;
+        if key_len != key.len() || CHUNK_HEADER_SIZE + key_len + value_len > CLASS_SIZES[class] {
+            return None;
+        }
+
+        let mut stored = vec![0u8; key_len + value_len];
+        unsafe {
+            ptr::copy_nonoverlapping(self.payload(class, chunk), stored.as_mut_ptr(), stored.len());
+        }
+
+        // A writer that took the chunk during the copy has changed the version.
+        fence(Ordering::Acquire);
+        if header.version.load(Ordering::Relaxed) != version || &stored[..key_len] != key {
+            return None;
+        }
+
+        stored.drain(..key_len);
+        Some(stored)
+    }
+
+    /// Frees the chunk of `class` that holds `key`, if any.
+    fn invalidate(&self, class: usize, hash: u64, key: &[u8], now: u64) -> bool {
+        let mut removed = false;
+
+        for chunk in self.candidates(class, hash) {
+            let header = self.chunk(class, chunk);
+            if self.read_chunk(class, chunk, hash, key, now).is_none() {
+                continue;
+            }
+            if let Some(version) = self.lock_chunk(class, chunk) {
+                if header.hash.load(Ordering::Relaxed) == hash {
+                    header.expires_at.store(0, Ordering::Relaxed);
+                    header.hash.store(0, Ordering::Relaxed);
+                    removed = true;
+                }
+                removed &= unlock_chunk(header, version);
+            }
+        }
+
+        removed
+    }
+
+    /// Points an index slot at the chunk. Slots of free or reused chunks are taken first,
+    /// a full probe sequence loses its first slot.
+    fn link(&self, hash: u64, class: usize, chunk: usize, now: u64) {
+        let entry = pack(hash, class, chunk);
+        let mut target = None;
+
+        for slot in self.probe(hash) {
+            let current = slot.load(Ordering::Acquire);
+            if current == entry {
+                return;
+            }
+            if current == 0 {
+                target = target.or(Some(slot));
+                continue;
+            }
+
+            let Some((other_class, other_chunk)) = self.unpack(current) else {
+                target = target.or(Some(slot));
+                continue;
+            };
+            let other = self.chunk(other_class, other_chunk);
+            let dead = other.expires_at.load(Ordering::Relaxed) <= now
+                || tag(other.hash.load(Ordering::Relaxed)) != tag(current);
+            if dead || (tag(current) == tag(hash) && other_class == class) {
+                target = target.or(Some(slot));
+            }
+        }
+
+        let slot = target.unwrap_or_else(|| self.probe(hash).next().unwrap());
+        slot.store(entry, Ordering::Release);
+    }
+}
+
+fn init_header(region: &Region, size: usize, geometry: &Geometry) {
+    let header = unsafe { &mut *(region.ptr as *mut Header) };
+    header.layout_version = LAYOUT_VERSION;
+    header.index_slots = geometry.index_slots as u32;
+    header.chunks = geometry.chunks.map(|count| count as u32);
+    header.size = size as u64;
+    header.magic.store(MAGIC, Ordering::Release);
+}
+
+fn header_matches(region: &Region, size: usize, geometry: &Geometry) -> bool {
+    let header = unsafe { &*(region.ptr as *const Header) };
+    header.magic.load(Ordering::Acquire) == MAGIC
+        && header.layout_version == LAYOUT_VERSION
+        && header.size == size as u64
+        && header.index_slots as usize == geometry.index_slots
+        && header.chunks == geometry.chunks.map(|count| count as u32)
+}
+
+/// Ends a write started by `lock_chunk`. False if another writer has taken the chunk over
+/// meanwhile, the chunk is then that writer's to finish.
+fn unlock_chunk(header: &ChunkHeader, locked: u64) -> bool {
+    if header.version.compare_exchange(locked, locked + 1, Ordering::Release, Ordering::Relaxed).is_err() {
+        return false;
+    }
+    header.writer.store(0, Ordering::Release);
+    true
+}
+
+/// Whether the process that wrote a chunk still runs. Only a writer that has exited leaves
+/// a chunk odd for good, a live one always finishes its copy.
+///
+/// The pid is all there is to go on. If it was reused by an unrelated process, the chunk
+/// counts as held until that process exits too: inserts that land on it are skipped, which
+/// loses space but never data. A pid from another pid namespace means nothing here, see
+/// the module doc.
+#[cfg(target_os = "linux")]
+fn process_alive(pid: u32) -> bool {
+    pid == std::process::id()
+        || unsafe { libc::kill(pid as libc::pid_t, 0) } == 0
+        || std::io::Error::last_os_error().raw_os_error() != Some(libc::ESRCH)
+}
+
+/// Without a shared segment every writer is this process.
+#[cfg(not(target_os = "linux"))]
+fn process_alive(_pid: u32) -> bool {
+    true
+}
+
+// Index slot: 32-bit hash tag, 4-bit class, 28-bit chunk number plus one (so it's never 0).
+fn pack(hash: u64, class: usize, chunk: usize) -> u64 {
+    (hash & 0xFFFF_FFFF_0000_0000) | (class as u64) << 28 | (chunk as u64 + 1)
+}
+
+fn tag(value: u64) -> u64 {
+    value >> 32
+}
+
+/// FNV-1a, stable across processes and builds unlike `DefaultHasher`.
+fn hash(key: &[u8]) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325u64;
+    for byte in key {
+        hash ^= *byte as u64;
+        hash = hash.wrapping_mul(0x0100_0000_01b3);
+    }
+    // 0 marks a free chunk.
+    hash.max(1)
+}
+
+fn now_ms() -> u64 {
+    SystemTime::now().duration_since(UNIX_EPOCH).map(|d| d.as_millis() as u64).unwrap_or(0)
+}
+
+struct Region {
+    ptr: *mut u8,
+    len: usize,
+    heap: Option<Vec<u64>>,
+}
+
+impl Region {
+    fn heap(len: usize) -> Self {
+        let mut memory = vec![0u64; len / size_of::<u64>()];
+        Self { ptr: memory.as_mut_ptr() as *mut u8, len, heap: Some(memory) }
+    }
+
+    fn is_shared(&self) -> bool {
+        self.heap.is_none()
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    fn map(_path: &Path, _len: usize, _geometry: &Geometry) -> std::io::Result<Self> {
+        Err(std::io::Error::new(std::io::ErrorKind::Unsupported, "shared memory segments are only supported on Linux"))
+    }
+
+    /// Opens and maps the file. Setting up a new file happens under `flock`, so processes that
+    /// start together agree on one segment.
+    ///
+    /// The file isn't followed if it's a symlink, and is refused unless it's a regular file
+    /// of this process's user: another user's segment could feed forged entries to readers.
+    #[cfg(target_os = "linux")]
+    fn map(path: &Path, len: usize, geometry: &Geometry) -> std::io::Result<Self> {
+        use std::{fs::{DirBuilder, OpenOptions}, io::{Error, ErrorKind}, os::{fd::AsRawFd, unix::fs::{DirBuilderExt, MetadataExt, OpenOptionsExt}}};
+
+        if let Some(parent) = path.parent() {
+            DirBuilder::new().recursive(true).mode(0o700).create(parent)?;
+        }
+
+        // Another process may replace the file between our open and our lock.
+        for _ in 0..8 {
+            let file = OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .mode(0o600)
+                .custom_flags(libc::O_NOFOLLOW | libc::O_CLOEXEC)
+                .open(path)?;
+
+            let metadata = file.metadata()?;
+            if !metadata.file_type().is_file() {
+                return Err(Error::new(ErrorKind::InvalidInput, "the segment is not a regular file"));
+            }
+            if metadata.uid() != unsafe { libc::geteuid() } {
+                return Err(Error::new(ErrorKind::PermissionDenied, format!("the segment is owned by uid {}", metadata.uid())));
+            }
+
+            if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX) } != 0 {
+                return Err(Error::last_os_error());
+            }
+            // Another process may have set the file up while we waited.
+            let metadata = file.metadata()?;
+
+            match std::fs::symlink_metadata(path) {
+                Ok(current) if current.ino() == metadata.ino() && current.dev() == metadata.dev() => {}
+                _ => continue,
+            }
+
+            let fresh = metadata.len() == 0;
+            if fresh {
+                file.set_len(len as u64)?;
+            } else if metadata.len() != len as u64 {
+                debug!("[Shared Cache] Replacing segment of {} bytes at {}", metadata.len(), path.display());
+                std::fs::remove_file(path)?;
+                continue;
+            }
+
+            let ptr = unsafe {
+                libc::mmap(ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, file.as_raw_fd(), 0)
+            };
+            if ptr == libc::MAP_FAILED {
+                return Err(Error::last_os_error());
+            }
+            let region = Self { ptr: ptr as *mut u8, len, heap: None };
+
+            if fresh {
+                init_header(&region, len, geometry);
+            } else if !header_matches(&region, len, geometry) {
+                debug!("[Shared Cache] Replacing segment with another layout at {}", path.display());
+                drop(region);
+                std::fs::remove_file(path)?;
+                continue;
+            }
+
+            // The mapping keeps the open file alive, closing it wouldn't release the lock.
+            unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_UN) };
+            return Ok(region);
+        }
+
+        Err(Error::new(ErrorKind::WouldBlock, "the segment kept being replaced"))
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        #[cfg(target_os = "linux")]
+        if self.heap.is_none() {
+            unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+        }
+    }
+}
+
+static CACHE_PATH: OnceLock<PathBuf> = OnceLock::new();
+static CACHE: OnceLock<SharedCache> = OnceLock::new();
+
+/// Sets the file of the host's cache segment. Only takes effect before the cache is first used.
+/// Without it the cache is private to this process.
+pub fn set_path(path: PathBuf) {
+    if CACHE_PATH.set(path).is_err() {
+        debug!("[Shared Cache] Path is already set");
+    }
+}
+
+/// The cache segment of this host, mapped on first use.
+pub fn global() -> &'static SharedCache {
+    CACHE.get_or_init(|| match CACHE_PATH.get() {
+        Some(path) => SharedCache::open(path, DEFAULT_SIZE),
+        None => SharedCache::private(DEFAULT_SIZE),
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const SMALL: usize = 1024 * 1024;
+
+    #[cfg(target_os = "linux")]
+    fn segment_path(test: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("netter-shared-cache-{}-{}", std::process::id(), test));
+        let _ = std::fs::remove_dir_all(&dir);
+        dir.join("shared-cache.bin")
+    }
+
+    #[test]
+    fn insert_then_get() {
+        let cache = SharedCache::private(SMALL);
+        assert!(cache.insert(b"small", b"value", Duration::from_secs(60)));
+        assert!(cache.insert(b"large", &[7; 10_000], Duration::from_secs(60)));
+
+        assert_eq!(cache.get(b"small").as_deref(), Some(&b"value"[..]));
+        assert_eq!(cache.get(b"large"), Some(vec![7; 10_000]));
+        assert_eq!(cache.get(b"missing"), None);
+
+        // A larger value for the same key moves it to another class.
+        assert!(cache.insert(b"small", &[1; 5000], Duration::from_secs(60)));
+        assert_eq!(cache.get(b"small"), Some(vec![1; 5000]));
+
+        assert!(cache.remove(b"small"));
+        assert_eq!(cache.get(b"small"), None);
+        assert!(!cache.insert(b"huge", &[0; 200_000], Duration::from_secs(60)));
+    }
+
+    #[test]
+    fn index_fits_every_chunk() {
+        let geometry = Geometry::for_size(DEFAULT_SIZE).unwrap();
+        let chunks: usize = geometry.chunks.iter().sum();
+        assert!(geometry.index_slots >= 2 * chunks, "{} slots for {} chunks", geometry.index_slots, chunks);
+    }
+
+    #[test]
+    fn full_class_evicts() {
+        // The largest class of a small cache has a single chunk.
+        let cache = SharedCache::private(SMALL);
+        assert_eq!(cache.geometry.chunks[3], 1);
+
+        assert!(cache.insert(b"first", &[1; 100_000], Duration::from_secs(60)));
+        assert!(cache.insert(b"second", &[2; 100_000], Duration::from_secs(60)));
+
+        assert_eq!(cache.get(b"first"), None);
+        assert_eq!(cache.get(b"second"), Some(vec![2; 100_000]));
+        assert_eq!(cache.stats().evictions, 1);
+    }
+
+    #[test]
+    fn index_slot_out_of_bounds_is_a_miss() {
+        let cache = SharedCache::private(SMALL);
+        let hash = hash(b"key");
+        for slot in cache.probe(hash) {
+            slot.store((hash & 0xFFFF_FFFF_0000_0000) | 9 << 28 | 1, Ordering::Relaxed);
+        }
+        assert_eq!(cache.get(b"key"), None);
+
+        for slot in cache.probe(hash) {
+            slot.store((hash & 0xFFFF_FFFF_0000_0000) | 3 << 28 | 0x0FFF_FFFF, Ordering::Relaxed);
+        }
+        assert_eq!(cache.get(b"key"), None);
+        assert!(!cache.remove(b"key"));
+
+        assert!(cache.insert(b"key", b"value", Duration::from_secs(60)));
+        assert_eq!(cache.get(b"key").as_deref(), Some(&b"value"[..]));
+    }
+
+    #[test]
+    fn chunk_of_exited_writer_is_taken_over() {
+        let cache = SharedCache::private(SMALL);
+        assert!(cache.insert(b"key", b"old", Duration::from_secs(60)));
+
+        let class = 0;
+        let chunk = cache.pick_chunk(class, hash(b"key"), now_ms());
+        assert!(cache.lock_chunk(class, chunk).is_some());
+        // Still held by this process.
+        assert!(!cache.insert(b"key", b"new", Duration::from_secs(60)));
+
+        #[cfg(target_os = "linux")]
+        {
+            // Pids never reach `i32::MAX`, so no process has this one.
+            cache.chunk(class, chunk).writer.store(i32::MAX as u32, Ordering::Relaxed);
+            assert!(cache.insert(b"key", b"new", Duration::from_secs(60)));
+            assert_eq!(cache.get(b"key").as_deref(), Some(&b"new"[..]));
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn shared_segment_survives_reopen() {
+        let path = segment_path("reopen");
+        let cache = SharedCache::open(&path, SMALL);
+        assert!(cache.stats().shared);
+        assert!(cache.insert(b"key", b"value", Duration::from_secs(60)));
+        drop(cache);
+
+        let cache = SharedCache::open(&path, SMALL);
+        assert_eq!(cache.get(b"key").as_deref(), Some(&b"value"[..]));
+        let _ = std::fs::remove_dir_all(path.parent().unwrap());
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn corrupt_segment_is_replaced() {
+        use std::io::{Seek, SeekFrom, Write};
+
+        let path = segment_path("corrupt");
+        let cache = SharedCache::open(&path, SMALL);
+        assert!(cache.insert(b"key", b"value", Duration::from_secs(60)));
+        drop(cache);
+
+        let mut file = std::fs::OpenOptions::new().write(true).open(&path).unwrap();
+        file.seek(SeekFrom::Start(0)).unwrap();
+        file.write_all(&[0xAB; HEADER_SIZE]).unwrap();
+        drop(file);
+
+        let cache = SharedCache::open(&path, SMALL);
+        assert!(cache.stats().shared);
+        assert_eq!(cache.get(b"key"), None);
+        assert!(cache.insert(b"key", b"value", Duration::from_secs(60)));
+        assert_eq!(cache.get(b"key").as_deref(), Some(&b"value"[..]));
+        let _ = std::fs::remove_dir_all(path.parent().unwrap());
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn symlinked_segment_is_not_followed() {
+        let path = segment_path("symlink");
+        let target = path.with_file_name("target.bin");
+        std::fs::create_dir_all(path.parent().unwrap()).unwrap();
+        std::os::unix::fs::symlink(&target, &path).unwrap();
+
+        let cache = SharedCache::open(&path, SMALL);
+        assert!(!cache.stats().shared);
+        assert!(!target.exists());
+        let _ = std::fs::remove_dir_all(path.parent().unwrap());
+    }
+}
@@ -0,0 +1,68 @@
+use std::{collections::HashMap, future::Future, sync::{Arc, Mutex}};
+use futures_util::{FutureExt, future::{BoxFuture, Shared}};
+use log::trace;
+use super::http_response::BufferedResponse;
+
+type Flight = Shared<BoxFuture<'static, Option<Arc<BufferedResponse>>>>;
+
+/// Merges concurrent executions with the same key into one.
+///
+/// The first request with a key starts the work on its own task, later requests with the
+/// same key wait for it. The key is released as soon as the work finishes, so nothing is
+/// cached: a request that comes after that runs the route again.
+#[derive(Debug, Default)]
+pub struct SingleFlight {
+    flights: Mutex<HashMap<String, Flight>>,
+}
+
+impl SingleFlight {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub async fn run<F>(self: &Arc<Self>, key: String, work: F) -> Option<Arc<BufferedResponse>>
+    where
+        F: Future<Output = Option<BufferedResponse>> + Send + 'static,
+    {
+        let flight = {
+            let mut flights = self.flights.lock().unwrap_or_else(|e| e.into_inner());
+
+            match flights.get(&key) {
+                Some(flight) => {
+                    trace!("[HTTP Server :: Single Flight] Joining in-flight request {:?}", key);
+                    flight.clone()
+                }
+                None => {
+                    let this = Arc::clone(self);
+                    let task_key = key.clone();
+
+                    // The work runs on its own task: the leader's connection may go away,
+                    // but the waiters still need the response.
+                    let task = tokio::spawn(async move {
+                        // Released even if the route panics, otherwise the key would stay taken forever.
+                        let _release = Release { flights: this, key: task_key };
+                        work.await.map(Arc::new)
+                    });
+
+                    let flight = task.map(|result| result.ok().flatten()).boxed().shared();
+                    flights.insert(key, flight.clone());
+                    flight
+                }
+            }
+        };
+
+        flight.await
+    }
+}
+
+struct Release {
+    flights: Arc<SingleFlight>,
+    key: String,
+}
+
+impl Drop for Release {
+    fn drop(&mut self) {
+        // The map stays locked until the flight is inserted, so this can't run before that.
+        self.flights.flights.lock().unwrap_or_else(|e| e.into_inner()).remove(&self.key);
+    }
+}
@@ -0,0 +1,357 @@
+//! Execution traces of slow requests, read with `netter slow`.
+//!
+//! With `slow_request = <milliseconds>;` in the `config` block, sampled requests record where
+//! their route spends its time: every statement of the route with its duration and the
+//! plugin calls inside it, and the size of the route's variables at the end. A recorded
+//! request that took longer than the threshold is kept in a ring buffer of its server, the
+//! others are discarded.
+//!
+//! Like [`super::timing`], the recording lives in a thread-local while [`capture`] runs the
+//! route. A request that isn't recorded costs one thread-local check per route and per
+//! plugin call.
+
+use std::{cell::RefCell, collections::{HashMap, VecDeque}, sync::{Arc, Mutex, Weak}, time::{Duration, Instant, SystemTime, UNIX_EPOCH}};
+use log::info;
+use netter_sdk::RDLTypes;
+use serde::{Deserialize, Serialize};
+use super::{SlowRequestConfig, trace};
+
+/// Slow requests kept per server, the oldest is dropped first.
+const CAPACITY: usize = 32;
+/// Statements kept per request, the slowest ones.
+const MAX_STATEMENTS: usize = 128;
+/// Largest variables kept per request.
+const MAX_VARIABLES: usize = 16;
+
+/// Slow requests of one server.
+#[derive(Debug)]
+pub struct SlowLog {
+    server_id: String,
+    threshold: Duration,
+    sample: u64,
+    requests: Mutex<VecDeque<SlowRequest>>,
+}
+
+impl SlowLog {
+    /// Decides whether a request is recorded.
+    pub fn sample(&self) -> bool {
+        trace::random() % 100 < self.sample
+    }
+
+    fn push(&self, request: SlowRequest) {
+        let mut requests = self.requests.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+        if requests.len() == CAPACITY {
+            requests.pop_front();
+        }
+        requests.push_back(request);
+    }
+
+    fn stats(&self) -> SlowRequestLog {
+        let requests = self.requests.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+        SlowRequestLog {
+            server_id: self.server_id.clone(),
+            threshold: self.threshold,
+            requests: requests.iter().rev().cloned().collect(),
+        }
+    }
+}
+
+static SERVERS: Mutex<Vec<Weak<SlowLog>>> = Mutex::new(Vec::new());
+
+/// Ring buffer for a server. It is listed by [`stats`] until the returned value is dropped.
+pub fn register(server_id: &str, config: &SlowRequestConfig) -> Arc<SlowLog> {
+    let log = Arc::new(SlowLog {
+        server_id: server_id.to_string(),
+        threshold: config.threshold,
+        sample: config.sample as u64,
+        requests: Mutex::new(VecDeque::with_capacity(CAPACITY)),
+    });
+    info!("[Slow Requests] Server {} records {}% of requests, keeps those slower than {:?}", server_id, config.sample, config.threshold);
+
+    let mut servers = SERVERS.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+    servers.retain(|server| server.strong_count() > 0);
+    servers.push(Arc::downgrade(&log));
+    log
+}
+
+/// Slow requests of all running servers with `slow_request` set.
+pub fn stats() -> Vec<SlowRequestLog> {
+    let servers = SERVERS.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+    let mut stats: Vec<_> = servers.iter()
+        .filter_map(Weak::upgrade)
+        .map(|log| log.stats())
+        .collect();
+    stats.sort_by(|a, b| a.server_id.cmp(&b.server_id));
+    stats
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct SlowRequestLog {
+    pub server_id: String,
+    pub threshold: Duration,
+    /// Newest first.
+    pub requests: Vec<SlowRequest>,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct SlowRequest {
+    pub method: String,
+    pub path: String,
+    /// Path of the route that handled the request, `None` when no route did.
+    pub route: Option<String>,
+    pub status: u16,
+    /// Seconds since the Unix epoch when the request started.
+    pub started: u64,
+    pub duration: Duration,
+    /// In the order they ran. Beyond `MAX_STATEMENTS`, only the slowest are kept.
+    pub statements: Vec<StatementTrace>,
+    pub omitted_statements: usize,
+    /// Largest first.
+    pub variables: Vec<VariableSize>,
+}
+
+/// One statement of the route, statements in blocks and loops are part of theirs.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct StatementTrace {
+    /// Position in the route, from 0.
+    pub index: usize,
+    pub statement: String,
+    pub duration: Duration,
+    /// Plugin functions called by the statement.
+    pub plugin_calls: Vec<PluginCalls>,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct PluginCalls {
+    /// `plugin.function`
+    pub function: String,
+    pub calls: u32,
+    pub duration: Duration,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct VariableSize {
+    pub name: String,
+    pub bytes: usize,
+}
+
+#[derive(Debug, Default)]
+struct Recording {
+    route: Option<String>,
+    statements: Vec<StatementTrace>,
+    omitted_statements: usize,
+    /// Calls of the running statement.
+    plugin_calls: Vec<PluginCalls>,
+    variables: Vec<VariableSize>,
+}
+
+thread_local! {
+    static RECORDING: RefCell<Option<Recording>> = const { RefCell::new(None) };
+}
+
+/// Runs a request and, with a `log`, records its route and keeps it when it takes longer
+/// than the threshold. `status` reads the response status from the result.
+pub fn capture<T>(log: Option<&SlowLog>, method: &str, path: &str, request: impl FnOnce() -> T, status: impl FnOnce(&T) -> u16) -> T {
+    let Some(log) = log else {
+        return request();
+    };
+
+    let capture = Capture {
+        log,
+        method,
+        path,
+        started: SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |since| since.as_secs()),
+        start: Instant::now(),
+        outer: Some(RECORDING.with(|recording| recording.replace(Some(Recording::default())))),
+    };
+    let result = request();
+    capture.finish(status(&result));
+    result
+}
+
+/// A request being recorded. If its route panics the guard is dropped without `finish`: the
+/// request is still kept, as a `500`, and the thread's outer recording is put back so the
+/// next route the scheduler runs on it isn't recorded into this one.
+struct Capture<'a> {
+    log: &'a SlowLog,
+    method: &'a str,
+    path: &'a str,
+    started: u64,
+    start: Instant,
+    outer: Option<Option<Recording>>,
+}
+
+impl Capture<'_> {
+    fn finish(mut self, status: u16) {
+        self.keep(status);
+    }
+
+    fn keep(&mut self, status: u16) {
+        let Some(outer) = self.outer.take() else {
+            return;
+        };
+        let recording = RECORDING.try_with(|recording| recording.replace(outer)).ok().flatten().unwrap_or_default();
+
+        let duration = self.start.elapsed();
+        if duration >= self.log.threshold {
+            self.log.push(SlowRequest {
+                method: self.method.to_string(),
+                path: self.path.to_string(),
+                route: recording.route,
+                status,
+                started: self.started,
+                duration,
+                statements: recording.statements,
+                omitted_statements: recording.omitted_statements,
+                variables: recording.variables,
+            });
+        }
+    }
+}
+
+impl Drop for Capture<'_> {
+    fn drop(&mut self) {
+        self.keep(500);
+    }
+}
+
+/// Whether the request running on this thread is recorded.
+pub fn recording() -> bool {
+    RECORDING.with(|recording| recording.borrow().is_some())
+}
+
+fn with_recording(f: impl FnOnce(&mut Recording)) {
+    RECORDING.with(|recording| {
+        if let Some(recording) = recording.borrow_mut().as_mut() {
+            f(recording);
+        }
+    });
+}
+
+/// The request is handled by the route at `route_path`.
+pub fn route(route_path: &str) {
+    with_recording(|recording| recording.route = Some(route_path.to_string()));
+}
+
+/// Runs statement `index` of the route, `describe` names it. Only call it while [`recording`].
+pub fn statement<T>(index: usize, describe: impl FnOnce() -> String, f: impl FnOnce() -> T) -> T {
+    let start = Instant::now();
+    let result = f();
+    let duration = start.elapsed();
+
+    with_recording(|recording| {
+        let plugin_calls = std::mem::take(&mut recording.plugin_calls);
+        let statements = &mut recording.statements;
+        if statements.len() == MAX_STATEMENTS {
+            recording.omitted_statements += 1;
+            let fastest = statements.iter().enumerate().min_by_key(|(_, statement)| statement.duration);
+            match fastest {
+                Some((position, statement)) if statement.duration < duration => {
+                    statements.remove(position);
+                }
+                _ => return,
+            }
+        }
+        statements.push(StatementTrace { index, statement: describe(), duration, plugin_calls });
+    });
+    result
+}
+
+/// Runs a plugin call, adding its time to the running statement of a recorded request.
+pub fn plugin_call<T>(plugin: &str, function: &str, call: impl FnOnce() -> T) -> T {
+    if !recording() {
+        return call();
+    }
+
+    let start = Instant::now();
+    let result = call();
+    let duration = start.elapsed();
+
+    with_recording(|recording| {
+        let calls = &mut recording.plugin_calls;
+        let existing = calls.iter_mut()
+            .find(|calls| calls.function.split_once('.') == Some((plugin, function)));
+        match existing {
+            Some(existing) => {
+                existing.calls += 1;
+                existing.duration += duration;
+            }
+            None => calls.push(PluginCalls { function: format!("{}.{}", plugin, function), calls: 1, duration }),
+        }
+    });
+    result
+}
+
+/// Records the size of the route's variables when it ends.
+pub fn variables(variables: &HashMap<RDLTypes, RDLTypes>) {
+    with_recording(|recording| {
+        let mut sizes: Vec<_> = variables.iter()
+            .filter(|(_, value)| !matches!(value, RDLTypes::Object(_)))
+            .map(|(name, value)| VariableSize { name: name.to_string(), bytes: size(value) })
+            .collect();
+        sizes.sort_by(|a, b| b.bytes.cmp(&a.bytes).then_with(|| a.name.cmp(&b.name)));
+        sizes.truncate(MAX_VARIABLES);
+        recording.variables = sizes;
+    });
+}
+
+/// Bytes of data in a value. Objects are owned by plugins and count as 0.
+fn size(value: &RDLTypes) -> usize {
+    match value {
+        RDLTypes::String(s) => s.len(),
+        RDLTypes::Bytes(bytes) => bytes.len(),
+        RDLTypes::Number(_) => size_of::<i64>(),
+        RDLTypes::Boolean(_) => 1,
+        RDLTypes::Vector(items) => items.iter().map(size).sum(),
+        RDLTypes::Object(_) => 0,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn log(threshold: Duration) -> Arc<SlowLog> {
+        register("test", &SlowRequestConfig { threshold, sample: 100 })
+    }
+
+    #[test]
+    fn keeps_slow_requests_only() {
+        let log = log(Duration::from_millis(20));
+        capture(Some(&log), "GET", "/fast", || route("/fast"), |_| 200);
+        capture(Some(&log), "GET", "/slow", || {
+            route("/slow");
+            std::thread::sleep(Duration::from_millis(25));
+        }, |_| 201);
+
+        let requests = log.stats().requests;
+        assert_eq!(requests.len(), 1);
+        assert_eq!(requests[0].route.as_deref(), Some("/slow"));
+        assert_eq!(requests[0].status, 201);
+        assert!(!recording());
+    }
+
+    #[test]
+    fn panicking_route_is_kept_as_500() {
+        let log = log(Duration::ZERO);
+        let panicked = std::panic::catch_unwind(|| {
+            capture(Some(&log), "POST", "/items", || {
+                route("/items");
+                statement(0, || "val item = Request.body()!!;".to_string(), || panic!("route failed"))
+            }, |_: &()| 200)
+        });
+        assert!(panicked.is_err());
+        assert!(!recording());
+
+        let requests = log.stats().requests;
+        assert_eq!(requests.len(), 1);
+        assert_eq!(requests[0].route.as_deref(), Some("/items"));
+        assert_eq!(requests[0].status, 500);
+
+        // The next request on the thread starts a recording of its own.
+        capture(Some(&log), "GET", "/next", || (), |_| 200);
+        let requests = log.stats().requests;
+        assert_eq!(requests[0].path, "/next");
+        assert_eq!(requests[0].route, None);
+    }
+}
@@ -0,0 +1,335 @@
+//! Where the time of a request goes.
+//!
+//! A request adds up how long it spent in each [`Phase`]. The durations go into per-server
+//! histograms, read with `netter timings`, and with `server_timing = true;` in the `config`
+//! block they are also sent back in a `Server-Timing` header.
+//!
+//! Phases inside the route run on an execution thread, far from the request's task. They are
+//! collected in a thread-local while [`track`] runs the route, so the interpreter and plugins
+//! only call [`measure`], which does nothing outside of a tracked route.
+
+use std::{cell::RefCell, fmt::Write, sync::{Arc, Mutex, Weak, atomic::{AtomicU64, Ordering}}, time::{Duration, Instant}};
+use serde::{Deserialize, Serialize};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Phase {
+    /// Parsing the query and copying the headers for the route.
+    Headers,
+    /// Reading the body.
+    Body,
+    /// Finding the route.
+    Route,
+    /// Waiting for an execution thread.
+    Queue,
+    /// Running RDL code, without the time of the other phases inside it.
+    Interpret,
+    Plugins,
+    /// Turning the route's response into an HTTP response.
+    Response,
+}
+
+const PHASES: usize = 7;
+
+impl Phase {
+    pub const ALL: [Phase; PHASES] = [
+        Phase::Headers, Phase::Body, Phase::Route, Phase::Queue, Phase::Interpret, Phase::Plugins, Phase::Response,
+    ];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            Phase::Headers => "headers",
+            Phase::Body => "body",
+            Phase::Route => "route",
+            Phase::Queue => "queue",
+            Phase::Interpret => "interpret",
+            Phase::Plugins => "plugins",
+            Phase::Response => "response",
+        }
+    }
+}
+
+/// Durations of the phases of one request, `None` for phases it didn't go through.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Phases([Option<Duration>; PHASES]);
+
+impl Phases {
+    pub fn add(&mut self, phase: Phase, duration: Duration) {
+        *self.0[phase as usize].get_or_insert(Duration::ZERO) += duration;
+    }
+
+    pub fn get(&self, phase: Phase) -> Option<Duration> {
+        self.0[phase as usize]
+    }
+
+    pub fn merge(&mut self, other: &Phases) {
+        for phase in Phase::ALL {
+            if let Some(duration) = other.get(phase) {
+                self.add(phase, duration);
+            }
+        }
+    }
+
+    /// `Server-Timing` value: one metric per phase and `total`, in milliseconds.
+    pub fn server_timing(&self, total: Duration) -> String {
+        let mut value = String::new();
+        for phase in Phase::ALL {
+            if let Some(duration) = self.get(phase) {
+                let _ = write!(value, "{};dur={:.3}, ", phase.name(), duration.as_secs_f64() * 1000.0);
+            }
+        }
+        let _ = write!(value, "total;dur={:.3}", total.as_secs_f64() * 1000.0);
+        value
+    }
+}
+
+thread_local! {
+    /// Phases of the route [`track`] runs on this thread.
+    static CURRENT: RefCell<Option<Phases>> = const { RefCell::new(None) };
+}
+
+/// Runs a route and returns the phases measured inside it. The rest of its time is
+/// [`Phase::Interpret`].
+pub fn track<T>(route: impl FnOnce() -> T) -> (T, Phases) {
+    let start = Instant::now();
+    let tracked = Tracked::enter();
+    let result = route();
+    let mut phases = tracked.finish();
+
+    let inner: Duration = phases.0.iter().flatten().sum();
+    phases.add(Phase::Interpret, start.elapsed().saturating_sub(inner));
+    (result, phases)
+}
+
+/// The phases of the outer route while an inner one is tracked. Dropping it puts them back,
+/// so a route that panics doesn't leave its phases to the next route on the thread.
+struct Tracked {
+    outer: Option<Option<Phases>>,
+}
+
+impl Tracked {
+    fn enter() -> Self {
+        Self { outer: Some(CURRENT.with(|current| current.replace(Some(Phases::default())))) }
+    }
+
+    fn finish(mut self) -> Phases {
+        let outer = self.outer.take().flatten();
+        CURRENT.with(|current| current.replace(outer)).unwrap_or_default()
+    }
+}
+
+impl Drop for Tracked {
+    fn drop(&mut self) {
+        if let Some(outer) = self.outer.take() {
+            let _ = CURRENT.try_with(|current| current.replace(outer));
+        }
+    }
+}
+
+/// Adds the time of `f` to `phase` of the tracked route, only runs `f` outside of one.
+pub fn measure<T>(phase: Phase, f: impl FnOnce() -> T) -> T {
+    if CURRENT.with(|current| current.borrow().is_none()) {
+        return f();
+    }
+
+    let start = Instant::now();
+    let result = f();
+    let elapsed = start.elapsed();
+    CURRENT.with(|current| {
+        if let Some(phases) = current.borrow_mut().as_mut() {
+            phases.add(phase, elapsed);
+        }
+    });
+    result
+}
+
+/// Phases of a request on its way through the server.
+#[derive(Debug)]
+pub struct RequestTimer {
+    start: Instant,
+    phases: Phases,
+}
+
+impl RequestTimer {
+    pub fn start() -> Self {
+        Self { start: Instant::now(), phases: Phases::default() }
+    }
+
+    pub fn measure<T>(&mut self, phase: Phase, f: impl FnOnce() -> T) -> T {
+        let start = Instant::now();
+        let result = f();
+        self.phases.add(phase, start.elapsed());
+        result
+    }
+
+    pub fn add(&mut self, phase: Phase, duration: Duration) {
+        self.phases.add(phase, duration);
+    }
+
+    pub fn merge(&mut self, phases: &Phases) {
+        self.phases.merge(phases);
+    }
+}
+
+/// Latency histograms of one server, by phase.
+#[derive(Debug)]
+pub struct ServerTimings {
+    server_id: String,
+    phases: [Histogram; PHASES],
+    total: Histogram,
+}
+
+impl ServerTimings {
+    /// Adds a finished request and returns its phases and total time.
+    pub fn record(&self, timer: RequestTimer) -> (Phases, Duration) {
+        let total = timer.start.elapsed();
+        for phase in Phase::ALL {
+            if let Some(duration) = timer.phases.get(phase) {
+                self.phases[phase as usize].record(duration);
+            }
+        }
+        self.total.record(total);
+        (timer.phases, total)
+    }
+
+    pub fn stats(&self) -> TimingStats {
+        let mut phases: Vec<_> = Phase::ALL.iter()
+            .map(|phase| self.phases[*phase as usize].stats(phase.name()))
+            .filter(|stats| stats.count > 0)
+            .collect();
+        phases.push(self.total.stats("total"));
+
+        TimingStats { server_id: self.server_id.clone(), phases }
+    }
+}
+
+/// Latency of one phase, percentiles are rounded up to a power of two microseconds.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct PhaseStats {
+    pub phase: String,
+    pub count: u64,
+    pub mean: Duration,
+    pub p50: Duration,
+    pub p90: Duration,
+    pub p99: Duration,
+    pub max: Duration,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TimingStats {
+    pub server_id: String,
+    /// Phases the server's requests went through, and `total` last.
+    pub phases: Vec<PhaseStats>,
+}
+
+static SERVERS: Mutex<Vec<Weak<ServerTimings>>> = Mutex::new(Vec::new());
+
+/// Histograms for a server. They are listed by [`stats`] until the returned value is dropped.
+pub fn register(server_id: &str) -> Arc<ServerTimings> {
+    let timings = Arc::new(ServerTimings {
+        server_id: server_id.to_string(),
+        phases: Default::default(),
+        total: Histogram::default(),
+    });
+
+    let mut servers = SERVERS.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+    servers.retain(|server| server.strong_count() > 0);
+    servers.push(Arc::downgrade(&timings));
+    timings
+}
+
+/// Timings of all running servers.
+pub fn stats() -> Vec<TimingStats> {
+    let servers = SERVERS.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+    let mut stats: Vec<_> = servers.iter()
+        .filter_map(Weak::upgrade)
+        .map(|timings| timings.stats())
+        .collect();
+    stats.sort_by(|a, b| a.server_id.cmp(&b.server_id));
+    stats
+}
+
+/// Bucket `n` counts durations below 2^n microseconds, the last one everything longer.
+pub(super) const BUCKETS: usize = 32;
+
+#[derive(Debug, Default)]
+pub(super) struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    sum_ns: AtomicU64,
+    max_ns: AtomicU64,
+}
+
+impl Histogram {
+    pub(super) fn record(&self, duration: Duration) {
+        let micros = duration.as_micros() as u64;
+        let bucket = ((u64::BITS - micros.leading_zeros()) as usize).min(BUCKETS - 1);
+        let nanos = duration.as_nanos() as u64;
+
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.sum_ns.fetch_add(nanos, Ordering::Relaxed);
+        self.max_ns.fetch_max(nanos, Ordering::Relaxed);
+    }
+
+    pub(super) fn buckets(&self) -> [u64; BUCKETS] {
+        std::array::from_fn(|n| self.buckets[n].load(Ordering::Relaxed))
+    }
+
+    fn stats(&self, phase: &str) -> PhaseStats {
+        let buckets = self.buckets();
+        let count: u64 = buckets.iter().sum();
+        let max = Duration::from_nanos(self.max_ns.load(Ordering::Relaxed));
+        let percentile = |q: f64| percentile(&buckets, q).map_or(max, |duration| duration.min(max));
+
+        PhaseStats {
+            phase: phase.to_string(),
+            count,
+            mean: Duration::from_nanos(self.sum_ns.load(Ordering::Relaxed) / count.max(1)),
+            p50: percentile(0.5),
+            p90: percentile(0.9),
+            p99: percentile(0.99),
+            max,
+        }
+    }
+}
+
+/// Quantile `q` of bucket counts, as the upper bound of its bucket. `None` without any count.
+pub(super) fn percentile(buckets: &[u64; BUCKETS], q: f64) -> Option<Duration> {
+    let count: u64 = buckets.iter().sum();
+    let rank = (count as f64 * q).ceil().max(1.0) as u64;
+    let mut seen = 0;
+    for (n, bucket) in buckets.iter().enumerate() {
+        seen += bucket;
+        if seen >= rank {
+            return Some(Duration::from_micros(1 << n));
+        }
+    }
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn panicking_route_leaves_no_phases() {
+        let panicked = std::panic::catch_unwind(|| {
+            track(|| measure(Phase::Plugins, || panic!("route failed")))
+        });
+        assert!(panicked.is_err());
+        assert!(CURRENT.with(|current| current.borrow().is_none()));
+
+        let ((), phases) = track(|| measure(Phase::Plugins, || ()));
+        assert!(phases.get(Phase::Plugins).is_some());
+    }
+
+    #[test]
+    fn nested_route_restores_the_outer_one() {
+        let (inner, outer) = track(|| {
+            measure(Phase::Plugins, || ());
+            let _ = std::panic::catch_unwind(|| track(|| panic!("inner route failed")));
+            track(|| measure(Phase::Route, || ())).1
+        });
+        assert!(outer.get(Phase::Plugins).is_some());
+        assert!(outer.get(Phase::Route).is_none());
+        assert!(inner.get(Phase::Route).is_some());
+    }
+}
@@ -0,0 +1,618 @@
+//! Sampled request tracing with W3C `traceparent` propagation.
+//!
+//! With `trace_export` in the `config` block, a sampled request gets a span, and so do its
+//! route, its plugin calls and its `Database`, `Kv` and `Store` calls. Finished spans go
+//! through a bounded queue to an export thread, which sends them in batches as OTLP/HTTP
+//! JSON or appends them to a file. When the queue is full spans are dropped: a request never
+//! waits for the exporter.
+//!
+//! Sampling is decided when a request arrives. A request with a `traceparent` follows its
+//! sampled flag, others are traced with `trace_sample` percent probability. An unsampled
+//! request costs one random number, and a thread-local check per plugin or database call.
+
+use std::{cell::{Cell, RefCell}, collections::hash_map::RandomState, fs::{File, OpenOptions}, hash::BuildHasher, io::{self, Write}, sync::{Arc, atomic::{AtomicU64, Ordering}, mpsc::{self, RecvTimeoutError}}, time::{Duration, Instant, SystemTime, UNIX_EPOCH}};
+use http_body_util::Full;
+use hyper::{HeaderMap, Uri, body::Bytes, header::CONTENT_TYPE};
+use hyper_util::{client::legacy::{Client, connect::HttpConnector}, rt::TokioExecutor};
+use log::{error, info, warn};
+use serde_json::{Value, json};
+use super::{TraceConfig, TraceExport};
+
+pub const TRACEPARENT: &str = "traceparent";
+
+/// Spans waiting for the export thread. When it falls behind, new spans are dropped.
+const QUEUE: usize = 4096;
+/// Spans sent in one export request.
+const BATCH: usize = 512;
+/// Longest a finished span waits to be exported.
+const EXPORT_INTERVAL: Duration = Duration::from_secs(2);
+const EXPORT_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Position in a trace, as carried by `traceparent`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TraceContext {
+    pub trace_id: u128,
+    pub span_id: u64,
+    pub sampled: bool,
+}
+
+impl TraceContext {
+    /// Parses `traceparent`: `00-<trace id>-<parent span id>-<flags>` in lowercase hex.
+    pub fn parse(value: &str) -> Option<Self> {
+        let mut fields = value.trim().split('-');
+        let (version, trace_id, span_id, flags) = (fields.next()?, fields.next()?, fields.next()?, fields.next()?);
+        // Later versions may append fields, version 00 has exactly four.
+        if version == "ff" || (version == "00" && fields.next().is_some()) {
+            return None;
+        }
+        let lengths = [(version, 2), (trace_id, 32), (span_id, 16), (flags, 2)];
+        if !lengths.iter().all(|(field, len)| field.len() == *len && field.bytes().all(|b| matches!(b, b'0'..=b'9' | b'a'..=b'f'))) {
+            return None;
+        }
+
+        Some(Self {
+            trace_id: u128::from_str_radix(trace_id, 16).ok().filter(|id| *id != 0)?,
+            span_id: u64::from_str_radix(span_id, 16).ok().filter(|id| *id != 0)?,
+            sampled: u8::from_str_radix(flags, 16).ok()? & 1 == 1,
+        })
+    }
+
+    pub fn header(&self) -> String {
+        format!("00-{:032x}-{:016x}-{:02x}", self.trace_id, self.span_id, self.sampled as u8)
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub enum SpanKind {
+    Internal = 1,
+    Server = 2,
+    Client = 3,
+}
+
+#[derive(Debug, Clone)]
+pub enum Attribute {
+    String(String),
+    Int(i64),
+}
+
+impl From<&str> for Attribute {
+    fn from(value: &str) -> Self {
+        Attribute::String(value.to_string())
+    }
+}
+
+impl From<String> for Attribute {
+    fn from(value: String) -> Self {
+        Attribute::String(value)
+    }
+}
+
+impl From<i64> for Attribute {
+    fn from(value: i64) -> Self {
+        Attribute::Int(value)
+    }
+}
+
+#[derive(Debug)]
+struct SpanData {
+    trace_id: u128,
+    span_id: u64,
+    parent_id: Option<u64>,
+    name: String,
+    kind: SpanKind,
+    start_ns: u64,
+    end_ns: u64,
+    attributes: Vec<(&'static str, Attribute)>,
+    error: bool,
+}
+
+#[derive(Debug)]
+struct OpenSpan {
+    data: SpanData,
+    started: Instant,
+}
+
+impl OpenSpan {
+    fn start(trace_id: u128, parent_id: Option<u64>, name: String, kind: SpanKind, attributes: Vec<(&'static str, Attribute)>) -> Self {
+        let start_ns = SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |since| since.as_nanos() as u64);
+        Self {
+            data: SpanData {
+                trace_id,
+                span_id: random(),
+                parent_id,
+                name,
+                kind,
+                start_ns,
+                end_ns: start_ns,
+                attributes,
+                error: false,
+            },
+            started: Instant::now(),
+        }
+    }
+
+    /// Durations come from the monotonic clock, only the start is wall time.
+    fn end(mut self) -> SpanData {
+        self.data.end_ns = self.data.start_ns + self.started.elapsed().as_nanos() as u64;
+        self.data
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Exporter {
+    spans: mpsc::SyncSender<SpanData>,
+    dropped: Arc<AtomicU64>,
+}
+
+impl Exporter {
+    fn send(&self, span: SpanData) {
+        if self.spans.try_send(span).is_err() {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Samples the requests of a server and exports their spans.
+#[derive(Debug)]
+pub struct Tracer {
+    sample: u64,
+    exporter: Exporter,
+}
+
+impl Tracer {
+    /// Starts the export thread. It ends once the tracer and the spans of its requests are dropped.
+    pub fn start(server_id: &str, config: &TraceConfig) -> io::Result<Self> {
+        let (sender, receiver) = mpsc::sync_channel(QUEUE);
+        let dropped = Arc::new(AtomicU64::new(0));
+
+        let export = config.export.clone();
+        let thread_dropped = Arc::clone(&dropped);
+        let thread_server_id = server_id.to_string();
+        std::thread::Builder::new()
+            .name("netter-trace-export".to_string())
+            .spawn(move || export_spans(thread_server_id, export, receiver, thread_dropped))?;
+        info!("[Tracing] Server {} traces {}% of requests to {}", server_id, config.sample, config.export);
+
+        Ok(Self {
+            sample: config.sample as u64,
+            exporter: Exporter { spans: sender, dropped },
+        })
+    }
+
+    /// The span of a request, `None` when it isn't sampled.
+    pub fn request(&self, headers: &HeaderMap, method: &str, path: &str) -> Option<RequestSpan> {
+        let parent = headers.get(TRACEPARENT)
+            .and_then(|value| value.to_str().ok())
+            .and_then(TraceContext::parse);
+        let sampled = match parent {
+            Some(parent) => parent.sampled,
+            None => random() % 100 < self.sample,
+        };
+        if !sampled {
+            return None;
+        }
+
+        let trace_id = parent.map_or_else(|| (random() as u128) << 64 | random() as u128, |parent| parent.trace_id);
+        let attributes = vec![
+            ("http.request.method", method.into()),
+            ("url.path", path.into()),
+        ];
+        Some(RequestSpan {
+            span: OpenSpan::start(trace_id, parent.map(|parent| parent.span_id), method.to_string(), SpanKind::Server, attributes),
+            exporter: self.exporter.clone(),
+        })
+    }
+}
+
+/// Span of a sampled request, from its arrival to its response.
+#[derive(Debug)]
+pub struct RequestSpan {
+    span: OpenSpan,
+    exporter: Exporter,
+}
+
+impl RequestSpan {
+    /// What the spans of the route continue, see [`enter`].
+    pub fn route_trace(&self) -> RouteTrace {
+        RouteTrace {
+            context: TraceContext { trace_id: self.span.data.trace_id, span_id: self.span.data.span_id, sampled: true },
+            exporter: self.exporter.clone(),
+        }
+    }
+
+    pub fn finish(mut self, status: u16) {
+        self.span.data.attributes.push(("http.response.status_code", Attribute::Int(status as i64)));
+        self.span.data.error = status >= 500;
+        self.exporter.send(self.span.end());
+    }
+}
+
+/// A sampled request on its way to the execution thread.
+#[derive(Debug, Clone)]
+pub struct RouteTrace {
+    context: TraceContext,
+    exporter: Exporter,
+}
+
+thread_local! {
+    /// Trace of the route running on this thread, its span id is the innermost open span.
+    static ACTIVE: RefCell<Option<RouteTrace>> = const { RefCell::new(None) };
+    static RANDOM: Cell<u64> = Cell::new(RandomState::new().hash_one(0u8) | 1);
+}
+
+/// Runs a route as part of `trace`: [`span`]s opened inside it are children of the request's span.
+pub fn enter<T>(trace: Option<RouteTrace>, route: impl FnOnce() -> T) -> T {
+    let Some(trace) = trace else {
+        return route();
+    };
+
+    let _outer = Entered(ACTIVE.with(|active| active.replace(Some(trace))));
+    route()
+}
+
+/// The trace that was active before a route, put back when the route ends. Restoring it on
+/// drop covers routes that panic: the scheduler catches the panic and reuses the thread.
+struct Entered(Option<RouteTrace>);
+
+impl Drop for Entered {
+    fn drop(&mut self) {
+        let outer = self.0.take();
+        let _ = ACTIVE.try_with(|active| active.replace(outer));
+    }
+}
+
+/// Makes the parent the innermost span again when a child span ends, also by a panic.
+struct ChildSpan {
+    parent_id: u64,
+}
+
+impl Drop for ChildSpan {
+    fn drop(&mut self) {
+        set_current(self.parent_id);
+    }
+}
+
+/// Runs `f` in a span of the traced route, or just runs it outside of one. `describe` gives
+/// the span's name and attributes and `failed` tells whether the result is an error; neither
+/// runs for unsampled requests.
+pub fn span<T>(
+    kind: SpanKind,
+    describe: impl FnOnce() -> (String, Vec<(&'static str, Attribute)>),
+    f: impl FnOnce() -> T,
+    failed: impl FnOnce(&T) -> bool,
+) -> T {
+    let Some(parent) = current() else {
+        return f();
+    };
+
+    let (name, attributes) = describe();
+    let span = OpenSpan::start(parent.trace_id, Some(parent.span_id), name, kind, attributes);
+    set_current(span.data.span_id);
+    let child = ChildSpan { parent_id: parent.span_id };
+    let result = f();
+    drop(child);
+
+    let mut data = span.end();
+    data.error = failed(&result);
+    ACTIVE.with(|active| {
+        if let Some(trace) = active.borrow().as_ref() {
+            trace.exporter.send(data);
+        }
+    });
+    result
+}
+
+/// `traceparent` of the innermost span on this thread, for routes to pass on to plugins and upstreams.
+pub fn traceparent() -> Option<String> {
+    current().map(|context| context.header())
+}
+
+fn current() -> Option<TraceContext> {
+    ACTIVE.with(|active| active.borrow().as_ref().map(|trace| trace.context))
+}
+
+fn set_current(span_id: u64) {
+    let _ = ACTIVE.try_with(|active| {
+        if let Some(trace) = active.borrow_mut().as_mut() {
+            trace.context.span_id = span_id;
+        }
+    });
+}
+
+/// xorshift64, seeded per thread. Never 0, so it's also a valid id.
+pub(super) fn random() -> u64 {
+    RANDOM.with(|state| {
+        let mut x = state.get();
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        state.set(x);
+        x
+    })
+}
+
+fn export_spans(server_id: String, export: TraceExport, spans: mpsc::Receiver<SpanData>, dropped: Arc<AtomicU64>) {
+    let mut sink = match Sink::open(&export) {
+        Ok(sink) => sink,
+        Err(e) => {
+            error!("[Tracing] Can't export spans of server {} to {}: {}", server_id, export, e);
+            return;
+        }
+    };
+
+    let mut batch = Vec::with_capacity(BATCH);
+    let mut deadline = Instant::now() + EXPORT_INTERVAL;
+    loop {
+        let closed = match spans.recv_timeout(deadline.saturating_duration_since(Instant::now())) {
+            Ok(span) => {
+                batch.push(span);
+                if batch.len() < BATCH {
+                    continue;
+                }
+                false
+            }
+            Err(RecvTimeoutError::Timeout) => false,
+            Err(RecvTimeoutError::Disconnected) => true,
+        };
+
+        if !batch.is_empty() {
+            if let Err(e) = sink.write(encode(&server_id, &batch)) {
+                warn!("[Tracing] Failed to export {} span(s) of server {}: {}", batch.len(), server_id, e);
+            }
+            batch.clear();
+        }
+        let lost = dropped.swap(0, Ordering::Relaxed);
+        if lost > 0 {
+            warn!("[Tracing] Export of server {} falls behind, dropped {} span(s)", server_id, lost);
+        }
+
+        if closed {
+            break;
+        }
+        deadline = Instant::now() + EXPORT_INTERVAL;
+    }
+}
+
+enum Sink {
+    /// One OTLP JSON export request per line, as read by the collector's `otlpjsonfile` receiver.
+    File(File),
+    Otlp {
+        runtime: tokio::runtime::Runtime,
+        client: Client<HttpConnector, Full<Bytes>>,
+        endpoint: Uri,
+    },
+}
+
+impl Sink {
+    fn open(export: &TraceExport) -> io::Result<Self> {
+        match export {
+            TraceExport::File(path) => Ok(Sink::File(OpenOptions::new().create(true).append(true).open(path)?)),
+            TraceExport::Otlp(endpoint) => Ok(Sink::Otlp {
+                runtime: tokio::runtime::Builder::new_current_thread().enable_all().build()?,
+                client: Client::builder(TokioExecutor::new()).build_http(),
+                endpoint: endpoint.parse().map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))?,
+            }),
+        }
+    }
+
+    fn write(&mut self, mut payload: Vec<u8>) -> Result<(), String> {
+        match self {
+            Sink::File(file) => {
+                payload.push(b'\n');
+                file.write_all(&payload).map_err(|e| e.to_string())
+            }
+            Sink::Otlp { runtime, client, endpoint } => runtime.block_on(async {
+                let request = hyper::Request::post(endpoint.clone())
+                    .header(CONTENT_TYPE, "application/json")
+                    .body(Full::new(Bytes::from(payload)))
+                    .map_err(|e| e.to_string())?;
+                let response = tokio::time::timeout(EXPORT_TIMEOUT, client.request(request)).await
+                    .map_err(|_| format!("no response within {:?}", EXPORT_TIMEOUT))?
+                    .map_err(|e| e.to_string())?;
+
+                match response.status().is_success() {
+                    true => Ok(()),
+                    false => Err(format!("collector answered {}", response.status())),
+                }
+            }),
+        }
+    }
+}
+
+/// An OTLP `ExportTraceServiceRequest` in its JSON encoding.
+fn encode(server_id: &str, spans: &[SpanData]) -> Vec<u8> {
+    let spans: Vec<Value> = spans.iter()
+        .map(|span| json!({
+            "traceId": format!("{:032x}", span.trace_id),
+            "spanId": format!("{:016x}", span.span_id),
+            "parentSpanId": span.parent_id.map(|id| format!("{:016x}", id)).unwrap_or_default(),
+            "name": span.name,
+            "kind": span.kind as u8,
+            "startTimeUnixNano": span.start_ns.to_string(),
+            "endTimeUnixNano": span.end_ns.to_string(),
+            "attributes": span.attributes.iter().map(|(key, value)| attribute(key, value)).collect::<Vec<_>>(),
+            // 2 is STATUS_CODE_ERROR, 0 leaves it unset.
+            "status": { "code": if span.error { 2 } else { 0 } },
+        }))
+        .collect();
+
+    let request = json!({
+        "resourceSpans": [{
+            "resource": {
+                "attributes": [
+                    attribute("service.name", &Attribute::from("netter")),
+                    attribute("service.instance.id", &Attribute::from(server_id)),
+                ],
+            },
+            "scopeSpans": [{
+                "scope": { "name": "netter", "version": env!("CARGO_PKG_VERSION") },
+                "spans": spans,
+            }],
+        }],
+    });
+    serde_json::to_vec(&request).unwrap_or_default()
+}
+
+fn attribute(key: &str, value: &Attribute) -> Value {
+    let value = match value {
+        Attribute::String(s) => json!({ "stringValue": s }),
+        // int64 is a string in the JSON encoding.
+        Attribute::Int(n) => json!({ "intValue": n.to_string() }),
+    };
+    json!({ "key": key, "value": value })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{io::Read, net::TcpListener, panic::AssertUnwindSafe};
+
+    const VALID: &str = "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01";
+
+    fn route_trace(spans: mpsc::SyncSender<SpanData>) -> RouteTrace {
+        RouteTrace {
+            context: TraceContext { trace_id: 1, span_id: 2, sampled: true },
+            exporter: Exporter { spans, dropped: Arc::new(AtomicU64::new(0)) },
+        }
+    }
+
+    #[test]
+    fn parses_valid_traceparent() {
+        let context = TraceContext::parse(VALID).unwrap();
+        assert_eq!(context.trace_id, 0x4bf92f3577b34da6a3ce929d0e0e4736);
+        assert_eq!(context.span_id, 0x00f067aa0ba902b7);
+        assert!(context.sampled);
+        assert_eq!(context.header(), VALID);
+        assert_eq!(TraceContext::parse(&format!(" {} ", VALID)), Some(context));
+    }
+
+    #[test]
+    fn rejects_bad_versions() {
+        assert_eq!(TraceContext::parse(&VALID.replacen("00", "ff", 1)), None);
+        assert_eq!(TraceContext::parse(&format!("{}-extra", VALID)), None);
+        assert_eq!(TraceContext::parse(&VALID.replacen("00", "0", 1)), None);
+        // A later version may carry more fields.
+        assert!(TraceContext::parse(&format!("{}-extra", VALID.replacen("00", "01", 1))).is_some());
+    }
+
+    #[test]
+    fn rejects_zero_ids_and_bad_hex() {
+        assert_eq!(TraceContext::parse("00-00000000000000000000000000000000-00f067aa0ba902b7-01"), None);
+        assert_eq!(TraceContext::parse("00-4bf92f3577b34da6a3ce929d0e0e4736-0000000000000000-01"), None);
+        assert_eq!(TraceContext::parse(&VALID.to_uppercase()), None);
+        assert_eq!(TraceContext::parse("00-4bf92f3577b34da6a3ce929d0e0e473-00f067aa0ba902b7-01"), None);
+        assert_eq!(TraceContext::parse("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7"), None);
+        assert_eq!(TraceContext::parse(""), None);
+    }
+
+    #[test]
+    fn sampled_flag_is_the_low_bit() {
+        let flags = |flags: &str| TraceContext::parse(&VALID.replace("-01", &format!("-{}", flags))).map(|context| context.sampled);
+        assert_eq!(flags("00"), Some(false));
+        assert_eq!(flags("03"), Some(true));
+        assert_eq!(flags("02"), Some(false));
+        assert_eq!(flags("0g"), None);
+    }
+
+    #[test]
+    fn panicking_route_leaves_no_trace() {
+        let (spans, received) = mpsc::sync_channel(16);
+        let trace = route_trace(spans);
+
+        let panicked = std::panic::catch_unwind(AssertUnwindSafe(|| enter(Some(trace.clone()), || {
+            span(SpanKind::Client, || ("plugin".to_string(), Vec::new()), || panic!("route failed"), |_: &()| false)
+        })));
+        assert!(panicked.is_err());
+        assert_eq!(current(), None);
+
+        // A span whose call panics inside a route gives the route its own span back.
+        enter(Some(trace), || {
+            let _ = std::panic::catch_unwind(|| {
+                span(SpanKind::Client, || ("plugin".to_string(), Vec::new()), || panic!("plugin failed"), |_: &()| false)
+            });
+            assert_eq!(current().map(|context| context.span_id), Some(2));
+        });
+        assert_eq!(current(), None);
+        assert!(received.try_recv().is_err());
+    }
+
+    /// Accepts one OTLP export request and answers it with `200`.
+    fn collector() -> (String, mpsc::Receiver<(String, Vec<u8>)>) {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let endpoint = format!("http://{}/v1/traces", listener.local_addr().unwrap());
+        let (requests, received) = mpsc::channel();
+
+        std::thread::spawn(move || {
+            let (mut stream, _) = listener.accept().unwrap();
+            let mut request = Vec::new();
+            let mut buffer = [0; 4096];
+            let body_start = loop {
+                let read = stream.read(&mut buffer).unwrap();
+                assert!(read > 0, "connection closed before the headers ended");
+                request.extend_from_slice(&buffer[..read]);
+                if let Some(end) = request.windows(4).position(|window| window == b"\r\n\r\n") {
+                    break end + 4;
+                }
+            };
+
+            let head = String::from_utf8_lossy(&request[..body_start]).to_ascii_lowercase();
+            let length: usize = head.lines()
+                .find_map(|line| line.strip_prefix("content-length:"))
+                .and_then(|length| length.trim().parse().ok())
+                .unwrap();
+            while request.len() < body_start + length {
+                let read = stream.read(&mut buffer).unwrap();
+                request.extend_from_slice(&buffer[..read]);
+            }
+
+            stream.write_all(b"HTTP/1.1 200 OK\r\ncontent-length: 0\r\n\r\n").unwrap();
+            let _ = requests.send((head, request[body_start..body_start + length].to_vec()));
+        });
+
+        (endpoint, received)
+    }
+
+    #[test]
+    fn exports_spans_to_collector() {
+        let (endpoint, received) = collector();
+        let tracer = Tracer::start("test-server", &TraceConfig { export: TraceExport::Otlp(endpoint), sample: 0 }).unwrap();
+
+        let mut headers = HeaderMap::new();
+        headers.insert(TRACEPARENT, VALID.parse().unwrap());
+        let request = tracer.request(&headers, "GET", "/items").unwrap();
+        enter(Some(request.route_trace()), || {
+            span(SpanKind::Client, || ("plugin".to_string(), vec![("plugin.name", "auth".into())]), || (), |_| true)
+        });
+        request.finish(200);
+
+        // Unsampled callers and `sample = 0` aren't traced.
+        headers.insert(TRACEPARENT, VALID.replace("-01", "-00").parse().unwrap());
+        assert!(tracer.request(&headers, "GET", "/items").is_none());
+        assert!(tracer.request(&HeaderMap::new(), "GET", "/items").is_none());
+
+        // The export thread sends what it has once the tracer is gone.
+        drop(tracer);
+        let (head, body) = received.recv_timeout(Duration::from_secs(10)).unwrap();
+        assert!(head.starts_with("post /v1/traces "), "{}", head);
+        assert!(head.contains("content-type: application/json"), "{}", head);
+
+        let body: Value = serde_json::from_slice(&body).unwrap();
+        let resource = &body["resourceSpans"][0];
+        assert_eq!(resource["resource"]["attributes"][1]["value"]["stringValue"], "test-server");
+        let spans = resource["scopeSpans"][0]["spans"].as_array().unwrap();
+        assert_eq!(spans.len(), 2);
+
+        let (plugin, server) = (&spans[0], &spans[1]);
+        for span in spans {
+            assert_eq!(span["traceId"], "4bf92f3577b34da6a3ce929d0e0e4736");
+        }
+        assert_eq!(server["name"], "GET");
+        assert_eq!(server["kind"], SpanKind::Server as u8);
+        assert_eq!(server["parentSpanId"], "00f067aa0ba902b7");
+        assert_eq!(server["status"]["code"], 0);
+        assert_eq!(plugin["name"], "plugin");
+        assert_eq!(plugin["parentSpanId"], server["spanId"]);
+        assert_eq!(plugin["status"]["code"], 2);
+        assert_eq!(plugin["attributes"][0]["value"]["stringValue"], "auth");
+    }
+}
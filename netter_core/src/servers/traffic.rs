@@ -0,0 +1,307 @@
+//! Live load of servers and routes, shown by `netter top`.
+//!
+//! Every route of a server has its own counters, created when the server starts, so a
+//! request only touches the counters of its route. A [`Watch`] reads all of them at an
+//! interval and turns the difference into rates and latency percentiles of that interval.
+//! Servers with `handshake_threads` also report their TLS handshake queue.
+
+use std::{collections::HashMap, sync::{Arc, Mutex, Weak, atomic::{AtomicU64, Ordering}}, time::{Duration, Instant}};
+use axum::body::{Body, HttpBody};
+use http_body_util::BodyExt;
+use serde::{Deserialize, Serialize};
+use super::handshake_pool::{HandshakePool, HandshakeStats};
+use super::timing::{self, BUCKETS, Histogram};
+
+/// Shown for requests no route handles.
+const UNMATCHED: &str = "(no route)";
+
+#[derive(Debug, Default)]
+struct RouteTraffic {
+    requests: AtomicU64,
+    /// Responses with a 5xx status.
+    errors: AtomicU64,
+    in_flight: AtomicU64,
+    bytes_in: AtomicU64,
+    bytes_out: AtomicU64,
+    latency: Histogram,
+}
+
+impl RouteTraffic {
+    fn counts(&self) -> Counts {
+        Counts {
+            requests: self.requests.load(Ordering::Relaxed),
+            errors: self.errors.load(Ordering::Relaxed),
+            bytes_in: self.bytes_in.load(Ordering::Relaxed),
+            bytes_out: self.bytes_out.load(Ordering::Relaxed),
+            latency: self.latency.buckets(),
+        }
+    }
+}
+
+/// Counters of one server, by route.
+#[derive(Debug)]
+pub struct ServerTraffic {
+    server_id: String,
+    /// By the interpreter's route key, `METHOD:/path`.
+    routes: HashMap<String, Arc<RouteTraffic>>,
+    unmatched: Arc<RouteTraffic>,
+    handshakes: Option<HandshakePool>,
+}
+
+/// Counters for a server and its routes. They are read by [`Watch`] until the returned
+/// value is dropped.
+pub fn register<'a>(
+    server_id: &str,
+    route_keys: impl IntoIterator<Item = &'a str>,
+    handshakes: Option<HandshakePool>,
+) -> Arc<ServerTraffic> {
+    let traffic = Arc::new(ServerTraffic {
+        server_id: server_id.to_string(),
+        routes: route_keys.into_iter().map(|key| (key.to_string(), Arc::default())).collect(),
+        unmatched: Arc::default(),
+        handshakes,
+    });
+
+    let mut servers = SERVERS.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+    servers.retain(|server| server.strong_count() > 0);
+    servers.push(Arc::downgrade(&traffic));
+    traffic
+}
+
+static SERVERS: Mutex<Vec<Weak<ServerTraffic>>> = Mutex::new(Vec::new());
+
+/// Counts one request. It is in flight from [`RequestTraffic::enter`] until it is dropped.
+#[derive(Debug)]
+pub struct RequestTraffic {
+    server: Arc<ServerTraffic>,
+    route: Option<Arc<RouteTraffic>>,
+}
+
+impl RequestTraffic {
+    pub fn new(server: Arc<ServerTraffic>) -> Self {
+        Self { server, route: None }
+    }
+
+    /// The request was matched to the route with `route_key`.
+    pub fn enter(&mut self, route_key: &str) {
+        if let Some(route) = self.server.routes.get(route_key) {
+            route.in_flight.fetch_add(1, Ordering::Relaxed);
+            self.route = Some(Arc::clone(route));
+        }
+    }
+
+    /// `body`, adding the bytes read from it to the route.
+    pub fn count_body(&self, body: Body) -> Body {
+        match &self.route {
+            Some(route) => counted(body, Arc::clone(route), |route| &route.bytes_in),
+            None => body,
+        }
+    }
+
+    /// Adds the response. A body of unknown length is counted while it is sent.
+    pub fn finish(&self, response: axum::response::Response, latency: Duration) -> axum::response::Response {
+        let route = self.route.as_ref().unwrap_or(&self.server.unmatched);
+        route.requests.fetch_add(1, Ordering::Relaxed);
+        if response.status().is_server_error() {
+            route.errors.fetch_add(1, Ordering::Relaxed);
+        }
+        route.latency.record(latency);
+
+        let (parts, body) = response.into_parts();
+        let body = match body.size_hint().exact() {
+            Some(len) => {
+                route.bytes_out.fetch_add(len, Ordering::Relaxed);
+                body
+            }
+            None => counted(body, Arc::clone(route), |route| &route.bytes_out),
+        };
+        axum::response::Response::from_parts(parts, body)
+    }
+}
+
+impl Drop for RequestTraffic {
+    fn drop(&mut self) {
+        if let Some(route) = &self.route {
+            route.in_flight.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+}
+
+fn counted(body: Body, route: Arc<RouteTraffic>, bytes: fn(&RouteTraffic) -> &AtomicU64) -> Body {
+    Body::new(body.map_frame(move |frame| {
+        if let Some(data) = frame.data_ref() {
+            bytes(&route).fetch_add(data.len() as u64, Ordering::Relaxed);
+        }
+        frame
+    }))
+}
+
+/// Load of a server or a route during the last interval.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Load {
+    /// `METHOD /path` of a route, or `total` for the whole server.
+    pub name: String,
+    pub rps: f64,
+    /// Rounded up to a power of two microseconds, `None` without requests in the interval.
+    pub p50: Option<Duration>,
+    pub p99: Option<Duration>,
+    /// Share of responses with a 5xx status.
+    pub error_rate: f64,
+    pub in_flight: u64,
+    /// Bytes per second.
+    pub bytes_in: u64,
+    pub bytes_out: u64,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ServerLoad {
+    pub server_id: String,
+    pub total: Load,
+    /// Busiest first.
+    pub routes: Vec<Load>,
+    /// Counters of the TLS handshake threads since the server started, `None` without them.
+    pub handshakes: Option<HandshakeStats>,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TrafficReport {
+    pub interval: Duration,
+    /// Resident memory of the process all servers run in, where the platform tells it.
+    pub memory: Option<u64>,
+    pub servers: Vec<ServerLoad>,
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+struct Counts {
+    requests: u64,
+    errors: u64,
+    bytes_in: u64,
+    bytes_out: u64,
+    latency: [u64; BUCKETS],
+}
+
+impl Counts {
+    /// Counted since `earlier`. Counters of a restarted server start again from zero.
+    fn since(&self, earlier: &Counts) -> Counts {
+        Counts {
+            requests: self.requests.saturating_sub(earlier.requests),
+            errors: self.errors.saturating_sub(earlier.errors),
+            bytes_in: self.bytes_in.saturating_sub(earlier.bytes_in),
+            bytes_out: self.bytes_out.saturating_sub(earlier.bytes_out),
+            latency: std::array::from_fn(|n| self.latency[n].saturating_sub(earlier.latency[n])),
+        }
+    }
+
+    fn add(&mut self, other: &Counts) {
+        self.requests += other.requests;
+        self.errors += other.errors;
+        self.bytes_in += other.bytes_in;
+        self.bytes_out += other.bytes_out;
+        for (bucket, other) in self.latency.iter_mut().zip(other.latency) {
+            *bucket += other;
+        }
+    }
+
+    fn load(&self, name: String, in_flight: u64, interval: Duration) -> Load {
+        let seconds = interval.as_secs_f64().max(f64::EPSILON);
+        Load {
+            name,
+            rps: self.requests as f64 / seconds,
+            p50: timing::percentile(&self.latency, 0.5),
+            p99: timing::percentile(&self.latency, 0.99),
+            error_rate: self.errors as f64 / self.requests.max(1) as f64,
+            in_flight,
+            bytes_in: (self.bytes_in as f64 / seconds) as u64,
+            bytes_out: (self.bytes_out as f64 / seconds) as u64,
+        }
+    }
+}
+
+/// Reads the counters of all servers, each [`Watch::next`] reports the load since the last one.
+#[derive(Debug)]
+pub struct Watch {
+    last: Instant,
+    /// By server id and route key.
+    counts: HashMap<(String, String), Counts>,
+}
+
+impl Watch {
+    pub fn new() -> Self {
+        let mut watch = Self { last: Instant::now(), counts: HashMap::new() };
+        watch.read();
+        watch
+    }
+
+    pub fn next(&mut self) -> TrafficReport {
+        let interval = self.last.elapsed();
+        self.last = Instant::now();
+        let previous = std::mem::take(&mut self.counts);
+
+        let mut servers = Vec::new();
+        for (server, routes) in self.read() {
+            let mut total = Counts::default();
+            let mut total_in_flight = 0;
+            let mut loads = Vec::new();
+
+            for (key, in_flight, counts) in routes {
+                let recent = match previous.get(&(server.server_id.clone(), key.clone())) {
+                    Some(earlier) => counts.since(earlier),
+                    None => counts,
+                };
+                total.add(&recent);
+                total_in_flight += in_flight;
+                if key == UNMATCHED && recent.requests == 0 {
+                    continue;
+                }
+                loads.push(recent.load(key.replacen(':', " ", 1), in_flight, interval));
+            }
+
+            loads.sort_by(|a, b| b.rps.total_cmp(&a.rps).then_with(|| a.name.cmp(&b.name)));
+            servers.push(ServerLoad {
+                server_id: server.server_id.clone(),
+                total: total.load("total".to_string(), total_in_flight, interval),
+                routes: loads,
+                handshakes: server.handshakes.as_ref().map(HandshakePool::stats),
+            });
+        }
+        servers.sort_by(|a, b| a.server_id.cmp(&b.server_id));
+
+        TrafficReport { interval, memory: resident_memory(), servers }
+    }
+
+    /// Current counters of every server, also kept for the next report.
+    fn read(&mut self) -> Vec<(Arc<ServerTraffic>, Vec<(String, u64, Counts)>)> {
+        let servers: Vec<_> = SERVERS.lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner())
+            .iter()
+            .filter_map(Weak::upgrade)
+            .collect();
+
+        servers.into_iter()
+            .map(|server| {
+                let routes: Vec<_> = server.routes.iter()
+                    .map(|(key, route)| (key.as_str(), route))
+                    .chain([(UNMATCHED, &server.unmatched)])
+                    .map(|(key, route)| (key.to_string(), route.in_flight.load(Ordering::Relaxed), route.counts()))
+                    .collect();
+                for (key, _, counts) in &routes {
+                    self.counts.insert((server.server_id.clone(), key.clone()), *counts);
+                }
+                (server, routes)
+            })
+            .collect()
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn resident_memory() -> Option<u64> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmRSS:"))?;
+    let kilobytes: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kilobytes * 1024)
+}
+
+#[cfg(not(target_os = "linux"))]
+fn resident_memory() -> Option<u64> {
+    None
+}
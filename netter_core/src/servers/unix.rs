@@ -0,0 +1,217 @@
+use std::{io, os::unix::fs::{FileTypeExt, PermissionsExt}, path::Path, sync::Arc, time::Duration};
+use axum::Router;
+use hyper_util::{rt::{TokioExecutor, TokioIo}, server::{conn::auto, graceful::GracefulShutdown}, service::TowerToHyperService};
+use log::{debug, error, info, warn};
+use tokio::{net::UnixListener, sync::{Notify, watch}};
+use super::limits::{ConnectionLimiter, configure_builder};
+
+/// Mode of the socket file. Connecting needs write access, so the server's user and group
+/// may connect: a reverse proxy is let in by adding it to the group.
+const SOCKET_MODE: u32 = 0o660;
+
+/// Binds the Unix domain socket at `path`, replacing a stale one.
+pub fn bind(path: &Path) -> io::Result<std::os::unix::net::UnixListener> {
+    remove_stale_socket(path)?;
+    let listener = std::os::unix::net::UnixListener::bind(path)?;
+    // The mode from bind depends on the umask of whoever started the service.
+    std::fs::set_permissions(path, std::fs::Permissions::from_mode(SOCKET_MODE))?;
+    info!("[HTTP Server :: Unix] Listening on {}", path.display());
+    Ok(listener)
+}
+
+/// Serves `app` on a Unix domain socket until `shutdown` is notified.
+///
+/// Used instead of `axum_server` when the server sits behind a reverse proxy on the same
+/// host: requests go through the same router, limits and route execution as over TCP,
+/// without the loopback TCP stack. Open connections get `grace` to finish on shutdown.
+/// The socket file stays, the server removes it once it stops for good.
+pub async fn serve(
+    listener: std::os::unix::net::UnixListener,
+    app: Router,
+    limiter: ConnectionLimiter,
+    shutdown: Arc<Notify>,
+    grace: Duration,
+) -> io::Result<()> {
+    listener.set_nonblocking(true)?;
+    let listener = UnixListener::from_std(listener)?;
+
+    let mut builder = auto::Builder::new(TokioExecutor::new());
+    configure_builder(&mut builder, limiter.limits());
+    let graceful = GracefulShutdown::new();
+    // Connections that outlive the grace period are dropped when this sender is.
+    let (_close_tx, close_rx) = watch::channel(());
+
+    loop {
+        tokio::select! {
+            accepted = listener.accept() => {
+                let stream = match accepted {
+                    Ok((stream, _)) => stream,
+                    Err(e) => {
+                        // Usually out of file descriptors, give open connections time to close.
+                        error!("[HTTP Server :: Unix] Failed to accept connection: {}", e);
+                        tokio::time::sleep(Duration::from_millis(50)).await;
+                        continue;
+                    }
+                };
+
+                let Some(permit) = limiter.admit() else {
+                    continue;
+                };
+
+                let io = TokioIo::new(limiter.guard(stream, permit));
+                let service = TowerToHyperService::new(app.clone());
+                let connection = graceful.watch(builder.serve_connection_with_upgrades(io, service).into_owned());
+
+                let mut close_rx = close_rx.clone();
+
+                tokio::spawn(async move {
+                    tokio::select! {
+                        result = connection => {
+                            if let Err(e) = result {
+                                debug!("[HTTP Server :: Unix] Connection closed with error: {}", e);
+                            }
+                        }
+                        _ = close_rx.changed() => {}
+                    }
+                });
+            }
+            _ = shutdown.notified() => break,
+        }
+    }
+
+    drop(listener);
+
+    if tokio::time::timeout(grace, graceful.shutdown()).await.is_err() {
+        warn!("[HTTP Server :: Unix] Connections still open after {:?}, closing them", grace);
+    }
+
+    Ok(())
+}
+
+pub fn remove_socket(path: &Path) {
+    if let Err(e) = std::fs::remove_file(path) {
+        warn!("[HTTP Server :: Unix] Failed to remove socket '{}': {}", path.display(), e);
+    }
+}
+
+/// A socket left by a server that didn't shut down cleanly would make `bind` fail.
+/// Sockets something still listens on and anything that isn't a socket are left alone.
+fn remove_stale_socket(path: &Path) -> io::Result<()> {
+    match std::fs::symlink_metadata(path) {
+        Ok(metadata) if metadata.file_type().is_socket() => {
+            if std::os::unix::net::UnixStream::connect(path).is_ok() {
+                return Err(io::Error::new(
+                    io::ErrorKind::AddrInUse,
+                    format!("'{}' is used by another server", path.display()),
+                ));
+            }
+            debug!("[HTTP Server :: Unix] Removing stale socket '{}'", path.display());
+            std::fs::remove_file(path)
+        }
+        Ok(_) => Err(io::Error::new(
+            io::ErrorKind::AlreadyExists,
+            format!("'{}' exists and is not a socket", path.display()),
+        )),
+        Err(e) if e.kind() == io::ErrorKind::NotFound => Ok(()),
+        Err(e) => Err(e),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::path::PathBuf;
+    use axum::routing::get;
+    use http_body_util::{BodyExt, Empty};
+    use hyper::body::Bytes;
+    use tokio::sync::Semaphore;
+    use crate::servers::ServerLimits;
+
+    fn socket_path(test: &str) -> PathBuf {
+        let path = std::env::temp_dir().join(format!("netter-unix-{}-{}.sock", std::process::id(), test));
+        let _ = std::fs::remove_file(&path);
+        path
+    }
+
+    async fn request(path: &Path) -> (u16, Bytes) {
+        let stream = tokio::net::UnixStream::connect(path).await.unwrap();
+        let (mut sender, connection) = hyper::client::conn::http1::handshake(TokioIo::new(stream)).await.unwrap();
+        tokio::spawn(connection);
+
+        let request = hyper::Request::get("/hello").header("host", "localhost").body(Empty::<Bytes>::new()).unwrap();
+        let response = sender.send_request(request).await.unwrap();
+        let status = response.status().as_u16();
+        (status, response.into_body().collect().await.unwrap().to_bytes())
+    }
+
+    #[test]
+    fn missing_socket_is_left_to_bind() {
+        let path = socket_path("missing");
+        remove_stale_socket(&path).unwrap();
+    }
+
+    #[test]
+    fn stale_socket_is_removed() {
+        let path = socket_path("stale");
+        // Dropping a listener keeps its file, like a server that was killed.
+        drop(std::os::unix::net::UnixListener::bind(&path).unwrap());
+        assert!(path.exists());
+
+        remove_stale_socket(&path).unwrap();
+        assert!(!path.exists());
+    }
+
+    #[test]
+    fn socket_in_use_is_kept() {
+        let path = socket_path("live");
+        let _listener = std::os::unix::net::UnixListener::bind(&path).unwrap();
+
+        let error = remove_stale_socket(&path).unwrap_err();
+        assert_eq!(error.kind(), io::ErrorKind::AddrInUse);
+        assert!(path.exists());
+        remove_socket(&path);
+    }
+
+    #[test]
+    fn other_files_are_kept() {
+        let path = socket_path("file");
+        std::fs::write(&path, b"not a socket").unwrap();
+
+        let error = remove_stale_socket(&path).unwrap_err();
+        assert_eq!(error.kind(), io::ErrorKind::AlreadyExists);
+        assert_eq!(std::fs::read(&path).unwrap(), b"not a socket");
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn bind_sets_the_socket_mode() {
+        let path = socket_path("mode");
+        let _listener = bind(&path).unwrap();
+
+        let mode = std::fs::metadata(&path).unwrap().permissions().mode();
+        assert_eq!(mode & 0o777, SOCKET_MODE);
+        remove_socket(&path);
+    }
+
+    #[tokio::test]
+    async fn serves_requests_until_shutdown() {
+        let path = socket_path("serve");
+        let listener = bind(&path).unwrap();
+        let limiter = ConnectionLimiter::new(Arc::new(Semaphore::new(16)), ServerLimits::default());
+        let app = Router::new().route("/hello", get(|| async { "hello" }));
+        let shutdown = Arc::new(Notify::new());
+        let server = tokio::spawn(serve(listener, app, limiter, Arc::clone(&shutdown), Duration::from_secs(1)));
+
+        for _ in 0..3 {
+            let (status, body) = request(&path).await;
+            assert_eq!(status, 200);
+            assert_eq!(&body[..], b"hello");
+        }
+
+        shutdown.notify_one();
+        tokio::time::timeout(Duration::from_secs(5), server).await.unwrap().unwrap().unwrap();
+        // The listener is closed, the file is removed by the server once it stops for good.
+        assert!(tokio::net::UnixStream::connect(&path).await.is_err());
+        remove_socket(&path);
+    }
+}
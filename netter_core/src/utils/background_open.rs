@@ -0,0 +1,94 @@
+use std::{
+    sync::{Condvar, Mutex, MutexGuard, OnceLock, PoisonError},
+    time::Duration,
+};
+
+/// A process-wide value that is opened on a thread of its own, such as a store that may wait
+/// for another process to release its directory.
+///
+/// Callers wait for the open only as long as they can afford, it goes on in the background
+/// after that. A failed open isn't kept: the next caller starts another one.
+pub struct BackgroundOpen<T> {
+    /// What is opened, in messages and the name of the thread.
+    name: &'static str,
+    value: OnceLock<T>,
+    state: Mutex<State>,
+    done: Condvar,
+}
+
+struct State {
+    opening: bool,
+    /// Why the last open failed.
+    error: Option<String>,
+}
+
+impl<T: Send + Sync + 'static> BackgroundOpen<T> {
+    pub const fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            value: OnceLock::new(),
+            state: Mutex::new(State { opening: false, error: None }),
+            done: Condvar::new(),
+        }
+    }
+
+    /// The value if it is open.
+    pub fn get(&self) -> Option<&T> {
+        self.value.get()
+    }
+
+    /// The value, starting `open` on a thread of its own if it isn't open and no open is
+    /// running. Waits at most `wait` for a running open, `None` waits until it ends.
+    pub fn get_or_open(&'static self, wait: Option<Duration>, open: fn() -> Result<T, String>) -> Result<&'static T, String> {
+        if let Some(value) = self.value.get() {
+            return Ok(value);
+        }
+
+        let mut state = self.lock();
+        if !state.opening && self.value.get().is_none() {
+            state.opening = true;
+            let spawned = std::thread::Builder::new()
+                .name(format!("netter-{}-open", self.name.replace(' ', "-")))
+                .spawn(move || self.open(open));
+            if let Err(e) = spawned {
+                state.opening = false;
+                return Err(format!("Failed to start opening the {}: {}", self.name, e));
+            }
+        }
+
+        let state = match wait {
+            Some(wait) => self.done.wait_timeout_while(state, wait, |state| state.opening)
+                .map(|(state, _)| state)
+                .unwrap_or_else(|e| e.into_inner().0),
+            None => self.done.wait_while(state, |state| state.opening).unwrap_or_else(PoisonError::into_inner),
+        };
+
+        if let Some(value) = self.value.get() {
+            return Ok(value);
+        }
+        Err(match &state.error {
+            Some(error) if !state.opening => format!("Failed to open the {}: {}", self.name, error),
+            _ => format!("The {} is still opening, it may be waiting for another process to release it", self.name),
+        })
+    }
+
+    fn open(&self, open: fn() -> Result<T, String>) {
+        let result = std::panic::catch_unwind(open)
+            .unwrap_or_else(|_| Err("the open panicked".to_string()));
+
+        let mut state = self.lock();
+        match result {
+            Ok(value) => {
+                let _ = self.value.set(value);
+                state.error = None;
+            }
+            Err(e) => state.error = Some(e),
+        }
+        state.opening = false;
+        self.done.notify_all();
+    }
+
+    fn lock(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+}
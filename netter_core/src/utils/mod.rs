@@ -1,3 +1,4 @@
+pub mod background_open;
 pub mod math;
 
-pub use math::powi;
\ No newline at end of file
+pub use math::powi;
@@ -2,12 +2,91 @@ extern crate proc_macro;
 
 use proc_macro::TokenStream;
 use quote::{quote, ToTokens};
-use syn::{parse_macro_input, FnArg, ItemFn, Pat, PatType, Type, ReturnType, Error};
+use syn::{parse_macro_input, FnArg, Ident, ItemFn, Meta, MetaNameValue, Pat, PatType, Type, ReturnType, Error, Token};
+use syn::parse::{Parse, ParseStream};
+use syn::punctuated::Punctuated;
 
+/// Options of `#[netter_plugin(...)]`.
+#[derive(Default)]
+struct PluginOptions {
+    state: bool,
+    batch: Option<BatchOptions>,
+}
+
+struct BatchOptions {
+    max_items: u32,
+    window_us: u32,
+}
+
+impl Default for BatchOptions {
+    fn default() -> Self {
+        Self {
+            max_items: 32,
+            window_us: 200,
+        }
+    }
+}
+
+impl PluginOptions {
+    fn from_metas(metas: Punctuated<Meta, Token![,]>) -> syn::Result<Self> {
+        let mut options = Self::default();
+
+        for meta in metas {
+            match &meta {
+                Meta::Path(path) if path.is_ident("state") => options.state = true,
+                Meta::Path(path) if path.is_ident("batch") => options.batch = Some(BatchOptions::default()),
+                Meta::List(list) if list.path.is_ident("batch") => {
+                    let mut batch = BatchOptions::default();
+                    let values = list.parse_args_with(Punctuated::<MetaNameValue, Token![,]>::parse_terminated)?;
+
+                    for value in values {
+                        let number = match &value.value {
+                            syn::Expr::Lit(syn::ExprLit { lit: syn::Lit::Int(int), .. }) => int.base10_parse::<u32>()?,
+                            other => return Err(Error::new_spanned(other, "Expected an integer")),
+                        };
+
+                        if value.path.is_ident("max_items") {
+                            batch.max_items = number.max(1);
+                        } else if value.path.is_ident("window_us") {
+                            batch.window_us = number;
+                        } else {
+                            return Err(Error::new_spanned(&value.path, "Unknown batch option, expected `max_items` or `window_us`"));
+                        }
+                    }
+
+                    options.batch = Some(batch);
+                }
+                _ => return Err(Error::new_spanned(&meta, "Unknown #[netter_plugin] option, expected `state` or `batch`")),
+            }
+        }
+
+        Ok(options)
+    }
+}
+
+/// Marks a function callable from RDL.
+///
+/// With `#[netter_plugin(state)]` the first argument is a shared reference to the
+/// plugin state created by the `#[netter_plugin_init]` function.
+///
+/// With `#[netter_plugin(batch(max_items = 64, window_us = 500))]` the function takes
+/// a single `Vec<(A, B, ..)>` (or `Vec<A>` for one argument) and returns `Result<Vec<R>, String>`
+/// with one result per item. RDL still calls it as `alias::name(a, b)`: the host collects
+/// concurrent calls for up to `max_items` items or `window_us` microseconds and invokes
+/// the function once for all of them.
 #[proc_macro_attribute]
-pub fn netter_plugin(_attr: TokenStream, item: TokenStream) -> TokenStream {
+pub fn netter_plugin(attr: TokenStream, item: TokenStream) -> TokenStream {
     let input_fn = parse_macro_input!(item as ItemFn);
 
+    let options = match syn::parse::Parser::parse(Punctuated::<Meta, Token![,]>::parse_terminated, attr) {
+        Ok(metas) => match PluginOptions::from_metas(metas) {
+            Ok(options) => options,
+            Err(e) => return e.to_compile_error().into(),
+        },
+        Err(e) => return e.to_compile_error().into(),
+    };
+    let uses_state = options.state;
+
     let fn_vis = &input_fn.vis;
     let fn_sig = &input_fn.sig;
     let fn_name = &fn_sig.ident;
@@ -32,208 +111,704 @@ pub fn netter_plugin(_attr: TokenStream, item: TokenStream) -> TokenStream {
 
     let internal_fn_name = quote::format_ident!("_internal_{}", fn_name);
     let internal_fn = quote! {
-        #fn_vis fn #internal_fn_name(#fn_inputs) #fn_output {
-            #fn_body
-        }
+        #fn_vis fn #internal_fn_name(#fn_inputs) #fn_output #fn_body
     };
+    let entry_name = quote::format_ident!("_netter_fn_{}", fn_name);
+    let dispatch_fn_name = quote::format_ident!("_dispatch_{}", fn_name);
+
+    if let Some(batch) = &options.batch {
+        return match batch_dispatch(fn_sig, &internal_fn_name, &dispatch_fn_name, uses_state) {
+            Ok(dispatch_code) => {
+                let max_items = batch.max_items;
+                let window_us = batch.window_us;
+
+                quote! {
+                    #internal_fn
+                    #dispatch_code
+
+                    #[doc(hidden)]
+                    #[allow(non_upper_case_globals)]
+                    const #entry_name: ::netter_sdk::PluginFunction = ::netter_sdk::PluginFunction::Batched {
+                        handler: #dispatch_fn_name,
+                        max_items: #max_items,
+                        window_us: #window_us,
+                    };
+                }
+                .into()
+            }
+            Err(e) => e.to_compile_error().into(),
+        };
+    }
 
     let mut arg_parsers = Vec::new();
     let mut arg_names_for_call = Vec::new();
-    let expected_arg_count = fn_inputs.len();
+    let mut rdl_inputs = fn_inputs.iter();
+
+    if uses_state {
+        match rdl_inputs.next() {
+            Some(FnArg::Typed(PatType { ty, .. })) if matches!(&**ty, Type::Reference(_)) => {
+                arg_parsers.push(quote! {
+                    if plugin_state.is_null() {
+                        return Err(format!("Function '{}' requires plugin state, but the plugin wasn't initialized", #fn_name_str));
+                    }
+                    let __plugin_state: &__NetterPluginState = unsafe { &*(plugin_state as *const __NetterPluginState) };
+                });
+                arg_names_for_call.push(quote::format_ident!("__plugin_state"));
+            }
+            _ => return Error::new_spanned(fn_sig, "#[netter_plugin(state)] function must take `&State` as its first argument")
+                .to_compile_error().into(),
+        }
+    }
 
-    for (index, arg) in fn_inputs.iter().enumerate() {
+    let rdl_inputs: Vec<&FnArg> = rdl_inputs.collect();
+    let expected_arg_count = rdl_inputs.len();
+
+    for (index, arg) in rdl_inputs.into_iter().enumerate() {
          if let FnArg::Typed(PatType { pat, ty, .. }) = arg {
             if let Pat::Ident(pat_ident) = &**pat {
                 let arg_name = &pat_ident.ident;
                 arg_names_for_call.push(arg_name.clone());
 
-                let type_path = if let Type::Path(type_path) = &**ty { type_path }
-                else if let Type::Reference(type_ref) = &**ty {
-                    if let Type::Path(type_path) = &*type_ref.elem { type_path }
-                    else { return Error::new_spanned(ty, "Unsupported argument type reference").to_compile_error().into(); }
+                match arg_parser(index, arg_name, ty) {
+                    Ok(parser_code) => arg_parsers.push(parser_code),
+                    Err(e) => return e.to_compile_error().into(),
                 }
-                else { return Error::new_spanned(ty, "Unsupported argument type").to_compile_error().into(); };
-                let type_ident = type_path.path.segments.last().map(|seg| &seg.ident);
-
-                let parser_code = match type_ident.map(|id| id.to_string()).as_deref() {
-                    Some("String") => quote! {
-                        let #arg_name: String = match rdl_args_vec.get(#index)
-                            .ok_or_else(|| format!("Missing argument #{}", #index))? {
-                                RDLTypes::String(s) => s.clone(),
-                                other => return Err(format!("Argument #{} must be a String, got {:?}", #index, other)),
-                            };
-                    },
-                    Some("str") => quote! {
-                        let temp_arg_string_for_ref = match rdl_args_vec.get(#index)
-                            .ok_or_else(|| format!("Missing argument #{}", #index))? {
-                                RDLTypes::String(s) => s,
-                                other => return Err(format!("Argument #{} must be a String slice, got {:?}", #index, other)),
-                            };
-                        let #arg_name: &str = temp_arg_string_for_ref.as_str();
-                    },
-                    Some("i32") | Some("i64") | Some("isize") => quote! {
-                        let #arg_name = match rdl_args_vec.get(#index)
-                            .ok_or_else(|| format!("Missing argument #{}", #index))? {
-                                RDLTypes::Number(n) => *n as #type_ident,
-                                other => return Err(format!("Argument #{} must be a Number, got {:?}", #index, other)),
-                            };
-                    },
-                    Some("bool") => quote! {
-                        let #arg_name = match rdl_args_vec.get(#index)
-                            .ok_or_else(|| format!("Missing argument #{}", #index))? {
-                                RDLTypes::Boolean(b) => *b,
-                                other => return Err(format!("Argument #{} must be a Boolean, got {:?}", #index, other)),
-                            };
-                    },
-                    _ => {
-                        let type_str = ty.to_token_stream().to_string();
-                        return Error::new_spanned(ty, format!("Unsupported argument type for RDL FFI dispatch: {}", type_str))
-                            .to_compile_error().into();
-                    }
-                };
-                arg_parsers.push(parser_code);
             } else { return Error::new_spanned(pat, "Unsupported argument pattern").to_compile_error().into(); }
          } else { return Error::new_spanned(arg, "Unsupported argument type (e.g., self)").to_compile_error().into(); }
     }
 
-    let ctor_fn_name = quote::format_ident!("_register_{}", fn_name);
-    let registration_code = quote! {
-        #[ctor::ctor]
-        fn #ctor_fn_name() {
-            let function_name = #fn_name_str.to_string();
-            let function_name_clone = function_name.clone();
+    let dispatch_code = quote! {
+        #[doc(hidden)]
+        fn #dispatch_fn_name(
+            plugin_state: *const std::ffi::c_void,
+            ffi_args: &[::netter_sdk::FFIValue],
+        ) -> Result<::netter_sdk::RDLTypes, String> {
+            let _ = plugin_state;
 
-            let handler: DispatchableFn = Box::new(move |rdl_args_vec: Vec<RDLTypes>| -> Result<RDLTypes, String> {
-                if rdl_args_vec.len() != #expected_arg_count {
-                    return Err(format!("Function '{}' expects {} arguments, but received {}", function_name_clone, #expected_arg_count, rdl_args_vec.len()));
-                }
+            if ffi_args.len() != #expected_arg_count {
+                return Err(format!("Function '{}' expects {} arguments, but received {}", #fn_name_str, #expected_arg_count, ffi_args.len()));
+            }
 
-                #( #arg_parsers )*
-                
-                #internal_fn_name(#(#arg_names_for_call),*).map(|res| res.into())
-            });
+            #( #arg_parsers )*
 
-            let mut registry = PLUGIN_REGISTRY.get_or_init(std::collections::HashMap::new);
-            
-            if let Ok(mut reg) = PLUGIN_REGISTRY.lock() {
-                if reg.contains_key(&function_name) {
-                    println!("Netter Plugin Warning: Duplicate registration for function '{}'. Overwriting.", function_name);
-                }
-                reg.insert(function_name, handler);
-            }
+            #internal_fn_name(#(#arg_names_for_call),*).map(|res| res.into())
         }
     };
 
     let output = quote! {
         #internal_fn
-        #registration_code
+        #dispatch_code
+
+        #[doc(hidden)]
+        #[allow(non_upper_case_globals)]
+        const #entry_name: ::netter_sdk::PluginFunction = ::netter_sdk::PluginFunction::Single(#dispatch_fn_name);
     };
 
     output.into()
 }
 
+/// Marks the plugin's init hook: `fn() -> Result<State, String>`.
+///
+/// It runs once when the interpreter loads the plugin. The returned state is boxed,
+/// handed to the host as an opaque pointer and passed back to every
+/// `#[netter_plugin(state)]` function. Calls may run concurrently from several
+/// threads, so `State` must be `Send + Sync` and use its own synchronization
+/// (`Mutex`, atomics, a connection pool) for anything mutable.
+#[proc_macro_attribute]
+pub fn netter_plugin_init(_attr: TokenStream, item: TokenStream) -> TokenStream {
+    let input_fn = parse_macro_input!(item as ItemFn);
+    let fn_name = &input_fn.sig.ident;
+
+    if !input_fn.sig.inputs.is_empty() {
+        return Error::new_spanned(&input_fn.sig.inputs, "#[netter_plugin_init] function must not take arguments")
+            .to_compile_error().into();
+    }
+
+    let state_ty = match result_ok_type(&input_fn.sig.output) {
+        Some(ty) => ty,
+        None => return Error::new_spanned(&input_fn.sig, "#[netter_plugin_init] function must return Result<State, String>")
+            .to_compile_error().into(),
+    };
+
+    quote! {
+        #input_fn
+
+        #[doc(hidden)]
+        type __NetterPluginState = #state_ty;
+
+        const _: fn() = || {
+            fn assert_send_sync<T: Send + Sync + 'static>() {}
+            assert_send_sync::<__NetterPluginState>();
+        };
+
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_init() -> ::netter_sdk::FFIInitResult {
+            use std::ffi::CString;
+            use ::netter_sdk::{FFIInitResult, FFIStatus};
+
+            let failed = |message: String| FFIInitResult {
+                status: FFIStatus::Err,
+                state: std::ptr::null_mut(),
+                error_ptr: CString::new(message).unwrap_or_default().into_raw(),
+            };
+
+            match std::panic::catch_unwind(#fn_name) {
+                Ok(Ok(state)) => FFIInitResult {
+                    status: FFIStatus::Ok,
+                    state: Box::into_raw(Box::new(state)) as *mut std::ffi::c_void,
+                    error_ptr: std::ptr::null_mut(),
+                },
+                Ok(Err(message)) => failed(message.to_string()),
+                Err(_) => failed("Panic during plugin init".to_string()),
+            }
+        }
+
+        /// Runs `__netter_init` inside a wasm instance and keeps the state in the instance.
+        #[cfg(target_arch = "wasm32")]
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_wasm_init() -> u64 {
+            use ::netter_sdk::{FFIStatus, wasm::guest};
+
+            let result = __netter_init();
+            match result.status {
+                FFIStatus::Ok => {
+                    guest::set_state(result.state);
+                    0
+                }
+                FFIStatus::Err => guest::respond_err(&unsafe { guest::take_error(result.error_ptr) }),
+            }
+        }
+    }
+    .into()
+}
+
+/// Marks the plugin's shutdown hook: `fn(State)`.
+///
+/// Runs once when the plugin is unloaded and takes the state back by value, so
+/// connections and files are closed by its `Drop` or explicitly here.
+#[proc_macro_attribute]
+pub fn netter_plugin_shutdown(_attr: TokenStream, item: TokenStream) -> TokenStream {
+    let input_fn = parse_macro_input!(item as ItemFn);
+    let fn_name = &input_fn.sig.ident;
+
+    if input_fn.sig.inputs.len() != 1 {
+        return Error::new_spanned(&input_fn.sig, "#[netter_plugin_shutdown] function must take the plugin state by value")
+            .to_compile_error().into();
+    }
+
+    quote! {
+        #input_fn
+
+        #[unsafe(no_mangle)]
+        pub unsafe extern "C" fn __netter_shutdown(state: *mut std::ffi::c_void) {
+            if state.is_null() {
+                return;
+            }
+
+            let state = unsafe { Box::from_raw(state as *mut __NetterPluginState) };
+            let _ = std::panic::catch_unwind(std::panic::AssertUnwindSafe(move || #fn_name(*state)));
+        }
+
+        #[cfg(target_arch = "wasm32")]
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_wasm_shutdown() {
+            unsafe { __netter_shutdown(::netter_sdk::wasm::guest::take_state()) }
+        }
+    }
+    .into()
+}
+
+fn result_ok_type(output: &ReturnType) -> Option<&Type> {
+    let ReturnType::Type(_, ty) = output else { return None };
+    let segment = last_segment(ty)?;
+    if segment.ident != "Result" {
+        return None;
+    }
+
+    generic_type_arg(segment)
+}
+
+fn last_segment(ty: &Type) -> Option<&syn::PathSegment> {
+    match ty {
+        Type::Path(type_path) => type_path.path.segments.last(),
+        _ => None,
+    }
+}
+
+fn type_name(ty: &Type) -> Option<String> {
+    last_segment(ty).map(|seg| seg.ident.to_string())
+}
+
+/// Builds the code that reads argument `index` from `ffi_args` into `arg_name`.
+fn arg_parser(index: usize, arg_name: &Ident, ty: &Type) -> Result<proc_macro2::TokenStream, Error> {
+    let value = arg_value(quote! { ffi_args[#index] }, index, ty)?;
+
+    Ok(quote! {
+        let #arg_name: #ty = #value;
+    })
+}
+
+/// Builds an expression converting the `FFIValue` place `arg` into `ty`.
+///
+/// `&str`, `&[u8]` and `&[FFIValue]` borrow the host's buffers directly. Owned types
+/// (`String`, `Vec<_>`) are copied out of them once. Conversion errors are returned
+/// with `?`, so the expression must be used inside a function returning `Result<_, String>`.
+fn arg_value(arg: proc_macro2::TokenStream, index: usize, ty: &Type) -> Result<proc_macro2::TokenStream, Error> {
+    let map_err = quote! {
+        .map_err(|e| format!("Argument #{}: {}", #index, e))?
+    };
+
+    if let Type::Reference(type_ref) = ty {
+        return match &*type_ref.elem {
+            Type::Slice(slice) => match type_name(&slice.elem).as_deref() {
+                Some("u8") => Ok(quote! { #arg.as_bytes() #map_err }),
+                Some("FFIValue") => Ok(quote! { #arg.as_array() #map_err }),
+                _ => Err(Error::new_spanned(ty, "Unsupported slice type, expected &[u8] or &[FFIValue]")),
+            },
+            elem if type_name(elem).as_deref() == Some("str") => Ok(quote! { #arg.as_str() #map_err }),
+            _ => Err(Error::new_spanned(ty, "Unsupported argument type reference")),
+        };
+    }
+
+    let segment = last_segment(ty)
+        .ok_or_else(|| Error::new_spanned(ty, "Unsupported argument type"))?;
+
+    match segment.ident.to_string().as_str() {
+        "String" => Ok(quote! { #arg.as_str() #map_err .to_string() }),
+        "i32" | "i64" | "isize" | "u32" | "u64" | "usize" => Ok(quote! { (#arg.as_i64() #map_err as #ty) }),
+        "bool" => Ok(quote! { #arg.as_bool() #map_err }),
+        "Vec" => {
+            let elem = generic_type_arg(segment)
+                .ok_or_else(|| Error::new_spanned(ty, "Vec argument must have an element type"))?;
+
+            let convert = match type_name(elem).as_deref() {
+                Some("u8") => return Ok(quote! { #arg.as_bytes() #map_err .to_vec() }),
+                Some("i32" | "i64" | "isize" | "u32" | "u64" | "usize") => quote! { item.as_i64().map(|n| n as #elem) },
+                Some("bool") => quote! { item.as_bool() },
+                Some("String") => quote! { item.as_str().map(|s| s.to_string()) },
+                Some("RDLTypes") => quote! { item.to_rdl() },
+                _ => return Err(Error::new_spanned(elem, format!(
+                    "Unsupported Vec element type for RDL FFI dispatch: {}", elem.to_token_stream()
+                ))),
+            };
+
+            Ok(quote! {
+                #arg.as_array() #map_err
+                    .iter()
+                    .map(|item| #convert)
+                    .collect::<Result<Vec<#elem>, String>>() #map_err
+            })
+        }
+        _ => Err(Error::new_spanned(ty, format!(
+            "Unsupported argument type for RDL FFI dispatch: {}", ty.to_token_stream()
+        ))),
+    }
+}
+
+fn generic_type_arg(segment: &syn::PathSegment) -> Option<&Type> {
+    match &segment.arguments {
+        syn::PathArguments::AngleBracketed(generic) => match generic.args.first() {
+            Some(syn::GenericArgument::Type(ty)) => Some(ty),
+            _ => None,
+        },
+        _ => None,
+    }
+}
+
+/// Builds the dispatcher of a `#[netter_plugin(batch)]` function.
+///
+/// The dispatcher receives one `Vector` per call holding that call's arguments. Calls
+/// whose arguments don't convert get their own error and are left out of the batch;
+/// the rest are passed to the function in one `Vec`.
+fn batch_dispatch(
+    fn_sig: &syn::Signature,
+    internal_fn_name: &Ident,
+    dispatch_fn_name: &Ident,
+    uses_state: bool,
+) -> Result<proc_macro2::TokenStream, Error> {
+    let fn_name_str = fn_sig.ident.to_string();
+    let mut inputs = fn_sig.inputs.iter();
+
+    if uses_state {
+        match inputs.next() {
+            Some(FnArg::Typed(PatType { ty, .. })) if matches!(&**ty, Type::Reference(_)) => {}
+            _ => return Err(Error::new_spanned(fn_sig, "#[netter_plugin(state)] function must take `&State` as its first argument")),
+        }
+    }
+
+    let batch_ty = match (inputs.next(), inputs.next()) {
+        (Some(FnArg::Typed(PatType { ty, .. })), None) => ty,
+        _ => return Err(Error::new_spanned(fn_sig, "#[netter_plugin(batch)] function must take a single Vec of calls")),
+    };
+
+    let item_ty = last_segment(batch_ty)
+        .filter(|segment| segment.ident == "Vec")
+        .and_then(generic_type_arg)
+        .ok_or_else(|| Error::new_spanned(batch_ty, "#[netter_plugin(batch)] argument must be a Vec<(A, B, ..)>"))?;
+
+    let item_types: Vec<&Type> = match item_ty {
+        Type::Tuple(tuple) => tuple.elems.iter().collect(),
+        other => vec![other],
+    };
+    let expected_arg_count = item_types.len();
+
+    let values = item_types.iter().enumerate()
+        .map(|(index, ty)| arg_value(quote! { ffi_args[#index] }, index, ty))
+        .collect::<Result<Vec<_>, Error>>()?;
+
+    let item_expr = match item_ty {
+        Type::Tuple(_) => quote! { ( #( #values ),* ) },
+        _ => quote! { #( #values )* },
+    };
+
+    let state_arg = if uses_state {
+        quote! {
+            if plugin_state.is_null() {
+                let message = format!("Function '{}' requires plugin state, but the plugin wasn't initialized", #fn_name_str);
+                for slot in slots {
+                    results[slot] = Err(message.clone());
+                }
+                return results;
+            }
+            let __plugin_state: &__NetterPluginState = unsafe { &*(plugin_state as *const __NetterPluginState) };
+        }
+    } else {
+        quote! {}
+    };
+    let state_call_arg = if uses_state { quote! { __plugin_state, } } else { quote! {} };
+
+    Ok(quote! {
+        #[doc(hidden)]
+        fn #dispatch_fn_name(
+            plugin_state: *const std::ffi::c_void,
+            ffi_calls: &[::netter_sdk::FFIValue],
+        ) -> Vec<Result<::netter_sdk::RDLTypes, String>> {
+            fn parse_call(call: &::netter_sdk::FFIValue) -> Result<#item_ty, String> {
+                let ffi_args = call.as_array()?;
+                if ffi_args.len() != #expected_arg_count {
+                    return Err(format!("Function '{}' expects {} arguments, but received {}", #fn_name_str, #expected_arg_count, ffi_args.len()));
+                }
+
+                Ok(#item_expr)
+            }
+
+            let _ = plugin_state;
+            let mut results: Vec<Result<::netter_sdk::RDLTypes, String>> = Vec::with_capacity(ffi_calls.len());
+            let mut batch = Vec::with_capacity(ffi_calls.len());
+            let mut slots = Vec::with_capacity(ffi_calls.len());
+
+            for call in ffi_calls {
+                match parse_call(call) {
+                    Ok(item) => {
+                        slots.push(results.len());
+                        batch.push(item);
+                        results.push(Err(String::new()));
+                    }
+                    Err(e) => results.push(Err(e)),
+                }
+            }
+
+            if batch.is_empty() {
+                return results;
+            }
+
+            #state_arg
+
+            match #internal_fn_name(#state_call_arg batch) {
+                Ok(outputs) if outputs.len() == slots.len() => {
+                    for (slot, output) in slots.into_iter().zip(outputs) {
+                        results[slot] = Ok(output.into());
+                    }
+                }
+                Ok(outputs) => {
+                    let message = format!("Function '{}' returned {} results for {} calls", #fn_name_str, outputs.len(), slots.len());
+                    for slot in slots {
+                        results[slot] = Err(message.clone());
+                    }
+                }
+                Err(e) => {
+                    let message = e.to_string();
+                    for slot in slots {
+                        results[slot] = Err(message.clone());
+                    }
+                }
+            }
+
+            results
+        }
+    })
+}
+
+struct PluginFunctions {
+    names: Vec<Ident>,
+}
+
+impl Parse for PluginFunctions {
+    fn parse(input: ParseStream) -> syn::Result<Self> {
+        let names = Punctuated::<Ident, Token![,]>::parse_terminated(input)?;
+        Ok(Self {
+            names: names.into_iter().collect(),
+        })
+    }
+}
+
+/// Generates the `__netter_dispatch` entry point and a static function table.
+///
+/// Every function marked with `#[netter_plugin]` must be listed here. The table is
+/// sorted by name at compile time, so a lookup is a binary search over a `static`
+/// slice: no registration runs when the library is loaded and calls never lock.
+///
+/// # Example
+/// ```ignore
+/// generate_dispatch_func!(add_numbers, check_flag);
+/// ```
 #[proc_macro]
-pub fn generate_dispatch_func(_item: TokenStream) -> TokenStream {
+pub fn generate_dispatch_func(item: TokenStream) -> TokenStream {
+    let functions = parse_macro_input!(item as PluginFunctions);
+
+    let mut names = functions.names;
+    names.sort_by_key(|name| name.to_string());
+
+    for pair in names.windows(2) {
+        if pair[0] == pair[1] {
+            return Error::new_spanned(&pair[1], format!("Function '{}' is listed more than once", pair[1]))
+                .to_compile_error().into();
+        }
+    }
+
+    let table_len = names.len();
+    let name_strs: Vec<String> = names.iter().map(|name| name.to_string()).collect();
+    let entries: Vec<Ident> = names.iter()
+        .map(|name| quote::format_ident!("_netter_fn_{}", name))
+        .collect();
+
     quote! {
-        use std::collections::HashMap;
-        use std::sync::OnceLock;
-        use std::ffi::{CStr, CString};
-        use std::os::raw::c_char;
-        use netter_sdk::
+        /// Plugin functions sorted by name. Built at compile time, read-only at runtime.
+        static PLUGIN_TABLE: [(&str, ::netter_sdk::PluginFunction); #table_len] = [
+            #( (#name_strs, #entries) ),*
+        ];
+
+        #[doc(hidden)]
+        unsafe fn __netter_lookup(
+            func_name_ptr: *const std::os::raw::c_char,
+        ) -> Result<::netter_sdk::PluginFunction, String> {
+            if func_name_ptr.is_null() {
+                return Err("Function name pointer is null".to_string());
+            }
+
+            let func_name = match unsafe { std::ffi::CStr::from_ptr(func_name_ptr) }.to_str() {
+                Ok(s) => s,
+                Err(e) => return Err(format!("Invalid UTF-8 in function name: {}", e)),
+            };
+
+            match PLUGIN_TABLE.binary_search_by(|(name, _)| (*name).cmp(func_name)) {
+                Ok(index) => Ok(PLUGIN_TABLE[index].1),
+                Err(_) => Err(format!("Function '{}' not found in plugin registry", func_name)),
+            }
+        }
+
+        #[doc(hidden)]
+        unsafe fn __netter_values<'a>(
+            ptr: *const ::netter_sdk::FFIValue,
+            len: usize,
+        ) -> Result<&'a [::netter_sdk::FFIValue], String> {
+            if ptr.is_null() && len > 0 {
+                return Err("Arguments pointer is null but length is greater than zero".to_string());
+            }
 
-        type DispatchableFn = Box<dyn Fn(Vec<RDLTypes>) -> Result<RDLTypes, String> + Send + Sync>;
+            if len == 0 {
+                Ok(&[])
+            } else {
+                Ok(unsafe { std::slice::from_raw_parts(ptr, len) })
+            }
+        }
+
+        #[doc(hidden)]
+        fn __netter_panic_message(panic_payload: Box<dyn std::any::Any + Send>) -> String {
+            let panic_msg = if let Some(s) = panic_payload.downcast_ref::<&str>() { *s }
+            else if let Some(s) = panic_payload.downcast_ref::<String>() { s.as_str() }
+            else { "Unknown panic payload" };
+
+            format!("Panic during plugin dispatch: {}", panic_msg)
+        }
 
-        static PLUGIN_REGISTRY: std::sync::Mutex<std::collections::HashMap<String, DispatchableFn>> =
-            std::sync::Mutex::new(std::collections::HashMap::new());
+        #[doc(hidden)]
+        fn __netter_ffi_result(result: Result<::netter_sdk::RDLTypes, String>) -> ::netter_sdk::FFIResult {
+            use std::ffi::CString;
+            use ::netter_sdk::{FFIResult, FFIStatus};
+
+            match result {
+                Ok(rdl_result) => {
+                    let result_str = rdl_result.to_string();
+                    FFIResult {
+                        status: FFIStatus::Ok,
+                        data_ptr: CString::new(result_str).unwrap_or_default().into_raw(),
+                    }
+                }
+                Err(err_msg) => {
+                    FFIResult {
+                        status: FFIStatus::Err,
+                        data_ptr: CString::new(err_msg).unwrap_or_default().into_raw(),
+                    }
+                }
+            }
+        }
 
         #[unsafe(no_mangle)]
-        #[unsafe(export_name = "__netter_dispatch")]
         pub unsafe extern "C" fn __netter_dispatch(
-            func_name_ptr: *const c_char,
-            args_ptr: *const FfiValue,
+            plugin_state: *const std::ffi::c_void,
+            func_name_ptr: *const std::os::raw::c_char,
+            args_ptr: *const ::netter_sdk::FFIValue,
             args_len: usize,
-        ) -> FfiResult {
+        ) -> ::netter_sdk::FFIResult {
+            use ::netter_sdk::{FFIArray, FFiDataUnion, FFITypeTag, FFIValue, PluginFunction, RDLTypes};
 
             unsafe fn run(
-                func_name_ptr: *const c_char,
-                args_ptr: *const FfiValue,
+                plugin_state: *const std::ffi::c_void,
+                func_name_ptr: *const std::os::raw::c_char,
+                args_ptr: *const FFIValue,
                 args_len: usize,
             ) -> Result<RDLTypes, String> {
-                if func_name_ptr.is_null() {
-                    return Err("Function name pointer is null".to_string());
-                }
-                
-                let func_name = match CStr::from_ptr(func_name_ptr).to_str() {
-                    Ok(s) => s.to_string(),
-                    Err(e) => return Err(format!("Invalid UTF-8 in function name: {}", e)),
-                };
+                let function = unsafe { __netter_lookup(func_name_ptr)? };
+                let ffi_args = unsafe { __netter_values(args_ptr, args_len)? };
 
-                if args_ptr.is_null() && args_len > 0 {
-                    return Err("Arguments pointer is null but length is greater than zero".to_string());
+                match function {
+                    PluginFunction::Single(handler) => handler(plugin_state, ffi_args),
+                    PluginFunction::Batched { handler, .. } => {
+                        // A host that doesn't batch still gets a result: run a batch of one call.
+                        let call = FFIValue {
+                            tag: FFITypeTag::Vector,
+                            data: FFiDataUnion {
+                                vector: FFIArray { ptr: ffi_args.as_ptr(), len: ffi_args.len() },
+                            },
+                        };
+                        handler(plugin_state, std::slice::from_ref(&call))
+                            .pop()
+                            .unwrap_or_else(|| Err("Batched function returned no result".to_string()))
+                    }
                 }
+            }
 
-                let ffi_slice = std::slice::from_raw_parts(args_ptr, args_len);
-                let mut rdl_args = Vec::with_capacity(args_len);
-
-                for ffi_val in ffi_slice {
-                    let rdl_val = match ffi_val.tag {
-                        FfiTag::Number => RDLTypes::Number(ffi_val.data.number),
-                        FfiTag::Boolean => RDLTypes::Boolean(ffi_val.data.boolean),
-                        FfiTag::String => {
-                            let str_slice = std::slice::from_raw_parts(
-                                ffi_val.data.string.ptr as *const u8,
-                                ffi_val.data.string.len
-                            );
-                            let s = match std::str::from_utf8(str_slice) {
-                                Ok(valid_str) => valid_str.to_string(),
-                                Err(e) => return Err(format!("Invalid UTF-8 in string argument: {}", e)),
-                            };
-                            RDLTypes::String(s)
-                        }
-                        FfiTag::Vector => return Err("Vector arguments unpacked handling not implemented yet".to_string()),
-                    };
-                    rdl_args.push(rdl_val);
-                }
+            let execution_result = std::panic::catch_unwind(|| {
+                unsafe { run(plugin_state, func_name_ptr, args_ptr, args_len) }
+            });
+
+            __netter_ffi_result(execution_result.unwrap_or_else(|panic_payload| Err(__netter_panic_message(panic_payload))))
+        }
+
+        /// Runs `calls_len` calls of one function. Each call is a `Vector` of its arguments.
+        #[unsafe(no_mangle)]
+        pub unsafe extern "C" fn __netter_dispatch_batch(
+            plugin_state: *const std::ffi::c_void,
+            func_name_ptr: *const std::os::raw::c_char,
+            calls_ptr: *const ::netter_sdk::FFIValue,
+            calls_len: usize,
+        ) -> ::netter_sdk::FFIBatchResult {
+            use std::ffi::CString;
+            use ::netter_sdk::{FFIBatchResult, FFIStatus, FFIValue, PluginFunction, RDLTypes};
 
-                let registry = PLUGIN_REGISTRY.get_or_init(HashMap::new);
+            unsafe fn run(
+                plugin_state: *const std::ffi::c_void,
+                func_name_ptr: *const std::os::raw::c_char,
+                calls_ptr: *const FFIValue,
+                calls_len: usize,
+            ) -> Result<Vec<Result<RDLTypes, String>>, String> {
+                let function = unsafe { __netter_lookup(func_name_ptr)? };
+                let ffi_calls = unsafe { __netter_values(calls_ptr, calls_len)? };
 
-                match registry.get(&func_name) {
-                    Some(handler) => handler(rdl_args),
-                    None => Err(format!("Function '{}' not found in plugin registry", func_name)),
+                match function {
+                    PluginFunction::Batched { handler, .. } => Ok(handler(plugin_state, ffi_calls)),
+                    PluginFunction::Single(handler) => Ok(ffi_calls.iter()
+                        .map(|call| call.as_array().and_then(|ffi_args| handler(plugin_state, ffi_args)))
+                        .collect()),
                 }
             }
 
             let execution_result = std::panic::catch_unwind(|| {
-                run(func_name_ptr, args_ptr, args_len)
+                unsafe { run(plugin_state, func_name_ptr, calls_ptr, calls_len) }
             });
 
-            match execution_result {
-                Ok(Ok(rdl_result)) => {
-                    let result_str = rdl_result.to_string(); 
-                    FfiResult {
-                        status: FfiStatus::Ok,
-                        data_ptr: CString::new(result_str).unwrap().into_raw(),
-                    }
-                }
-                Ok(Err(err_msg)) => {
-                    FfiResult {
-                        status: FfiStatus::Err,
-                        data_ptr: CString::new(err_msg).unwrap().into_raw(),
-                    }
-                }
-                Err(panic_payload) => {
-                    let panic_msg = if let Some(s) = panic_payload.downcast_ref::<&str>() { *s }
-                    else if let Some(s) = panic_payload.downcast_ref::<String>() { s.as_str() }
-                    else { "Unknown panic payload" };
-                    
-                    let complete_err = format!("Panic during plugin dispatch: {}", panic_msg);
-                    FfiResult {
-                        status: FfiStatus::Err,
-                        data_ptr: CString::new(complete_err).unwrap().into_raw(),
-                    }
+            let error = match execution_result {
+                Ok(Ok(results)) => {
+                    let results: Box<[::netter_sdk::FFIResult]> = results.into_iter()
+                        .map(__netter_ffi_result)
+                        .collect();
+                    let len = results.len();
+
+                    return FFIBatchResult {
+                        status: FFIStatus::Ok,
+                        results: Box::into_raw(results) as *mut ::netter_sdk::FFIResult,
+                        len,
+                        error_ptr: std::ptr::null_mut(),
+                    };
                 }
+                Ok(Err(err_msg)) => err_msg,
+                Err(panic_payload) => __netter_panic_message(panic_payload),
+            };
+
+            FFIBatchResult {
+                status: FFIStatus::Err,
+                results: std::ptr::null_mut(),
+                len: 0,
+                error_ptr: CString::new(error).unwrap_or_default().into_raw(),
             }
         }
+
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_abi_version() -> u32 {
+            ::netter_sdk::ABI_VERSION
+        }
+
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_function_count() -> usize {
+            PLUGIN_TABLE.len()
+        }
+
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_function_info(index: usize) -> ::netter_sdk::FFIFunctionInfo {
+            use ::netter_sdk::{FFIFunctionInfo, FFISlice, PluginFunction};
+
+            let Some((name, function)) = PLUGIN_TABLE.get(index) else {
+                return FFIFunctionInfo {
+                    name: FFISlice { ptr: std::ptr::null(), len: 0 },
+                    batched: false,
+                    max_batch_items: 0,
+                    batch_window_us: 0,
+                };
+            };
+
+            let (batched, max_batch_items, batch_window_us) = match function {
+                PluginFunction::Single(_) => (false, 0, 0),
+                PluginFunction::Batched { max_items, window_us, .. } => (true, *max_items, *window_us),
+            };
+
+            FFIFunctionInfo {
+                name: FFISlice { ptr: name.as_ptr() as *const std::os::raw::c_char, len: name.len() },
+                batched,
+                max_batch_items,
+                batch_window_us,
+            }
+        }
+
+        // Exports of a plugin built for `wasm32`. The host copies arguments into the
+        // instance's memory and every call goes through `__netter_dispatch` above.
+        #[cfg(target_arch = "wasm32")]
+        #[unsafe(no_mangle)]
+        pub extern "C" fn __netter_alloc(len: u32) -> u32 {
+            ::netter_sdk::wasm::guest::alloc(len)
+        }
+
+        #[cfg(target_arch = "wasm32")]
+        #[unsafe(no_mangle)]
+        pub unsafe extern "C" fn __netter_free(ptr: u32, len: u32) {
+            unsafe { ::netter_sdk::wasm::guest::free(ptr, len) }
+        }
+
+        #[cfg(target_arch = "wasm32")]
+        #[unsafe(no_mangle)]
+        pub unsafe extern "C" fn __netter_wasm_call(name_ptr: u32, name_len: u32, args_ptr: u32, args_len: u32) -> u64 {
+            unsafe { ::netter_sdk::wasm::guest::call(name_ptr, name_len, args_ptr, args_len, __netter_dispatch) }
+        }
     }
     .into()
-}
\ No newline at end of file
+}
@@ -1,5 +1,14 @@
 use std::{ffi::{c_char, c_void}, hash::Hash, ops::Not, sync::Arc};
 
+pub mod wasm;
+
+/// Version of the plugin C ABI, exported by plugins as `__netter_abi_version`.
+///
+/// Bumped whenever an export's signature or a `#[repr(C)]` layout changes. The host
+/// refuses to load a library built for another version instead of calling it with the
+/// wrong signature.
+pub const ABI_VERSION: u32 = 2;
+
 #[repr(C)]
 pub enum FFIStatus {
     Ok, Err,
@@ -11,6 +20,51 @@ pub struct FFIResult {
     pub data_ptr: *mut c_char,
 }
 
+/// Result of the optional `__netter_init` export.
+///
+/// `state` is an opaque pointer owned by the plugin: the host passes it to every
+/// `__netter_dispatch` call and gives it back to `__netter_shutdown` on unload.
+#[repr(C)]
+pub struct FFIInitResult {
+    pub status: FFIStatus,
+    pub state: *mut c_void,
+    pub error_ptr: *mut c_char,
+}
+
+/// Result of the `__netter_dispatch_batch` export: one `FFIResult` per call, in call order.
+///
+/// If `status` is `Err` the whole batch failed, `error_ptr` holds the message and `results` is null.
+#[repr(C)]
+pub struct FFIBatchResult {
+    pub status: FFIStatus,
+    pub results: *mut FFIResult,
+    pub len: usize,
+    pub error_ptr: *mut c_char,
+}
+
+/// Description of one exported plugin function, returned by `__netter_function_info`.
+#[repr(C)]
+pub struct FFIFunctionInfo {
+    pub name: FFISlice,
+    pub batched: bool,
+    pub max_batch_items: u32,
+    pub batch_window_us: u32,
+}
+
+/// Entry of the static function table generated by `netter_plugger`.
+#[derive(Clone, Copy)]
+pub enum PluginFunction {
+    /// Called once per RDL call with that call's arguments.
+    Single(fn(*const c_void, &[FFIValue]) -> Result<RDLTypes, String>),
+    /// Called with an array of calls, each an array of arguments, and returns one result per call.
+    Batched {
+        handler: fn(*const c_void, &[FFIValue]) -> Vec<Result<RDLTypes, String>>,
+        max_items: u32,
+        window_us: u32,
+    },
+}
+
+/// Borrowed UTF-8 string. Not NUL-terminated.
 #[repr(C)]
 #[derive(Clone, Copy)]
 pub struct FFISlice {
@@ -18,36 +72,187 @@ pub struct FFISlice {
     pub len: usize,
 }
 
+/// Borrowed byte buffer.
 #[repr(C)]
+#[derive(Clone, Copy)]
+pub struct FFIBytes {
+    pub ptr: *const u8,
+    pub len: usize,
+}
+
+/// Borrowed array of `FFIValue`. Elements use the same layout as top-level arguments,
+/// so nested arrays are arrays of `FFIValue` too.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct FFIArray {
+    pub ptr: *const FFIValue,
+    pub len: usize,
+}
+
+/// Type tag of `FFIValue`. New tags are only ever appended, existing discriminants are stable.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum FFITypeTag {
     Number,
     Boolean,
     String,
     Vector,
     Object,
+    Bytes,
 }
 
 #[repr(C)]
+#[derive(Clone, Copy)]
 pub union FFiDataUnion {
     pub number: i64,
     pub boolean: bool,
     pub string: FFISlice,
-    pub vector: FFISlice,
-    pub object_ptr: *mut std::ffi::c_void,
+    pub vector: FFIArray,
+    pub bytes: FFIBytes,
+    pub object_ptr: *const c_void,
 }
 
+/// Argument passed across the plugin boundary.
+///
+/// All pointers are borrowed from the host and stay valid only for the duration of the
+/// call: a plugin that needs the data afterwards must copy it.
 #[repr(C)]
+#[derive(Clone, Copy)]
 pub struct FFIValue {
     pub tag: FFITypeTag,
     pub data: FFiDataUnion,
 }
 
+impl FFIValue {
+    pub fn as_i64(&self) -> Result<i64, String> {
+        match self.tag {
+            FFITypeTag::Number => Ok(unsafe { self.data.number }),
+            other => Err(format!("Expected Number, got {:?}", other)),
+        }
+    }
+
+    pub fn as_bool(&self) -> Result<bool, String> {
+        match self.tag {
+            FFITypeTag::Boolean => Ok(unsafe { self.data.boolean }),
+            other => Err(format!("Expected Boolean, got {:?}", other)),
+        }
+    }
+
+    /// Borrows the string without copying.
+    pub fn as_str(&self) -> Result<&str, String> {
+        match self.tag {
+            FFITypeTag::String => {
+                let bytes = unsafe { raw_slice(self.data.string.ptr as *const u8, self.data.string.len) };
+                std::str::from_utf8(bytes).map_err(|e| format!("Invalid UTF-8 in string argument: {}", e))
+            }
+            other => Err(format!("Expected String, got {:?}", other)),
+        }
+    }
+
+    /// Borrows the byte buffer without copying. Strings are accepted as their UTF-8 bytes.
+    pub fn as_bytes(&self) -> Result<&[u8], String> {
+        match self.tag {
+            FFITypeTag::Bytes => Ok(unsafe { raw_slice(self.data.bytes.ptr, self.data.bytes.len) }),
+            FFITypeTag::String => Ok(unsafe { raw_slice(self.data.string.ptr as *const u8, self.data.string.len) }),
+            other => Err(format!("Expected Bytes, got {:?}", other)),
+        }
+    }
+
+    /// Borrows the array elements without copying.
+    pub fn as_array(&self) -> Result<&[FFIValue], String> {
+        match self.tag {
+            FFITypeTag::Vector => Ok(unsafe { raw_slice(self.data.vector.ptr, self.data.vector.len) }),
+            other => Err(format!("Expected Vector, got {:?}", other)),
+        }
+    }
+
+    /// Copies the value into an owned `RDLTypes`.
+    pub fn to_rdl(&self) -> Result<RDLTypes, String> {
+        match self.tag {
+            FFITypeTag::Number => self.as_i64().map(RDLTypes::Number),
+            FFITypeTag::Boolean => self.as_bool().map(RDLTypes::Boolean),
+            FFITypeTag::String => self.as_str().map(|s| RDLTypes::String(s.to_string())),
+            FFITypeTag::Bytes => self.as_bytes().map(|b| RDLTypes::Bytes(b.to_vec())),
+            FFITypeTag::Vector => self.as_array()?
+                .iter()
+                .map(FFIValue::to_rdl)
+                .collect::<Result<Vec<_>, _>>()
+                .map(RDLTypes::Vector),
+            FFITypeTag::Object => Err("Object arguments can't be passed to plugins".to_string()),
+        }
+    }
+}
+
+unsafe fn raw_slice<'a, T>(ptr: *const T, len: usize) -> &'a [T] {
+    if ptr.is_null() || len == 0 {
+        &[]
+    } else {
+        unsafe { std::slice::from_raw_parts(ptr, len) }
+    }
+}
+
+/// Host-side argument list for a plugin call.
+///
+/// Borrows strings and byte buffers from the `RDLTypes` it was built from and owns
+/// the `FFIValue` buffers of nested arrays, so it must outlive the call.
+pub struct FFIArgs<'a> {
+    values: Vec<FFIValue>,
+    arrays: Vec<Vec<FFIValue>>,
+    _source: std::marker::PhantomData<&'a [RDLTypes]>,
+}
+
+impl<'a> FFIArgs<'a> {
+    pub fn new(args: &'a [RDLTypes]) -> Self {
+        let mut arrays = Vec::new();
+        let values = args.iter().map(|arg| Self::encode(arg, &mut arrays)).collect();
+
+        Self {
+            values,
+            arrays,
+            _source: std::marker::PhantomData,
+        }
+    }
+
+    fn encode(value: &RDLTypes, arrays: &mut Vec<Vec<FFIValue>>) -> FFIValue {
+        match value {
+            RDLTypes::Vector(v) => {
+                let items: Vec<FFIValue> = v.iter().map(|item| Self::encode(item, arrays)).collect();
+                // The heap buffer of `items` doesn't move when it's pushed into `arrays`.
+                let array = FFIArray { ptr: items.as_ptr(), len: items.len() };
+                arrays.push(items);
+                FFIValue {
+                    tag: FFITypeTag::Vector,
+                    data: FFiDataUnion { vector: array },
+                }
+            }
+            other => other.to_ffi(),
+        }
+    }
+
+    pub fn as_ptr(&self) -> *const FFIValue {
+        self.values.as_ptr()
+    }
+
+    pub fn len(&self) -> usize {
+        self.values.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.values.is_empty()
+    }
+
+    pub fn array_count(&self) -> usize {
+        self.arrays.len()
+    }
+}
+
 #[derive(Clone)]
 pub enum RDLTypes {
     String(String),
     Number(i64),
     Vector(Vec<RDLTypes>),
     Boolean(bool),
+    Bytes(Vec<u8>),
     Object(Arc<tokio::sync::Mutex<dyn Object + Send + Sync>>),
 }
 
@@ -80,6 +285,9 @@ impl RDLTypes {
         }
     }
 
+    /// Converts a scalar, string or byte buffer into a borrowed `FFIValue`.
+    ///
+    /// Vectors need storage for their elements, use `FFIArgs` to build call arguments.
     pub fn to_ffi(&self) -> FFIValue {
         match self {
             Self::Number(n) => FFIValue {
@@ -96,16 +304,22 @@ impl RDLTypes {
                     string: FFISlice { ptr: s.as_ptr() as *const c_char, len: s.len() },
                 },
             },
-            Self::Vector(v) => FFIValue {
+            Self::Bytes(b) => FFIValue {
+                tag: FFITypeTag::Bytes,
+                data: FFiDataUnion {
+                    bytes: FFIBytes { ptr: b.as_ptr(), len: b.len() },
+                },
+            },
+            Self::Vector(_) => FFIValue {
                 tag: FFITypeTag::Vector,
                 data: FFiDataUnion {
-                    vector: FFISlice { ptr: v.as_ptr() as *const c_char, len: v.len() },
+                    vector: FFIArray { ptr: std::ptr::null(), len: 0 },
                 },
             },
             Self::Object(o) => FFIValue {
                 tag: FFITypeTag::Object,
                 data: FFiDataUnion {
-                    object_ptr: Arc::into_raw(o.clone()) as *mut c_void
+                    object_ptr: Arc::as_ptr(o) as *const c_void,
                 }
             }
         }
@@ -186,6 +400,7 @@ impl Hash for RDLTypes {
             Self::Number(n) => n.hash(state),
             Self::Boolean(b) => b.hash(state),
             Self::Vector(v) => v.hash(state),
+            Self::Bytes(b) => b.hash(state),
             Self::Object(obj) => {
                 let ptr = Arc::as_ptr(obj) as *const () as usize;
                 ptr.hash(state);
@@ -203,6 +418,7 @@ impl PartialEq for RDLTypes {
             (Self::Number(n1), Self::Number(n2)) => *n1 == *n2,
             (Self::String(s1), Self::String(s2)) => *s1 == *s2,
             (Self::Vector(v1), Self::Vector(v2)) => *v1 == *v2,
+            (Self::Bytes(b1), Self::Bytes(b2)) => *b1 == *b2,
             (Self::Object(obj1), Self::Object(obj2)) => {
                 Arc::ptr_eq(obj1, obj2)
             },
@@ -218,6 +434,7 @@ impl From<RDLTypes> for u16 {
             RDLTypes::Number(n) => n as u16,
             RDLTypes::String(s) => s.parse::<u16>().unwrap_or(0),
             RDLTypes::Vector(v) => v.into_iter().map(u16::from).sum(),
+            RDLTypes::Bytes(_) => 0,
             RDLTypes::Object(_) => 0,
         }
     }
@@ -242,6 +459,7 @@ impl From<&RDLTypes> for u16 {
             RDLTypes::Number(n) => *n as u16,
             RDLTypes::String(s) => s.parse::<u16>().unwrap_or(0),
             RDLTypes::Vector(v) => v.iter().map(u16::from).sum(), 
+            RDLTypes::Bytes(_) => 0,
             RDLTypes::Object(_) => 0,
         }
     }
@@ -259,6 +477,12 @@ impl From<&str> for RDLTypes {
     }
 }
 
+impl From<Vec<u8>> for RDLTypes {
+    fn from(value: Vec<u8>) -> Self {
+        RDLTypes::Bytes(value)
+    }
+}
+
 impl From<i64> for RDLTypes {
     fn from(value: i64) -> Self {
         RDLTypes::Number(value)
@@ -278,6 +502,7 @@ impl std::fmt::Debug for RDLTypes {
             RDLTypes::Number(n) => f.debug_tuple("Number").field(n).finish(),
             RDLTypes::Boolean(b) => f.debug_tuple("Boolean").field(b).finish(),
             RDLTypes::Vector(v) => f.debug_tuple("Vector").field(v).finish(),
+            RDLTypes::Bytes(b) => f.debug_tuple("Bytes").field(&b.len()).finish(),
             RDLTypes::Object(_) => f.debug_tuple("Object").field(&"dyn Object").finish(),
         }
     }
@@ -290,6 +515,7 @@ impl std::fmt::Display for RDLTypes {
             RDLTypes::Number(n) => write!(f, "{n}"),
             RDLTypes::Boolean(b) => write!(f, "{b}"),
             RDLTypes::Object(_) => f.write_str("[object Object]"),
+            RDLTypes::Bytes(b) => f.write_str(&String::from_utf8_lossy(b)),
             RDLTypes::Vector(v) => {
                 f.write_str("[")?;
                 for (i, item) in v.iter().enumerate() {
@@ -0,0 +1,269 @@
+//! Wire format and guest-side glue for plugins compiled to WebAssembly.
+//!
+//! A wasm plugin can't see host memory, so arguments and results are copied through the
+//! guest's linear memory in a small binary encoding:
+//!
+//! * `Number`  - tag `0`, `i64` little endian;
+//! * `Boolean` - tag `1`, one byte (`0` or `1`);
+//! * `String`  - tag `2`, `u32` length, UTF-8 bytes;
+//! * `Bytes`   - tag `3`, `u32` length, raw bytes;
+//! * `Vector`  - tag `4`, `u32` item count, encoded items.
+//!
+//! Objects live in the host and can't be passed to a wasm plugin.
+//!
+//! Exports of a wasm plugin (generated by `netter_plugger`):
+//!
+//! * `__netter_alloc(len: u32) -> u32` and `__netter_free(ptr: u32, len: u32)`;
+//! * `__netter_wasm_call(name_ptr, name_len, args_ptr, args_len: u32) -> u64` - takes ownership
+//!   of both buffers and returns the response buffer packed as `ptr << 32 | len`. The first byte
+//!   of the response is the status (`0` - ok, `1` - error), the rest is the encoded result or the
+//!   UTF-8 error message. The host frees the response with `__netter_free`;
+//! * `__netter_wasm_init() -> u64` and `__netter_wasm_shutdown()` - optional, present when the
+//!   plugin uses `#[netter_plugin_init]`. `init` returns `0` or a packed error response.
+
+use crate::RDLTypes;
+
+pub const STATUS_OK: u8 = 0;
+pub const STATUS_ERR: u8 = 1;
+
+const TAG_NUMBER: u8 = 0;
+const TAG_BOOLEAN: u8 = 1;
+const TAG_STRING: u8 = 2;
+const TAG_BYTES: u8 = 3;
+const TAG_VECTOR: u8 = 4;
+
+/// Deepest nesting of vectors a decoded value may have, so a hostile payload can't
+/// overflow the decoder's stack.
+pub const MAX_DEPTH: usize = 64;
+
+pub fn encode_values(values: &[RDLTypes]) -> Result<Vec<u8>, String> {
+    let mut out = Vec::new();
+    write_len(&mut out, values.len())?;
+    for value in values {
+        encode_value(value, &mut out)?;
+    }
+    Ok(out)
+}
+
+pub fn encode_value(value: &RDLTypes, out: &mut Vec<u8>) -> Result<(), String> {
+    match value {
+        RDLTypes::Number(n) => {
+            out.push(TAG_NUMBER);
+            out.extend_from_slice(&n.to_le_bytes());
+        }
+        RDLTypes::Boolean(b) => {
+            out.push(TAG_BOOLEAN);
+            out.push(*b as u8);
+        }
+        RDLTypes::String(s) => {
+            out.push(TAG_STRING);
+            write_len(out, s.len())?;
+            out.extend_from_slice(s.as_bytes());
+        }
+        RDLTypes::Bytes(b) => {
+            out.push(TAG_BYTES);
+            write_len(out, b.len())?;
+            out.extend_from_slice(b);
+        }
+        RDLTypes::Vector(items) => {
+            out.push(TAG_VECTOR);
+            write_len(out, items.len())?;
+            for item in items {
+                encode_value(item, out)?;
+            }
+        }
+        RDLTypes::Object(_) => return Err("Object arguments can't be passed to wasm plugins".to_string()),
+    }
+    Ok(())
+}
+
+pub fn decode_values(bytes: &[u8]) -> Result<Vec<RDLTypes>, String> {
+    let mut reader = Reader { bytes, pos: 0 };
+    let count = reader.len()?;
+    let mut values = Vec::with_capacity(count.min(bytes.len()));
+    for _ in 0..count {
+        values.push(reader.value(0)?);
+    }
+    Ok(values)
+}
+
+pub fn decode_value(bytes: &[u8]) -> Result<RDLTypes, String> {
+    Reader { bytes, pos: 0 }.value(0)
+}
+
+fn write_len(out: &mut Vec<u8>, len: usize) -> Result<(), String> {
+    let len = u32::try_from(len).map_err(|_| format!("Value of length {} is too large for a wasm plugin", len))?;
+    out.extend_from_slice(&len.to_le_bytes());
+    Ok(())
+}
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, len: usize) -> Result<&'a [u8], String> {
+        let end = self.pos.checked_add(len).filter(|end| *end <= self.bytes.len())
+            .ok_or_else(|| "Truncated wasm plugin value".to_string())?;
+        let slice = &self.bytes[self.pos..end];
+        self.pos = end;
+        Ok(slice)
+    }
+
+    fn len(&mut self) -> Result<usize, String> {
+        let bytes = self.take(4)?;
+        Ok(u32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]) as usize)
+    }
+
+    /// Reads one value nested in `depth` vectors.
+    fn value(&mut self, depth: usize) -> Result<RDLTypes, String> {
+        let tag = self.take(1)?[0];
+        match tag {
+            TAG_NUMBER => {
+                let mut number = [0u8; 8];
+                number.copy_from_slice(self.take(8)?);
+                Ok(RDLTypes::Number(i64::from_le_bytes(number)))
+            }
+            TAG_BOOLEAN => Ok(RDLTypes::Boolean(self.take(1)?[0] != 0)),
+            TAG_STRING => {
+                let len = self.len()?;
+                let bytes = self.take(len)?;
+                String::from_utf8(bytes.to_vec())
+                    .map(RDLTypes::String)
+                    .map_err(|e| format!("Invalid UTF-8 in wasm plugin string: {}", e))
+            }
+            TAG_BYTES => {
+                let len = self.len()?;
+                Ok(RDLTypes::Bytes(self.take(len)?.to_vec()))
+            }
+            TAG_VECTOR => {
+                if depth >= MAX_DEPTH {
+                    return Err(format!("Wasm plugin value is nested deeper than {} vectors", MAX_DEPTH));
+                }
+                let count = self.len()?;
+                let mut items = Vec::with_capacity(count.min(self.bytes.len() - self.pos));
+                for _ in 0..count {
+                    items.push(self.value(depth + 1)?);
+                }
+                Ok(RDLTypes::Vector(items))
+            }
+            other => Err(format!("Unknown wasm plugin value tag {}", other)),
+        }
+    }
+}
+
+/// Helpers used by the exports `netter_plugger` generates for `wasm32` targets.
+#[cfg(target_arch = "wasm32")]
+pub mod guest {
+    use std::ffi::{c_char, c_void, CString};
+    use std::sync::atomic::{AtomicPtr, Ordering};
+    use crate::{FFIArgs, FFIResult, FFIStatus};
+    use super::{decode_values, encode_value, STATUS_ERR, STATUS_OK};
+
+    /// State returned by `#[netter_plugin_init]`. Every wasm instance has its own.
+    static STATE: AtomicPtr<c_void> = AtomicPtr::new(std::ptr::null_mut());
+
+    pub fn state() -> *const c_void {
+        STATE.load(Ordering::Acquire)
+    }
+
+    pub fn set_state(state: *mut c_void) {
+        STATE.store(state, Ordering::Release);
+    }
+
+    pub fn take_state() -> *mut c_void {
+        STATE.swap(std::ptr::null_mut(), Ordering::AcqRel)
+    }
+
+    pub fn alloc(len: u32) -> u32 {
+        let mut buffer = Vec::<u8>::with_capacity(len as usize);
+        let ptr = buffer.as_mut_ptr();
+        std::mem::forget(buffer);
+        ptr as u32
+    }
+
+    /// # Safety
+    /// `ptr` and `len` must come from `alloc`.
+    pub unsafe fn free(ptr: u32, len: u32) {
+        if ptr != 0 {
+            drop(unsafe { Vec::from_raw_parts(ptr as *mut u8, 0, len as usize) });
+        }
+    }
+
+    /// # Safety
+    /// The buffer must come from `alloc` and hold `len` initialized bytes.
+    unsafe fn take_buffer(ptr: u32, len: u32) -> Vec<u8> {
+        if ptr == 0 {
+            return Vec::new();
+        }
+        unsafe { Vec::from_raw_parts(ptr as *mut u8, len as usize, len as usize) }
+    }
+
+    /// Packs a response buffer. Its capacity is trimmed so that the host can free it with `len`.
+    pub fn respond(status: u8, payload: &[u8]) -> u64 {
+        let mut response = Vec::with_capacity(payload.len() + 1);
+        response.push(status);
+        response.extend_from_slice(payload);
+        let response = response.into_boxed_slice();
+        let len = response.len() as u64;
+        let ptr = Box::into_raw(response) as *mut u8 as u64;
+        (ptr << 32) | len
+    }
+
+    pub fn respond_err(message: &str) -> u64 {
+        respond(STATUS_ERR, message.as_bytes())
+    }
+
+    /// Decodes a call coming from the host and runs it through the plugin's native `__netter_dispatch`.
+    ///
+    /// # Safety
+    /// Both buffers must come from `alloc`. They are freed here.
+    pub unsafe fn call(
+        name_ptr: u32,
+        name_len: u32,
+        args_ptr: u32,
+        args_len: u32,
+        dispatch: unsafe extern "C" fn(*const c_void, *const c_char, *const crate::FFIValue, usize) -> FFIResult,
+    ) -> u64 {
+        let name = unsafe { take_buffer(name_ptr, name_len) };
+        let args = unsafe { take_buffer(args_ptr, args_len) };
+
+        let name = match CString::new(name) {
+            Ok(name) => name,
+            Err(_) => return respond_err("Function name contains a NUL byte"),
+        };
+        let args = match decode_values(&args) {
+            Ok(args) => args,
+            Err(e) => return respond_err(&e),
+        };
+
+        let ffi_args = FFIArgs::new(&args);
+        let result = unsafe { dispatch(state(), name.as_ptr(), ffi_args.as_ptr(), ffi_args.len()) };
+        let message = if result.data_ptr.is_null() {
+            String::new()
+        } else {
+            unsafe { CString::from_raw(result.data_ptr) }.into_string().unwrap_or_else(|e| e.into_cstring().to_string_lossy().into_owned())
+        };
+
+        match result.status {
+            FFIStatus::Ok => {
+                let mut payload = Vec::with_capacity(message.len() + 5);
+                match encode_value(&crate::RDLTypes::String(message), &mut payload) {
+                    Ok(()) => respond(STATUS_OK, &payload),
+                    Err(e) => respond_err(&e),
+                }
+            }
+            FFIStatus::Err => respond_err(&message),
+        }
+    }
+
+    /// # Safety
+    /// `ptr` must be null or a string allocated by `CString::into_raw`.
+    pub unsafe fn take_error(ptr: *mut c_char) -> String {
+        if ptr.is_null() {
+            return String::new();
+        }
+        unsafe { CString::from_raw(ptr) }.to_string_lossy().into_owned()
+    }
+}
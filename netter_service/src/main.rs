@@ -4,21 +4,22 @@ use std::{
     fs,
     io,
     path::{Path, PathBuf},
-    time::Duration,
-    sync::Arc,
+    time::{Duration, Instant},
+    sync::{Arc, atomic::{AtomicBool, Ordering}},
 };
 use lazy_static::lazy_static;
 use log::{debug, error, info, trace, warn, LevelFilter};
 use serde::{Deserialize, Serialize};
 use uuid::Uuid;
 use tokio::{
-    io::{AsyncReadExt, AsyncWriteExt},
+    io::{AsyncReadExt, AsyncWrite, AsyncWriteExt},
     sync::mpsc as tokio_mpsc,
-    task::JoinHandle,
+    task::{JoinHandle, JoinSet},
     sync::Mutex,
 };
 use netter_core::{
-    Command, CoreError, CoreExecutionResult, Response, ServerInfo, ServerType, servers::{Server, http_core::HttpServer}
+    Command, CompiledConfig, CoreError, CoreExecutionResult, Response, ServerInfo, ServerType, servers::{Server, http_core::{HttpServer, ListenAddr}, traffic::Watch},
+    language::interpreter::builtin::plugin::PluginManager,
 };
 use netter_logger;
 
@@ -47,17 +48,74 @@ use std::os::unix::fs::PermissionsExt;
 use tokio::net::{UnixListener, UnixStream};
 #[cfg(unix)]
 use tokio::signal::unix::{signal, SignalKind};
+#[cfg(target_os = "linux")]
+use netter_core::servers::handoff::{Handoff, HandoffListener};
 
 #[allow(dead_code)]
 const QUALIFIER: &str = "com";
 const ORGANIZATION: &str = "Netter";
 const APPLICATION: &str = "NetterService";
 
+/// Marks state files that hold server configs. Older files only hold `ServerInfo`.
+const STATE_MAGIC: u32 = 0x4E54_5354;
+const STATE_VERSION: u32 = 3;
+
+/// Set while the servers are handed to a new daemon process started with `--takeover`.
+/// Commands that change servers are refused meanwhile, the new daemon wouldn't see them.
+static HANDOFF_IN_PROGRESS: AtomicBool = AtomicBool::new(false);
+
 #[derive(Debug, Serialize, Deserialize)]
 struct RunningServer {
     info: ServerInfo,
+    /// Config the server was started with, to start it again after a restart of the service.
+    config: Option<CompiledConfig>,
     #[serde(skip)]
     task_handle: Option<JoinHandle<()>>,
+    #[serde(skip)]
+    plugins: Option<PluginManager>,
+}
+
+/// Layout of the state file before server configs were saved.
+#[derive(Deserialize)]
+struct LegacyServer {
+    info: ServerInfo,
+}
+
+/// Server of state file version 2, which kept the AST inline. It only decodes while the AST
+/// hasn't changed since, the config is then parsed again from its source.
+#[derive(Deserialize)]
+struct InlineAstServer {
+    info: ServerInfo,
+    config: Option<InlineAstConfig>,
+}
+
+#[derive(Deserialize)]
+struct InlineAstConfig {
+    core_version: String,
+    source: String,
+    #[serde(rename = "ast")]
+    _ast: netter_core::language::ast::AstNode,
+}
+
+#[derive(Deserialize)]
+struct InlineAstStateFile {
+    #[serde(rename = "header")]
+    _header: StateHeader,
+    servers: HashMap<String, InlineAstServer>,
+}
+
+/// Start of every state file since configs are saved, read first to pick the layout.
+#[derive(Deserialize)]
+struct StateHeader {
+    magic: u32,
+    version: u32,
+}
+
+#[derive(Serialize, Deserialize)]
+struct StateFile {
+    magic: u32,
+    version: u32,
+    servers: HashMap<String, RunningServer>,
 }
 
 lazy_static! {
@@ -103,6 +161,38 @@ lazy_static! {
     static ref RUNNING_SERVERS: Arc<Mutex<HashMap<String, RunningServer>>> = Arc::new(Mutex::new(HashMap::new()));
 }
 
+/// Compiled artifacts of the servers, such as wasm plugins, next to the state file.
+fn compiled_cache_dir() -> PathBuf {
+    STATE_FILE_PATH
+        .parent()
+        .map(|dir| dir.join("cache"))
+        .unwrap_or_else(|| PathBuf::from("netter_cache"))
+}
+
+/// Response and `Store` cache segment shared by every Netter process on the host.
+fn shared_cache_path() -> PathBuf {
+    STATE_FILE_PATH
+        .parent()
+        .map(|dir| dir.join("shared-cache.bin"))
+        .unwrap_or_else(|| PathBuf::from("netter-shared-cache.bin"))
+}
+
+/// Durable `Kv` entries of the servers' routes.
+fn kv_dir() -> PathBuf {
+    STATE_FILE_PATH
+        .parent()
+        .map(|dir| dir.join("kv"))
+        .unwrap_or_else(|| PathBuf::from("netter_kv"))
+}
+
+/// Background jobs enqueued by the servers' routes that haven't finished yet.
+fn jobs_dir() -> PathBuf {
+    STATE_FILE_PATH
+        .parent()
+        .map(|dir| dir.join("jobs"))
+        .unwrap_or_else(|| PathBuf::from("netter_jobs"))
+}
+
 fn get_state_file_path_with_create_dir() -> Option<PathBuf> {
     let path = &*STATE_FILE_PATH;
     if let Some(parent) = path.parent() {
@@ -140,7 +230,9 @@ async fn save_state() {
                 id.clone(),
                 RunningServer {
                     info: rs.info.clone(),
+                    config: rs.config.clone(),
                     task_handle: None,
+                    plugins: None,
                 },
             )
         })
@@ -148,7 +240,12 @@ async fn save_state() {
 
     drop(servers);
 
-    match bincode::serialize(&serializable_servers) {
+    let state = StateFile {
+        magic: STATE_MAGIC,
+        version: STATE_VERSION,
+        servers: serializable_servers,
+    };
+    match bincode::serialize(&state) {
         Ok(encoded) => {
             let temp_path = path.with_extension("tmp");
             match fs::write(&temp_path, encoded) {
@@ -199,7 +296,7 @@ async fn load_state() {
     info!("Loading state from {}", path.display());
     match fs::read(&path) {
         Ok(encoded) => {
-            match bincode::deserialize::<HashMap<String, RunningServer>>(&encoded) {
+            match decode_state(&encoded) {
                 Ok(loaded) => {
                     let len = loaded.len();
                     *RUNNING_SERVERS.lock().await = loaded;
@@ -231,7 +328,188 @@ async fn load_state() {
     }
 }
 
+fn decode_state(encoded: &[u8]) -> bincode::Result<HashMap<String, RunningServer>> {
+    match bincode::deserialize::<StateHeader>(encoded) {
+        Ok(header) if header.magic == STATE_MAGIC && header.version == STATE_VERSION => {
+            Ok(bincode::deserialize::<StateFile>(encoded)?.servers)
+        }
+        Ok(header) if header.magic == STATE_MAGIC && header.version == 2 => {
+            let state = bincode::deserialize::<InlineAstStateFile>(encoded)?;
+            info!("State file has version 2, its configs are parsed again.");
+            Ok(state.servers
+                .into_iter()
+                .map(|(id, server)| {
+                    let config = server.config.map(|config| CompiledConfig::from_source(config.core_version, config.source));
+                    (id, RunningServer { info: server.info, config, task_handle: None, plugins: None })
+                })
+                .collect())
+        }
+        Ok(header) if header.magic == STATE_MAGIC => Err(Box::new(bincode::ErrorKind::Custom(
+            format!("unsupported state version {}", header.version),
+        ))),
+        _ => {
+            let legacy = bincode::deserialize::<HashMap<String, LegacyServer>>(encoded)?;
+            warn!("State file has no server configs, its servers have to be started again.");
+            Ok(legacy
+                .into_iter()
+                .map(|(id, server)| {
+                    (id, RunningServer { info: server.info, config: None, task_handle: None, plugins: None })
+                })
+                .collect())
+        }
+    }
+}
+
+/// Starts the servers loaded from the state file again. Their configs are interpreted in
+/// parallel from the saved AST, so no server waits for the others.
+async fn restore_servers() {
+    let saved: Vec<(String, CompiledConfig)> = {
+        let servers = RUNNING_SERVERS.lock().await;
+        servers
+            .iter()
+            .filter(|(_, srv)| srv.task_handle.is_none())
+            .filter_map(|(id, srv)| srv.config.clone().map(|config| (id.clone(), config)))
+            .collect()
+    };
+    if !saved.is_empty() {
+        info!("Restoring {} server(s)...", saved.len());
+    }
+    let started = Instant::now();
+    let total = saved.len();
+    let mut tasks = JoinSet::new();
+    for (server_id, config) in saved {
+        tasks.spawn_blocking(move || (server_id, netter_core::restore_server(config)));
+    }
+
+    let mut listening = Vec::new();
+    while let Some(joined) = tasks.join_next().await {
+        match joined {
+            Ok((server_id, CoreExecutionResult::StartHttpServer { interpreter, tls_config, compiled })) => {
+                let info = start_http_server(server_id, interpreter, tls_config, compiled).await;
+                listening.extend(ListenAddr::parse(&info.address).map(|addr| addr.to_string()));
+            }
+            Ok((server_id, CoreExecutionResult::CliResponse(response))) => {
+                error!("Failed to restore server {}: {:?}", server_id, response);
+            }
+            Err(e) => error!("Restore task failed: {}", e),
+        }
+    }
+    if total > 0 {
+        info!("Restored {} of {} server(s) in {:?}.", listening.len(), total, started.elapsed());
+    }
+
+    // Sockets handed over for servers that failed to restore would keep clients waiting.
+    #[cfg(target_os = "linux")]
+    netter_core::servers::handoff::release_inherited(|key| listening.iter().any(|addr| addr == key));
+
+    save_state().await;
+}
+
+/// Spawns the server task and adds the server to the running list, replacing an entry
+/// with the same id.
+async fn start_http_server(
+    server_id: String,
+    interpreter: netter_core::language::Interpreter,
+    tls_config: Option<netter_core::servers::TlsConfig>,
+    compiled: CompiledConfig,
+) -> ServerInfo {
+    let default_host = "127.0.0.1";
+    let default_port: u16 = 9090;
+
+    let unix_socket = interpreter.configuration.as_ref()
+        .filter(|config| config.config_type.eq_ignore_ascii_case("http"))
+        .and_then(|config| config.unix.clone());
+
+    let (addr_str, port) = if let Some(config) = &interpreter.configuration {
+        if unix_socket.is_some() {
+            (default_host.to_string(), default_port)
+        } else if config.config_type.eq_ignore_ascii_case("http") {
+            let host = if config.host.is_empty() {
+                warn!("Config block 'http' found but host is empty, using default '{}'", default_host);
+                default_host
+            } else {
+                &config.host
+            };
+
+            let port = config.port.parse::<u16>().unwrap_or_else(|_| {
+                warn!("Failed to parse port '{}' from config, using default {}", config.port, default_port);
+                default_port
+            });
+
+            info!("Using host '{}' and port {} from 'config' block.", host, port);
+            (host.to_string(), port)
+        } else {
+            warn!("Config block found but type is not 'http' (is '{}'), using defaults.", config.config_type);
+            (default_host.to_string(), default_port)
+        }
+    } else {
+        info!("No 'config' block found in configuration, using default host '{}' and port {}.", default_host, default_port);
+        (default_host.to_string(), default_port)
+    };
+
+    let plugins = interpreter.plugin_manager.clone();
+    let server_state_v2 = Arc::new(Mutex::new(HttpServer::from_interpreter(interpreter, tls_config, server_id.clone())));
+    // let server_state = Arc::new(HttpServer::from_interpreter(interpreter, tls_config));
+
+    let socket_addr_str = match unix_socket {
+        Some(path) => {
+            info!("Using Unix domain socket '{}' from 'config' block instead of host and port.", path);
+            format!("{}{}", ListenAddr::UNIX_PREFIX, path)
+        }
+        None => format!("{}:{}", addr_str, port),
+    };
+    info!(
+        "Attempting to start HTTP server (ID: {}) on {}...",
+        server_id, socket_addr_str
+    );
+
+    let task_handle = tokio::spawn({
+        // let id_c = server_id.clone();
+        // let state_c = server_state.clone();
+        let state_c = server_state_v2.clone();
+        let addr_c = socket_addr_str.clone();
+
+        async move {
+            let mut guard = state_c.lock().await;
+
+            guard.start(addr_c).await;
+        }
+    });
+
+    let server_info = ServerInfo {
+        server_id: server_id.clone(),
+        server_type: ServerType::Http,
+        address: socket_addr_str,
+        pid: None,
+        status: "Starting".to_string(),
+    };
+
+    {
+        let mut servers = RUNNING_SERVERS
+            .lock()
+            .await;
+        servers.insert(
+            server_id,
+            RunningServer {
+                info: server_info.clone(),
+                config: Some(compiled),
+                task_handle: Some(task_handle),
+                plugins: Some(plugins),
+            },
+        );
+    }
+    server_info
+}
+
 async fn process_command(command: Command, client_id: Uuid) -> Result<Response, CoreError> {
+    if HANDOFF_IN_PROGRESS.load(Ordering::SeqCst)
+        && matches!(command, Command::StartServer { .. } | Command::StopServer { .. } | Command::ReloadPlugins { .. })
+    {
+        warn!("[Client {}] Refusing {:?} during handoff.", client_id, command);
+        return Err(CoreError::OperationFailed(
+            "Service is handing its servers to a new process, try again".to_string(),
+        ));
+    }
     let core_result = netter_core::execute_core_command(command.clone()).await;
     info!("[Client {}] Core result: {:?}", client_id, core_result);
     match core_result {
@@ -313,86 +591,47 @@ async fn process_command(command: Command, client_id: Uuid) -> Result<Response,
                     info!("Found {} server.", list.len());
                     Ok(Response::AllServersStatusReport(list))
                 }
+                Command::ReloadPlugins { server_id, force } => {
+                    info!("Handling ReloadPlugins: {} (force: {})", server_id, force);
+                    let plugins = {
+                        let servers = RUNNING_SERVERS
+                            .lock()
+                            .await;
+                        match servers.get(&server_id) {
+                            Some(srv) => srv.plugins.clone(),
+                            None => {
+                                warn!("Not found: {}", server_id);
+                                return Err(CoreError::ServerNotFound(server_id));
+                            }
+                        }
+                    };
+                    let Some(plugins) = plugins else {
+                        return Err(CoreError::OperationFailed(format!(
+                            "Server {} was restored from state and has no loaded plugins",
+                            server_id
+                        )));
+                    };
+
+                    match tokio::task::spawn_blocking(move || plugins.reload_changed(force)).await {
+                        Ok(Ok(reloaded)) => {
+                            info!("Reloaded {} plugin(s) of server {}", reloaded.len(), server_id);
+                            Ok(Response::PluginsReloaded(reloaded))
+                        }
+                        Ok(Err(e)) => Err(CoreError::OperationFailed(format!("Plugin reload failed: {}", e))),
+                        Err(e) => Err(CoreError::InternalError(format!("Plugin reload task failed: {}", e))),
+                    }
+                }
                 _ => Ok(core_response),
             }
         }
         CoreExecutionResult::StartHttpServer {
             interpreter,
             tls_config,
+            compiled,
         } => {
             debug!("Core returned StartHttpServer.");
             let server_id = Uuid::new_v4().to_string();
-
-            let default_host = "127.0.0.1";
-            let default_port: u16 = 9090;
-
-            let (addr_str, port) = if let Some(config) = &interpreter.configuration {
-                if config.config_type.eq_ignore_ascii_case("http") {
-                    let host = if config.host.is_empty() {
-                        warn!("Config block 'http' found but host is empty, using default '{}'", default_host);
-                        default_host
-                    } else {
-                        &config.host
-                    };
-
-                    let port = config.port.parse::<u16>().unwrap_or_else(|_| {
-                        warn!("Failed to parse port '{}' from config, using default {}", config.port, default_port);
-                        default_port
-                    });
-
-                    info!("Using host '{}' and port {} from 'config' block.", host, port);
-                    (host.to_string(), port)
-                } else {
-                    warn!("Config block found but type is not 'http' (is '{}'), using defaults.", config.config_type);
-                    (default_host.to_string(), default_port)
-                }
-            } else {
-                info!("No 'config' block found in configuration, using default host '{}' and port {}.", default_host, default_port);
-                (default_host.to_string(), default_port)
-            };
-
-            let server_state_v2 = Arc::new(Mutex::new(HttpServer::from_interpreter(interpreter, tls_config, server_id.clone())));
-            // let server_state = Arc::new(HttpServer::from_interpreter(interpreter, tls_config));
-
-            let socket_addr_str = format!("{}:{}", addr_str, port);
-            info!(
-                "Attempting to start HTTP server (ID: {}) on {}...",
-                server_id, socket_addr_str
-            );
-
-            let task_handle = tokio::spawn({
-                // let id_c = server_id.clone();
-                // let state_c = server_state.clone();
-                let state_c = server_state_v2.clone();
-                let addr_c = socket_addr_str.clone();
-
-                async move {
-                    let mut guard = state_c.lock().await;
-
-                    guard.start(addr_c).await;
-                }
-            });
-
-            let server_info = ServerInfo {
-                server_id: server_id.clone(),
-                server_type: ServerType::Http,
-                address: socket_addr_str,
-                pid: None,
-                status: "Starting".to_string(),
-            };
-
-             {
-                let mut servers = RUNNING_SERVERS
-                    .lock()
-                    .await;
-                 servers.insert(
-                    server_id.clone(),
-                    RunningServer {
-                        info: server_info.clone(),
-                        task_handle: Some(task_handle),
-                    },
-                );
-            }
+            let server_info = start_http_server(server_id.clone(), interpreter, tls_config, compiled).await;
             save_state().await;
             info!("Server {} added to running list and state saved.", server_id);
             Ok(Response::ServerStarted(server_info))
@@ -400,6 +639,39 @@ async fn process_command(command: Command, client_id: Uuid) -> Result<Response,
     }
 }
 
+/// Shortest interval `netter top` may ask for.
+const MIN_WATCH_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Sends `Response::Traffic` every `interval` until the client disconnects.
+async fn stream_traffic<S: AsyncWrite + Unpin>(stream: &mut S, interval: Duration, client_id: Uuid) {
+    info!("[Client {}] Watching traffic every {:?}", client_id, interval);
+    let mut watch = Watch::new();
+    let mut ticks = tokio::time::interval(interval.max(MIN_WATCH_INTERVAL));
+    // The first tick is immediate, the first report covers a whole interval.
+    ticks.tick().await;
+
+    loop {
+        ticks.tick().await;
+        let report = match bincode::serialize(&Response::Traffic(watch.next())) {
+            Ok(report) => report,
+            Err(e) => {
+                error!("[Client {}] Failed to serialize traffic report: {}", client_id, e);
+                return;
+            }
+        };
+
+        let sent = async {
+            stream.write_all(&(report.len() as u32).to_be_bytes()).await?;
+            stream.write_all(&report).await?;
+            stream.flush().await
+        }.await;
+        if let Err(e) = sent {
+            info!("[Client {}] Traffic watch ended: {}", client_id, e);
+            return;
+        }
+    }
+}
+
 #[cfg(windows)]
 mod windows_service_impl {
     use tokio::runtime::Handle;
@@ -451,6 +723,10 @@ use super::*;
         rt.block_on(async {
             load_state().await;
         });
+        netter_core::set_compiled_cache_dir(compiled_cache_dir());
+        netter_core::set_shared_cache_path(shared_cache_path());
+        netter_core::set_kv_dir(kv_dir());
+        netter_core::set_jobs_dir(jobs_dir());
 
         let (shutdown_tx, shutdown_rx) = mpsc::channel();
         match run_service(arguments, shutdown_tx, shutdown_rx) {
@@ -530,6 +806,8 @@ use super::*;
         };
         info!("Tokio runtime created.");
 
+        rt.block_on(restore_servers());
+
         let async_handle = rt.spawn(run_async_server(err_tx_async.clone()));
         info!("Async IPC task spawned.");
 
@@ -750,6 +1028,10 @@ use super::*;
         }.await;
 
         let response = match command_result {
+             Ok(Command::WatchTraffic { interval }) => {
+                stream_traffic(&mut pipe, interval, client_id).await;
+                return;
+             }
              Ok(command) => {
                 trace!("[Client {}] Received command: {:?}", client_id, command);
                 process_command(command, client_id).await
@@ -841,6 +1123,18 @@ mod unix_daemon_impl {
     use super::*;
     const SOCKET_DIR_FALLBACK: &str = "/tmp/netterd";
     const SOCKET_NAME: &str = "netterd.sock";
+    #[cfg(target_os = "linux")]
+    const HANDOFF_SOCKET_NAME: &str = "netterd-handoff.sock";
+    /// Time the new daemon may take to start serving before the old one keeps serving itself.
+    #[cfg(target_os = "linux")]
+    const HANDOFF_TIMEOUT: Duration = Duration::from_secs(30);
+    /// Time connections of the old daemon get to finish after a handoff, for all servers
+    /// together. Has to stay below the 30 seconds the new daemon waits for the `Kv` and job
+    /// stores this one holds until it exits.
+    const DRAIN_TIMEOUT: Duration = Duration::from_secs(10);
+
+    /// Set once a new daemon took over the servers, this one only drains and exits.
+    static HANDED_OFF: AtomicBool = AtomicBool::new(false);
 
     pub async fn daemon_main() -> Result<(), Box<dyn StdError>> {
         let _log_file = &*LOG_PATH;
@@ -853,12 +1147,46 @@ mod unix_daemon_impl {
         info!("Socket path: {}", get_socket_path().display());
         info!("State file: {}", STATE_FILE_PATH.display());
 
-        load_state();
+        // Started next to a running daemon to replace it without closing its sockets.
+        let takeover = std::env::args().skip(1).any(|arg| arg == "--takeover");
+        #[cfg(target_os = "linux")]
+        let handoff = if takeover { Some(take_over().await?) } else { None };
+        #[cfg(not(target_os = "linux"))]
+        if takeover {
+            return Err("--takeover is only supported on Linux".into());
+        }
+
+        load_state().await;
+        netter_core::set_compiled_cache_dir(compiled_cache_dir());
+        netter_core::set_shared_cache_path(shared_cache_path());
+        netter_core::set_kv_dir(kv_dir());
+        netter_core::set_jobs_dir(jobs_dir());
+
+        info!("Initializing netter_core backend...");
+        netter_core::init_backend();
+        restore_servers().await;
 
         let (shutdown_tx, mut shutdown_rx) = tokio_mpsc::channel::<()>(1);
 
-        let signals_task = tokio::spawn(handle_signals(shutdown_tx.clone()));
-        let ipc_server_task = tokio::spawn(run_ipc_server(shutdown_tx));
+        let ipc_listener = bind_ipc_socket()?;
+        #[cfg(target_os = "linux")]
+        match HandoffListener::bind(&get_handoff_socket_path()) {
+            Ok(listener) => {
+                tokio::spawn(run_handoff_server(listener, shutdown_tx.clone()));
+            }
+            Err(e) => warn!("Handoff socket {}: {}. Upgrades with --takeover are unavailable.", get_handoff_socket_path().display(), e),
+        }
+        #[cfg(target_os = "linux")]
+        if let Some(handoff) = handoff {
+            match tokio::task::spawn_blocking(move || handoff.confirm()).await {
+                Ok(Ok(())) => info!("Took over from the previous daemon, it drains its connections now."),
+                Ok(Err(e)) => warn!("Failed to confirm the takeover: {}", e),
+                Err(e) => warn!("Takeover confirmation task failed: {}", e),
+            }
+        }
+
+        let signals_task = tokio::spawn(handle_signals(shutdown_tx));
+        let ipc_server_task = tokio::spawn(run_ipc_server(ipc_listener));
         info!("Daemon {} started.", APPLICATION);
 
         let shutdown_reason: String;
@@ -870,41 +1198,55 @@ mod unix_daemon_impl {
 
         info!("Shutting down (Reason: {})...", shutdown_reason);
 
-        save_state();
+        // After a handoff the state file and the sockets belong to the new daemon.
+        let handed_off = HANDED_OFF.load(Ordering::SeqCst);
+        if handed_off {
+            #[cfg(target_os = "linux")]
+            netter_core::servers::handoff::drain();
+        } else {
+            save_state().await;
+        }
 
         info!("Stopping server...");
-        let ids: Vec<String> = match RUNNING_SERVERS.lock() {
-            Ok(g) => g.keys().cloned().collect(),
-            Err(_) => {
-                error!("Mutex poisoned on shutdown.");
-                vec![]
-            }
-        };
+        let ids: Vec<String> = RUNNING_SERVERS.lock().await.keys().cloned().collect();
         if !ids.is_empty() {
-            let mut g = RUNNING_SERVERS.lock().unwrap();
+            let mut g = RUNNING_SERVERS.lock().await;
             let mut h = Vec::new();
             for id in ids {
                 if let Some(s) = g.get_mut(&id) {
                     if let Some(t) = s.task_handle.take() {
-                        info!("Stopping {}...", id);
-                        t.abort();
+                        if handed_off {
+                            info!("Draining {}...", id);
+                        } else {
+                            info!("Stopping {}...", id);
+                            t.abort();
+                        }
                         h.push(t);
                     }
                 }
             }
             drop(g);
-            for t in h {
-                let _ = tokio::time::timeout(Duration::from_secs(5), t).await;
+            // The servers stop together, so the whole shutdown takes one timeout at most.
+            let wait = if handed_off { DRAIN_TIMEOUT } else { Duration::from_secs(5) };
+            let deadline = tokio::time::Instant::now() + wait;
+            for mut t in h {
+                if tokio::time::timeout_at(deadline, &mut t).await.is_err() {
+                    t.abort();
+                }
             }
             info!("Servers stopped.");
         } else {
             info!("No server to stop.");
         }
 
-        let sp = get_socket_path();
-        if sp.exists() {
-            info!("Removing socket {}", sp.display());
-            let _ = fs::remove_file(&sp);
+        if !handed_off {
+            let sp = get_socket_path();
+            if sp.exists() {
+                info!("Removing socket {}", sp.display());
+                let _ = fs::remove_file(&sp);
+            }
+            #[cfg(target_os = "linux")]
+            let _ = fs::remove_file(get_handoff_socket_path());
         }
         info!("Daemon {} shut down.", APPLICATION);
         Ok(())
@@ -930,6 +1272,65 @@ mod unix_daemon_impl {
         }
     }
 
+    #[cfg(target_os = "linux")]
+    fn get_handoff_socket_path() -> PathBuf {
+        get_socket_path().with_file_name(HANDOFF_SOCKET_NAME)
+    }
+
+    /// Receives the listening sockets of the running daemon. The servers themselves are
+    /// restored from the state file, which that daemon saves before sending.
+    #[cfg(target_os = "linux")]
+    async fn take_over() -> io::Result<Handoff> {
+        let path = get_handoff_socket_path();
+        info!("Taking over the servers of the daemon at {}...", path.display());
+        tokio::task::spawn_blocking(move || {
+            let handoff = Handoff::connect(&path, HANDOFF_TIMEOUT)?;
+            handoff.receive_listeners()?;
+            Ok(handoff)
+        })
+        .await
+        .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?
+    }
+
+    /// Waits for a daemon started with `--takeover` and hands it the servers. This daemon
+    /// keeps serving if the new one fails to start.
+    #[cfg(target_os = "linux")]
+    async fn run_handoff_server(listener: HandoffListener, tx: tokio_mpsc::Sender<()>) {
+        loop {
+            let handoff = match listener.accept().await {
+                Ok(handoff) => handoff,
+                Err(e) => {
+                    error!("Handoff accept: {}", e);
+                    tokio::time::sleep(Duration::from_secs(1)).await;
+                    continue;
+                }
+            };
+
+            info!("New daemon connected, handing over the servers...");
+            HANDOFF_IN_PROGRESS.store(true, Ordering::SeqCst);
+            save_state().await;
+
+            let result = tokio::task::spawn_blocking(move || {
+                handoff.set_timeout(HANDOFF_TIMEOUT)?;
+                let sent = handoff.send_listeners()?;
+                handoff.wait_confirmed()?;
+                Ok::<_, io::Error>(sent)
+            })
+            .await;
+            match result {
+                Ok(Ok(sent)) => {
+                    info!("Handed {} listening socket(s) to the new daemon.", sent);
+                    HANDED_OFF.store(true, Ordering::SeqCst);
+                    let _ = tx.send(()).await;
+                    return;
+                }
+                Ok(Err(e)) => error!("Handoff failed, this daemon keeps serving: {}", e),
+                Err(e) => error!("Handoff task failed, this daemon keeps serving: {}", e),
+            }
+            HANDOFF_IN_PROGRESS.store(false, Ordering::SeqCst);
+        }
+    }
+
     async fn handle_signals(tx: tokio_mpsc::Sender<()>) {
         let mut si = match signal(SignalKind::interrupt()) {
             Ok(s) => s,
@@ -953,22 +1354,22 @@ mod unix_daemon_impl {
         info!("Signal handling done.");
     }
 
-    async fn run_ipc_server(tx: tokio_mpsc::Sender<()>) {
+    /// Binds the CLI socket. A socket of a daemon being replaced is unlinked, that daemon
+    /// can't be reached by new clients afterwards.
+    fn bind_ipc_socket() -> io::Result<UnixListener> {
         let sp = get_socket_path();
         if sp.exists() {
             warn!("Remove old socket {}", sp.display());
             if let Err(e) = fs::remove_file(&sp) {
                 error!("Remove fail: {}.", e);
-                let _ = tx.send(()).await;
-                return;
+                return Err(e);
             }
         }
         let l = match UnixListener::bind(&sp) {
             Ok(l) => l,
             Err(e) => {
                 error!("Bind {}: {}.", sp.display(), e);
-                let _ = tx.send(()).await;
-                return;
+                return Err(e);
             }
         };
         match fs::metadata(&sp) {
@@ -984,6 +1385,10 @@ mod unix_daemon_impl {
             Err(e) => warn!("Meta err: {}", e),
         };
         info!("IPC listening {}", sp.display());
+        Ok(l)
+    }
+
+    async fn run_ipc_server(l: UnixListener) {
         loop {
             match l.accept().await {
                 Ok((s, _)) => {
@@ -1003,7 +1408,7 @@ mod unix_daemon_impl {
     async fn handle_client_unix(mut stream: UnixStream) {
         let cid = Uuid::new_v4();
         trace!("[Client {}] Start (Unix).", cid);
-        let res: Result<Response, CoreError> = async {
+        let command: Result<Command, CoreError> = async {
             let mut sb = [0u8; 4];
             stream
                 .read_exact(&mut sb)
@@ -1021,11 +1426,18 @@ mod unix_daemon_impl {
                 .await
                 .map_err(|e| CoreError::IoError(format!("Read body: {}", e)))?;
             trace!("[Client {}] Read {}b.", cid, ms);
-            let cmd: Command = bincode::deserialize(&b)
-                .map_err(|e| CoreError::DeserializationError(format!("Parse: {}", e)))?;
-            process_command(cmd, cid).await
+            bincode::deserialize(&b)
+                .map_err(|e| CoreError::DeserializationError(format!("Parse: {}", e)))
         }
         .await;
+        let res = match command {
+            Ok(Command::WatchTraffic { interval }) => {
+                stream_traffic(&mut stream, interval, cid).await;
+                return;
+            }
+            Ok(cmd) => process_command(cmd, cid).await,
+            Err(e) => Err(e),
+        };
         match res {
             Ok(r) => {
                 match bincode::serialize(&r) {
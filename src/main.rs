@@ -1,5 +1,5 @@
 use clap::{Parser, Subcommand};
-use std::{path::{Path, PathBuf}, process::ExitCode};
+use std::{path::{Path, PathBuf}, process::ExitCode, time::Duration};
 use netter_logger;
 use log::{
     info,
@@ -21,6 +21,7 @@ use netter_core::{
     CoreError,
     ConfigSource,
     ServerInfo,
+    servers::traffic::TrafficReport,
 };
 
 #[cfg(windows)]
@@ -58,7 +59,20 @@ enum Commands {
         #[arg(short, long)]
         id: String,
     },
+    Reload {
+        #[arg(short, long)]
+        id: String,
+        #[arg(short, long, help = "Перезагрузить все плагины, даже если файл не изменился")]
+        force: bool,
+    },
     List,
+    Scheduler,
+    Timings,
+    Slow,
+    Top {
+        #[arg(short, long, default_value_t = 1.0, help = "Интервал обновления в секундах")]
+        interval: f64,
+    },
     Update,
     Install,
     Download,
@@ -154,6 +168,18 @@ async fn main() -> ExitCode {
                 }
             }
         },
+        Commands::Top { interval } => {
+            match top(interval).await {
+                Ok(code) => {
+                    return code
+                },
+                Err(e) => {
+                    error!("Traffic watch failed: {}", e);
+                    eprintln!("\nError: {}", e);
+                    return ExitCode::FAILURE
+                }
+            }
+        },
         _ => {}
     }
 
@@ -208,16 +234,21 @@ async fn create_service_command(command: Commands) -> Result<Command, Box<dyn st
         }
         Commands::Stop { id } => Ok(Command::StopServer { server_id: id }),
         Commands::Status { id } => Ok(Command::GetServerStatus { server_id: id }),
+        Commands::Reload { id, force } => Ok(Command::ReloadPlugins { server_id: id, force }),
         Commands::List => {
             info!("Preparing List command (GetAllServersStatus)");
             Ok(Command::GetAllServersStatus)
         }
+        Commands::Scheduler => Ok(Command::GetSchedulerStats),
+        Commands::Timings => Ok(Command::GetRequestTimings),
+        Commands::Slow => Ok(Command::GetSlowRequests),
         Commands::Update => Ok(Command::CheckForUpdate),
         Commands::Install
         | Commands::Uninstall
         | Commands::ServiceStart
         | Commands::ServiceStop
         | Commands::ServiceStatus
+        | Commands::Top { .. }
         | Commands::Download => {
             unreachable!("Management commands should be handled before create_service_command")
         }
@@ -225,21 +256,37 @@ async fn create_service_command(command: Commands) -> Result<Command, Box<dyn st
 }
 
 
+#[cfg(windows)]
+type ServiceStream = tokio::net::windows::named_pipe::NamedPipeClient;
+#[cfg(unix)]
+type ServiceStream = UnixStream;
+
 async fn send_command_to_service(command: Command) -> Result<Response, Box<dyn std::error::Error>> {
+    let mut stream = connect_to_service().await?;
+    write_command(&mut stream, &command).await?;
+
+    trace!("Command sent to service/daemon. Awaiting response...");
+    read_response(&mut stream).await
+}
+
+async fn connect_to_service() -> Result<ServiceStream, Box<dyn std::error::Error>> {
     trace!("Attempting to connect to IPC: {}", IPC_PATH);
 
     #[cfg(windows)]
-    let mut stream = ClientOptions::new()
+    let stream = ClientOptions::new()
         .open(IPC_PATH)
         .map_err(|e| format!("Failed to open pipe '{}': {}", IPC_PATH, e))?;
     #[cfg(unix)]
-    let mut stream = UnixStream::connect(IPC_PATH)
+    let stream = UnixStream::connect(IPC_PATH)
         .await
         .map_err(|e| format!("Failed to connect to socket '{}': {}", IPC_PATH, e))?;
 
     trace!("Successfully connected to IPC.");
+    Ok(stream)
+}
 
-    let encoded_command = bincode::serialize(&command)?;
+async fn write_command(stream: &mut ServiceStream, command: &Command) -> Result<(), Box<dyn std::error::Error>> {
+    let encoded_command = bincode::serialize(command)?;
     trace!("Serialized command ({} bytes)", encoded_command.len());
 
     let command_size = encoded_command.len() as u32;
@@ -247,9 +294,10 @@ async fn send_command_to_service(command: Command) -> Result<Response, Box<dyn s
     stream.write_all(&command_size.to_be_bytes()).await?;
     stream.write_all(&encoded_command).await?;
     stream.flush().await?;
+    Ok(())
+}
 
-    trace!("Command sent to service/daemon. Awaiting response...");
-
+async fn read_response(stream: &mut ServiceStream) -> Result<Response, Box<dyn std::error::Error>> {
     let mut size_buf = [0u8; 4];
     stream.read_exact(&mut size_buf).await
         .map_err(|e| format!("Failed to read response size header: {}", e))?;
@@ -272,6 +320,83 @@ async fn send_command_to_service(command: Command) -> Result<Response, Box<dyn s
     Ok(response)
 }
 
+/// Redraws the load of all servers whenever the service sends it, until interrupted.
+async fn top(interval: f64) -> Result<ExitCode, Box<dyn std::error::Error>> {
+    if !interval.is_finite() || interval <= 0.0 {
+        return Err(format!("Interval must be a positive number of seconds, got {}", interval).into());
+    }
+
+    let mut stream = connect_to_service().await?;
+    write_command(&mut stream, &Command::WatchTraffic { interval: Duration::from_secs_f64(interval) }).await?;
+
+    loop {
+        match read_response(&mut stream).await? {
+            Response::Traffic(report) => {
+                // Clears the terminal and starts at the top, like `top`.
+                print!("\x1b[H\x1b[2J");
+                print_traffic(&report);
+            }
+            response => {
+                handle_service_response(response);
+                return Ok(ExitCode::FAILURE);
+            }
+        }
+    }
+}
+
+fn print_traffic(report: &TrafficReport) {
+    let memory = report.memory.map_or("-".to_string(), format_bytes);
+    println!("netter top - every {:.1?}, memory {} (Ctrl+C to quit)", report.interval, memory);
+    if report.servers.is_empty() {
+        println!();
+        println!("No active server managed by the service.");
+    }
+
+    for server in &report.servers {
+        println!();
+        println!("Server {}", server.server_id);
+        println!("  {:<32} {:>9} {:>10} {:>10} {:>7} {:>9} {:>11} {:>11}", "Route", "RPS", "p50", "p99", "Errors", "In-flight", "In/s", "Out/s");
+        for load in std::iter::once(&server.total).chain(&server.routes) {
+            println!("  {:<32} {:>9.1} {:>10} {:>10} {:>6.1}% {:>9} {:>11} {:>11}",
+                load.name,
+                load.rps,
+                load.p50.map_or("-".to_string(), |p50| format!("{:?}", p50)),
+                load.p99.map_or("-".to_string(), |p99| format!("{:?}", p99)),
+                load.error_rate * 100.0,
+                load.in_flight,
+                format_bytes(load.bytes_in),
+                format_bytes(load.bytes_out));
+        }
+        if let Some(handshakes) = &server.handshakes {
+            let average_wait = match handshakes.saturated {
+                0 => Duration::ZERO,
+                waited => handshakes.queue_wait.div_f64(waited as f64),
+            };
+            println!("  TLS handshakes: {} queued, {} running, {} done, {} failed, {} waited (avg {:?})",
+                handshakes.queued,
+                handshakes.in_flight,
+                handshakes.completed,
+                handshakes.failed,
+                handshakes.saturated,
+                average_wait);
+        }
+    }
+}
+
+fn format_bytes(bytes: u64) -> String {
+    const UNITS: [&str; 4] = ["KiB", "MiB", "GiB", "TiB"];
+    if bytes < 1024 {
+        return format!("{} B", bytes);
+    }
+    let mut value = bytes as f64 / 1024.0;
+    let mut unit = 0;
+    while value >= 1024.0 && unit < UNITS.len() - 1 {
+        value /= 1024.0;
+        unit += 1;
+    }
+    format!("{:.1} {}", value, UNITS[unit])
+}
+
 fn handle_service_response(response: Response) {
     println!("--- Netter Service Response ---");
     match response {
@@ -309,6 +434,91 @@ fn handle_service_response(response: Response) {
                 println!("---");
             }
         }
+        Response::PluginsReloaded(plugins) => {
+            println!("Status: Plugins Reloaded.");
+            if plugins.is_empty() {
+                println!("  No plugin changed since the last load.");
+            }
+            for (alias, version) in plugins {
+                println!("  - {}: version {}", alias, version);
+            }
+        }
+        Response::SchedulerStats(servers) => {
+            println!("Status: Route Execution Scheduler");
+            if servers.is_empty() {
+                println!("Status: No active server managed by the service.");
+            }
+            for stats in servers {
+                println!("---");
+                println!("  Server ID:      {}", stats.server_id);
+                println!("  Weight:         {} (cpu share {}%)", stats.weight, stats.cpu_share);
+                println!("  Running/Queued: {}/{}", stats.running, stats.queued);
+                println!("  Completed:      {}", stats.completed);
+                println!("  Busy Time:      {:?}", stats.busy);
+                let average_wait = stats.queue_wait.checked_div(stats.completed.max(1) as u32).unwrap_or_default();
+                println!("  Queue Wait:     {:?} average, {:?} max", average_wait, stats.max_queue_wait);
+            }
+        }
+        Response::RequestTimings(servers) => {
+            println!("Status: Request Timings");
+            if servers.is_empty() {
+                println!("Status: No active server managed by the service.");
+            }
+            for timings in servers {
+                println!("---");
+                println!("  Server ID: {}", timings.server_id);
+                println!("  {:<10} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12}", "Phase", "Count", "Mean", "p50", "p90", "p99", "Max");
+                for phase in timings.phases {
+                    println!("  {:<10} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12}",
+                        phase.phase,
+                        phase.count,
+                        format!("{:?}", phase.mean),
+                        format!("{:?}", phase.p50),
+                        format!("{:?}", phase.p90),
+                        format!("{:?}", phase.p99),
+                        format!("{:?}", phase.max));
+                }
+            }
+        }
+        Response::SlowRequests(servers) => {
+            println!("Status: Slow Requests");
+            if servers.is_empty() {
+                println!("Status: No active server with 'slow_request' set.");
+            }
+            for log in servers {
+                println!("---");
+                println!("  Server ID: {} (slower than {:?})", log.server_id, log.threshold);
+                if log.requests.is_empty() {
+                    println!("  No slow request recorded.");
+                }
+                for request in log.requests {
+                    println!();
+                    println!("  {} {} -> {} in {:?} (route {}, started at {})",
+                        request.method,
+                        request.path,
+                        request.status,
+                        request.duration,
+                        request.route.as_deref().unwrap_or("-"),
+                        request.started);
+                    for statement in request.statements {
+                        println!("    #{:<4} {:>12}  {}", statement.index, format!("{:?}", statement.duration), statement.statement);
+                        for calls in statement.plugin_calls {
+                            println!("          {:>12}  {} x{}", format!("{:?}", calls.duration), calls.function, calls.calls);
+                        }
+                    }
+                    if request.omitted_statements > 0 {
+                        println!("    ... {} more statements", request.omitted_statements);
+                    }
+                    if !request.variables.is_empty() {
+                        let variables: Vec<_> = request.variables.iter()
+                            .map(|variable| format!("{} {}", variable.name, format_bytes(variable.bytes as u64)))
+                            .collect();
+                        println!("    Variables: {}", variables.join(", "));
+                    }
+                }
+            }
+        }
+        Response::Traffic(report) => print_traffic(&report),
         Response::UpdateAvailable(info) => {
             println!("Status: Update Available!");
             println!("  Current Version: {}", info.current_version);